@@ -48,7 +48,16 @@ public:
 	virtual void Update( void ) = 0;									// update internal state
 	virtual void Upkeep( void ) { }										// lightweight update guaranteed to occur every server tick
 
+	/**
+	 * Optional two-phase precompute for the coming Update(), used when nb_update_parallel is set.
+	 * BeginPrepareUpdate() runs on the main thread and returns true if PrepareUpdate() has work to do.
+	 * PrepareUpdate() may run on a worker thread, so it must not change anything outside this component.
+	 */
+	virtual bool BeginPrepareUpdate( void ) { return false; }
+	virtual void PrepareUpdate( void ) { }
+
 	inline bool ComputeUpdateInterval();								// return false is no time has elapsed (interval is zero)
+	inline bool IsUpdateDue() const;									// return true if ComputeUpdateInterval() would let Update() run now
 	inline float GetUpdateInterval();
 
 	virtual INextBot *GetBot( void ) const  { return m_bot; }
@@ -97,6 +106,11 @@ inline bool INextBotComponent::ComputeUpdateInterval()
 	return true;
 }
 
+inline bool INextBotComponent::IsUpdateDue() const
+{
+	return !m_lastUpdateTime || gpGlobals->curtime - m_lastUpdateTime > 0.0001f;
+}
+
 inline float INextBotComponent::GetUpdateInterval() 
 { 
 	return m_curInterval; 
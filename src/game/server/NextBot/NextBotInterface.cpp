@@ -149,6 +149,38 @@ void INextBot::Upkeep( void )
 }
 
 
+//----------------------------------------------------------------------------------------------------------------
+bool INextBot::BeginPrepareUpdate( void )
+{
+	bool hasWork = false;
+
+	for( INextBotComponent *comp = m_componentList; comp; comp = comp->m_nextComponent )
+	{
+		// don't prepare for an Update() that won't happen this tick
+		if ( comp->IsUpdateDue() && comp->BeginPrepareUpdate() )
+		{
+			hasWork = true;
+		}
+	}
+
+	return hasWork;
+}
+
+
+//----------------------------------------------------------------------------------------------------------------
+/**
+ * Invoked from the job pool by NextBotManager when nb_update_parallel is set.
+ * Components may only touch their own state here.
+ */
+void INextBot::PrepareUpdate( void )
+{
+	for( INextBotComponent *comp = m_componentList; comp; comp = comp->m_nextComponent )
+	{
+		comp->PrepareUpdate();
+	}
+}
+
+
 //----------------------------------------------------------------------------------------------------------------
 bool INextBot::SetPosition( const Vector &pos )
 {
@@ -44,6 +44,9 @@ public:
 	virtual void Update( void );									// (EXTEND) update internal state
 	virtual void Upkeep( void );									// (EXTEND) lightweight update guaranteed to occur every server tick
 
+	virtual bool BeginPrepareUpdate( void );						// (EXTEND) main thread, return true if PrepareUpdate() should run
+	virtual void PrepareUpdate( void );								// (EXTEND) read-only precompute for the next Update(), may run on a worker thread
+
 	void FlagForUpdate( bool b = true );
 	bool IsFlaggedForUpdate();
 	int GetTickLastUpdate() const;
@@ -14,6 +14,7 @@
 #endif
 
 #include "SharedFunctorUtils.h"
+#include "vstdlib/jobthread.h"
 //#include "../../common/blackbox_helper.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -25,6 +26,7 @@ ConVar nb_update_frequency( "nb_update_frequency", ".1", FCVAR_CHEAT );
 ConVar nb_update_framelimit( "nb_update_framelimit", ( IsDebug() ) ? "30" : "15", FCVAR_CHEAT );
 ConVar nb_update_maxslide( "nb_update_maxslide", "2", FCVAR_CHEAT );
 ConVar nb_update_debug( "nb_update_debug", "0", FCVAR_CHEAT );
+ConVar nb_update_parallel( "nb_update_parallel", "0", FCVAR_CHEAT, "Run the vision line of sight traces of scheduled NextBot updates on the job pool before entities think. Bots see where entities were at the start of the tick." );
 
 //---------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------
@@ -391,6 +393,11 @@ void NextBotManager::Update( void )
 			nScheduled = m_botList.Count();
 		}
 
+		if ( nb_update_parallel.GetBool() )
+		{
+			PrepareScheduledUpdates();
+		}
+
 		if ( nb_update_debug.GetBool() )
 		{
 			int nIntentionalSliders = 0;
@@ -412,6 +419,45 @@ void NextBotManager::Update( void )
 	}
 }
 
+//---------------------------------------------------------------------------------------------
+static void PrepareBotUpdate( INextBot *&bot )
+{
+	bot->PrepareUpdate();
+}
+
+
+//---------------------------------------------------------------------------------------------
+/**
+ * Precompute the read-only part of this tick's bot updates on the job pool.
+ * Each bot only writes its own prepared results, which its Update() consumes 
+ * serially later in the frame. Results a bot doesn't use this tick are discarded.
+ */
+void NextBotManager::PrepareScheduledUpdates( void )
+{
+	VPROF_BUDGET( "NextBotManager::PrepareScheduledUpdates", "NextBot" );
+
+	m_preparedBotVector.RemoveAll();
+
+	for( int i = m_botList.Head(); i != m_botList.InvalidIndex(); i = m_botList.Next( i ) )
+	{
+		INextBot *bot = m_botList[i];
+
+		if ( m_iUpdateTickrate > 0 && !bot->IsFlaggedForUpdate() )
+			continue;
+
+		if ( IsDead( bot ) )
+			continue;
+
+		if ( bot->BeginPrepareUpdate() )
+		{
+			m_preparedBotVector.AddToTail( bot );
+		}
+	}
+
+	ParallelProcess( "NextBotManager::PrepareScheduledUpdates", m_preparedBotVector.Base(), m_preparedBotVector.Count(), &PrepareBotUpdate );
+}
+
+
 //---------------------------------------------------------------------------------------------
 bool NextBotManager::ShouldUpdate( INextBot *bot )
 {
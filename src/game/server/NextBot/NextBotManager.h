@@ -145,7 +145,10 @@ protected:
 	int Register( INextBot *bot );
 	void UnRegister( INextBot *bot );
 
+	void PrepareScheduledUpdates( void );			// run bots' PrepareUpdate() on the job pool
+
 	CUtlLinkedList< INextBot * > m_botList;				// list of all active NextBots
+	CUtlVector< INextBot * > m_preparedBotVector;		// bots being prepared this tick
 
 	int m_iUpdateTickrate;
 	double m_CurUpdateStartTime;
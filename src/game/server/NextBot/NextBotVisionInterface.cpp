@@ -25,6 +25,7 @@
 
 ConVar nb_blind( "nb_blind", "0", FCVAR_CHEAT, "Disable vision" );
 ConVar nb_debug_known_entities( "nb_debug_known_entities", "0", FCVAR_CHEAT, "Show the 'known entities' for the bot that is the current spectator target" );
+ConVar nb_update_parallel_verify( "nb_update_parallel_verify", "0", FCVAR_CHEAT, "Repeat prepared vision updates serially and report when the results differ (debug only, runs the vision checks twice)" );
 
 
 //------------------------------------------------------------------------------------------
@@ -46,6 +47,11 @@ void IVision::Reset( void )
 	m_lastVisionUpdateTimestamp = 0.0f;
 	m_primaryThreat = NULL;
 
+	m_preparedTick = -1;
+	m_preparedPotentiallyVisible.RemoveAll();
+	m_preparedSightLines.RemoveAll();
+	m_preparedVisible.RemoveAll();
+
 	m_FOV = GetDefaultFieldOfView();
 	m_cosHalfFOV = cos( 0.5f * m_FOV * M_PI / 180.0f );
 	
@@ -368,18 +374,67 @@ void IVision::UpdateKnownEntities( void )
 {
 	VPROF_BUDGET( "IVision::UpdateKnownEntities", "NextBot" );
 
-	// construct set of potentially visible objects
-	CUtlVector< CBaseEntity * > potentiallyVisible;
-	CollectPotentiallyVisibleEntities( &potentiallyVisible );
-
 	// collect set of visible and recognized entities at this moment
 	CollectVisible visibleNow( this );
-	FOR_EACH_VEC( potentiallyVisible, pit )
+
+	if ( m_preparedTick == gpGlobals->tickcount )
 	{
-		VPROF_BUDGET( "IVision::UpdateKnownEntities( collect visible )", "NextBot" );
+		// line of sight was already tested on the job pool this tick, finish up with the checks that may change state
+		VPROF_BUDGET( "IVision::UpdateKnownEntities( commit prepared )", "NextBot" );
 
-		if ( visibleNow( potentiallyVisible[ pit ] ) == false )
-			break;
+		m_preparedTick = -1;
+
+		FOR_EACH_VEC( m_preparedVisible, pit )
+		{
+			CBaseEntity *entity = m_preparedVisible[ pit ];
+
+			if ( entity &&
+				 !IsIgnored( entity ) &&
+				 entity->IsAlive() &&
+				 entity != GetBot()->GetEntity() &&
+				 IsVisibleEntityNoticed( entity ) )
+			{
+				visibleNow.m_recognized.AddToTail( entity );
+			}
+		}
+
+		if ( nb_update_parallel_verify.GetBool() )
+		{
+			CollectVisible visibleSerial( this );
+			FOR_EACH_VEC( m_preparedPotentiallyVisible, pit )
+			{
+				visibleSerial( m_preparedPotentiallyVisible[ pit ] );
+			}
+
+			bool isMatch = ( visibleSerial.m_recognized.Count() == visibleNow.m_recognized.Count() );
+			for( int i=0; isMatch && i < visibleNow.m_recognized.Count(); ++i )
+			{
+				isMatch = ( visibleSerial.m_recognized[i] == visibleNow.m_recognized[i] );
+			}
+
+			if ( !isMatch )
+			{
+				Warning( "%3.2f: %s prepared vision update differs from serial update (%d visible, expected %d)\n",
+						 gpGlobals->curtime,
+						 GetBot()->GetDebugIdentifier(),
+						 visibleNow.m_recognized.Count(),
+						 visibleSerial.m_recognized.Count() );
+			}
+		}
+	}
+	else
+	{
+		// construct set of potentially visible objects
+		CUtlVector< CBaseEntity * > potentiallyVisible;
+		CollectPotentiallyVisibleEntities( &potentiallyVisible );
+
+		FOR_EACH_VEC( potentiallyVisible, pit )
+		{
+			VPROF_BUDGET( "IVision::UpdateKnownEntities( collect visible )", "NextBot" );
+
+			if ( visibleNow( potentiallyVisible[ pit ] ) == false )
+				break;
+		}
 	}
 	
 	// update known set with new data
@@ -564,11 +619,117 @@ void IVision::Update( void )
 }
 
 
+//------------------------------------------------------------------------------------------
+/**
+ * Everything but the line-of-sight traces runs here on the main thread: derived versions of
+ * CollectPotentiallyVisibleEntities() may update timers and caches, and the positions the
+ * checks read are computed lazily, which writes to the entities. The trace end points are
+ * taken here too, so PrepareUpdate() only has to trace.
+ *
+ * This runs before any entity thinks this tick, so the bot sees where everything was at the
+ * start of the tick rather than after the entities updated before it have moved. That can
+ * differ from a serial update by a tick of movement - nb_update_parallel_verify reports when
+ * it changes what the bot sees.
+ */
+bool IVision::BeginPrepareUpdate( void )
+{
+	if ( nb_blind.GetBool() )
+	{
+		return false;
+	}
+
+	CUtlVector< CBaseEntity * > potentiallyVisible;
+	CollectPotentiallyVisibleEntities( &potentiallyVisible );
+
+	m_preparedPotentiallyVisible.RemoveAll();
+	m_preparedPotentiallyVisible.EnsureCapacity( potentiallyVisible.Count() );
+	m_preparedSightLines.RemoveAll();
+
+	m_preparedEyePosition = GetBot()->GetBodyInterface()->GetEyePosition();
+
+	FOR_EACH_VEC( potentiallyVisible, pit )
+	{
+		CBaseEntity *entity = potentiallyVisible[ pit ];
+
+		m_preparedPotentiallyVisible.AddToTail( entity );
+
+		if ( entity &&
+			 entity->IsAlive() &&
+			 entity != GetBot()->GetEntity() &&
+			 IsInViewRange( entity, IVision::USE_FOV ) )
+		{
+			PreparedSightLine &line = m_preparedSightLines[ m_preparedSightLines.AddToTail() ];
+			line.subject = entity;
+			line.center = entity->WorldSpaceCenter();
+			line.eye = entity->EyePosition();
+			line.origin = entity->GetAbsOrigin();
+		}
+	}
+
+	m_preparedVisible.RemoveAll();
+	m_preparedTick = gpGlobals->tickcount;
+
+	return true;
+}
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Trace the sight lines collected by BeginPrepareUpdate() for the coming UpdateKnownEntities().
+ * May run on a worker thread, so no VPROF here. Besides the traces themselves, this only calls the
+ * trace filter, which reads collision groups, owners and MyCombatCharacterPointer().
+ * IsIgnored() and IsVisibleEntityNoticed() are left for the update itself since derived
+ * versions can change bot state.
+ */
+void IVision::PrepareUpdate( void )
+{
+	if ( m_preparedTick != gpGlobals->tickcount )
+	{
+		return;
+	}
+
+	FOR_EACH_VEC( m_preparedSightLines, lit )
+	{
+		const PreparedSightLine &line = m_preparedSightLines[ lit ];
+
+		if ( IsSightLineClear( m_preparedEyePosition, line.subject, line.center, line.eye, line.origin, NULL ) )
+		{
+			m_preparedVisible.AddToTail( line.subject );
+		}
+	}
+}
+
+
 //------------------------------------------------------------------------------------------
 bool IVision::IsAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV, Vector *visibleSpot ) const
 {
 	VPROF_BUDGET( "IVision::IsAbleToSee", "NextBotExpensive" );
 
+	if ( !HasClearViewOf( subject, checkFOV ) )
+	{
+		return false;
+	}
+
+	return IsVisibleEntityNoticed( subject );
+}
+
+
+//------------------------------------------------------------------------------------------
+bool IVision::HasClearViewOf( CBaseEntity *subject, FieldOfViewCheckType checkFOV ) const
+{
+	if ( !IsInViewRange( subject, checkFOV ) )
+	{
+		return false;
+	}
+
+	// do actual line-of-sight trace
+	return IsLineOfSightClearToEntity( subject );
+}
+
+
+//------------------------------------------------------------------------------------------
+bool IVision::IsInViewRange( CBaseEntity *subject, FieldOfViewCheckType checkFOV ) const
+{
 	if ( GetBot()->IsRangeGreaterThan( subject, GetMaxVisionRange() ) )
 	{
 		return false;
@@ -601,13 +762,7 @@ bool IVision::IsAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV,
 		}
 	}
 
-	// do actual line-of-sight trace
-	if ( !IsLineOfSightClearToEntity( subject ) )
-	{
-		return false;
-	}
-
-	return IsVisibleEntityNoticed( subject );
+	return true;
 }
 
 
@@ -749,17 +904,29 @@ bool IVision::IsLineOfSightClearToEntity( const CBaseEntity *subject, Vector *vi
 	// TODO: Use plain-old traces until querycache/etc gets integrated
 	VPROF_BUDGET( "IVision::IsLineOfSightClearToEntity", "NextBot" );
 
+	return IsSightLineClear( GetBot()->GetBodyInterface()->GetEyePosition(), subject, subject->WorldSpaceCenter(), subject->EyePosition(), subject->GetAbsOrigin(), visibleSpot );
+
+#endif
+}
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Trace to the subject's center, then its eyes, then its origin, until one is unobstructed
+ */
+bool IVision::IsSightLineClear( const Vector &from, const CBaseEntity *subject, const Vector &center, const Vector &eye, const Vector &origin, Vector *visibleSpot )
+{
 	trace_t result;
 	NextBotTraceFilterIgnoreActors filter( subject, COLLISION_GROUP_NONE );
 
-	UTIL_TraceLine( GetBot()->GetBodyInterface()->GetEyePosition(), subject->WorldSpaceCenter(), MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
+	UTIL_TraceLine( from, center, MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
 	if ( result.DidHit() )
 	{
-		UTIL_TraceLine( GetBot()->GetBodyInterface()->GetEyePosition(), subject->EyePosition(), MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
+		UTIL_TraceLine( from, eye, MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
 
 		if ( result.DidHit() )
 		{
-			UTIL_TraceLine( GetBot()->GetBodyInterface()->GetEyePosition(), subject->GetAbsOrigin(), MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
+			UTIL_TraceLine( from, origin, MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
 		}
 	}
 
@@ -769,8 +936,6 @@ bool IVision::IsLineOfSightClearToEntity( const CBaseEntity *subject, Vector *vi
 	}
 
 	return ( result.fraction >= 1.0f && !result.startsolid );
-
-#endif
 }
 
 
@@ -26,6 +26,9 @@ public:
 	virtual void Reset( void );									// reset to initial state
 	virtual void Update( void );								// update internal state
 
+	virtual bool BeginPrepareUpdate( void );					// collect the sight lines PrepareUpdate() will trace
+	virtual void PrepareUpdate( void );							// line of sight traces for the next Update(), may run on a worker thread
+
 	//-- attention/short term memory interface follows ------------------------------------------
 
 	//
@@ -87,6 +90,13 @@ public:
 	virtual bool IsIgnored( CBaseEntity *subject ) const;		// return true to completely ignore this entity (may not be in sight when this is called)
 	virtual bool IsVisibleEntityNoticed( CBaseEntity *subject ) const;		// return true if we 'notice' the subject, even though we have LOS to it
 
+	/**
+	 * The range, fog, FOV and line-of-sight part of IsAbleToSee(), without IsVisibleEntityNoticed().
+	 * IsInViewRange() is all of it but the line-of-sight trace.
+	 */
+	bool HasClearViewOf( CBaseEntity *subject, FieldOfViewCheckType checkFOV ) const;
+	bool IsInViewRange( CBaseEntity *subject, FieldOfViewCheckType checkFOV ) const;
+
 	/**
 	 * Check if 'subject' is within the viewer's field of view
 	 */
@@ -121,6 +131,22 @@ private:
 
 	float m_lastVisionUpdateTimestamp;
 	IntervalTimer m_notVisibleTimer[ MAX_TEAMS ];		// for tracking interval since last saw a member of the given team
+
+	// the traces of IsLineOfSightClearToEntity(), with the end points it would use taken up front
+	struct PreparedSightLine
+	{
+		CBaseEntity *subject;
+		Vector center;
+		Vector eye;
+		Vector origin;
+	};
+	static bool IsSightLineClear( const Vector &from, const CBaseEntity *subject, const Vector &center, const Vector &eye, const Vector &origin, Vector *visibleSpot );
+
+	int m_preparedTick;												// tick the prepared vectors below were built for
+	CUtlVector< CHandle< CBaseEntity > > m_preparedPotentiallyVisible;	// from CollectPotentiallyVisibleEntities() in BeginPrepareUpdate()
+	Vector m_preparedEyePosition;
+	CUtlVector< PreparedSightLine > m_preparedSightLines;				// those in view range, from BeginPrepareUpdate()
+	CUtlVector< CHandle< CBaseEntity > > m_preparedVisible;			// those with a clear view, from PrepareUpdate()
 };
 
 inline void IVision::CollectKnownEntities( CUtlVector< CKnownEntity > *knownVector )
@@ -33,6 +33,146 @@ Path::Path( void )
 	m_cursorData.segmentPrior = NULL;
 	m_ageTimer.Invalidate();
 	m_subject = NULL;
+
+	m_routeGeneration = 0;
+	m_routeSearchTime = 0.0f;
+	m_isRouteRepairable = false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Build actual path by following the areas of m_route to the goal.
+ * If returns true, path reaches the goal.
+ */
+bool Path::AssembleRoute( INextBot *bot, const Vector &start, const Vector &goal, bool pathResult, bool includeGoalIfPathFails )
+{
+	// save room for endpoint
+	int count = MIN( m_route.Count(), MAX_PATH_SEGMENTS-1 );
+
+	if ( count == 1 )
+	{
+		BuildTrivialPath( bot, goal );
+		return pathResult;
+	}
+
+	// assemble path from the last 'count' areas of the route
+	int first = m_route.Count() - count;
+	for( int i=0; i<count; ++i )
+	{
+		m_path[ i ].area = m_route[ first + i ].area;
+		m_path[ i ].how = m_route[ first + i ].how;
+		m_path[ i ].type = ON_GROUND;
+	}
+	m_segmentCount = count;
+
+	if ( pathResult || includeGoalIfPathFails )
+	{
+		// append actual goal position
+		m_path[ m_segmentCount ].area = m_route.Tail().area;
+		m_path[ m_segmentCount ].pos = goal;
+		m_path[ m_segmentCount ].ladder = NULL;
+		m_path[ m_segmentCount ].how = NUM_TRAVERSE_TYPES;
+		m_path[ m_segmentCount ].type = ON_GROUND;
+		++m_segmentCount;
+	}
+
+	// compute path positions
+	if ( ComputePathDetails( bot, start ) == false )
+	{
+		Invalidate();
+		OnPathChanged( bot, NO_PATH );
+		return false;
+	}
+
+	// remove redundant nodes and clean up path
+	Optimize( bot );
+
+	PostProcess();
+
+	OnPathChanged( bot, pathResult ? COMPLETE_PATH : PARTIAL_PATH );
+
+	return pathResult;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Collect the route from startArea to endArea by following the parent links left by the last search
+ */
+void Path::BuildRouteFromParents( CNavArea *startArea, CNavArea *endArea, NextBotRoute *route ) const
+{
+	route->RemoveAll();
+
+	for( CNavArea *area = endArea; area; area = area->GetParent() )
+	{
+		int i = route->AddToTail();
+		(*route)[ i ].area = area;
+		(*route)[ i ].how = area->GetParentHow();
+
+		if ( area == startArea )
+		{
+			// startArea can be re-evaluated during the pathfind and given a parent...
+			break;
+		}
+
+		if ( route->Count() > TheNavAreas.Count() )
+		{
+			// parent links are corrupt
+			Assert( false );
+			break;
+		}
+	}
+
+	// put route in start to end order
+	route->Reverse();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Replace the part of m_route after spliceIndex with the route found by a search from
+ * the splice area to endArea, and drop the part of m_route before startIndex.
+ */
+void Path::SpliceRoute( int startIndex, int spliceIndex, CNavArea *endArea )
+{
+	NextBotRoute tail;
+	BuildRouteFromParents( m_route[ spliceIndex ].area, endArea, &tail );
+
+	// if the new tail crosses the old route, cut the route short there instead of doubling back
+	int joinIndex = spliceIndex;
+	int tailIndex = 0;
+	for( int t=tail.Count()-1; t>0 && tailIndex == 0; --t )
+	{
+		for( int r=startIndex; r<spliceIndex; ++r )
+		{
+			if ( m_route[ r ].area == tail[ t ].area )
+			{
+				joinIndex = r;
+				tailIndex = t;
+				break;
+			}
+		}
+	}
+
+	m_route.SetCountNonDestructively( joinIndex + 1 );
+
+	for( int t=tailIndex+1; t<tail.Count(); ++t )
+	{
+		m_route.AddToTail( tail[ t ] );
+	}
+
+	m_route.RemoveMultipleFromHead( startIndex );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void Path::RememberRoute( const NextBotRouteKey &key, bool isRepairable, float searchTime )
+{
+	m_routeKey = key;
+	m_routeGeneration = TheNavMesh->GetPathingGeneration();
+	m_routeSearchTime = searchTime;
+	m_isRouteRepairable = isRepairable;
 }
 
 
@@ -7,6 +7,7 @@
 #define _NEXT_BOT_PATH_H_
 
 #include "NextBotInterface.h"
+#include "NextBotPathCache.h"
 
 #include "tier0/vprof.h"
 
@@ -27,8 +28,29 @@ class IPathCost
 {
 public:
 	virtual float operator()( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, const CFuncElevator *elevator, float length ) const = 0;
+
+	/**
+	 * If this functor's costs depend only on the nav mesh and on state that fits in 'key',
+	 * store that state and return true to let Path::Compute() cache and repair routes built with it.
+	 * Bots whose functors store the same key share cached routes, so the key must hold everything
+	 * that differs between them. Costs that depend on anything else (enemy positions, combat,
+	 * randomness) must return false.
+	 */
+	virtual bool GetCacheKey( NextBotPathCostKey *key ) const { return false; }
 };
 
+// cost functors that are not IPathCosts are never cached
+inline bool GetPathCostCacheKey( const IPathCost *costFunc, NextBotPathCostKey *key ) { return costFunc->GetCacheKey( key ); }
+inline bool GetPathCostCacheKey( const void *costFunc, NextBotPathCostKey *key ) { return false; }
+
+// a unique address for each cost functor type, so routes built with different functors are kept apart
+template< typename CostFunctor >
+inline const void *GetPathCostType( void )
+{
+	static char token;
+	return &token;
+}
+
 
 //---------------------------------------------------------------------------------------------------------------
 /**
@@ -187,78 +209,15 @@ public:
 		}
 
 		//
-		// Compute shortest path to subject
+		// Compute shortest route to subject
 		//
-		CNavArea *closestArea = NULL;
-		bool pathResult = NavAreaBuildPath( startArea, subjectArea, &subjectPos, costFunc, &closestArea, maxPathLength, bot->GetEntity()->GetTeamNumber() );
+		bool pathResult = ComputeRoute( bot, startArea, subjectArea, subjectPos, costFunc, maxPathLength );
 
 		// Failed?
-		if ( closestArea == NULL )
-			return false;
-
-		//
-		// Build actual path by following parent links back from goal area
-		//
-
-		// get count
-		int count = 0;
-		CNavArea *area;
-		for( area = closestArea; area; area = area->GetParent() )
-		{
-			++count;
-
-			if ( area == startArea )
-			{
-				// startArea can be re-evaluated during the pathfind and given a parent...
-				break;
-			}
-			if ( count >= MAX_PATH_SEGMENTS-1 ) // save room for endpoint
-				break;
-		}
-		
-		if ( count == 1 )
-		{
-			BuildTrivialPath( bot, subjectPos );
-			return pathResult;
-		}
-
-		// assemble path
-		m_segmentCount = count;
-		for( area = closestArea; count && area; area = area->GetParent() )
-		{
-			--count;
-			m_path[ count ].area = area;
-			m_path[ count ].how = area->GetParentHow();
-			m_path[ count ].type = ON_GROUND;
-		}
-
-		if ( pathResult || includeGoalIfPathFails )
-		{
-			// append actual subject position
-			m_path[ m_segmentCount ].area = closestArea;
-			m_path[ m_segmentCount ].pos = subjectPos;
-			m_path[ m_segmentCount ].ladder = NULL;
-			m_path[ m_segmentCount ].how = NUM_TRAVERSE_TYPES;
-			m_path[ m_segmentCount ].type = ON_GROUND;
-			++m_segmentCount;
-		}
-				
-		// compute path positions
-		if ( ComputePathDetails( bot, start ) == false )
-		{
-			Invalidate();
-			OnPathChanged( bot, NO_PATH );
+		if ( m_route.Count() == 0 )
 			return false;
-		}
-
-		// remove redundant nodes and clean up path
-		Optimize( bot );
-		
-		PostProcess();
-
-		OnPathChanged( bot, pathResult ? COMPLETE_PATH : PARTIAL_PATH );
 
-		return pathResult;
+		return AssembleRoute( bot, start, subjectPos, pathResult, includeGoalIfPathFails );
 	}
 
 
@@ -315,78 +274,15 @@ public:
 		}
 
 		//
-		// Compute shortest path to goal
+		// Compute shortest route to goal
 		//
-		CNavArea *closestArea = NULL;
-		bool pathResult = NavAreaBuildPath( startArea, goalArea, &goal, costFunc, &closestArea, maxPathLength, bot->GetEntity()->GetTeamNumber() );
+		bool pathResult = ComputeRoute( bot, startArea, goalArea, goal, costFunc, maxPathLength );
 
 		// Failed?
-		if ( closestArea == NULL )
+		if ( m_route.Count() == 0 )
 			return false;
 
-		//
-		// Build actual path by following parent links back from goal area
-		//
-
-		// get count
-		int count = 0;
-		CNavArea *area;
-		for( area = closestArea; area; area = area->GetParent() )
-		{
-			++count;
-
-			if ( area == startArea )
-			{
-				// startArea can be re-evaluated during the pathfind and given a parent...
-				break;
-			}
-			if ( count >= MAX_PATH_SEGMENTS-1 ) // save room for endpoint
-				break;
-		}
-		
-		if ( count == 1 )
-		{
-			BuildTrivialPath( bot, goal );
-			return pathResult;
-		}
-
-		// assemble path
-		m_segmentCount = count;
-		for( area = closestArea; count && area; area = area->GetParent() )
-		{
-			--count;
-			m_path[ count ].area = area;
-			m_path[ count ].how = area->GetParentHow();
-			m_path[ count ].type = ON_GROUND;
-		}
-
-		if ( pathResult || includeGoalIfPathFails )
-		{
-			// append actual goal position
-			m_path[ m_segmentCount ].area = closestArea;
-			m_path[ m_segmentCount ].pos = pathEndPosition;
-			m_path[ m_segmentCount ].ladder = NULL;
-			m_path[ m_segmentCount ].how = NUM_TRAVERSE_TYPES;
-			m_path[ m_segmentCount ].type = ON_GROUND;
-			++m_segmentCount;
-		}
-				
-		// compute path positions
-		if ( ComputePathDetails( bot, start ) == false )
-		{
-			Invalidate();
-			OnPathChanged( bot, NO_PATH );
-			return false;
-		}
-
-		// remove redundant nodes and clean up path
-		Optimize( bot );
-		
-		PostProcess();
-
-		OnPathChanged( bot, pathResult ? COMPLETE_PATH : PARTIAL_PATH );
-
-		return pathResult;
+		return AssembleRoute( bot, start, pathEndPosition, pathResult, includeGoalIfPathFails );
 	}
 
 
@@ -610,6 +506,128 @@ private:
 	IntervalTimer m_ageTimer;					// how old is this path?
 	CHandle< CBaseCombatCharacter > m_subject;	// the subject this path leads to
 
+	NextBotRoute m_route;						// areas of the most recently computed route, from start area to closest area
+	NextBotRouteKey m_routeKey;					// the search that produced m_route
+	unsigned int m_routeGeneration;				// nav mesh pathing generation m_route was computed in
+	float m_routeSearchTime;					// when the full search m_route derives from was done
+	bool m_isRouteRepairable;					// true if m_route is a complete, cacheable route that later searches may reuse
+
+	bool AssembleRoute( INextBot *bot, const Vector &start, const Vector &goal, bool pathResult, bool includeGoalIfPathFails );	// build the path segments from m_route
+	void BuildRouteFromParents( CNavArea *startArea, CNavArea *endArea, NextBotRoute *route ) const;	// collect the route found by the last search
+	void SpliceRoute( int startIndex, int spliceIndex, CNavArea *endArea );	// replace the end of m_route after spliceIndex with the route found by the last search
+	void RememberRoute( const NextBotRouteKey &key, bool isRepairable, float searchTime );
+
+	/**
+	 * Find the route from startArea to goalArea, leaving it in m_route.
+	 * Complete routes found with cacheable cost functors are shared through TheNextBotPathCache(),
+	 * and a route to a goal that moved only slightly is repaired instead of searched again.
+	 * Returns true if the route reaches the goal.
+	 */
+	template< typename CostFunctor >
+	bool ComputeRoute( INextBot *bot, CNavArea *startArea, CNavArea *goalArea, const Vector &goalPos, CostFunctor &costFunc, float maxPathLength )
+	{
+		NextBotRouteKey key;
+		key.startArea = startArea;
+		key.goalArea = goalArea;
+		key.costType = GetPathCostType< CostFunctor >();
+		V_memset( &key.costKey, 0, sizeof( key.costKey ) );
+		key.team = bot->GetEntity()->GetTeamNumber();
+		key.maxPathLength = maxPathLength;
+
+		// partial routes depend on the exact goal position, so only routes to a known goal area are reused
+		bool isCacheable = NextBotPathCache.GetBool() && goalArea && GetPathCostCacheKey( &costFunc, &key.costKey );
+
+		if ( isCacheable )
+		{
+			float searchTime;
+			if ( TheNextBotPathCache().Find( key, &m_route, &searchTime ) )
+			{
+				RememberRoute( key, true, searchTime );
+				return true;
+			}
+
+			// repaired routes may not be optimal, so they are only used by this path and never shared
+			if ( RepairRoute( key, goalPos, costFunc ) )
+			{
+				RememberRoute( key, true, m_routeSearchTime );
+				return true;
+			}
+		}
+
+		CNavArea *closestArea = NULL;
+		bool pathResult = NavAreaBuildPath( startArea, goalArea, &goalPos, costFunc, &closestArea, maxPathLength, key.team );
+
+		BuildRouteFromParents( startArea, closestArea, &m_route );
+
+		if ( isCacheable && pathResult )
+		{
+			TheNextBotPathCache().Store( key, m_route, gpGlobals->curtime );
+		}
+
+		RememberRoute( key, isCacheable && pathResult, gpGlobals->curtime );
+
+		return pathResult;
+	}
+
+	/**
+	 * Try to derive the route for 'key' from our previous route without a full search.
+	 * If we are still on our previous route and the goal area is the same, the rest of the route is reused.
+	 * If the goal area moved a short distance, only the last few areas of the route are searched again.
+	 * This is a bounded local repair, not an exact incremental search, so it is limited
+	 * to routes no older than nb_path_cache_max_age.
+	 */
+	template< typename CostFunctor >
+	bool RepairRoute( const NextBotRouteKey &key, const Vector &goalPos, CostFunctor &costFunc )
+	{
+		if ( !m_isRouteRepairable || !m_routeKey.IsSameSearch( key ) )
+			return false;
+
+		if ( m_routeGeneration != TheNavMesh->GetPathingGeneration() || gpGlobals->curtime - m_routeSearchTime > NextBotPathCacheMaxAge.GetFloat() )
+			return false;
+
+		// a length limit is measured from the start, and can't be checked for a spliced route
+		if ( key.maxPathLength > 0.0f )
+			return false;
+
+		int startIndex;
+		for( startIndex = 0; startIndex < m_route.Count(); ++startIndex )
+		{
+			if ( m_route[ startIndex ].area == key.startArea )
+				break;
+		}
+
+		if ( startIndex == m_route.Count() )
+		{
+			// we've left our old route
+			return false;
+		}
+
+		if ( key.goalArea == m_routeKey.goalArea )
+		{
+			// we've moved along our route to the same goal - the rest of it is still the route to take
+			m_route.RemoveMultipleFromHead( startIndex );
+			TheNextBotPathCache().OnRouteRepaired();
+			return true;
+		}
+
+		if ( ( key.goalArea->GetCenter() - m_routeKey.goalArea->GetCenter() ).IsLengthGreaterThan( NextBotPathRepairRange.GetFloat() ) )
+			return false;
+
+		// search from a few areas before the old goal to the new goal, and splice the result onto the old route
+		int spliceIndex = MAX( startIndex, m_route.Count() - 1 - NextBotPathRepairDepth.GetInt() );
+
+		CNavArea *closestArea = NULL;
+		if ( !NavAreaBuildPath( m_route[ spliceIndex ].area, key.goalArea, &goalPos, costFunc, &closestArea, 0.0f, key.team ) )
+		{
+			TheNextBotPathCache().OnRouteRepairFailed();
+			return false;
+		}
+
+		SpliceRoute( startIndex, spliceIndex, closestArea );
+		TheNextBotPathCache().OnRouteRepaired();
+		return true;
+	}
+
 	/**
 	 * Build a vector of adjacent areas reachable from the given area
 	 */
@@ -0,0 +1,231 @@
+// NextBotPathCache.cpp
+// Shared cache of recently computed area routes for Path::Compute()
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#include "cbase.h"
+
+#include "nav_mesh.h"
+#include "NextBotPathCache.h"
+
+#include "tier0/vprof.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+ConVar NextBotPathCache( "nb_path_cache", "0", FCVAR_CHEAT, "If nonzero, complete routes computed by Path::Compute() are cached and reused, and small goal changes are repaired locally instead of re-searched" );
+ConVar NextBotPathCacheSize( "nb_path_cache_size", "512", FCVAR_CHEAT, "Maximum number of routes held in the shared path cache" );
+ConVar NextBotPathCacheMaxAge( "nb_path_cache_max_age", "2", FCVAR_CHEAT, "Cached routes older than this many seconds are recomputed" );
+ConVar NextBotPathRepairDepth( "nb_path_repair_depth", "3", FCVAR_CHEAT, "When repairing a route toward a moved goal, how many areas before the old goal to search from" );
+ConVar NextBotPathRepairRange( "nb_path_repair_range", "500", FCVAR_CHEAT, "A route is only repaired if its goal area moved less than this distance, otherwise it is re-searched" );
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNextBotPathCache &TheNextBotPathCache( void )
+{
+	static CNextBotPathCache cache;
+	return cache;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNextBotPathCache::CNextBotPathCache( void ) : m_entryMap( KeyLessFunc )
+{
+	m_generation = 0;
+	ResetStats();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNextBotPathCache::~CNextBotPathCache()
+{
+	Flush();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNextBotPathCache::KeyLessFunc( const NextBotRouteKey &lhs, const NextBotRouteKey &rhs )
+{
+	if ( lhs.startArea != rhs.startArea )
+		return lhs.startArea < rhs.startArea;
+
+	if ( lhs.goalArea != rhs.goalArea )
+		return lhs.goalArea < rhs.goalArea;
+
+	if ( lhs.costType != rhs.costType )
+		return lhs.costType < rhs.costType;
+
+	int costCompare = V_memcmp( lhs.costKey.data, rhs.costKey.data, sizeof( lhs.costKey.data ) );
+	if ( costCompare != 0 )
+		return costCompare < 0;
+
+	if ( lhs.team != rhs.team )
+		return lhs.team < rhs.team;
+
+	return lhs.maxPathLength < rhs.maxPathLength;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNextBotPathCache::Flush( void )
+{
+	FOR_EACH_MAP_FAST( m_entryMap, it )
+	{
+		delete m_entryMap[ it ];
+	}
+	m_entryMap.RemoveAll();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Cached routes hold raw area pointers, so anything that changes the mesh
+ * or its blocked state invalidates all of them.
+ */
+void CNextBotPathCache::Validate( void )
+{
+	if ( m_generation != TheNavMesh->GetPathingGeneration() )
+	{
+		if ( m_entryMap.Count() )
+		{
+			++m_flushCount;
+		}
+
+		Flush();
+		m_generation = TheNavMesh->GetPathingGeneration();
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNextBotPathCache::Find( const NextBotRouteKey &key, NextBotRoute *route, float *searchTime )
+{
+	Validate();
+
+	unsigned short it = m_entryMap.Find( key );
+	if ( it != m_entryMap.InvalidIndex() )
+	{
+		Entry *entry = m_entryMap[ it ];
+
+		if ( gpGlobals->curtime - entry->timestamp <= NextBotPathCacheMaxAge.GetFloat() )
+		{
+			route->CopyArray( entry->route.Base(), entry->route.Count() );
+			*searchTime = entry->timestamp;
+
+			++m_hitCount;
+			VPROF_INCREMENT_COUNTER( "NextBotPathCache hit", 1 );
+			return true;
+		}
+
+		// stale
+		delete entry;
+		m_entryMap.RemoveAt( it );
+	}
+
+	++m_missCount;
+	VPROF_INCREMENT_COUNTER( "NextBotPathCache miss", 1 );
+	return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNextBotPathCache::Store( const NextBotRouteKey &key, const NextBotRoute &route, float searchTime )
+{
+	Validate();
+
+	if ( route.Count() == 0 || NextBotPathCacheSize.GetInt() <= 0 )
+		return;
+
+	Entry *entry;
+	unsigned short it = m_entryMap.Find( key );
+	if ( it != m_entryMap.InvalidIndex() )
+	{
+		entry = m_entryMap[ it ];
+	}
+	else
+	{
+		while( m_entryMap.Count() >= NextBotPathCacheSize.GetInt() )
+		{
+			EvictOldest();
+		}
+
+		entry = new Entry;
+		m_entryMap.Insert( key, entry );
+	}
+
+	entry->route.CopyArray( route.Base(), route.Count() );
+	entry->timestamp = searchTime;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNextBotPathCache::EvictOldest( void )
+{
+	unsigned short oldest = m_entryMap.InvalidIndex();
+
+	FOR_EACH_MAP_FAST( m_entryMap, it )
+	{
+		if ( oldest == m_entryMap.InvalidIndex() || m_entryMap[ it ]->timestamp < m_entryMap[ oldest ]->timestamp )
+		{
+			oldest = it;
+		}
+	}
+
+	if ( oldest != m_entryMap.InvalidIndex() )
+	{
+		delete m_entryMap[ oldest ];
+		m_entryMap.RemoveAt( oldest );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNextBotPathCache::OnRouteRepaired( void )
+{
+	++m_repairCount;
+	VPROF_INCREMENT_COUNTER( "NextBotPathCache repair", 1 );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNextBotPathCache::OnRouteRepairFailed( void )
+{
+	++m_repairFailCount;
+	VPROF_INCREMENT_COUNTER( "NextBotPathCache repair failed", 1 );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNextBotPathCache::ResetStats( void )
+{
+	m_hitCount = 0;
+	m_missCount = 0;
+	m_repairCount = 0;
+	m_repairFailCount = 0;
+	m_flushCount = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNextBotPathCache::PrintStats( void ) const
+{
+	int lookups = m_hitCount + m_missCount;
+
+	Msg( "Path cache: %d routes cached, %d flushes\n", m_entryMap.Count(), m_flushCount );
+	Msg( "  %d lookups, %d hits (%.1f%%), %d misses\n", lookups, m_hitCount, lookups ? 100.0f * m_hitCount / lookups : 0.0f, m_missCount );
+	Msg( "  %d misses repaired locally, %d repairs fell back to a full search\n", m_repairCount, m_repairFailCount );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CON_COMMAND_F( nb_path_cache_stats, "Display hit rates of the NextBot path cache. 'nb_path_cache_stats reset' clears the counters.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	TheNextBotPathCache().PrintStats();
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		TheNextBotPathCache().ResetStats();
+	}
+}
@@ -0,0 +1,120 @@
+// NextBotPathCache.h
+// Shared cache of recently computed area routes for Path::Compute()
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#ifndef _NEXT_BOT_PATH_CACHE_H_
+#define _NEXT_BOT_PATH_CACHE_H_
+
+#include "nav.h"
+#include "utlvector.h"
+#include "utlmap.h"
+
+class CNavArea;
+
+
+//---------------------------------------------------------------------------------------------------------------
+/**
+ * One step of an area route: the area, and how it is entered from the previous step
+ */
+struct NextBotRouteNode
+{
+	CNavArea *area;
+	NavTraverseType how;
+};
+
+typedef CUtlVector< NextBotRouteNode > NextBotRoute;
+
+
+//---------------------------------------------------------------------------------------------------------------
+/**
+ * A cost functor's own description of the state its costs depend on (see IPathCost::GetCacheKey()).
+ * Keys are compared byte for byte, so unused bytes must be zero.
+ */
+struct NextBotPathCostKey
+{
+	unsigned char data[ 32 ];
+
+	template< typename T >
+	void Set( const T &state )
+	{
+		COMPILE_TIME_ASSERT( sizeof( T ) <= sizeof( data ) );
+		V_memset( data, 0, sizeof( data ) );
+		V_memcpy( data, &state, sizeof( T ) );
+	}
+};
+
+
+//---------------------------------------------------------------------------------------------------------------
+/**
+ * Everything a route search result depends on.
+ * 'costType' identifies the cost functor class, 'costKey' is the state of the functor.
+ */
+struct NextBotRouteKey
+{
+	CNavArea *startArea;
+	CNavArea *goalArea;
+	const void *costType;
+	NextBotPathCostKey costKey;
+	int team;
+	float maxPathLength;
+
+	bool IsSameSearch( const NextBotRouteKey &other ) const		// true if everything but the endpoints match
+	{
+		return costType == other.costType && team == other.team && maxPathLength == other.maxPathLength && !V_memcmp( costKey.data, other.costKey.data, sizeof( costKey.data ) );
+	}
+};
+
+
+//---------------------------------------------------------------------------------------------------------------
+/**
+ * Shared cache of complete area routes, keyed on start/goal area and cost functor.
+ * The whole cache is flushed whenever the nav mesh pathing generation changes
+ * (areas blocked/unblocked, created or destroyed, func_nav_cost changes), and entries expire after nb_path_cache_max_age.
+ * Only complete routes found by a full search are stored - repaired routes are never shared.
+ */
+class CNextBotPathCache
+{
+public:
+	CNextBotPathCache( void );
+	~CNextBotPathCache();
+
+	bool Find( const NextBotRouteKey &key, NextBotRoute *route, float *searchTime );	// if a valid route for the key is cached, copy it into 'route', return when it was searched for, and return true
+	void Store( const NextBotRouteKey &key, const NextBotRoute &route, float searchTime );	// remember a complete route for the given key
+	void Flush( void );
+
+	void OnRouteRepaired( void );		// a route was derived from a bot's previous route instead of searched for
+	void OnRouteRepairFailed( void );
+
+	void PrintStats( void ) const;
+	void ResetStats( void );
+
+private:
+	struct Entry
+	{
+		NextBotRoute route;
+		float timestamp;		// when the search this route came from was done
+	};
+
+	static bool KeyLessFunc( const NextBotRouteKey &lhs, const NextBotRouteKey &rhs );
+	void Validate( void );				// flush if the nav mesh has changed since the cache was filled
+	void EvictOldest( void );
+
+	CUtlMap< NextBotRouteKey, Entry * > m_entryMap;
+	unsigned int m_generation;
+
+	int m_hitCount;
+	int m_missCount;
+	int m_repairCount;
+	int m_repairFailCount;
+	int m_flushCount;
+};
+
+extern CNextBotPathCache &TheNextBotPathCache( void );
+
+extern ConVar NextBotPathCache;
+extern ConVar NextBotPathCacheMaxAge;
+extern ConVar NextBotPathRepairDepth;
+extern ConVar NextBotPathRepairRange;
+
+
+#endif // _NEXT_BOT_PATH_CACHE_H_
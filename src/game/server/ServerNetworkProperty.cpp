@@ -15,6 +15,8 @@
 
 extern CTimedEventMgr g_NetworkPropertyEventMgr;
 
+int g_nPVSInformationUpdates = 0;
+
 
 //-----------------------------------------------------------------------------
 // Save/load
@@ -147,6 +149,7 @@ void CServerNetworkProperty::RecomputePVSInformation()
 	{
 		m_pPev->m_fStateFlags &= ~FL_EDICT_DIRTY_PVS_INFORMATION;
 		engine->BuildEntityClusterList( edict(), &m_PVSInfo );
+		g_nPVSInformationUpdates++;
 	}
 }
 
@@ -152,6 +152,10 @@ inline PVSInfo_t *CServerNetworkProperty::GetPVSInfo()
 }
 
 
+// Incremented whenever any entity's PVS information is recomputed
+extern int g_nPVSInformationUpdates;
+
+
 //-----------------------------------------------------------------------------
 // Marks the PVS information dirty
 //-----------------------------------------------------------------------------
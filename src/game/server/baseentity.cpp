@@ -703,6 +703,13 @@ CBaseEntity *CBaseEntity::GetFollowedEntity()
 void CBaseEntity::SetClassname( const char *className )
 {
 	m_iClassname = AllocPooledString( className );
+	NameIndex_EntityChanged( this );
+}
+
+void CBaseEntity::SetName( string_t newName )
+{
+	m_iName = newName;
+	NameIndex_EntityChanged( this );
 }
 
 void CBaseEntity::SetModelIndex( int index )
@@ -3659,6 +3666,9 @@ int CBaseEntity::Restore( IRestore &restore )
 	// loops through the data description list, restoring each data desc block in order
 	int status = RestoreDataDescBlock( restore, GetDataDescMap() );
 
+	// the names came back with the rest of the data description
+	NameIndex_EntityChanged( this );
+
 	// ---------------------------------------------------------------
 	// HACKHACK: We don't know the space of these vectors until now
 	// if they are worldspace, fix them up.
@@ -87,6 +87,7 @@ OUTPUTS:
 #include "fgdlib/entitydefs.h"
 
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -731,8 +732,9 @@ CEventQueue g_EventQueue;
 
 CEventQueue::CEventQueue()
 {
-	m_Events.m_flFireTime = -FLT_MAX;
-	m_Events.m_pNext = NULL;
+	m_nNextSerial = 0;
+	memset( m_pTargetEvents, 0, sizeof( m_pTargetEvents ) );
+	memset( m_pCallerEvents, 0, sizeof( m_pCallerEvents ) );
 
 	Init();
 }
@@ -846,21 +848,27 @@ void CEventQueue::Init( void )
 void CEventQueue::Clear( void )
 {
 	// delete all the events in the queue
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-	
-	while ( pe != NULL )
+	for ( int i = 0; i < m_Heap.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
+		EventQueuePrioritizedEvent_t *pe = m_Heap[i];
+		if ( pe->m_pEntTarget.IsValid() )
+		{
+			m_pTargetEvents[pe->m_pEntTarget.GetEntryIndex()] = NULL;
+		}
+		if ( pe->m_pCaller.IsValid() )
+		{
+			m_pCallerEvents[pe->m_pCaller.GetEntryIndex()] = NULL;
+		}
 		delete pe;
-		pe = next;
 	}
 
-	m_Events.m_pNext = NULL;
+	m_Heap.Purge();
 }
 
 void CEventQueue::Dump( void )
 {
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	CUtlVector<EventQueuePrioritizedEvent_t *> events;
+	GetSortedEvents( events );
 
 	Msg("Dumping event queue. Current time is: %.2f\n",
 #ifdef TF_DLL
@@ -870,9 +878,9 @@ void CEventQueue::Dump( void )
 #endif
 		);
 
-	while ( pe != NULL )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
+		EventQueuePrioritizedEvent_t *pe = events[i];
 
 		Msg("   (%.2f) Target: '%s', Input: '%s', Parameter '%s'. Activator: '%s', Caller '%s'.  \n", 
 			pe->m_flFireTime, 
@@ -881,8 +889,6 @@ void CEventQueue::Dump( void )
 			pe->m_VariantValue.String(),
 			pe->m_pActivator ? pe->m_pActivator->GetDebugName() : "None", 
 			pe->m_pCaller ? pe->m_pCaller->GetDebugName() : "None"  );
-
-		pe = next;
 	}
 
 	Msg("Finished dump.\n");
@@ -944,40 +950,165 @@ void CEventQueue::AddEvent( CBaseEntity *target, const char *action, float fireD
 
 
 //-----------------------------------------------------------------------------
-// Purpose: private function, adds an event into the list
-// Input  : *newEvent - the (already built) event to add
+// Purpose: links an event into one of the per entity slot lists
 //-----------------------------------------------------------------------------
-void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
+typedef EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*EventLink_t;
+
+static void LinkEvent( EventQueuePrioritizedEvent_t *&pHead, EventQueuePrioritizedEvent_t *pe, EventLink_t pNext, EventLink_t pPrev )
 {
-	// loop through the actions looking for a place to insert
-	EventQueuePrioritizedEvent_t *pe;
-	for ( pe = &m_Events; pe->m_pNext != NULL; pe = pe->m_pNext )
+	pe->*pPrev = NULL;
+	pe->*pNext = pHead;
+	if ( pHead )
 	{
-		if ( pe->m_pNext->m_flFireTime > newEvent->m_flFireTime )
-		{
+		pHead->*pPrev = pe;
+	}
+	pHead = pe;
+}
+
+static void UnlinkEvent( EventQueuePrioritizedEvent_t *&pHead, EventQueuePrioritizedEvent_t *pe, EventLink_t pNext, EventLink_t pPrev )
+{
+	if ( pe->*pPrev )
+	{
+		(pe->*pPrev)->*pNext = pe->*pNext;
+	}
+	else
+	{
+		Assert( pHead == pe );
+		pHead = pe->*pNext;
+	}
+
+	if ( pe->*pNext )
+	{
+		(pe->*pNext)->*pPrev = pe->*pPrev;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: true if a fires before b. Events with the same fire time fire in the
+//			order they were added.
+//-----------------------------------------------------------------------------
+bool CEventQueue::FiresBefore( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b )
+{
+	if ( a->m_flFireTime != b->m_flFireTime )
+		return a->m_flFireTime < b->m_flFireTime;
+
+	return (int)( a->m_nSerial - b->m_nSerial ) < 0;
+}
+
+void CEventQueue::HeapMoveUp( int iHeap )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Heap[iHeap];
+	while ( iHeap > 0 )
+	{
+		int iParent = ( iHeap - 1 ) >> 1;
+		if ( !FiresBefore( pe, m_Heap[iParent] ) )
+			break;
+
+		m_Heap[iHeap] = m_Heap[iParent];
+		m_Heap[iHeap]->m_iHeapIndex = iHeap;
+		iHeap = iParent;
+	}
+
+	m_Heap[iHeap] = pe;
+	pe->m_iHeapIndex = iHeap;
+}
+
+void CEventQueue::HeapMoveDown( int iHeap )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Heap[iHeap];
+	int nCount = m_Heap.Count();
+	while ( 1 )
+	{
+		int iChild = ( iHeap << 1 ) + 1;
+		if ( iChild >= nCount )
 			break;
+
+		if ( iChild + 1 < nCount && FiresBefore( m_Heap[iChild + 1], m_Heap[iChild] ) )
+		{
+			iChild++;
 		}
+
+		if ( !FiresBefore( m_Heap[iChild], pe ) )
+			break;
+
+		m_Heap[iHeap] = m_Heap[iChild];
+		m_Heap[iHeap]->m_iHeapIndex = iHeap;
+		iHeap = iChild;
 	}
 
-	Assert( pe );
+	m_Heap[iHeap] = pe;
+	pe->m_iHeapIndex = iHeap;
+}
+
+static int __cdecl CompareEventFireOrder( EventQueuePrioritizedEvent_t * const *a, EventQueuePrioritizedEvent_t * const *b )
+{
+	if ( (*a)->m_flFireTime != (*b)->m_flFireTime )
+		return ( (*a)->m_flFireTime < (*b)->m_flFireTime ) ? -1 : 1;
+
+	return (int)( (*a)->m_nSerial - (*b)->m_nSerial );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: copies out the queued events in the order they'll fire
+//-----------------------------------------------------------------------------
+void CEventQueue::GetSortedEvents( CUtlVector<EventQueuePrioritizedEvent_t *> &events )
+{
+	events.CopyArray( m_Heap.Base(), m_Heap.Count() );
+	events.Sort( CompareEventFireOrder );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: private function, adds an event into the queue
+// Input  : *newEvent - the (already built) event to add
+//-----------------------------------------------------------------------------
+void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
+{
+	newEvent->m_nSerial = m_nNextSerial++;
+	HeapMoveUp( m_Heap.AddToTail( newEvent ) );
+
+	newEvent->m_pTargetNext = newEvent->m_pTargetPrev = NULL;
+	if ( newEvent->m_pEntTarget.IsValid() )
+	{
+		LinkEvent( m_pTargetEvents[newEvent->m_pEntTarget.GetEntryIndex()], newEvent, &EventQueuePrioritizedEvent_t::m_pTargetNext, &EventQueuePrioritizedEvent_t::m_pTargetPrev );
+	}
 
-	// insert
-	newEvent->m_pNext = pe->m_pNext;
-	newEvent->m_pPrev = pe;
-	pe->m_pNext = newEvent;
-	if ( newEvent->m_pNext )
+	newEvent->m_pCallerNext = newEvent->m_pCallerPrev = NULL;
+	if ( newEvent->m_pCaller.IsValid() )
 	{
-		newEvent->m_pNext->m_pPrev = newEvent;
+		LinkEvent( m_pCallerEvents[newEvent->m_pCaller.GetEntryIndex()], newEvent, &EventQueuePrioritizedEvent_t::m_pCallerNext, &EventQueuePrioritizedEvent_t::m_pCallerPrev );
 	}
 }
 
 void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
 {
-	Assert( pe->m_pPrev );
-	pe->m_pPrev->m_pNext = pe->m_pNext;
-	if ( pe->m_pNext )
+	int iHeap = pe->m_iHeapIndex;
+	Assert( m_Heap[iHeap] == pe );
+
+	// move the last event into the hole, and let it find its place
+	int iLast = m_Heap.Count() - 1;
+	if ( iHeap != iLast )
 	{
-		pe->m_pNext->m_pPrev = pe->m_pPrev;
+		m_Heap[iHeap] = m_Heap[iLast];
+		m_Heap[iHeap]->m_iHeapIndex = iHeap;
+	}
+	m_Heap.FastRemove( iLast );
+
+	if ( iHeap < m_Heap.Count() )
+	{
+		HeapMoveDown( iHeap );
+		HeapMoveUp( iHeap );
+	}
+
+	if ( pe->m_pEntTarget.IsValid() )
+	{
+		UnlinkEvent( m_pTargetEvents[pe->m_pEntTarget.GetEntryIndex()], pe, &EventQueuePrioritizedEvent_t::m_pTargetNext, &EventQueuePrioritizedEvent_t::m_pTargetPrev );
+	}
+
+	if ( pe->m_pCaller.IsValid() )
+	{
+		UnlinkEvent( m_pCallerEvents[pe->m_pCaller.GetEntryIndex()], pe, &EventQueuePrioritizedEvent_t::m_pCallerNext, &EventQueuePrioritizedEvent_t::m_pCallerPrev );
 	}
 }
 
@@ -992,7 +1123,7 @@ void CEventQueue::ServiceEvents( void )
 		return;
 	}
 
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pe = m_Heap.Count() ? m_Heap[0] : NULL;
 
 #ifdef TF_DLL
 	while ( pe != NULL && pe->m_flFireTime <= engine->GetServerTime() )
@@ -1065,7 +1196,7 @@ void CEventQueue::ServiceEvents( void )
 			ADD_DEBUG_HISTORY( HISTORY_ENTITY_IO, szBuffer );
 		}
 
-		// remove the event from the list (remembering that the queue may have been added to)
+		// remove the event from the queue (remembering that the queue may have been added to)
 		RemoveEvent( pe );
 		delete pe;
 
@@ -1080,8 +1211,8 @@ void CEventQueue::ServiceEvents( void )
 			}
 		}
 
-		// restart the list (to catch any new items have probably been added to the queue)
-		pe = m_Events.m_pNext;	
+		// restart from the top (to catch any new items have probably been added to the queue)
+		pe = m_Heap.Count() ? m_Heap[0] : NULL;
 	}
 }
 
@@ -1097,6 +1228,73 @@ void CC_DumpEventQueue()
 }
 static ConCommand dumpeventqueue( "dumpeventqueue", CC_DumpEventQueue, "Dump the contents of the Entity I/O event queue to the console." );
 
+//-----------------------------------------------------------------------------
+// Purpose: Times adding, finding and cancelling a batch of events on the world,
+//			to measure the per event cost of the queue. HasEventPending is timed
+//			for an input that is found at the head of the world's event list, and
+//			for one that is missing, which has to walk the whole list.
+//-----------------------------------------------------------------------------
+CON_COMMAND_F( eventqueue_benchmark, "Times the Entity I/O event queue. Usage: eventqueue_benchmark [event count]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	CBaseEntity *pWorld = CBaseEntity::Instance( 0 );
+	if ( !pWorld )
+		return;
+
+	int nEvents = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 10000;
+	nEvents = clamp( nEvents, 1, 1000000 );
+
+	variant_t Value;
+	Value.Set( FIELD_VOID, NULL );
+
+	// far enough in the future that none of them fire, with plenty of ties
+	CFastTimer timer;
+	timer.Start();
+	for ( int i = 0; i < nEvents; i++ )
+	{
+		g_EventQueue.AddEvent( pWorld, "EventQueueBenchmark", Value, 100000.0f + ( i % 997 ) * 0.1f, NULL, pWorld );
+	}
+	timer.End();
+	float flAddTime = timer.GetDuration().GetMicrosecondsF();
+
+	timer.Start();
+	int nPending = 0;
+	for ( int i = 0; i < nEvents; i++ )
+	{
+		if ( g_EventQueue.HasEventPending( pWorld, "EventQueueBenchmark" ) )
+		{
+			nPending++;
+		}
+	}
+	timer.End();
+	float flPendingTime = timer.GetDuration().GetMicrosecondsF();
+
+	// each of these walks every event, so don't do as many
+	int nMissingCalls = MIN( nEvents, 1000 );
+	timer.Start();
+	for ( int i = 0; i < nMissingCalls; i++ )
+	{
+		if ( g_EventQueue.HasEventPending( pWorld, "EventQueueMissing" ) )
+		{
+			nPending++;
+		}
+	}
+	timer.End();
+	float flMissingTime = timer.GetDuration().GetMicrosecondsF();
+
+	timer.Start();
+	g_EventQueue.CancelEventOn( pWorld, "EventQueueBenchmark" );
+	timer.End();
+	float flCancelTime = timer.GetDuration().GetMicrosecondsF();
+
+	Msg( "Event queue, %d events: AddEvent %.3f us/event, HasEventPending %.3f us/call (found) %.3f us/call (missing), CancelEventOn %.3f us/event\n",
+		nEvents, flAddTime / nEvents, flPendingTime / nEvents, flMissingTime / nMissingCalls, flCancelTime / nEvents );
+	Assert( nPending == nEvents );
+	Assert( !g_EventQueue.HasEventPending( pWorld, "EventQueueBenchmark" ) );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Removes all pending events from the I/O queue that were added by the
 //			given caller.
@@ -1106,10 +1304,11 @@ static ConCommand dumpeventqueue( "dumpeventqueue", CC_DumpEventQueue, "Dump the
 //-----------------------------------------------------------------------------
 void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 {
-	if (!pCaller)
+	if (!pCaller || !pCaller->GetRefEHandle().IsValid())
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	// only the events in the caller's slot can have been added by it
+	EventQueuePrioritizedEvent_t *pCur = m_pCallerEvents[pCaller->GetRefEHandle().GetEntryIndex()];
 
 	while (pCur != NULL)
 	{
@@ -1126,7 +1325,7 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pCallerNext;
 
 		if (bDelete)
 		{
@@ -1144,10 +1343,10 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 //-----------------------------------------------------------------------------
 void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 {
-	if (!pTarget)
+	if (!pTarget || !pTarget->GetRefEHandle().IsValid())
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pTargetEvents[pTarget->GetRefEHandle().GetEntryIndex()];
 
 	while (pCur != NULL)
 	{
@@ -1162,7 +1361,7 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pTargetNext;
 
 		if (bDelete)
 		{
@@ -1179,10 +1378,10 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 //-----------------------------------------------------------------------------
 bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName )
 {
-	if (!pTarget)
+	if (!pTarget || !pTarget->GetRefEHandle().IsValid())
 		return false;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pTargetEvents[pTarget->GetRefEHandle().GetEntryIndex()];
 
 	while (pCur != NULL)
 	{
@@ -1195,7 +1394,7 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 				return true;
 		}
 
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pTargetNext;
 	}
 
 	return false;
@@ -1230,29 +1429,27 @@ BEGIN_SIMPLE_DATADESC( EventQueuePrioritizedEvent_t )
 	DEFINE_FIELD( m_iOutputID, FIELD_INTEGER ),
 	DEFINE_CUSTOM_FIELD( m_VariantValue, variantFuncs ),
 
-//	DEFINE_FIELD( m_pNext, FIELD_??? ),
-//	DEFINE_FIELD( m_pPrev, FIELD_??? ),
+	// m_nSerial, m_iHeapIndex and the slot list links are rebuilt when the restored event is added
 END_DATADESC()
 
 
 int CEventQueue::Save( ISave &save )
 {
-	// count the number of items in the queue
-	EventQueuePrioritizedEvent_t *pe;
+	// save the events in the order they'll fire, so the same-time ones restore in the same order
+	CUtlVector<EventQueuePrioritizedEvent_t *> events;
+	GetSortedEvents( events );
 
-	m_iListCount = 0;
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
-	{
-		m_iListCount++;
-	}
+	// count the number of items in the queue
+	m_iListCount = events.Count();
 
 	// save that value out to disk, so we know how many to restore
 	if ( !save.WriteFields( "EventQueue", this, NULL, m_DataMap.dataDesc, m_DataMap.dataNumFields ) )
 		return 0;
 	
 	// cycle through all the events, saving them all
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
+		EventQueuePrioritizedEvent_t *pe = events[i];
 		if ( !save.WriteFields( "PEvent", pe, NULL, pe->m_DataMap.dataDesc, pe->m_DataMap.dataNumFields ) )
 			return 0;
 	}
@@ -11,7 +11,9 @@
 #include "igamesystem.h"
 #include "collisionutils.h"
 #include "UtlSortVector.h"
+#include "bitvec.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
 #include "mapentities.h"
 #include "client.h"
 #include "ai_initutils.h"
@@ -127,10 +129,20 @@ void AimTarget_ForceRepopulateList()
 // NOTE: This is usually a small subset of the global entity list, so it's
 // an optimization to maintain this list incrementally rather than polling each
 // frame.
+//
+// Entities that only think wait on a timing wheel keyed by their next think tick,
+// so each frame only touches the entities that come due. Entities that are due
+// are marked in a bit vector by list position, which keeps ListCopy in list order.
+#define SIMTHINK_WHEEL_BITS		8
+#define SIMTHINK_WHEEL_SIZE		(1<<SIMTHINK_WHEEL_BITS)
+#define SIMTHINK_WHEEL_MASK		(SIMTHINK_WHEEL_SIZE-1)
+#define SIMTHINK_SLOT_OVERFLOW	SIMTHINK_WHEEL_SIZE		// thinks more than a turn of the wheel from now
+#define SIMTHINK_SLOT_DUE		0xFFFF					// simulates or thinks this frame
+
 struct simthinkentry_t
 {
 	unsigned short	entEntry;
-	unsigned short	unused0;
+	unsigned short	wheelSlot;
 	int				nextThinkTick;
 };
 class CSimThinkManager : public IEntityListener
@@ -147,6 +159,12 @@ public:
 		{
 			m_entinfoIndex[i] = 0xFFFF;
 		}
+		for ( int i = 0; i < ARRAYSIZE(m_wheelHead); i++ )
+		{
+			m_wheelHead[i] = 0xFFFF;
+		}
+		m_dueList.ClearAll();
+		m_wheelTick = -1;
 	}
 	void LevelInitPreEntity()
 	{
@@ -175,6 +193,7 @@ public:
 		if ( listHandle != 0xFFFF )
 		{
 			Assert(m_simThinkList[listHandle].entEntry == index);
+			UnlinkEntry( listHandle );
 			m_simThinkList.FastRemove( listHandle );
 			m_entinfoIndex[index] = 0xFFFF;
 			
@@ -182,6 +201,14 @@ public:
 			if ( listHandle < m_simThinkList.Count() )
 			{
 				m_entinfoIndex[m_simThinkList[listHandle].entEntry] = listHandle;
+
+				// wheel slots link entinfo indices, but the due list has to follow him
+				int lastHandle = m_simThinkList.Count();
+				if ( m_dueList.IsBitSet( lastHandle ) )
+				{
+					m_dueList.Clear( lastHandle );
+					m_dueList.Set( listHandle );
+				}
 			}
 		}
 	}
@@ -192,21 +219,21 @@ public:
 
 	int ListCopy( CBaseEntity *pList[], int listMax )
 	{
+		AdvanceWheel( gpGlobals->tickcount );
+
 		int count = MIN(listMax, ListCount());
 		int out = 0;
-		for ( int i = 0; i < count; i++ )
+		// only copy out entities that will simulate or think this frame
+		for ( int i = m_dueList.FindNextSetBit( 0 ); i >= 0 && i < count; i = m_dueList.FindNextSetBit( i + 1 ) )
 		{
-			// only copy out entities that will simulate or think this frame
-			if ( m_simThinkList[i].nextThinkTick <= gpGlobals->tickcount )
-			{
-				Assert(m_simThinkList[i].nextThinkTick>=0);
-				int entinfoIndex = m_simThinkList[i].entEntry;
-				const CEntInfo *pInfo = gEntList.GetEntInfoPtrByIndex( entinfoIndex );
-				pList[out] = (CBaseEntity *)pInfo->m_pEntity;
-				Assert(m_simThinkList[i].nextThinkTick==0 || pList[out]->GetFirstThinkTick()==m_simThinkList[i].nextThinkTick);
-				Assert( gEntList.IsEntityPtr( pList[out] ) );
-				out++;
-			}
+			Assert(m_simThinkList[i].nextThinkTick <= gpGlobals->tickcount);
+			Assert(m_simThinkList[i].nextThinkTick>=0);
+			int entinfoIndex = m_simThinkList[i].entEntry;
+			const CEntInfo *pInfo = gEntList.GetEntInfoPtrByIndex( entinfoIndex );
+			pList[out] = (CBaseEntity *)pInfo->m_pEntity;
+			Assert(m_simThinkList[i].nextThinkTick==0 || pList[out]->GetFirstThinkTick()==m_simThinkList[i].nextThinkTick);
+			Assert( gEntList.IsEntityPtr( pList[out] ) );
+			out++;
 		}
 
 		return out;
@@ -241,26 +268,163 @@ public:
 					m_simThinkList[m_entinfoIndex[index]].nextThinkTick = pEntity->GetFirstThinkTick();
 					Assert(m_simThinkList[m_entinfoIndex[index]].nextThinkTick>=0);
 				}
+				LinkEntry( m_entinfoIndex[index] );
 			}
 			else
 			{
 				// updating existing entry - if no sim, reset think time
+				int nextThinkTick = 0;
 				if ( pEntity->IsEFlagSet(EFL_NO_GAME_PHYSICS_SIMULATION) )
 				{
-					m_simThinkList[m_entinfoIndex[index]].nextThinkTick = pEntity->GetFirstThinkTick();
-					Assert(m_simThinkList[m_entinfoIndex[index]].nextThinkTick>=0);
+					nextThinkTick = pEntity->GetFirstThinkTick();
+					Assert(nextThinkTick>=0);
 				}
-				else
+
+				int listHandle = m_entinfoIndex[index];
+				if ( m_simThinkList[listHandle].nextThinkTick != nextThinkTick )
 				{
-					m_simThinkList[m_entinfoIndex[index]].nextThinkTick = 0;
+					UnlinkEntry( listHandle );
+					m_simThinkList[listHandle].nextThinkTick = nextThinkTick;
+					LinkEntry( listHandle );
 				}
 			}
 		}
 	}
 
 private:
+	// Marks the entry due, or puts it in the wheel slot of its think tick
+	void LinkEntry( int listHandle )
+	{
+		simthinkentry_t &entry = m_simThinkList[listHandle];
+		if ( entry.nextThinkTick <= m_wheelTick )
+		{
+			entry.wheelSlot = SIMTHINK_SLOT_DUE;
+			m_dueList.Set( listHandle );
+			return;
+		}
+
+		int slot = SIMTHINK_SLOT_OVERFLOW;
+		if ( entry.nextThinkTick - m_wheelTick <= SIMTHINK_WHEEL_SIZE )
+		{
+			slot = entry.nextThinkTick & SIMTHINK_WHEEL_MASK;
+		}
+
+		unsigned short index = entry.entEntry;
+		entry.wheelSlot = slot;
+		m_wheelPrev[index] = 0xFFFF;
+		m_wheelNext[index] = m_wheelHead[slot];
+		if ( m_wheelHead[slot] != 0xFFFF )
+		{
+			m_wheelPrev[m_wheelHead[slot]] = index;
+		}
+		m_wheelHead[slot] = index;
+	}
+
+	void UnlinkEntry( int listHandle )
+	{
+		const simthinkentry_t &entry = m_simThinkList[listHandle];
+		if ( entry.wheelSlot == SIMTHINK_SLOT_DUE )
+		{
+			m_dueList.Clear( listHandle );
+			return;
+		}
+
+		unsigned short index = entry.entEntry;
+		unsigned short next = m_wheelNext[index];
+		unsigned short prev = m_wheelPrev[index];
+		if ( prev != 0xFFFF )
+		{
+			m_wheelNext[prev] = next;
+		}
+		else
+		{
+			m_wheelHead[entry.wheelSlot] = next;
+		}
+		if ( next != 0xFFFF )
+		{
+			m_wheelPrev[next] = prev;
+		}
+	}
+
+	void MoveSlotToDue( int slot )
+	{
+		for ( unsigned short index = m_wheelHead[slot]; index != 0xFFFF; index = m_wheelNext[index] )
+		{
+			int listHandle = m_entinfoIndex[index];
+			m_simThinkList[listHandle].wheelSlot = SIMTHINK_SLOT_DUE;
+			m_dueList.Set( listHandle );
+		}
+		m_wheelHead[slot] = 0xFFFF;
+	}
+
+	// Moves the overflow entries that are now within a turn of the wheel into their slots
+	void RelinkOverflow()
+	{
+		unsigned short index = m_wheelHead[SIMTHINK_SLOT_OVERFLOW];
+		m_wheelHead[SIMTHINK_SLOT_OVERFLOW] = 0xFFFF;
+		while ( index != 0xFFFF )
+		{
+			unsigned short next = m_wheelNext[index];
+			LinkEntry( m_entinfoIndex[index] );
+			index = next;
+		}
+	}
+
+	void AdvanceWheel( int tick )
+	{
+		if ( tick == m_wheelTick )
+			return;
+
+		if ( tick < m_wheelTick )
+		{
+			// the clock went backwards (restored a save), sort everyone again
+			m_wheelTick = tick;
+			m_dueList.ClearAll();
+			for ( int i = 0; i < ARRAYSIZE(m_wheelHead); i++ )
+			{
+				m_wheelHead[i] = 0xFFFF;
+			}
+			for ( int i = 0; i < m_simThinkList.Count(); i++ )
+			{
+				LinkEntry( i );
+			}
+			return;
+		}
+
+		if ( tick - m_wheelTick >= SIMTHINK_WHEEL_SIZE )
+		{
+			// skipped a whole turn, everyone on the wheel is due
+			for ( int i = 0; i < SIMTHINK_WHEEL_SIZE; i++ )
+			{
+				MoveSlotToDue( i );
+			}
+			m_wheelTick = tick;
+			RelinkOverflow();
+			return;
+		}
+
+		while ( m_wheelTick < tick )
+		{
+			m_wheelTick++;
+			MoveSlotToDue( m_wheelTick & SIMTHINK_WHEEL_MASK );
+
+			// an overflow entry is always relinked here at least once in the turn before it thinks
+			if ( ( m_wheelTick & SIMTHINK_WHEEL_MASK ) == 0 )
+			{
+				RelinkOverflow();
+			}
+		}
+	}
+
 	unsigned short m_entinfoIndex[NUM_ENT_ENTRIES];
 	CUtlVector<simthinkentry_t>	m_simThinkList;
+
+	// wheel slot lists, linked through entinfo index
+	unsigned short m_wheelHead[SIMTHINK_WHEEL_SIZE+1];
+	unsigned short m_wheelNext[NUM_ENT_ENTRIES];
+	unsigned short m_wheelPrev[NUM_ENT_ENTRIES];
+	int m_wheelTick;						// everyone thinking at or before this tick is due
+	CBitVec<NUM_ENT_ENTRIES> m_dueList;	// list handles of the entries that are due
 };
 
 CSimThinkManager g_SimThinkManager;
@@ -280,6 +444,209 @@ void SimThink_EntityChanged( CBaseEntity *pEntity )
 	g_SimThinkManager.EntityChanged( pEntity );
 }
 
+
+//-----------------------------------------------------------------------------
+// Purpose: Buckets the entities in the global list by classname or targetname
+//			so the finds don't have to walk every entity.
+//
+// A bucket holds the entities whose names could match the same queries,
+// linked through the slot arrays in global list order. This only narrows the
+// search down, the finds still run the entity's own match on every candidate.
+// Wildcard finds walk the whole list as before - a wildcard can match many
+// buckets, and finding the next match in list order across all of them on
+// every call costs more than the walk.
+//-----------------------------------------------------------------------------
+ConVar ent_find_index( "ent_find_index", "1", 0, "Use the classname and targetname indices to find entities by name." );
+
+// increases as entities are added, so it sorts the slots in global list order
+static unsigned int g_EntityListOrder[NUM_ENT_ENTRIES];
+static unsigned int g_nNextEntityListOrder;
+
+static inline bool IsEarlierInEntityList( int iSlot, int iOtherSlot )
+{
+	return (int)( g_EntityListOrder[iSlot] - g_EntityListOrder[iOtherSlot] ) < 0;
+}
+
+// NamesMatch's case test subtracts from an int, so it doesn't stop at 'A' or 'a':
+// a name character up to 'Z' also matches the query character 32 above it, and
+// one up to 'z' the character 32 below it. Folding everything up to 'z' onto its
+// value mod 32 puts every pair it can match in the same bucket. The +1 keeps
+// folded characters from looking like the terminator.
+static inline unsigned char FoldNameChar( unsigned char c )
+{
+	return ( c <= 'z' ) ? ( c & 31 ) + 1 : c;
+}
+
+static int CompareEntityNames( const char *pszName, const char *pszOther )
+{
+	while ( *pszName && *pszOther && FoldNameChar( *pszName ) == FoldNameChar( *pszOther ) )
+	{
+		++pszName;
+		++pszOther;
+	}
+	int nName = *pszName ? FoldNameChar( *pszName ) : 0;
+	int nOther = *pszOther ? FoldNameChar( *pszOther ) : 0;
+	return nName - nOther;
+}
+
+// Only exact names are looked up in the index, see above
+static inline bool CanUseNameIndex( const char *pszQuery )
+{
+	return pszQuery && pszQuery[0] != 0 && !strchr( pszQuery, '*' ) && ent_find_index.GetBool();
+}
+
+class CEntityNameIndex
+{
+public:
+	CEntityNameIndex() : m_buckets( 0, 0, BucketLessFunc )
+	{
+		for ( int i = 0; i < ARRAYSIZE(m_bucketIndex); i++ )
+		{
+			m_bucketIndex[i] = m_buckets.InvalidIndex();
+		}
+	}
+
+	// Moves the slot to the bucket for this name, NULL_STRING to remove it
+	void Update( int iSlot, string_t name )
+	{
+		int iBucket = m_bucketIndex[iSlot];
+		if ( iBucket != m_buckets.InvalidIndex() )
+		{
+			if ( name != NULL_STRING && !CompareEntityNames( m_buckets[iBucket].pszName, STRING(name) ) )
+				return;
+
+			Unlink( iSlot );
+		}
+
+		if ( name != NULL_STRING )
+		{
+			Link( iSlot, STRING(name) );
+		}
+	}
+
+	// Returns the first slot after iAfterSlot (-1 to start from the beginning)
+	// whose name could match pszQuery, which has no wildcard, or -1.
+	int NextCandidate( const char *pszQuery, int iAfterSlot ) const
+	{
+		bucket_t search;
+		search.pszName = pszQuery;
+		int iBucket = m_buckets.Find( search );
+		if ( iBucket == m_buckets.InvalidIndex() )
+			return -1;
+
+		return FirstInBucketAfter( iBucket, iAfterSlot );
+	}
+
+private:
+	struct bucket_t
+	{
+		const char		*pszName;	// owned copy
+		unsigned short	head;
+		unsigned short	tail;
+	};
+
+	static bool BucketLessFunc( const bucket_t &lhs, const bucket_t &rhs )
+	{
+		return CompareEntityNames( lhs.pszName, rhs.pszName ) < 0;
+	}
+
+	int FirstInBucketAfter( int iBucket, int iAfterSlot ) const
+	{
+		int iSlot = m_buckets[iBucket].head;
+		if ( iAfterSlot >= 0 )
+		{
+			if ( m_bucketIndex[iAfterSlot] == iBucket )
+			{
+				iSlot = m_next[iAfterSlot];
+			}
+			else
+			{
+				while ( iSlot != 0xFFFF && !IsEarlierInEntityList( iAfterSlot, iSlot ) )
+				{
+					iSlot = m_next[iSlot];
+				}
+			}
+		}
+		return ( iSlot != 0xFFFF ) ? iSlot : -1;
+	}
+
+	void Link( int iSlot, const char *pszName )
+	{
+		bucket_t search;
+		search.pszName = pszName;
+		int iBucket = m_buckets.Find( search );
+		if ( iBucket == m_buckets.InvalidIndex() )
+		{
+			search.pszName = V_strdup( pszName );
+			search.head = search.tail = 0xFFFF;
+			iBucket = m_buckets.Insert( search );
+		}
+		m_bucketIndex[iSlot] = iBucket;
+
+		// Entities are usually named as they're created, so they almost always go on the end
+		bucket_t &bucket = m_buckets[iBucket];
+		unsigned short prev = bucket.tail;
+		while ( prev != 0xFFFF && IsEarlierInEntityList( iSlot, prev ) )
+		{
+			prev = m_prev[prev];
+		}
+		unsigned short next = ( prev != 0xFFFF ) ? m_next[prev] : bucket.head;
+
+		m_prev[iSlot] = prev;
+		m_next[iSlot] = next;
+		if ( prev != 0xFFFF )
+			m_next[prev] = iSlot;
+		else
+			bucket.head = iSlot;
+		if ( next != 0xFFFF )
+			m_prev[next] = iSlot;
+		else
+			bucket.tail = iSlot;
+	}
+
+	void Unlink( int iSlot )
+	{
+		int iBucket = m_bucketIndex[iSlot];
+		bucket_t &bucket = m_buckets[iBucket];
+		unsigned short prev = m_prev[iSlot];
+		unsigned short next = m_next[iSlot];
+		if ( prev != 0xFFFF )
+			m_next[prev] = next;
+		else
+			bucket.head = next;
+		if ( next != 0xFFFF )
+			m_prev[next] = prev;
+		else
+			bucket.tail = prev;
+		m_bucketIndex[iSlot] = m_buckets.InvalidIndex();
+
+		if ( bucket.head == 0xFFFF )
+		{
+			delete[] bucket.pszName;
+			m_buckets.RemoveAt( iBucket );
+		}
+	}
+
+	CUtlRBTree<bucket_t, int> m_buckets;
+	int				m_bucketIndex[NUM_ENT_ENTRIES];	// bucket each slot is in
+	unsigned short	m_next[NUM_ENT_ENTRIES];		// list order links within the bucket
+	unsigned short	m_prev[NUM_ENT_ENTRIES];
+};
+
+static CEntityNameIndex g_ClassnameIndex;
+static CEntityNameIndex g_TargetnameIndex;
+
+void NameIndex_EntityChanged( CBaseEntity *pEntity )
+{
+	// entities get indexed when they're added to the list
+	if ( !pEntity->GetRefEHandle().IsValid() )
+		return;
+
+	int iSlot = pEntity->GetRefEHandle().GetEntryIndex();
+	g_ClassnameIndex.Update( iSlot, pEntity->m_iClassname );
+	g_TargetnameIndex.Update( iSlot, pEntity->GetEntityName() );
+}
+
 static CBaseEntityClassList *s_pClassLists = NULL;
 CBaseEntityClassList::CBaseEntityClassList()
 {
@@ -481,6 +848,24 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName, IEntityFindFilter *pFilter )
 {
+	if ( CanUseNameIndex( szName ) )
+	{
+		int iSlot = pStartEntity ? pStartEntity->GetRefEHandle().GetEntryIndex() : -1;
+		while ( ( iSlot = g_ClassnameIndex.NextCandidate( szName, iSlot ) ) >= 0 )
+		{
+			CBaseEntity *pEntity = (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+			if ( pEntity->ClassMatches(szName) )
+			{
+				if ( pFilter && !pFilter->ShouldFindEntity( pEntity ) )
+					continue;
+
+				return pEntity;
+			}
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -595,6 +980,24 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 
 		return NULL;
 	}
+
+	if ( CanUseNameIndex( szName ) )
+	{
+		int iSlot = pStartEntity ? pStartEntity->GetRefEHandle().GetEntryIndex() : -1;
+		while ( ( iSlot = g_TargetnameIndex.NextCandidate( szName, iSlot ) ) >= 0 )
+		{
+			CBaseEntity *ent = (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+			if ( ent->NameMatches( szName ) )
+			{
+				if ( pFilter && !pFilter->ShouldFindEntity(ent) )
+					continue;
+
+				return ent;
+			}
+		}
+
+		return NULL;
+	}
 	
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -1128,6 +1531,11 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
+
+	// the active list appends, so this keeps the name index buckets in list order
+	g_EntityListOrder[handle.GetEntryIndex()] = g_nNextEntityListOrder++;
+	NameIndex_EntityChanged( pBaseEnt );
+
 	//DevMsg(2,"Created %s\n", pBaseEnt->GetClassname() );
 	for ( i = m_entityListeners.Count()-1; i >= 0; i-- )
 	{
@@ -1158,6 +1566,9 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts--;
 
+	g_ClassnameIndex.Update( handle.GetEntryIndex(), NULL_STRING );
+	g_TargetnameIndex.Update( handle.GetEntryIndex(), NULL_STRING );
+
 	m_iNumEnts--;
 }
 
@@ -1648,6 +2059,60 @@ CON_COMMAND(report_touchlinks, "Lists all touchlinks")
 	list.ReportEntityList();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Times FindEntityByClassname and FindEntityByName with and without
+//			the name indices, and checks they find as many entities.
+//-----------------------------------------------------------------------------
+static int TimeEntityFinds( const char *pszName, bool bClassname, int nIterations, float *pflMicroseconds )
+{
+	CFastTimer timer;
+	int nFound = 0;
+	timer.Start();
+	for ( int i = 0; i < nIterations; i++ )
+	{
+		CBaseEntity *pEntity = NULL;
+		while ( ( pEntity = ( bClassname ? gEntList.FindEntityByClassname( pEntity, pszName ) : gEntList.FindEntityByName( pEntity, pszName ) ) ) != NULL )
+		{
+			nFound++;
+		}
+	}
+	timer.End();
+	*pflMicroseconds = timer.GetDuration().GetMicrosecondsF() / nIterations;
+	return nFound / nIterations;
+}
+
+CON_COMMAND_F( ent_find_benchmark, "Times finding entities by classname and targetname. Usage: ent_find_benchmark <name or wildcard> [iterations]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: ent_find_benchmark <name or wildcard> [iterations]\n" );
+		return;
+	}
+
+	const char *pszName = args[1];
+	int nIterations = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 100;
+	nIterations = clamp( nIterations, 1, 100000 );
+
+	bool bUseIndex = ent_find_index.GetBool();
+	for ( int i = 0; i < 2; i++ )
+	{
+		bool bClassname = ( i == 0 );
+		float flIndexTime, flScanTime;
+		ent_find_index.SetValue( 1 );
+		int nIndexFound = TimeEntityFinds( pszName, bClassname, nIterations, &flIndexTime );
+		ent_find_index.SetValue( 0 );
+		int nScanFound = TimeEntityFinds( pszName, bClassname, nIterations, &flScanTime );
+
+		Msg( "%s \"%s\", %d entities: indexed %.3f us, scan %.3f us (%d found%s)\n",
+			bClassname ? "FindEntityByClassname" : "FindEntityByName", pszName, gEntList.NumberOfEntities(),
+			flIndexTime, flScanTime, nIndexFound, ( nIndexFound == nScanFound ) ? "" : ", MISMATCH" );
+	}
+	ent_find_index.SetValue( bUseIndex );
+}
+
 CON_COMMAND(report_simthinklist, "Lists all simulating/thinking entities")
 {
 	if ( !UTIL_IsCommandIssuedByServerAdmin() )
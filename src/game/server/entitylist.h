@@ -360,4 +360,7 @@ void SimThink_EntityChanged( CBaseEntity *pEntity );
 int SimThink_ListCount();
 int SimThink_ListCopy( CBaseEntity *pList[], int listMax );
 
+// call when an entity's classname or targetname changes
+void NameIndex_EntityChanged( CBaseEntity *pEntity );
+
 #endif // ENTITYLIST_H
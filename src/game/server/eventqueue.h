@@ -15,6 +15,7 @@
 #endif
 
 #include "mempool.h"
+#include "utlvector.h"
 
 struct EventQueuePrioritizedEvent_t
 {
@@ -28,8 +29,14 @@ struct EventQueuePrioritizedEvent_t
 
 	variant_t m_VariantValue;	// variable-type parameter
 
-	EventQueuePrioritizedEvent_t *m_pNext;
-	EventQueuePrioritizedEvent_t *m_pPrev;
+	unsigned int m_nSerial;		// secondary priority key; events with the same fire time go in the order they were added
+	int m_iHeapIndex;			// where the event is in the queue's heap
+
+	// lists of the events sharing an entity slot, by target and by caller
+	EventQueuePrioritizedEvent_t *m_pTargetNext;
+	EventQueuePrioritizedEvent_t *m_pTargetPrev;
+	EventQueuePrioritizedEvent_t *m_pCallerNext;
+	EventQueuePrioritizedEvent_t *m_pCallerPrev;
 
 	DECLARE_SIMPLE_DATADESC();
 
@@ -71,8 +78,20 @@ private:
 	void AddEvent( EventQueuePrioritizedEvent_t *event );
 	void RemoveEvent( EventQueuePrioritizedEvent_t *pe );
 
+	// binary heap, ordered by fire time and then serial
+	static bool FiresBefore( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b );
+	void HeapMoveUp( int iHeap );
+	void HeapMoveDown( int iHeap );
+	void GetSortedEvents( CUtlVector<EventQueuePrioritizedEvent_t *> &events );
+
 	DECLARE_SIMPLE_DATADESC();
-	EventQueuePrioritizedEvent_t m_Events;
+	CUtlVector<EventQueuePrioritizedEvent_t *> m_Heap;
+	unsigned int m_nNextSerial;
+
+	// heads of the per entity slot lists, indexed by the entry index of the event's target and caller handles
+	EventQueuePrioritizedEvent_t *m_pTargetEvents[NUM_ENT_ENTRIES];
+	EventQueuePrioritizedEvent_t *m_pCallerEvents[NUM_ENT_ENTRIES];
+
 	int m_iListCount;
 };
 
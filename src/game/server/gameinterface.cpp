@@ -90,6 +90,7 @@
 #include "serverbenchmark_base.h"
 #include "querycache.h"
 #include "player_voice_listener.h"
+#include "transmitsnapshot.h"
 
 #ifdef TF_DLL
 #include "gc_clientsystem.h"
@@ -2505,6 +2506,13 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 		    bIsReplay == ( pInfo->m_pTransmitAlways != NULL) );
 #endif
 
+	// HLTV and replay don't cull against the PVS
+	bool bSnapshotPVS = true;
+#ifndef _X360
+	bSnapshotPVS = !bIsHLTV && !bIsReplay;
+#endif
+	bSnapshotPVS = bSnapshotPVS && g_TransmitSnapshot.TestPVS( pInfo, pEdictIndices, nEdicts );
+
 	for ( int i=0; i < nEdicts; i++ )
 	{
 		int iEdict = pEdictIndices[i];
@@ -2599,7 +2607,7 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			continue;
 		}
 
-		bool bInPVS = netProp->IsInPVS( pInfo );
+		bool bInPVS = bSnapshotPVS ? g_TransmitSnapshot.IsInPVS( netProp, pInfo ) : netProp->IsInPVS( pInfo );
 		if ( bInPVS || sv_force_transmit_ents.GetBool() )
 		{
 			// only send if entity is in PVS
@@ -2654,7 +2662,7 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			{
 				// Check pvs
 				check->RecomputePVSInformation();
-				bool bMoveParentInPVS = check->IsInPVS( pInfo );
+				bool bMoveParentInPVS = bSnapshotPVS ? g_TransmitSnapshot.IsInPVS( check, pInfo ) : check->IsInPVS( pInfo );
 				if ( bMoveParentInPVS )
 				{
 					orig->SetTransmit( pInfo, true );
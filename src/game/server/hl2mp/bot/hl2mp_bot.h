@@ -850,6 +850,38 @@ public:
 		}
 	}
 
+	virtual bool GetCacheKey( NextBotPathCostKey *key ) const
+	{
+		if ( m_routeType == SAFEST_ROUTE )
+			return false;
+
+		struct
+		{
+			int entindex;			// only the DEFAULT_ROUTE preference is per-bot - other bots with the same state share routes
+			int team;
+			int routeType;
+			int timeMod;
+			float stepHeight;
+			float maxJumpHeight;
+			float maxDropHeight;
+		}
+		state;
+
+		bool isPreferenceUsed = ( m_routeType == DEFAULT_ROUTE );
+
+		V_memset( &state, 0, sizeof( state ) );
+		state.entindex = isPreferenceUsed ? m_me->entindex() : 0;
+		state.team = m_me->GetTeamNumber();
+		state.routeType = m_routeType;
+		state.timeMod = isPreferenceUsed ? (int)( gpGlobals->curtime / 10.0f ) + 1 : 0;
+		state.stepHeight = m_stepHeight;
+		state.maxJumpHeight = m_maxJumpHeight;
+		state.maxDropHeight = m_maxDropHeight;
+
+		key->Set( state );
+		return true;
+	}
+
 	CHL2MPBot *m_me;
 	RouteType m_routeType;
 	float m_stepHeight;
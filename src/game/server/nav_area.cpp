@@ -46,6 +46,7 @@ NavAreaVector TheNavAreas;
 unsigned int CNavArea::m_masterMarker = 1;
 CNavArea *CNavArea::m_openList = NULL;
 CNavArea *CNavArea::m_openListTail = NULL;
+CTHREADLOCALPTR( CNavSearchContext ) CNavArea::m_activeSearchContext;
 
 bool CNavArea::m_isReset = false;
 uint32 CNavArea::s_nCurrVisTestCounter = 0;
@@ -916,6 +917,7 @@ void CNavArea::AddLadderDown( CNavLadder *ladder )
 void CNavArea::FinishMerge( CNavArea *adjArea )
 {
 	// update extent
+	TheNavMesh->InvalidatePackedGrid();
 	m_nwCorner = *m_node[ NORTH_WEST ]->GetPosition();
 	m_seCorner = *m_node[ SOUTH_EAST ]->GetPosition();
 
@@ -1741,6 +1743,7 @@ bool CNavArea::MergeEdit( CNavArea *adj )
 	Vector originalSECorner = m_seCorner;
 	
 	// update extent
+	TheNavMesh->InvalidatePackedGrid();
 	if (m_nwCorner.x > adj->m_nwCorner.x || m_nwCorner.y > adj->m_nwCorner.y)
 		m_nwCorner = adj->m_nwCorner;
 
@@ -3555,6 +3558,8 @@ void CNavArea::ClearSearchLists( void )
 //--------------------------------------------------------------------------------------------------------------
 void CNavArea::SetCorner( NavCornerType corner, const Vector& newPosition )
 {
+	TheNavMesh->InvalidatePackedGrid();
+
 	switch( corner )
 	{
 		case NORTH_WEST:
@@ -4558,6 +4563,8 @@ void CNavArea::PlaceOnGround( NavCornerType corner, float inset )
  */
 void CNavArea::Shift( const Vector &shift )
 {
+	TheNavMesh->InvalidatePackedGrid();
+
 	m_nwCorner += shift;
 	m_seCorner += shift;
 	
@@ -23,6 +23,7 @@ enum { MAX_NAV_TEAMS = 2 };
 class CFuncElevator;
 class CFuncNavPrerequisite;
 class CFuncNavCost;
+class CNavSearchContext;
 
 class CNavVectorNoEditAllocator
 {
@@ -451,6 +452,7 @@ public:
 
 	void SetCostSoFar( float value )	{ DebuggerBreakOnNaN_StagingOnly( value ); Assert( value >= 0.0 && !IS_NAN(value) ); m_costSoFar = value; }
 	float GetCostSoFar( void ) const	{ DebuggerBreakOnNaN_StagingOnly( m_costSoFar ); return m_costSoFar; }
+	float GetSearchCostSoFar( void ) const	{ return ( !m_activeSearchContext ) ? GetCostSoFar() : GetSearchContextCostSoFar(); }	// while a CNavSearchContext is searching on this thread, returns its cost instead
 
 	void SetPathLengthSoFar( float value )	{ DebuggerBreakOnNaN_StagingOnly( value ); Assert( value >= 0.0 && !IS_NAN(value) ); m_pathLengthSoFar = value; }
 	float GetPathLengthSoFar( void ) const	{ DebuggerBreakOnNaN_StagingOnly( m_pathLengthSoFar ); return m_pathLengthSoFar; }
@@ -643,6 +645,8 @@ public:
 private:
 	friend class CNavMesh;
 	friend class CNavLadder;
+	friend class CNavSearchContext;
+	friend class CNavVisibilityCache;
 	friend class CCSNavArea;									// allow CS load code to complete replace our default load behavior
 
 	static bool m_isReset;										// if true, don't bother cleaning up in destructor since everything is going away
@@ -708,6 +712,9 @@ private:
 	static CNavArea *m_openList;
 	static CNavArea *m_openListTail;
 
+	static CTHREADLOCALPTR( CNavSearchContext ) m_activeSearchContext;	// the context searching on this thread, if any
+	float GetSearchContextCostSoFar( void ) const;
+
 	//- connections to adjacent areas -------------------------------------------------------------------
 	NavConnectVector m_incomingConnect[ NUM_DIRECTIONS ];		// a list of adjacent areas for each direction that connect TO us, but we have no connection back to them
 
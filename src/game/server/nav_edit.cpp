@@ -3916,6 +3916,9 @@ bool CNavMesh::IsInSelectedSet( const CNavArea *area ) const
  */
 void CNavMesh::OnEditCreateNotify( CNavArea *newArea )
 {
+	++m_pathingGeneration;
+	TheNavHierarchy.Invalidate();
+
 	FOR_EACH_VEC( TheNavAreas, it )
 	{
 		TheNavAreas[ it ]->OnEditCreateNotify( newArea );
@@ -3929,6 +3932,9 @@ void CNavMesh::OnEditCreateNotify( CNavArea *newArea )
  */
 void CNavMesh::OnEditDestroyNotify( CNavArea *deadArea )
 {
+	++m_pathingGeneration;
+	TheNavHierarchy.Invalidate();
+
 	// clean up any edit hooks
 	m_markedArea = NULL;
 	m_selectedArea = NULL;
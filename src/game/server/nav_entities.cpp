@@ -152,6 +152,23 @@ void CFuncNavCost::CostThink( void )
 }
 
 
+//--------------------------------------------------------------------------------------------------------
+bool CFuncNavCost::IsAnyEnabled( void )
+{
+	for( int i=0; i<gm_masterCostVector.Count(); ++i )
+	{
+		CFuncNavCost *cost = gm_masterCostVector[i];
+
+		if ( cost && cost->IsEnabled() )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
 //--------------------------------------------------------------------------------------------------------
 bool CFuncNavCost::HasTag( const char *groupname ) const
 {
@@ -318,6 +335,9 @@ void CFuncNavCost::UpdateAllNavCostDecoration( void )
 			}
 		}
 	}
+
+	// routes computed with the old costs are stale
+	TheNavMesh->OnPathCostsChanged();
 }
 
 
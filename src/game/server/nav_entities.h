@@ -38,6 +38,8 @@ public:
 
 	virtual float GetCostMultiplier( CBaseCombatCharacter *who ) const	{ return 1.0f; }
 
+	static bool IsAnyEnabled( void );								// return true if any func_nav_cost may be changing area costs
+
 protected:
 	int m_team;
 	bool m_isDisabled;
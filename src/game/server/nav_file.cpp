@@ -11,6 +11,7 @@
 
 #include "cbase.h"
 #include "nav_mesh.h"
+#include "nav_hierarchy.h"
 #include "gamerules.h"
 #include "datacache/imdlcache.h"
 
@@ -190,6 +191,111 @@ PlaceDirectory placeDirectory;
 	#define PATH_NAVFILE_EMBEDDED "maps\\embed.nav"
 #endif
 
+ConVar nav_save_binary( "nav_save_binary", "0", FCVAR_GAMEDLL | FCVAR_CHEAT, "If nonzero, a binary image of the nav mesh is saved alongside the .nav file, so the mesh loads faster next time" );
+
+
+//--------------------------------------------------------------------------------------------------------------
+//
+// The binary nav image is an optional copy of a map's nav mesh, saved alongside its .nav file.
+// Each kind of record is stored as one contiguous array of fixed size records (a "section"), and
+// records refer to each other by array index and to areas by ID, so the image is position independent.
+// Loading it is one file read, after which records are used where they lie - there is no parsing,
+// and every area's lists are allocated at their final size up front.
+//
+// An image is only used if it was made from the current .nav file, otherwise the .nav file is parsed
+// as usual. Meshes with derived class data (see GetSubVersionNumber()) always use the .nav file.
+//
+#define FORMAT_NAVBINARYFILE "maps\\%s.navb"
+
+#define NAV_BINARY_MAGIC_NUMBER	0x4256414E		// 'NAVB'
+#define NAV_BINARY_VERSION		1
+
+enum NavBinarySectionType
+{
+	NAV_BINARY_AREAS,
+	NAV_BINARY_CONNECTIONS,
+	NAV_BINARY_LADDER_CONNECTIONS,
+	NAV_BINARY_HIDING_SPOTS,
+	NAV_BINARY_ENCOUNTERS,
+	NAV_BINARY_SPOT_ORDERS,
+	NAV_BINARY_VISIBLE_AREAS,
+	NAV_BINARY_PLACES,						// the place directory, as saved in the .nav file
+	NAV_BINARY_LADDERS,						// the ladders, as saved in the .nav file
+
+	NAV_BINARY_SECTION_COUNT
+};
+
+struct NavBinarySection_t
+{
+	unsigned int offset;					// from the start of the image, always 4-byte aligned
+	unsigned int count;						// number of records, or of bytes for the places and ladders
+};
+
+struct NavBinaryHeader_t
+{
+	unsigned int magic;
+	unsigned int version;					// layout of the image
+	unsigned int navVersion;				// nav data version the image was made with
+	unsigned int navSize;					// size and time of the .nav file the image was made from
+	unsigned int navTime;
+	unsigned int bspSize;					// size of the bsp file, as stored in the .nav file
+	unsigned int isAnalyzed;
+	NavBinarySection_t section[ NAV_BINARY_SECTION_COUNT ];
+};
+
+struct NavBinaryArea_t
+{
+	unsigned int id;
+	int attributeFlags;
+	float nwCorner[3];
+	float seCorner[3];
+	float neZ;
+	float swZ;
+	unsigned int firstConnection;			// connections in each direction follow each other, in NavDirType order
+	unsigned int connectionCount[ NUM_DIRECTIONS ];
+	unsigned int firstLadderConnection;		// likewise, in LadderDirectionType order
+	unsigned int ladderConnectionCount[ CNavLadder::NUM_LADDER_DIRECTIONS ];
+	unsigned int firstHidingSpot;
+	unsigned int hidingSpotCount;
+	unsigned int firstEncounter;
+	unsigned int encounterCount;
+	unsigned int firstVisibleArea;
+	unsigned int visibleAreaCount;
+	unsigned int inheritVisibilityFrom;
+	unsigned int place;						// index into the place directory
+	float earliestOccupyTime[ MAX_NAV_TEAMS ];
+	float lightIntensity[ NUM_CORNERS ];
+};
+
+struct NavBinaryHidingSpot_t
+{
+	unsigned int id;
+	float pos[3];
+	unsigned int flags;
+};
+
+struct NavBinaryEncounter_t
+{
+	unsigned int fromID;
+	unsigned int fromDir;
+	unsigned int toID;
+	unsigned int toDir;
+	unsigned int firstSpotOrder;
+	unsigned int spotOrderCount;
+};
+
+struct NavBinarySpotOrder_t
+{
+	unsigned int id;
+	unsigned int t;							// 0-255, quantized as in the .nav file
+};
+
+struct NavBinaryVisibleArea_t
+{
+	unsigned int id;
+	unsigned int attributes;
+};
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Replace extension with "bsp"
@@ -1029,6 +1135,23 @@ inline void COM_FixSlashes( char *pname )
 #endif
 }
 
+
+//--------------------------------------------------------------------------------------------------------------
+static void WarnMeshOutOfDate( void )
+{
+	if ( engine->IsDedicatedServer() )
+	{
+		// Warning doesn't print to the dedicated server console, so we'll use Msg instead
+		DevMsg( "The Navigation Mesh was built using a different version of this map.\n" );
+	}
+	else
+	{
+		DevWarning( "The Navigation Mesh was built using a different version of this map.\n" );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
 static void WarnIfMeshNeedsAnalysis( int version )
 {
 	// Quick check to warn about needing to analyze: nav_strip, nav_delete, etc set
@@ -1220,6 +1343,18 @@ bool CNavMesh::Save( void ) const
 	unsigned int navSize = filesystem->Size( filename );
 	DevMsg( "Size of nav file '%s' is %u bytes.\n", filename, navSize );
 
+	// the mesh may have been edited or regenerated, so rebuild the hierarchy saved with it
+	if ( nav_hpa.GetBool() )
+	{
+		TheNavHierarchy.Build();
+		TheNavHierarchy.Save();
+	}
+
+	if ( nav_save_binary.GetBool() )
+	{
+		SaveBinary( STRING( gpGlobals->mapname ) );
+	}
+
 	return true;
 }
 
@@ -1389,10 +1524,10 @@ const CUtlVector< Place > *CNavMesh::GetPlacesFromNavFile( bool *hasUnnamedPlace
 /**
  * Fetch raw nav data into buffer
  */
-NavErrorType CNavMesh::GetNavDataFromFile( CUtlBuffer &outBuffer, bool *pNavDataFromBSP )
+NavErrorType CNavMesh::GetNavDataFromFile( CUtlBuffer &outBuffer, bool *pNavDataFromBSP, const char *mapName )
 {
 	char maptmp[256];
-	const char *pszMapName = GetCleanMapName( STRING( gpGlobals->mapname ), maptmp );
+	const char *pszMapName = GetCleanMapName( mapName ? mapName : STRING( gpGlobals->mapname ), maptmp );
 
 	// nav filename is derived from map filename
 	char filename[MAX_PATH] = { 0 };
@@ -1429,11 +1564,571 @@ NavErrorType CNavMesh::GetNavDataFromFile( CUtlBuffer &outBuffer, bool *pNavData
 	return NAV_OK;
 }
 
+//--------------------------------------------------------------------------------------------------------------
+static void PutNavBinarySection( CUtlBuffer &fileBuffer, NavBinaryHeader_t *header, NavBinarySectionType type, const void *data, unsigned int recordSize, unsigned int count )
+{
+	// keep every section aligned, so its records can be used in place
+	while( fileBuffer.TellPut() % 4 )
+	{
+		fileBuffer.PutUnsignedChar( 0 );
+	}
+
+	header->section[ type ].offset = fileBuffer.TellPut();
+	header->section[ type ].count = count;
+
+	fileBuffer.Put( data, recordSize * count );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the records of the given section of a binary nav image, or NULL if the section does not fit in the image
+ */
+static const void *GetNavBinarySection( const CUtlBuffer &fileBuffer, NavBinarySectionType type, unsigned int recordSize )
+{
+	const NavBinaryHeader_t *header = (const NavBinaryHeader_t *)fileBuffer.Base();
+	const NavBinarySection_t &section = header->section[ type ];
+	unsigned int size = fileBuffer.TellPut();
+
+	if ( section.offset % 4 || section.offset > size || section.count > ( size - section.offset ) / recordSize )
+		return NULL;
+
+	return (const byte *)fileBuffer.Base() + section.offset;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if the records first .. first + count - 1 are all within a section of the given count
+ */
+inline bool IsNavBinaryRangeValid( unsigned int first, unsigned int count, unsigned int sectionCount )
+{
+	return first <= sectionCount && count <= sectionCount - first;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Store a binary image of the Navigation Mesh, which must match the given map's current .nav file
+ */
+bool CNavMesh::SaveBinary( const char *mapName ) const
+{
+	if ( IsX360() || GetSubVersionNumber() != 0 )
+		return false;
+
+	char navFilename[MAX_PATH];
+	Q_snprintf( navFilename, sizeof( navFilename ), FORMAT_NAVFILE, mapName );
+
+	// the image stands in for the .nav file, so it carries the bsp size stored in it
+	FileHandle_t file = filesystem->Open( navFilename, "rb", "MOD" );
+	if ( !file )
+		return false;
+
+	unsigned int navHeader[4];		// magic, version, sub-version, bsp size
+	int result = filesystem->Read( navHeader, sizeof( navHeader ), file );
+	filesystem->Close( file );
+
+	if ( result != sizeof( navHeader ) || navHeader[0] != NAV_MAGIC_NUMBER || navHeader[1] != NavCurrentVersion )
+		return false;
+
+	NavBinaryHeader_t header;
+	Q_memset( &header, 0, sizeof( header ) );
+
+	header.magic = NAV_BINARY_MAGIC_NUMBER;
+	header.version = NAV_BINARY_VERSION;
+	header.navVersion = NavCurrentVersion;
+	header.navSize = filesystem->Size( navFilename, "MOD" );
+	header.navTime = (unsigned int)filesystem->GetFileTime( navFilename, "MOD" );
+	header.bspSize = navHeader[3];
+	header.isAnalyzed = m_isAnalyzed;
+
+	// build a directory of the Places in this map, as Save() does
+	placeDirectory.Reset();
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		placeDirectory.AddPlace( TheNavAreas[ it ]->GetPlace() );
+	}
+
+	CUtlVector< NavBinaryArea_t > areaRecords;
+	CUtlVector< unsigned int > connections;
+	CUtlVector< unsigned int > ladderConnections;
+	CUtlVector< NavBinaryHidingSpot_t > hidingSpots;
+	CUtlVector< NavBinaryEncounter_t > encounters;
+	CUtlVector< NavBinarySpotOrder_t > spotOrders;
+	CUtlVector< NavBinaryVisibleArea_t > visibleAreas;
+
+	areaRecords.SetCount( TheNavAreas.Count() );
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const CNavArea *area = TheNavAreas[ it ];
+		NavBinaryArea_t &record = areaRecords[ it ];
+
+		record.id = area->m_id;
+		record.attributeFlags = area->m_attributeFlags;
+
+		for( int i=0; i<3; ++i )
+		{
+			record.nwCorner[i] = area->m_nwCorner[i];
+			record.seCorner[i] = area->m_seCorner[i];
+		}
+
+		record.neZ = area->m_neZ;
+		record.swZ = area->m_swZ;
+
+		record.firstConnection = connections.Count();
+		for( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			record.connectionCount[d] = area->m_connect[d].Count();
+
+			FOR_EACH_VEC( area->m_connect[d], cit )
+			{
+				connections.AddToTail( area->m_connect[d][ cit ].area->GetID() );
+			}
+		}
+
+		record.firstLadderConnection = ladderConnections.Count();
+		for( int dir=0; dir<CNavLadder::NUM_LADDER_DIRECTIONS; ++dir )
+		{
+			record.ladderConnectionCount[dir] = area->m_ladder[dir].Count();
+
+			FOR_EACH_VEC( area->m_ladder[dir], lit )
+			{
+				ladderConnections.AddToTail( area->m_ladder[dir][ lit ].ladder->GetID() );
+			}
+		}
+
+		// hiding spots and encounter spots are truncated as in the .nav file, so both load the same mesh
+		record.firstHidingSpot = hidingSpots.Count();
+		record.hidingSpotCount = MIN( area->m_hidingSpots.Count(), 255 );
+
+		for( unsigned int h=0; h<record.hidingSpotCount; ++h )
+		{
+			const HidingSpot *spot = area->m_hidingSpots[h];
+
+			NavBinaryHidingSpot_t spotRecord;
+			spotRecord.id = spot->m_id;
+			spotRecord.pos[0] = spot->m_pos.x;
+			spotRecord.pos[1] = spot->m_pos.y;
+			spotRecord.pos[2] = spot->m_pos.z;
+			spotRecord.flags = spot->m_flags;
+
+			hidingSpots.AddToTail( spotRecord );
+		}
+
+		record.firstEncounter = encounters.Count();
+		record.encounterCount = area->m_spotEncounters.Count();
+
+		FOR_EACH_VEC( area->m_spotEncounters, eit )
+		{
+			const SpotEncounter *e = area->m_spotEncounters[ eit ];
+
+			NavBinaryEncounter_t encounter;
+			encounter.fromID = ( e->from.area ) ? e->from.area->GetID() : 0;
+			encounter.fromDir = (unsigned char)e->fromDir;
+			encounter.toID = ( e->to.area ) ? e->to.area->GetID() : 0;
+			encounter.toDir = (unsigned char)e->toDir;
+			encounter.firstSpotOrder = spotOrders.Count();
+			encounter.spotOrderCount = MIN( e->spots.Count(), 255 );
+
+			for( unsigned int s=0; s<encounter.spotOrderCount; ++s )
+			{
+				const SpotOrder &order = e->spots[s];
+
+				NavBinarySpotOrder_t orderRecord;
+				orderRecord.id = ( order.spot ) ? order.spot->GetID() : 0;
+				orderRecord.t = (unsigned char)( 255 * order.t );
+
+				spotOrders.AddToTail( orderRecord );
+			}
+
+			encounters.AddToTail( encounter );
+		}
+
+		record.firstVisibleArea = visibleAreas.Count();
+		record.visibleAreaCount = area->m_potentiallyVisibleAreas.Count();
+
+		for( int v=0; v<area->m_potentiallyVisibleAreas.Count(); ++v )
+		{
+			const CNavArea::AreaBindInfo &info = area->m_potentiallyVisibleAreas[v];
+
+			NavBinaryVisibleArea_t visible;
+			visible.id = ( info.area ) ? info.area->GetID() : 0;
+			visible.attributes = info.attributes;
+
+			visibleAreas.AddToTail( visible );
+		}
+
+		record.inheritVisibilityFrom = ( area->m_inheritVisibilityFrom.area ) ? area->m_inheritVisibilityFrom.area->GetID() : 0;
+		record.place = placeDirectory.GetIndex( area->GetPlace() );
+
+		for( int i=0; i<MAX_NAV_TEAMS; ++i )
+		{
+			record.earliestOccupyTime[i] = area->m_earliestOccupyTime[i];
+		}
+
+		for( int i=0; i<NUM_CORNERS; ++i )
+		{
+			record.lightIntensity[i] = area->m_lightIntensity[i];
+		}
+	}
+
+	CUtlBuffer placeBuffer;
+	placeDirectory.Save( placeBuffer );
+
+	CUtlBuffer ladderBuffer;
+	ladderBuffer.PutUnsignedInt( m_ladders.Count() );
+	FOR_EACH_VEC( m_ladders, it )
+	{
+		m_ladders[ it ]->Save( ladderBuffer, NavCurrentVersion );
+	}
+
+	CUtlBuffer fileBuffer( 4096, 1024*1024 );
+	fileBuffer.Put( &header, sizeof( header ) );
+
+	PutNavBinarySection( fileBuffer, &header, NAV_BINARY_AREAS, areaRecords.Base(), sizeof( NavBinaryArea_t ), areaRecords.Count() );
+	PutNavBinarySection( fileBuffer, &header, NAV_BINARY_CONNECTIONS, connections.Base(), sizeof( unsigned int ), connections.Count() );
+	PutNavBinarySection( fileBuffer, &header, NAV_BINARY_LADDER_CONNECTIONS, ladderConnections.Base(), sizeof( unsigned int ), ladderConnections.Count() );
+	PutNavBinarySection( fileBuffer, &header, NAV_BINARY_HIDING_SPOTS, hidingSpots.Base(), sizeof( NavBinaryHidingSpot_t ), hidingSpots.Count() );
+	PutNavBinarySection( fileBuffer, &header, NAV_BINARY_ENCOUNTERS, encounters.Base(), sizeof( NavBinaryEncounter_t ), encounters.Count() );
+	PutNavBinarySection( fileBuffer, &header, NAV_BINARY_SPOT_ORDERS, spotOrders.Base(), sizeof( NavBinarySpotOrder_t ), spotOrders.Count() );
+	PutNavBinarySection( fileBuffer, &header, NAV_BINARY_VISIBLE_AREAS, visibleAreas.Base(), sizeof( NavBinaryVisibleArea_t ), visibleAreas.Count() );
+	PutNavBinarySection( fileBuffer, &header, NAV_BINARY_PLACES, placeBuffer.Base(), 1, placeBuffer.TellPut() );
+	PutNavBinarySection( fileBuffer, &header, NAV_BINARY_LADDERS, ladderBuffer.Base(), 1, ladderBuffer.TellPut() );
+
+	// now that the sections are placed, store the completed header
+	Q_memcpy( fileBuffer.Base(), &header, sizeof( header ) );
+
+	char filename[MAX_PATH];
+	Q_snprintf( filename, sizeof( filename ), FORMAT_NAVBINARYFILE, mapName );
+
+	if ( !filesystem->WriteFile( filename, "MOD", fileBuffer ) )
+	{
+		Warning( "Unable to save binary nav image to %s\n", filename );
+		return false;
+	}
+
+	DevMsg( "Saved binary nav image %s (%d bytes)\n", filename, fileBuffer.TellPut() );
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the given map's binary nav image, if it was made from the current .nav file.
+ * The whole image is validated before anything is created, so if this returns false the mesh is untouched
+ * and the .nav file can be loaded instead.
+ */
+bool CNavMesh::LoadBinary( const char *mapName )
+{
+	if ( IsX360() || GetSubVersionNumber() != 0 )
+		return false;
+
+	char navFilename[MAX_PATH];
+	Q_snprintf( navFilename, sizeof( navFilename ), FORMAT_NAVFILE, mapName );
+
+	char filename[MAX_PATH];
+	Q_snprintf( filename, sizeof( filename ), FORMAT_NAVBINARYFILE, mapName );
+
+	// images are only made from loose .nav files
+	unsigned int navSize = filesystem->Size( navFilename, "MOD" );
+	if ( navSize == 0 )
+		return false;
+
+	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
+	if ( !filesystem->ReadFile( filename, "MOD", fileBuffer ) )
+		return false;
+
+	if ( fileBuffer.TellPut() < (int)sizeof( NavBinaryHeader_t ) )
+		return false;
+
+	const NavBinaryHeader_t *header = (const NavBinaryHeader_t *)fileBuffer.Base();
+
+	if ( header->magic != NAV_BINARY_MAGIC_NUMBER || header->version != NAV_BINARY_VERSION || header->navVersion != NavCurrentVersion )
+		return false;
+
+	if ( header->navSize != navSize || header->navTime != (unsigned int)filesystem->GetFileTime( navFilename, "MOD" ) )
+	{
+		DevMsg( "Binary nav image %s is out of date\n", filename );
+		return false;
+	}
+
+	const NavBinaryArea_t *areaRecords = (const NavBinaryArea_t *)GetNavBinarySection( fileBuffer, NAV_BINARY_AREAS, sizeof( NavBinaryArea_t ) );
+	const unsigned int *connections = (const unsigned int *)GetNavBinarySection( fileBuffer, NAV_BINARY_CONNECTIONS, sizeof( unsigned int ) );
+	const unsigned int *ladderConnections = (const unsigned int *)GetNavBinarySection( fileBuffer, NAV_BINARY_LADDER_CONNECTIONS, sizeof( unsigned int ) );
+	const NavBinaryHidingSpot_t *hidingSpots = (const NavBinaryHidingSpot_t *)GetNavBinarySection( fileBuffer, NAV_BINARY_HIDING_SPOTS, sizeof( NavBinaryHidingSpot_t ) );
+	const NavBinaryEncounter_t *encounters = (const NavBinaryEncounter_t *)GetNavBinarySection( fileBuffer, NAV_BINARY_ENCOUNTERS, sizeof( NavBinaryEncounter_t ) );
+	const NavBinarySpotOrder_t *spotOrders = (const NavBinarySpotOrder_t *)GetNavBinarySection( fileBuffer, NAV_BINARY_SPOT_ORDERS, sizeof( NavBinarySpotOrder_t ) );
+	const NavBinaryVisibleArea_t *visibleAreas = (const NavBinaryVisibleArea_t *)GetNavBinarySection( fileBuffer, NAV_BINARY_VISIBLE_AREAS, sizeof( NavBinaryVisibleArea_t ) );
+	const void *places = GetNavBinarySection( fileBuffer, NAV_BINARY_PLACES, 1 );
+	const void *ladders = GetNavBinarySection( fileBuffer, NAV_BINARY_LADDERS, 1 );
+
+	if ( !areaRecords || !connections || !ladderConnections || !hidingSpots || !encounters || !spotOrders || !visibleAreas || !places || !ladders )
+	{
+		Warning( "Invalid binary nav image %s\n", filename );
+		return false;
+	}
+
+	unsigned int areaCount = header->section[ NAV_BINARY_AREAS ].count;
+	if ( areaCount == 0 )
+		return false;
+
+	// validate every range, so a damaged image falls back to the .nav file instead of crashing
+	bool isValid = true;
+
+	for( unsigned int i=0; i<areaCount && isValid; ++i )
+	{
+		const NavBinaryArea_t &record = areaRecords[i];
+
+		unsigned int first = record.firstConnection;
+		for( int d=0; d<NUM_DIRECTIONS && isValid; ++d )
+		{
+			isValid = IsNavBinaryRangeValid( first, record.connectionCount[d], header->section[ NAV_BINARY_CONNECTIONS ].count );
+			first += record.connectionCount[d];
+		}
+
+		first = record.firstLadderConnection;
+		for( int dir=0; dir<CNavLadder::NUM_LADDER_DIRECTIONS && isValid; ++dir )
+		{
+			isValid = IsNavBinaryRangeValid( first, record.ladderConnectionCount[dir], header->section[ NAV_BINARY_LADDER_CONNECTIONS ].count );
+			first += record.ladderConnectionCount[dir];
+		}
+
+		isValid = isValid &&
+				  IsNavBinaryRangeValid( record.firstHidingSpot, record.hidingSpotCount, header->section[ NAV_BINARY_HIDING_SPOTS ].count ) &&
+				  IsNavBinaryRangeValid( record.firstEncounter, record.encounterCount, header->section[ NAV_BINARY_ENCOUNTERS ].count ) &&
+				  IsNavBinaryRangeValid( record.firstVisibleArea, record.visibleAreaCount, header->section[ NAV_BINARY_VISIBLE_AREAS ].count );
+	}
+
+	for( unsigned int e=0; e<header->section[ NAV_BINARY_ENCOUNTERS ].count && isValid; ++e )
+	{
+		isValid = IsNavBinaryRangeValid( encounters[e].firstSpotOrder, encounters[e].spotOrderCount, header->section[ NAV_BINARY_SPOT_ORDERS ].count );
+	}
+
+	if ( !isValid )
+	{
+		Warning( "Invalid binary nav image %s\n", filename );
+		return false;
+	}
+
+	//
+	// The image is good - build the mesh from it
+	//
+	char bspFilename[MAX_PATH];
+	Q_snprintf( bspFilename, sizeof( bspFilename ), FORMAT_BSPFILE, mapName );
+
+	if ( filesystem->Size( bspFilename ) != header->bspSize )
+	{
+		WarnMeshOutOfDate();
+		m_isOutOfDate = true;
+	}
+
+	m_isAnalyzed = header->isAnalyzed != 0;
+
+	CUtlBuffer placeBuffer( places, header->section[ NAV_BINARY_PLACES ].count, CUtlBuffer::READ_ONLY );
+	placeDirectory.Load( placeBuffer, NavCurrentVersion );
+
+	Extent extent;
+	extent.lo.x = 9999999999.9f;
+	extent.lo.y = 9999999999.9f;
+	extent.hi.x = -9999999999.9f;
+	extent.hi.y = -9999999999.9f;
+
+	TheNavMesh->PreLoadAreas( areaCount );
+	TheNavAreas.EnsureCapacity( areaCount );
+
+	Extent areaExtent;
+	for( unsigned int i=0; i<areaCount; ++i )
+	{
+		const NavBinaryArea_t &record = areaRecords[i];
+		CNavArea *area = TheNavMesh->CreateArea();
+
+		area->m_id = record.id;
+
+		// update nextID to avoid collisions
+		if ( area->m_id >= CNavArea::m_nextID )
+			CNavArea::m_nextID = area->m_id + 1;
+
+		area->m_attributeFlags = record.attributeFlags;
+
+		area->m_nwCorner.Init( record.nwCorner[0], record.nwCorner[1], record.nwCorner[2] );
+		area->m_seCorner.Init( record.seCorner[0], record.seCorner[1], record.seCorner[2] );
+
+		area->m_center = ( area->m_nwCorner + area->m_seCorner ) / 2.0f;
+
+		if ( ( area->m_seCorner.x - area->m_nwCorner.x ) > 0.0f && ( area->m_seCorner.y - area->m_nwCorner.y ) > 0.0f )
+		{
+			area->m_invDxCorners = 1.0f / ( area->m_seCorner.x - area->m_nwCorner.x );
+			area->m_invDyCorners = 1.0f / ( area->m_seCorner.y - area->m_nwCorner.y );
+		}
+		else
+		{
+			area->m_invDxCorners = area->m_invDyCorners = 0;
+
+			DevWarning( "Degenerate Navigation Area #%d at setpos %g %g %g\n", 
+				area->m_id, area->m_center.x, area->m_center.y, area->m_center.z );
+		}
+
+		area->m_neZ = record.neZ;
+		area->m_swZ = record.swZ;
+
+		area->CheckWaterLevel();
+
+		const unsigned int *connection = &connections[ record.firstConnection ];
+		for( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			area->m_connect[d].EnsureCapacity( record.connectionCount[d] );
+
+			for( unsigned int c=0; c<record.connectionCount[d]; ++c )
+			{
+				NavConnect connect;
+				connect.id = *connection++;
+				area->m_connect[d].AddToTail( connect );
+			}
+		}
+
+		area->m_hidingSpots.EnsureCapacity( record.hidingSpotCount );
+		for( unsigned int h=0; h<record.hidingSpotCount; ++h )
+		{
+			const NavBinaryHidingSpot_t &spotRecord = hidingSpots[ record.firstHidingSpot + h ];
+
+			// create new hiding spot and put on master list
+			HidingSpot *spot = TheNavMesh->CreateHidingSpot();
+
+			spot->m_id = spotRecord.id;
+			spot->m_pos.Init( spotRecord.pos[0], spotRecord.pos[1], spotRecord.pos[2] );
+			spot->m_flags = (unsigned char)spotRecord.flags;
+
+			// update next ID to avoid ID collisions by later spots
+			if ( spot->m_id >= HidingSpot::m_nextID )
+				HidingSpot::m_nextID = spot->m_id + 1;
+
+			area->m_hidingSpots.AddToTail( spot );
+		}
+
+		area->m_spotEncounters.EnsureCapacity( record.encounterCount );
+		for( unsigned int e=0; e<record.encounterCount; ++e )
+		{
+			const NavBinaryEncounter_t &encounterRecord = encounters[ record.firstEncounter + e ];
+
+			SpotEncounter *encounter = new SpotEncounter;
+
+			encounter->from.id = encounterRecord.fromID;
+			encounter->fromDir = static_cast<NavDirType>( encounterRecord.fromDir );
+			encounter->to.id = encounterRecord.toID;
+			encounter->toDir = static_cast<NavDirType>( encounterRecord.toDir );
+
+			encounter->spots.EnsureCapacity( encounterRecord.spotOrderCount );
+			for( unsigned int s=0; s<encounterRecord.spotOrderCount; ++s )
+			{
+				const NavBinarySpotOrder_t &orderRecord = spotOrders[ encounterRecord.firstSpotOrder + s ];
+
+				SpotOrder order;
+				order.id = orderRecord.id;
+				order.t = (float)orderRecord.t/255.0f;
+
+				encounter->spots.AddToTail( order );
+			}
+
+			area->m_spotEncounters.AddToTail( encounter );
+		}
+
+		area->SetPlace( placeDirectory.IndexToPlace( (PlaceDirectory::IndexType)record.place ) );
+
+		const unsigned int *ladderConnection = &ladderConnections[ record.firstLadderConnection ];
+		for( int dir=0; dir<CNavLadder::NUM_LADDER_DIRECTIONS; ++dir )
+		{
+			area->m_ladder[dir].EnsureCapacity( record.ladderConnectionCount[dir] );
+
+			for( unsigned int l=0; l<record.ladderConnectionCount[dir]; ++l )
+			{
+				NavLadderConnect connect;
+				connect.id = *ladderConnection++;
+				area->m_ladder[dir].AddToTail( connect );
+			}
+		}
+
+		for( int t=0; t<MAX_NAV_TEAMS; ++t )
+		{
+			area->m_earliestOccupyTime[t] = record.earliestOccupyTime[t];
+		}
+
+		for( int c=0; c<NUM_CORNERS; ++c )
+		{
+			area->m_lightIntensity[c] = record.lightIntensity[c];
+		}
+
+		area->m_potentiallyVisibleAreas.EnsureCapacity( record.visibleAreaCount );
+		for( unsigned int v=0; v<record.visibleAreaCount; ++v )
+		{
+			const NavBinaryVisibleArea_t &visible = visibleAreas[ record.firstVisibleArea + v ];
+
+			CNavArea::AreaBindInfo info;
+			info.id = visible.id;
+			info.attributes = (unsigned char)visible.attributes;
+
+			area->m_potentiallyVisibleAreas.AddToTail( info );
+		}
+
+		area->m_inheritVisibilityFrom.id = record.inheritVisibilityFrom;
+
+		TheNavAreas.AddToTail( area );
+
+		area->GetExtent( &areaExtent );
+
+		if (areaExtent.lo.x < extent.lo.x)
+			extent.lo.x = areaExtent.lo.x;
+		if (areaExtent.lo.y < extent.lo.y)
+			extent.lo.y = areaExtent.lo.y;
+		if (areaExtent.hi.x > extent.hi.x)
+			extent.hi.x = areaExtent.hi.x;
+		if (areaExtent.hi.y > extent.hi.y)
+			extent.hi.y = areaExtent.hi.y;
+	}
+
+	// add the areas to the grid
+	AllocateGrid( extent.lo.x, extent.hi.x, extent.lo.y, extent.hi.y );
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		AddNavArea( TheNavAreas[ it ] );
+	}
+
+	// set up all the ladders
+	CUtlBuffer ladderBuffer( ladders, header->section[ NAV_BINARY_LADDERS ].count, CUtlBuffer::READ_ONLY );
+	unsigned int ladderCount = ladderBuffer.GetUnsignedInt();
+	m_ladders.EnsureCapacity( MIN( ladderCount, (unsigned int)ladderBuffer.GetBytesRemaining() ) );
+
+	for( unsigned int l=0; l<ladderCount && ladderBuffer.IsValid(); ++l )
+	{
+		CNavLadder *ladder = new CNavLadder;
+		ladder->Load( ladderBuffer, NavCurrentVersion );
+		m_ladders.AddToTail( ladder );
+	}
+
+	MarkStairAreas();
+
+	return true;
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Load AI navigation data from a file
  */
 NavErrorType CNavMesh::Load( void )
+{
+	return LoadFromFile( STRING( gpGlobals->mapname ), true );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the given map's navigation data, from its binary image if allowed and up to date, otherwise from its .nav file
+ */
+NavErrorType CNavMesh::LoadFromFile( const char *mapName, bool allowBinary, bool *loadedBinary )
 {
 	MDLCACHE_CRITICAL_SECTION();
 
@@ -1446,9 +2141,28 @@ NavErrorType CNavMesh::Load( void )
 
 	CNavArea::m_nextID = 1;
 
+	if ( loadedBinary )
+	{
+		*loadedBinary = false;
+	}
+
+	if ( allowBinary && LoadBinary( mapName ) )
+	{
+		if ( loadedBinary )
+		{
+			*loadedBinary = true;
+		}
+
+		NavErrorType loadResult = PostLoad( NavCurrentVersion );
+
+		WarnIfMeshNeedsAnalysis( NavCurrentVersion );
+
+		return loadResult;
+	}
+
 	bool navIsInBsp = false;
 	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
-	NavErrorType readResult = GetNavDataFromFile( fileBuffer, &navIsInBsp );
+	NavErrorType readResult = GetNavDataFromFile( fileBuffer, &navIsInBsp, mapName );
 	if ( readResult != NAV_OK )
 	{
 		return readResult;
@@ -1488,21 +2202,13 @@ NavErrorType CNavMesh::Load( void )
 
 		// verify size
 		char bspFilename[MAX_PATH] = { 0 };
-		Q_snprintf( bspFilename, sizeof( bspFilename ), FORMAT_BSPFILE , STRING( gpGlobals->mapname ) );
+		Q_snprintf( bspFilename, sizeof( bspFilename ), FORMAT_BSPFILE , mapName );
 
 		unsigned int bspSize = filesystem->Size( bspFilename );
 
 		if ( bspSize != saveBspSize && !navIsInBsp )
 		{
-			if ( engine->IsDedicatedServer() )
-			{
-				// Warning doesn't print to the dedicated server console, so we'll use Msg instead
-				DevMsg( "The Navigation Mesh was built using a different version of this map.\n" );
-			}
-			else
-			{
-				DevWarning( "The Navigation Mesh was built using a different version of this map.\n" );
-			}
+			WarnMeshOutOfDate();
 			m_isOutOfDate = true;
 		}
 	}
@@ -1605,6 +2311,12 @@ NavErrorType CNavMesh::Load( void )
 
 	WarnIfMeshNeedsAnalysis( version );
 
+	// save a binary image, so this map's mesh loads faster next time
+	if ( loadResult == NAV_OK && allowBinary && !navIsInBsp && nav_save_binary.GetBool() )
+	{
+		SaveBinary( mapName );
+	}
+
 	return loadResult;
 }
 
@@ -1632,6 +2344,29 @@ struct OneWayLink_t
  */
 NavErrorType CNavMesh::PostLoad( unsigned int version )
 {
+	// binding looks up every connection, encounter and visible area by ID, so index the areas by ID
+	// for the duration - unless the IDs are too sparse for a table to be worth it, in which case
+	// GetNavAreaByID() uses the hash table as usual
+	const unsigned int maxTableSize = 4 * (unsigned int)TheNavAreas.Count() + 1024;
+	unsigned int maxAreaID = 0;
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		maxAreaID = MAX( maxAreaID, TheNavAreas[ it ]->GetID() );
+	}
+
+	// compare the largest ID itself, since ID+1 wraps to zero for an ID of 0xFFFFFFFF
+	if ( maxAreaID < maxTableSize )
+	{
+		unsigned int areaIDCount = maxAreaID + 1;
+		m_areaByID.SetCount( areaIDCount );
+		Q_memset( m_areaByID.Base(), 0, areaIDCount * sizeof( CNavArea * ) );
+
+		FOR_EACH_VEC( TheNavAreas, it )
+		{
+			m_areaByID[ TheNavAreas[ it ]->GetID() ] = TheNavAreas[ it ];
+		}
+	}
+
 	// allow areas to connect to each other, etc
 	FOR_EACH_VEC( TheNavAreas, pit )
 	{
@@ -1646,6 +2381,8 @@ NavErrorType CNavMesh::PostLoad( unsigned int version )
 		spot->PostLoad();
 	}
 
+	m_areaByID.Purge();
+
 	if ( version < 8 )
 	{
 		// Old nav meshes need to compute earliest occupy times
@@ -1712,6 +2449,12 @@ NavErrorType CNavMesh::PostLoad( unsigned int version )
 
 	ValidateNavAreaConnections();
 
+	// use the saved hierarchical nav graph if it is up to date, otherwise build a new one
+	if ( nav_hpa.GetBool() && !TheNavHierarchy.Load() )
+	{
+		TheNavHierarchy.Build();
+	}
+
 	// TERROR: loading into a map directly creates entities before the mesh is loaded.  Tell the preexisting
 	// entities now that the mesh is loaded so they can update areas.
 	for ( int i=0; i<m_avoidanceObstacles.Count(); ++i )
@@ -1724,3 +2467,101 @@ NavErrorType CNavMesh::PostLoad( unsigned int version )
 	
 	return NAV_OK;
 }
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Time loading nav meshes from their .nav files, and from their binary images.
+ * Each map's binary image is remade from its .nav file before it is timed. Images made
+ * only for the benchmark are removed afterwards, unless nav_save_binary is set.
+ */
+void CommandNavBenchLoad( const CCommand &args )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	CUtlStringList mapList;
+
+	if ( args.ArgC() > 1 )
+	{
+		for( int i=1; i<args.ArgC(); ++i )
+		{
+			mapList.CopyAndAddToTail( args[i] );
+		}
+	}
+	else
+	{
+		// use every map with a .nav file
+		FileFindHandle_t findHandle;
+		const char *navFilename = filesystem->FindFirstEx( "maps/*.nav", "MOD", &findHandle );
+		while ( navFilename )
+		{
+			char mapName[ MAX_PATH ];
+			Q_StripExtension( navFilename, mapName, sizeof( mapName ) );
+			mapList.CopyAndAddToTail( mapName );
+
+			navFilename = filesystem->FindNext( findHandle );
+		}
+		filesystem->FindClose( findHandle );
+	}
+
+	double totalTextTime = 0.0;
+	double totalBinaryTime = 0.0;
+	int benchCount = 0;
+
+	FOR_EACH_VEC( mapList, it )
+	{
+		const char *mapName = mapList[ it ];
+
+		double start = Plat_FloatTime();
+		NavErrorType result = TheNavMesh->LoadFromFile( mapName, false );
+		double textTime = Plat_FloatTime() - start;
+
+		if ( result != NAV_OK )
+		{
+			Warning( "%s: unable to load nav mesh\n", mapName );
+			continue;
+		}
+
+		char binaryFilename[ MAX_PATH ];
+		Q_snprintf( binaryFilename, sizeof( binaryFilename ), FORMAT_NAVBINARYFILE, mapName );
+		bool keepBinary = nav_save_binary.GetBool() || filesystem->FileExists( binaryFilename, "MOD" );
+
+		bool loadedBinary = false;
+		if ( !TheNavMesh->SaveBinary( mapName ) )
+		{
+			Warning( "%s: unable to save binary nav image\n", mapName );
+			continue;
+		}
+
+		start = Plat_FloatTime();
+		TheNavMesh->LoadFromFile( mapName, true, &loadedBinary );
+		double binaryTime = Plat_FloatTime() - start;
+
+		if ( !keepBinary )
+		{
+			filesystem->RemoveFile( binaryFilename, "MOD" );
+		}
+
+		if ( !loadedBinary )
+		{
+			Warning( "%s: unable to load binary nav image\n", mapName );
+			continue;
+		}
+
+		Msg( "%s: %d areas, .nav %.2f ms, binary %.2f ms\n", mapName, TheNavAreas.Count(), 1000.0 * textTime, 1000.0 * binaryTime );
+
+		totalTextTime += textTime;
+		totalBinaryTime += binaryTime;
+		++benchCount;
+	}
+
+	if ( benchCount )
+	{
+		Msg( "Loaded %d nav meshes: .nav %.2f ms, binary %.2f ms (%.1fx)\n", benchCount, 1000.0 * totalTextTime, 1000.0 * totalBinaryTime, ( totalBinaryTime > 0.0 ) ? totalTextTime / totalBinaryTime : 0.0 );
+	}
+
+	// put back the current map's mesh
+	TheNavMesh->Load();
+}
+static ConCommand nav_bench_load( "nav_bench_load", CommandNavBenchLoad, "Times loading nav meshes from .nav files and from binary images. Usage: nav_bench_load [map...] - with no maps, every map with a .nav file is used.", FCVAR_GAMEDLL | FCVAR_CHEAT );
@@ -14,9 +14,11 @@
 #include "nav_mesh.h"
 #include "nav_node.h"
 #include "nav_pathfind.h"
+#include "nav_vis_cache.h"
 #include "viewport_panel_names.h"
 //#include "terror/TerrorShared.h"
 #include "fmtstr.h"
+#include "vstdlib/jobthread.h"
 
 #ifdef TERROR
 #include "func_simpleladder.h"
@@ -43,6 +45,9 @@ ConVar nav_generate_jump_connections( "nav_generate_jump_connections", "1", FCVA
 ConVar nav_generate_incremental_range( "nav_generate_incremental_range", "2000", FCVAR_CHEAT );
 ConVar nav_generate_incremental_tolerance( "nav_generate_incremental_tolerance", "0", FCVAR_CHEAT, "Z tolerance for adding new nav areas." );
 ConVar nav_area_max_size( "nav_area_max_size", "50", FCVAR_CHEAT, "Max area size created in nav generation" );
+ConVar nav_generate_parallel( "nav_generate_parallel", "1", FCVAR_CHEAT, "If nonzero, the traces for sampling, area creation, and area connection are run on the job pool during nav generation" );
+ConVar nav_generate_parallel_batch( "nav_generate_parallel_batch", "256", FCVAR_CHEAT, "Maximum number of sample steps computed ahead of the sampling walk at once" );
+ConVar nav_generate_parallel_depth( "nav_generate_parallel_depth", "4", FCVAR_CHEAT, "How many steps ahead of the sampling walk to compute sample steps" );
 
 // Common bounding box for traces
 Vector NavTraceMins( -0.45, -0.45, 0 );
@@ -1935,151 +1940,188 @@ inline bool CheckCliff( const Vector *fromPos, NavDirType dir, bool bExhaustive
 
 //--------------------------------------------------------------------------------------------------------------
 /**
- * Define connections between adjacent generated areas
+ * Find the connections from one generated area to its adjacent areas.
+ * This only reads the node graph and the mesh, so it can run on the job pool.
  */
-void CNavMesh::ConnectGeneratedAreas( void )
+void CNavMesh::FindGeneratedConnections( GeneratedAreaConnections &connections )
 {
-	Msg( "Connecting navigation areas...\n" );
+	CNavArea *area = connections.area;
 
-	FOR_EACH_VEC( TheNavAreas, it )
+	// scan along edge nodes, stepping one node over into the next area
+	// for now, only use bi-directional connections
+
+	// north edge
+	CNavNode *node;
+	for( node = area->m_node[ NORTH_WEST ]; node != area->m_node[ NORTH_EAST ]; node = node->GetConnectedNode( EAST ) )
 	{
-		CNavArea *area = TheNavAreas[ it ];
+		CNavNode *adj = node->GetConnectedNode( NORTH );
 
-		// scan along edge nodes, stepping one node over into the next area
-		// for now, only use bi-directional connections
+		if (adj && adj->GetArea() && adj->GetConnectedNode( SOUTH ) == node )
+		{
+			connections.Add( adj->GetArea(), NORTH );
+		}
+		else
+		{
+			CNavArea *downArea = findJumpDownArea( node->GetPosition(), NORTH );
+			if (downArea && downArea != area)
+				connections.Add( downArea, NORTH );
+		}
+	}
 
-		// north edge
-		CNavNode *node;
-		for( node = area->m_node[ NORTH_WEST ]; node != area->m_node[ NORTH_EAST ]; node = node->GetConnectedNode( EAST ) )
+	// west edge
+	for( node = area->m_node[ NORTH_WEST ]; node != area->m_node[ SOUTH_WEST ]; node = node->GetConnectedNode( SOUTH ) )
+	{
+		CNavNode *adj = node->GetConnectedNode( WEST );
+		
+		if (adj && adj->GetArea() && adj->GetConnectedNode( EAST ) == node )
 		{
-			CNavNode *adj = node->GetConnectedNode( NORTH );
+			connections.Add( adj->GetArea(), WEST );
+		}
+		else
+		{
+			CNavArea *downArea = findJumpDownArea( node->GetPosition(), WEST );
+			if (downArea && downArea != area)
+				connections.Add( downArea, WEST );
+		}
+	}
 
-			if (adj && adj->GetArea() && adj->GetConnectedNode( SOUTH ) == node )
+	// south edge - this edge's nodes are actually part of adjacent areas
+	// move one node north, and scan west to east
+	/// @todo This allows one-node-wide areas - do we want this?
+	node = area->m_node[ SOUTH_WEST ];
+	if ( node ) // pre-existing areas in incremental generates won't have nodes
+	{
+		node = node->GetConnectedNode( NORTH );
+	}
+	if (node)
+	{
+		CNavNode *end = area->m_node[ SOUTH_EAST ]->GetConnectedNode( NORTH );
+		/// @todo Figure out why cs_backalley gets a NULL node in here...
+		for( ; node && node != end; node = node->GetConnectedNode( EAST ) )
+		{
+			CNavNode *adj = node->GetConnectedNode( SOUTH );
+			
+			if (adj && adj->GetArea() && adj->GetConnectedNode( NORTH ) == node )
 			{
-				area->ConnectTo( adj->GetArea(), NORTH );
+				connections.Add( adj->GetArea(), SOUTH );
 			}
 			else
 			{
-				CNavArea *downArea = findJumpDownArea( node->GetPosition(), NORTH );
+				CNavArea *downArea = findJumpDownArea( node->GetPosition(), SOUTH );
 				if (downArea && downArea != area)
-					area->ConnectTo( downArea, NORTH );
+					connections.Add( downArea, SOUTH );
 			}
 		}
+	}
+
+	// south edge part 2 - scan the actual south edge.  If the node is not part of an adjacent area, then it
+	// really belongs to us.  This will happen if our area runs right up against a ledge.
+	for( node = area->m_node[ SOUTH_WEST ]; node != area->m_node[ SOUTH_EAST ]; node = node->GetConnectedNode( EAST ) )
+	{
+		if ( node->GetArea() )
+			continue;	// some other area owns this node, pay no attention to it
+
+		CNavNode *adj = node->GetConnectedNode( SOUTH );
+
+		if ( node->IsBlockedInAnyDirection() || (adj && adj->IsBlockedInAnyDirection()) )
+			continue;	// The space around this node is blocked, so don't connect across it
 
-		// west edge
-		for( node = area->m_node[ NORTH_WEST ]; node != area->m_node[ SOUTH_WEST ]; node = node->GetConnectedNode( SOUTH ) )
+		// Don't directly connect to adj's area, since it's already 1 cell removed from our area.
+		// There was no area in between, presumably for good reason.  Only look for jump down links.
+		if ( !adj || !adj->GetArea() )
 		{
-			CNavNode *adj = node->GetConnectedNode( WEST );
-			
-			if (adj && adj->GetArea() && adj->GetConnectedNode( EAST ) == node )
+			CNavArea *downArea = findJumpDownArea( node->GetPosition(), SOUTH );
+			if (downArea && downArea != area)
+				connections.Add( downArea, SOUTH );
+		}
+	}
+
+	// east edge - this edge's nodes are actually part of adjacent areas
+	node = area->m_node[ NORTH_EAST ];
+	if ( node ) // pre-existing areas in incremental generates won't have nodes
+	{
+		node = node->GetConnectedNode( WEST );
+	}
+	if (node)
+	{
+		CNavNode *end = area->m_node[ SOUTH_EAST ]->GetConnectedNode( WEST );
+		for( ; node && node != end; node = node->GetConnectedNode( SOUTH ) )
+		{
+			CNavNode *adj = node->GetConnectedNode( EAST );			
+
+			if (adj && adj->GetArea() && adj->GetConnectedNode( WEST ) == node )
 			{
-				area->ConnectTo( adj->GetArea(), WEST );
+				connections.Add( adj->GetArea(), EAST );
 			}
 			else
 			{
-				CNavArea *downArea = findJumpDownArea( node->GetPosition(), WEST );
+				CNavArea *downArea = findJumpDownArea( node->GetPosition(), EAST );
 				if (downArea && downArea != area)
-					area->ConnectTo( downArea, WEST );
+					connections.Add( downArea, EAST );
 			}
 		}
+	}
 
-		// south edge - this edge's nodes are actually part of adjacent areas
-		// move one node north, and scan west to east
-		/// @todo This allows one-node-wide areas - do we want this?
-		node = area->m_node[ SOUTH_WEST ];
-		if ( node ) // pre-existing areas in incremental generates won't have nodes
-		{
-			node = node->GetConnectedNode( NORTH );
-		}
-		if (node)
+	// east edge part 2 - scan the actual east edge.  If the node is not part of an adjacent area, then it
+	// really belongs to us.  This will happen if our area runs right up against a ledge.
+	for( node = area->m_node[ NORTH_EAST ]; node != area->m_node[ SOUTH_EAST ]; node = node->GetConnectedNode( SOUTH ) )
+	{
+		if ( node->GetArea() )
+			continue;	// some other area owns this node, pay no attention to it
+
+		CNavNode *adj = node->GetConnectedNode( EAST );
+
+		if ( node->IsBlockedInAnyDirection() || (adj && adj->IsBlockedInAnyDirection()) )
+			continue;	// The space around this node is blocked, so don't connect across it
+
+		// Don't directly connect to adj's area, since it's already 1 cell removed from our area.
+		// There was no area in between, presumably for good reason.  Only look for jump down links.
+		if ( !adj || !adj->GetArea() )
 		{
-			CNavNode *end = area->m_node[ SOUTH_EAST ]->GetConnectedNode( NORTH );
-			/// @todo Figure out why cs_backalley gets a NULL node in here...
-			for( ; node && node != end; node = node->GetConnectedNode( EAST ) )
-			{
-				CNavNode *adj = node->GetConnectedNode( SOUTH );
-				
-				if (adj && adj->GetArea() && adj->GetConnectedNode( NORTH ) == node )
-				{
-					area->ConnectTo( adj->GetArea(), SOUTH );
-				}
-				else
-				{
-					CNavArea *downArea = findJumpDownArea( node->GetPosition(), SOUTH );
-					if (downArea && downArea != area)
-						area->ConnectTo( downArea, SOUTH );
-				}
-			}
+			CNavArea *downArea = findJumpDownArea( node->GetPosition(), EAST );
+			if (downArea && downArea != area)
+				connections.Add( downArea, EAST );
 		}
+	}
+}
 
-		// south edge part 2 - scan the actual south edge.  If the node is not part of an adjacent area, then it
-		// really belongs to us.  This will happen if our area runs right up against a ledge.
-		for( node = area->m_node[ SOUTH_WEST ]; node != area->m_node[ SOUTH_EAST ]; node = node->GetConnectedNode( EAST ) )
-		{
-			if ( node->GetArea() )
-				continue;	// some other area owns this node, pay no attention to it
 
-			CNavNode *adj = node->GetConnectedNode( SOUTH );
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Define connections between adjacent generated areas
+ */
+void CNavMesh::ConnectGeneratedAreas( void )
+{
+	Msg( "Connecting navigation areas...\n" );
 
-			if ( node->IsBlockedInAnyDirection() || (adj && adj->IsBlockedInAnyDirection()) )
-				continue;	// The space around this node is blocked, so don't connect across it
+	CUtlVector< GeneratedAreaConnections > connections;
+	connections.SetCount( TheNavAreas.Count() );
 
-			// Don't directly connect to adj's area, since it's already 1 cell removed from our area.
-			// There was no area in between, presumably for good reason.  Only look for jump down links.
-			if ( !adj || !adj->GetArea() )
-			{
-				CNavArea *downArea = findJumpDownArea( node->GetPosition(), SOUTH );
-				if (downArea && downArea != area)
-					area->ConnectTo( downArea, SOUTH );
-			}
-		}
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		connections[ it ].area = TheNavAreas[ it ];
+	}
 
-		// east edge - this edge's nodes are actually part of adjacent areas
-		node = area->m_node[ NORTH_EAST ];
-		if ( node ) // pre-existing areas in incremental generates won't have nodes
+	if ( nav_generate_parallel.GetBool() && connections.Count() )
+	{
+		ParallelProcess( "CNavMesh::ConnectGeneratedAreas", connections.Base(), connections.Count(), this, &CNavMesh::FindGeneratedConnections );
+	}
+	else
+	{
+		FOR_EACH_VEC( connections, cit )
 		{
-			node = node->GetConnectedNode( WEST );
+			FindGeneratedConnections( connections[ cit ] );
 		}
-		if (node)
-		{
-			CNavNode *end = area->m_node[ SOUTH_EAST ]->GetConnectedNode( WEST );
-			for( ; node && node != end; node = node->GetConnectedNode( SOUTH ) )
-			{
-				CNavNode *adj = node->GetConnectedNode( EAST );			
+	}
 
-				if (adj && adj->GetArea() && adj->GetConnectedNode( WEST ) == node )
-				{
-					area->ConnectTo( adj->GetArea(), EAST );
-				}
-				else
-				{
-					CNavArea *downArea = findJumpDownArea( node->GetPosition(), EAST );
-					if (downArea && downArea != area)
-						area->ConnectTo( downArea, EAST );
-				}
-			}
-		}
+	// connect in the same order as if each area had been scanned and connected in turn
+	FOR_EACH_VEC( connections, cit )
+	{
+		CNavArea *area = connections[ cit ].area;
 
-		// east edge part 2 - scan the actual east edge.  If the node is not part of an adjacent area, then it
-		// really belongs to us.  This will happen if our area runs right up against a ledge.
-		for( node = area->m_node[ NORTH_EAST ]; node != area->m_node[ SOUTH_EAST ]; node = node->GetConnectedNode( SOUTH ) )
+		FOR_EACH_VEC( connections[ cit ].connect, i )
 		{
-			if ( node->GetArea() )
-				continue;	// some other area owns this node, pay no attention to it
-
-			CNavNode *adj = node->GetConnectedNode( EAST );
-
-			if ( node->IsBlockedInAnyDirection() || (adj && adj->IsBlockedInAnyDirection()) )
-				continue;	// The space around this node is blocked, so don't connect across it
-
-			// Don't directly connect to adj's area, since it's already 1 cell removed from our area.
-			// There was no area in between, presumably for good reason.  Only look for jump down links.
-			if ( !adj || !adj->GetArea() )
-			{
-				CNavArea *downArea = findJumpDownArea( node->GetPosition(), EAST );
-				if (downArea && downArea != area)
-					area->ConnectTo( downArea, EAST );
-			}
+			area->ConnectTo( connections[ cit ].connect[ i ].area, connections[ cit ].connect[ i ].dir );
 		}
 	}
 
@@ -3281,6 +3323,39 @@ int CNavMesh::BuildArea( CNavNode *node, int width, int height )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if none of the nodes an area of size (width, height) at the given node would cover are covered yet.
+ * The area must have passed TestArea(), so all of the nodes exist.
+ */
+static bool IsAreaUncovered( CNavNode *node, int width, int height )
+{
+	CNavNode *vertNode = node;
+	for( int y=0; y<height; ++y )
+	{
+		CNavNode *horizNode = vertNode;
+		for( int x=0; x<width; ++x )
+		{
+			if ( horizNode->IsCovered() )
+				return false;
+
+			horizNode = horizNode->GetConnectedNode( EAST );
+		}
+
+		vertNode = vertNode->GetConnectedNode( SOUTH );
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavMesh::ComputeAreaTest( AreaTest &test )
+{
+	test.canBuild = TestArea( test.node, test.width, test.height );
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * This function uses the CNavNodes that have been sampled from the map to
@@ -3297,15 +3372,53 @@ void CNavMesh::CreateNavAreasFromNodes( void )
 	int tryWidth = nav_area_max_size.GetInt();
 	int tryHeight = tryWidth;
 	int uncoveredNodes = CNavNode::GetListLength();
+	CUtlVector< AreaTest > tests;
 
 	while( uncoveredNodes > 0 )
 	{
+		// Building an area only ever covers nodes, and TestArea() only ever fails because of covered
+		// nodes or things that don't change during this pass. So test every uncovered node on the job
+		// pool up front - a node that failed can be skipped, and a node that passed only needs to
+		// make sure none of its nodes have been covered since.
+		bool isParallel = nav_generate_parallel.GetBool();
+		if ( isParallel )
+		{
+			tests.RemoveAll();
+
+			for( CNavNode *node = CNavNode::GetFirst(); node; node = node->GetNext() )
+			{
+				if ( !node->IsCovered() )
+				{
+					AreaTest test = { node, tryWidth, tryHeight, false };
+					tests.AddToTail( test );
+				}
+			}
+
+			ParallelProcess( "CNavMesh::CreateNavAreasFromNodes", tests.Base(), tests.Count(), this, &CNavMesh::ComputeAreaTest );
+		}
+
+		int testIndex = 0;
+
 		for( CNavNode *node = CNavNode::GetFirst(); node; node = node->GetNext() )
 		{
 			if (node->IsCovered())
 				continue;
 
-			if (TestArea( node, tryWidth, tryHeight ))
+			bool canBuild;
+			if ( isParallel )
+			{
+				// tests are in node order, and any node skipped over was covered during this pass
+				while( tests[ testIndex ].node != node )
+					++testIndex;
+
+				canBuild = tests[ testIndex ].canBuild && IsAreaUncovered( node, tryWidth, tryHeight );
+			}
+			else
+			{
+				canBuild = TestArea( node, tryWidth, tryHeight );
+			}
+
+			if (canBuild)
 			{
 				int covered = BuildArea( node, tryWidth, tryHeight );
 				if (covered < 0)
@@ -3468,6 +3581,8 @@ void CNavMesh::BeginGeneration( bool incremental )
 
 	// the system will see this NULL and select the next walkable seed
 	m_currentNode = NULL;
+	m_crouchCheckNodes.RemoveAll();
+	m_sampleStepCache.RemoveAll();
 
 	// if there are no seed points, we can't generate
 	if (m_walkableSeeds.Count() == 0)
@@ -3485,6 +3600,63 @@ void CNavMesh::BeginGeneration( bool incremental )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Generate a Navigation Mesh for each of the given maps in turn, then quit.
+ * Each map is loaded with "map", and generation begins when it activates (see OnServerActivate()).
+ */
+void CNavMesh::BeginBatchGeneration( const CUtlStringList &mapList )
+{
+	m_batchMapList.PurgeAndDeleteElements();
+
+	FOR_EACH_VEC( mapList, it )
+	{
+		if ( !engine->IsMapValid( mapList[ it ] ) )
+		{
+			Warning( "nav_generate_batch: skipping '%s' - not a valid map\n", mapList[ it ] );
+			continue;
+		}
+
+		m_batchMapList.CopyAndAddToTail( mapList[ it ] );
+	}
+
+	if ( m_batchMapList.Count() == 0 )
+	{
+		Msg( "nav_generate_batch: no maps to generate\n" );
+		return;
+	}
+
+	Msg( "Generating Navigation Meshes for %d maps...\n", m_batchMapList.Count() );
+
+	m_batchMapIndex = -1;
+	ContinueBatchGeneration();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the next map in the batch, or quit if there are none left
+ */
+void CNavMesh::ContinueBatchGeneration( void )
+{
+	++m_batchMapIndex;
+
+	if ( m_batchMapIndex >= m_batchMapList.Count() )
+	{
+		Msg( "Batch generation complete - %d Navigation Meshes generated.\n", m_batchMapList.Count() );
+
+		m_batchMapIndex = -1;
+		m_batchMapList.PurgeAndDeleteElements();
+		engine->ServerCommand( "quit\n" );
+		return;
+	}
+
+	Msg( "Batch generation: map %d of %d, '%s'\n", m_batchMapIndex + 1, m_batchMapList.Count(), m_batchMapList[ m_batchMapIndex ] );
+
+	engine->ServerCommand( CFmtStr( "map %s\n", m_batchMapList[ m_batchMapIndex ] ) );
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Re-analyze an existing Mesh.  Determine Hiding Spots, Encounter Spots, etc.
@@ -3658,6 +3830,8 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
+			FinishSampling();
+
 			// sampling is complete, now build nav areas
 			m_generationState = CREATE_AREAS_FROM_SAMPLES;
 
@@ -3798,7 +3972,10 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				CNavArea *area = TheNavAreas[ m_generationIndex ];
 				++m_generationIndex;
 
-				area->ComputeVisibilityToMesh();
+				if ( !TheNavVisibilityCache.IsRestored( area ) )
+				{
+					area->ComputeVisibilityToMesh();
+				}
 
 				// don't go over our time allotment
 				if ( Plat_FloatTime() - startTime > maxTime )
@@ -4019,7 +4196,11 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				Msg( "ERROR: Cannot save navigation map '%s'.\n", (filename) ? filename : "(null)" );
 			}
 
-			if ( m_bQuitWhenFinished )
+			if ( IsBatchGenerating() )
+			{
+				ContinueBatchGeneration();
+			}
+			else if ( m_bQuitWhenFinished )
 			{
 				engine->ServerCommand( "quit\n" );
 			}
@@ -4127,7 +4308,19 @@ CNavNode *CNavMesh::AddNode( const Vector &destPos, const Vector &normal, NavDir
 		m_currentNode = node;
 	}
 
-	node->CheckCrouch();
+	if ( nav_generate_parallel.GetBool() )
+	{
+		// the crouch check only depends on the node's position, so do them all at once when sampling is complete
+		if ( !node->m_isCrouchCheckPending )
+		{
+			node->m_isCrouchCheckPending = true;
+			m_crouchCheckNodes.AddToTail( node );
+		}
+	}
+	else
+	{
+		node->CheckCrouch();
+	}
 
 	// determine if there's a cliff nearby and set an attribute on this node
 	for ( int i = 0; i < NUM_DIRECTIONS; i++ )
@@ -4350,6 +4543,404 @@ static bool IsNodeOverlapped( const Vector& pos, const Vector& offset )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+bool CNavMesh::SampleStepLessFunc( const SampleStepResult &lhs, const SampleStepResult &rhs )
+{
+	if ( lhs.from.x != rhs.from.x )
+		return lhs.from.x < rhs.from.x;
+
+	if ( lhs.from.y != rhs.from.y )
+		return lhs.from.y < rhs.from.y;
+
+	if ( lhs.from.z != rhs.from.z )
+		return lhs.from.z < rhs.from.z;
+
+	return lhs.dir < rhs.dir;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Determine if a node can be added one step from step.from in step.dir, and if so, where.
+ * This only depends on the world, the existing mesh, and the step itself - not on the nodes
+ * sampled so far - so steps can be computed ahead of the sampling walk on the job pool.
+ */
+void CNavMesh::ComputeSampleStep( SampleStepResult &step )
+{
+	step.isWalkable = false;
+
+	// start at node position
+	Vector pos = step.from;
+
+	// snap to grid
+	int cx = SnapToGrid( pos.x );
+	int cy = SnapToGrid( pos.y );
+
+	// attempt to move to adjacent node
+	switch( step.dir )
+	{
+		case NORTH:		cy -= GenerationStepSize; break;
+		case SOUTH:		cy += GenerationStepSize; break;
+		case EAST:		cx += GenerationStepSize; break;
+		case WEST:		cx -= GenerationStepSize; break;
+	}
+
+	pos.x = cx;
+	pos.y = cy;
+
+	// sanity check to not generate across the world for incremental generation
+	const float incrementalRange = nav_generate_incremental_range.GetFloat();
+	if ( m_generationMode == GENERATE_INCREMENTAL && incrementalRange > 0 )
+	{
+		bool inRange = false;
+		for ( int i=0; i<m_walkableSeeds.Count(); ++i )
+		{
+			const Vector &seedPos = m_walkableSeeds[i].pos;
+			if ( (seedPos - pos).IsLengthLessThan( incrementalRange ) )
+			{
+				inRange = true;
+				break;
+			}
+		}
+
+		if ( !inRange )
+		{
+			return;
+		}
+	}
+
+	if ( m_generationMode == GENERATE_SIMPLIFY )
+	{
+		if ( !m_simplifyGenerationExtent.Contains( pos ) )
+		{
+			return;
+		}
+	}
+
+	// test if we can move to new position
+	// (the climb up test leaves the surface of this trace unset - don't read garbage below)
+	trace_t result;
+	Q_memset( &result, 0, sizeof( result ) );
+	const Vector &from = step.from;
+	CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
+	Vector to = vec3_origin, toNormal = vec3_origin;
+	float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
+	if ( TraceAdjacentNode( 0, from, pos, &result ) )
+	{
+		to = result.endpos;
+		toNormal = result.plane.normal;
+	}
+	else
+	{
+		// test going up ClimbUpHeight
+		bool success = false;
+		for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
+		{						
+			trace_t tr;
+			Vector start( from );
+			Vector end( pos );
+			start.z += height;
+			end.z += height;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
+			if ( !tr.startsolid && tr.fraction == 1.0f )
+			{
+				if ( !StayOnFloor( &tr ) )
+				{
+					break;
+				}
+
+				to = tr.endpos;
+				toNormal = tr.plane.normal;
+
+				start = end = from;
+				end.z += height;
+				UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
+				if ( tr.fraction < 1.0f )
+				{
+					break;
+				}
+
+				// keep track of far up we had to go to find a path to the next node
+				obstacleHeight = height;
+				success = true;
+				break;
+			}
+			else
+			{
+				// Could not trace from node to node at this height, something is in the way.
+				// Trace in the other direction to see if we hit something
+				Vector vecToObstacleStart = tr.endpos - start;
+				Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
+				if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
+				{
+					UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
+					if ( !tr.startsolid && tr.fraction < 1.0 )
+					{
+						// We hit something going the other direction.  There is some obstacle between the two nodes.
+						Vector vecToObstacleEnd = tr.endpos - start;
+						Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
+						if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
+						{
+							// Remember the distances to start and end of the obstacle (with respect to the "from" node).
+							// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
+							// If we do eventually clear the obstacle, these values will be the start and end distance to the
+							// very tip of the obstacle.
+							obstacleStartDist = vecToObstacleStart.Length();
+							obstacleEndDist = vecToObstacleEnd.Length();
+							if ( obstacleEndDist == 0 )
+							{
+								obstacleEndDist = GenerationStepSize;
+							}
+						}								
+					}
+				}
+			}
+		}
+
+		if ( !success )
+		{
+			return;
+		}
+	}
+
+	// Don't generate nodes if we spill off the end of the world onto skybox
+	if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
+	{
+		return;
+	}
+
+	// If we're incrementally generating, don't overlap existing nav areas.
+	Vector testPos( to );
+	bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
+	bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
+	bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
+	bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
+	if ( overlapSE && overlapSW && overlapNE && overlapNW && m_generationMode != GENERATE_SIMPLIFY )
+	{
+		return;
+	}
+
+	int nTolerance = nav_generate_incremental_tolerance.GetInt();
+	if ( nTolerance > 0 && m_generationMode == GENERATE_INCREMENTAL )
+	{
+		bool bValid = false;
+		int zPos = to.z;
+		for ( int i=0; i<m_walkableSeeds.Count(); ++i )
+		{
+			const Vector &seedPos = m_walkableSeeds[i].pos;
+			int zMin = seedPos.z - nTolerance;
+			int zMax = seedPos.z + nTolerance;
+
+			if ( zPos >= zMin && zPos <= zMax )
+			{
+				bValid = true;
+				break;
+			}
+		}
+
+		if ( !bValid )
+			return;
+	}
+
+
+	bool isOnDisplacement = result.IsDispSurface();
+
+	if ( nav_displacement_test.GetInt() > 0 )
+	{
+		// Test for nodes under displacement surfaces.
+		// This happens during development, and is a pain because the space underneath a displacement
+		// is not 'solid'.
+		Vector start = to + Vector( 0, 0, 0 );
+		Vector end = start + Vector( 0, 0, nav_displacement_test.GetInt() );
+		UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
+
+		if ( result.fraction > 0 )
+		{
+			end = start;
+			start = result.endpos;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
+			if ( result.fraction < 1 )
+			{
+				// if we made it down to within StepHeight, maybe we're on a static prop
+				if ( result.endpos.z > to.z + StepHeight )
+				{
+					return;
+				}
+			}
+		}
+	}
+
+	float deltaZ = to.z - from.z;
+	// If there's an obstacle in the way and it's traversable, or the obstacle is not higher than the destination node itself minus a small epsilon
+	// (meaning the obstacle was just the height change to get to the destination node, no extra obstacle between the two), clear obstacle height
+	// and distances
+	if ( ( obstacleHeight < MaxTraversableHeight ) || ( deltaZ > ( obstacleHeight - 2.0f ) ) )
+	{
+		obstacleHeight = 0;
+		obstacleStartDist = 0;
+		obstacleEndDist = GenerationStepSize;
+	}
+
+	step.isWalkable = true;
+	step.to = to;
+	step.toNormal = toNormal;
+	step.isOnDisplacement = isOnDisplacement;
+	step.obstacleHeight = obstacleHeight;
+	step.obstacleStartDist = obstacleStartDist;
+	step.obstacleEndDist = obstacleEndDist;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the result of taking a step from the given node in the given direction
+ */
+void CNavMesh::GetSampleStep( CNavNode *node, NavDirType dir, SampleStepResult *step )
+{
+	step->from = *node->GetPosition();
+	step->dir = dir;
+
+	if ( nav_generate_parallel.GetBool() )
+	{
+		int it = m_sampleStepCache.Find( *step );
+		if ( it == m_sampleStepCache.InvalidIndex() )
+		{
+			PrepareSampleSteps( node );
+			it = m_sampleStepCache.Find( *step );
+		}
+
+		if ( it != m_sampleStepCache.InvalidIndex() )
+		{
+			*step = m_sampleStepCache[ it ];
+			m_sampleStepCache.RemoveAt( it );
+			return;
+		}
+	}
+
+	ComputeSampleStep( *step );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Compute the steps from the given node in all unvisited directions on the job pool.
+ * Then, since the sampling walk moves on to each new node as soon as it is added, compute the steps
+ * from those positions too, and so on up to nav_generate_parallel_depth steps ahead.
+ * The results are cached until the walk reaches them. Steps that are never taken are wasted work,
+ * but never change the result.
+ */
+void CNavMesh::PrepareSampleSteps( CNavNode *node )
+{
+	VPROF_BUDGET( "CNavMesh::PrepareSampleSteps", "NextBot" );
+
+	const int maxSteps = MAX( nav_generate_parallel_batch.GetInt(), NUM_DIRECTIONS );
+	const int maxDepth = nav_generate_parallel_depth.GetInt();
+
+	CUtlVector< SampleStepResult > steps;
+
+	for( int dir = NORTH; dir < NUM_DIRECTIONS; dir++ )
+	{
+		if ( !node->HasVisited( (NavDirType)dir ) )
+		{
+			SampleStepResult step;
+			step.from = *node->GetPosition();
+			step.dir = (NavDirType)dir;
+
+			if ( m_sampleStepCache.Find( step ) == m_sampleStepCache.InvalidIndex() )
+			{
+				steps.AddToTail( step );
+			}
+		}
+	}
+
+	int levelStart = 0;
+	for( int depth = 0; levelStart < steps.Count(); ++depth )
+	{
+		int levelEnd = steps.Count();
+
+		ParallelProcess( "CNavMesh::PrepareSampleSteps", steps.Base() + levelStart, levelEnd - levelStart, this, &CNavMesh::ComputeSampleStep );
+
+		for( int i=levelStart; i<levelEnd; ++i )
+		{
+			m_sampleStepCache.Insert( steps[i] );
+		}
+
+		if ( depth >= maxDepth )
+			break;
+
+		// queue the steps from the new nodes this level will add
+		for( int i=levelStart; i<levelEnd && steps.Count() < maxSteps; ++i )
+		{
+			if ( !steps[i].isWalkable )
+				continue;
+
+			// AddNode() won't create a node here, so the walk won't step from it
+			if ( CNavNode::GetNode( steps[i].to ) )
+				continue;
+
+			// AddNode() connects back to the source when the change in height is small, marking that direction as visited
+			const float zTolerance = 50.0f;
+			bool isReturnVisited = fabs( steps[i].from.z - steps[i].to.z ) < zTolerance;
+
+			for( int dir = NORTH; dir < NUM_DIRECTIONS && steps.Count() < maxSteps; dir++ )
+			{
+				if ( isReturnVisited && dir == OppositeDirection( steps[i].dir ) )
+					continue;
+
+				SampleStepResult next;
+				next.from = steps[i].to;
+				next.dir = (NavDirType)dir;
+
+				if ( m_sampleStepCache.Find( next ) != m_sampleStepCache.InvalidIndex() )
+					continue;
+
+				bool isQueued = false;
+				for( int q=levelEnd; q<steps.Count(); ++q )
+				{
+					if ( !SampleStepLessFunc( steps[q], next ) && !SampleStepLessFunc( next, steps[q] ) )
+					{
+						isQueued = true;
+						break;
+					}
+				}
+
+				if ( !isQueued )
+				{
+					steps.AddToTail( next );
+				}
+			}
+		}
+
+		levelStart = levelEnd;
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavMesh::CheckNodeCrouch( CNavNode *&node )
+{
+	node->CheckCrouch();
+	node->m_isCrouchCheckPending = false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Sampling is complete - run the crouch checks deferred by AddNode() and discard any steps
+ * computed ahead of the walk that it never took.
+ */
+void CNavMesh::FinishSampling( void )
+{
+	if ( m_crouchCheckNodes.Count() )
+	{
+		ParallelProcess( "CNavMesh::FinishSampling", m_crouchCheckNodes.Base(), m_crouchCheckNodes.Count(), this, &CNavMesh::CheckNodeCrouch );
+	}
+
+	m_crouchCheckNodes.RemoveAll();
+	m_sampleStepCache.RemoveAll();
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Search the world and build a map of possible movements.
@@ -4407,225 +4998,20 @@ bool CNavMesh::SampleStep( void )
 			if (!m_currentNode->HasVisited( (NavDirType)dir ))
 			{
 				// have not searched in this direction yet
-
-				// start at current node position
-				Vector pos = *m_currentNode->GetPosition();
-
-				// snap to grid
-				int cx = SnapToGrid( pos.x );
-				int cy = SnapToGrid( pos.y );
-
-				// attempt to move to adjacent node
-				switch( dir )
-				{
-					case NORTH:		cy -= GenerationStepSize; break;
-					case SOUTH:		cy += GenerationStepSize; break;
-					case EAST:		cx += GenerationStepSize; break;
-					case WEST:		cx -= GenerationStepSize; break;
-				}
-
-				pos.x = cx;
-				pos.y = cy;
-
 				m_generationDir = (NavDirType)dir;
 
+				SampleStepResult step;
+				GetSampleStep( m_currentNode, m_generationDir, &step );
+
 				// mark direction as visited
 				m_currentNode->MarkAsVisited( m_generationDir );
 
-				// sanity check to not generate across the world for incremental generation
-				const float incrementalRange = nav_generate_incremental_range.GetFloat();
-				if ( m_generationMode == GENERATE_INCREMENTAL && incrementalRange > 0 )
-				{
-					bool inRange = false;
-					for ( int i=0; i<m_walkableSeeds.Count(); ++i )
-					{
-						const Vector &seedPos = m_walkableSeeds[i].pos;
-						if ( (seedPos - pos).IsLengthLessThan( incrementalRange ) )
-						{
-							inRange = true;
-							break;
-						}
-					}
-
-					if ( !inRange )
-					{
-						return true;
-					}
-				}
-
-				if ( m_generationMode == GENERATE_SIMPLIFY )
-				{
-					if ( !m_simplifyGenerationExtent.Contains( pos ) )
-					{
-						return true;
-					}
-				}
-
-				// test if we can move to new position
-				trace_t result;
-				Vector from( *m_currentNode->GetPosition() );
-				CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
-				Vector to = vec3_origin, toNormal = vec3_origin;
-				float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
-				if ( TraceAdjacentNode( 0, from, pos, &result ) )
+				if ( step.isWalkable )
 				{
-					to = result.endpos;
-					toNormal = result.plane.normal;
+					// we can move here
+					// create a new navigation node, and update current node pointer
+					AddNode( step.to, step.toNormal, m_generationDir, m_currentNode, step.isOnDisplacement, step.obstacleHeight, step.obstacleStartDist, step.obstacleEndDist );
 				}
-				else
-				{
-					// test going up ClimbUpHeight
-					bool success = false;
-					for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
-					{						
-						trace_t tr;
-						Vector start( from );
-						Vector end( pos );
-						start.z += height;
-						end.z += height;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-						if ( !tr.startsolid && tr.fraction == 1.0f )
-						{
-							if ( !StayOnFloor( &tr ) )
-							{
-								break;
-							}
-
-							to = tr.endpos;
-							toNormal = tr.plane.normal;
-
-							start = end = from;
-							end.z += height;
-							UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-							if ( tr.fraction < 1.0f )
-							{
-								break;
-							}
-
-							// keep track of far up we had to go to find a path to the next node
-							obstacleHeight = height;
-							success = true;
-							break;
-						}
-						else
-						{
-							// Could not trace from node to node at this height, something is in the way.
-							// Trace in the other direction to see if we hit something
-							Vector vecToObstacleStart = tr.endpos - start;
-							Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
-							if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
-							{
-								UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-								if ( !tr.startsolid && tr.fraction < 1.0 )
-								{
-									// We hit something going the other direction.  There is some obstacle between the two nodes.
-									Vector vecToObstacleEnd = tr.endpos - start;
-									Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
-									if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
-									{
-										// Remember the distances to start and end of the obstacle (with respect to the "from" node).
-										// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
-										// If we do eventually clear the obstacle, these values will be the start and end distance to the
-										// very tip of the obstacle.
-										obstacleStartDist = vecToObstacleStart.Length();
-										obstacleEndDist = vecToObstacleEnd.Length();
-										if ( obstacleEndDist == 0 )
-										{
-											obstacleEndDist = GenerationStepSize;
-										}
-									}								
-								}
-							}
-						}
-					}
-
-					if ( !success )
-					{
-						return true;
-					}
-				}
-
-				// Don't generate nodes if we spill off the end of the world onto skybox
-				if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
-				{
-					return true;
-				}
-
-				// If we're incrementally generating, don't overlap existing nav areas.
-				Vector testPos( to );
-				bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
-				bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
-				bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
-				bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
-				if ( overlapSE && overlapSW && overlapNE && overlapNW && m_generationMode != GENERATE_SIMPLIFY )
-				{
-					return true;
-				}
-
-				int nTolerance = nav_generate_incremental_tolerance.GetInt();
-				if ( nTolerance > 0 && m_generationMode == GENERATE_INCREMENTAL )
-				{
-					bool bValid = false;
-					int zPos = to.z;
-					for ( int i=0; i<m_walkableSeeds.Count(); ++i )
-					{
-						const Vector &seedPos = m_walkableSeeds[i].pos;
-						int zMin = seedPos.z - nTolerance;
-						int zMax = seedPos.z + nTolerance;
-
-						if ( zPos >= zMin && zPos <= zMax )
-						{
-							bValid = true;
-							break;
-						}
-					}
-
-					if ( !bValid )
-						return true;
-				}
-
-
-				bool isOnDisplacement = result.IsDispSurface();
-
-				if ( nav_displacement_test.GetInt() > 0 )
-				{
-					// Test for nodes under displacement surfaces.
-					// This happens during development, and is a pain because the space underneath a displacement
-					// is not 'solid'.
-					Vector start = to + Vector( 0, 0, 0 );
-					Vector end = start + Vector( 0, 0, nav_displacement_test.GetInt() );
-					UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-
-					if ( result.fraction > 0 )
-					{
-						end = start;
-						start = result.endpos;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-						if ( result.fraction < 1 )
-						{
-							// if we made it down to within StepHeight, maybe we're on a static prop
-							if ( result.endpos.z > to.z + StepHeight )
-							{
-								return true;
-							}
-						}
-					}
-				}
-
-				float deltaZ = to.z - m_currentNode->GetPosition()->z;
-				// If there's an obstacle in the way and it's traversable, or the obstacle is not higher than the destination node itself minus a small epsilon
-				// (meaning the obstacle was just the height change to get to the destination node, no extra obstacle between the two), clear obstacle height
-				// and distances
-				if ( ( obstacleHeight < MaxTraversableHeight ) || ( deltaZ > ( obstacleHeight - 2.0f ) ) )
-				{
-					obstacleHeight = 0;
-					obstacleStartDist = 0;
-					obstacleEndDist = GenerationStepSize;
-				}
-
-				// we can move here
-				// create a new navigation node, and update current node pointer
-				AddNode( to, toNormal, m_generationDir, m_currentNode, isOnDisplacement, obstacleHeight, obstacleStartDist, obstacleEndDist );
 
 				return true;
 			}
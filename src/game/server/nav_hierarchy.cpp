@@ -0,0 +1,678 @@
+// nav_hierarchy.cpp
+// Clustered abstraction of the Navigation Mesh for long-range path searches
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#include "cbase.h"
+#include "fmtstr.h"
+#include "filesystem.h"
+#include "checksum_crc.h"
+#include "vstdlib/random.h"
+#include "tier0/vprof.h"
+
+#include "nav_mesh.h"
+#include "nav_pathfind.h"
+#include "nav_hierarchy.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//--------------------------------------------------------------------------------------------------------------
+// the hierarchy is only built and saved while nav_hpa is on, so get one when it is turned on
+static void NavHpaChanged( IConVar *var, const char *pOldValue, float flOldValue )
+{
+	ConVarRef hpa( var );
+	if ( hpa.GetBool() && !TheNavHierarchy.IsValid() && TheNavAreas.Count() > 0 )
+	{
+		if ( !TheNavHierarchy.Load() )
+		{
+			TheNavHierarchy.Build();
+		}
+	}
+}
+
+ConVar nav_hpa( "nav_hpa", "0", FCVAR_CHEAT, "If nonzero, long path searches are restricted to a corridor found through the hierarchical nav graph. The coarse route ignores the cost functor, so paths may be longer than a full search finds.", NavHpaChanged );
+ConVar nav_hpa_cluster_size( "nav_hpa_cluster_size", "1000", FCVAR_CHEAT, "Size of the grid cells used to group nav areas into clusters when building the hierarchical nav graph" );
+ConVar nav_hpa_min_range( "nav_hpa_min_range", "2000", FCVAR_CHEAT, "Path searches between areas closer than this use the whole nav mesh" );
+ConVar nav_hpa_corridor_width( "nav_hpa_corridor_width", "1", FCVAR_CHEAT, "How many clusters on each side of the coarse route are also searched" );
+
+CNavHierarchy TheNavHierarchy;
+
+#define NAV_HIERARCHY_MAGIC_NUMBER	0x4150484E		// 'NHPA'
+#define NAV_HIERARCHY_VERSION		1
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Collect every area the given area connects to - floor connections, the tops and bottoms
+ * of ladders that can be used from it, and elevator stops
+ */
+static void CollectConnectedAreas( CNavArea *area, CUtlVector< CNavArea * > *connected )
+{
+	connected->RemoveAll();
+
+	for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+	{
+		const NavConnectVector *floorList = area->GetAdjacentAreas( (NavDirType)dir );
+		for( int i=0; i<floorList->Count(); ++i )
+		{
+			connected->AddToTail( floorList->Element(i).area );
+		}
+	}
+
+	const NavLadderConnectVector *ladderUpList = area->GetLadders( CNavLadder::LADDER_UP );
+	for( int i=0; i<ladderUpList->Count(); ++i )
+	{
+		const CNavLadder *ladder = ladderUpList->Element(i).ladder;
+
+		if ( ladder->m_topForwardArea )
+			connected->AddToTail( ladder->m_topForwardArea );
+
+		if ( ladder->m_topLeftArea )
+			connected->AddToTail( ladder->m_topLeftArea );
+
+		if ( ladder->m_topRightArea )
+			connected->AddToTail( ladder->m_topRightArea );
+	}
+
+	const NavLadderConnectVector *ladderDownList = area->GetLadders( CNavLadder::LADDER_DOWN );
+	for( int i=0; i<ladderDownList->Count(); ++i )
+	{
+		if ( ladderDownList->Element(i).ladder->m_bottomArea )
+			connected->AddToTail( ladderDownList->Element(i).ladder->m_bottomArea );
+	}
+
+	if ( area->GetElevator() )
+	{
+		const NavConnectVector &elevatorAreas = area->GetElevatorAreas();
+		for( int i=0; i<elevatorAreas.Count(); ++i )
+		{
+			connected->AddToTail( elevatorAreas[i].area );
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+struct ClusterLink_t
+{
+	int from;
+	int to;
+
+	static int Compare( const ClusterLink_t *lhs, const ClusterLink_t *rhs )
+	{
+		if ( lhs->from != rhs->from )
+			return lhs->from - rhs->from;
+
+		return lhs->to - rhs->to;
+	}
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavHierarchy::CNavHierarchy( void ) : m_openClusters( 0, 0, OpenCluster::IsLowerPriority )
+{
+	m_isValid = false;
+	m_clusterSize = 0.0f;
+	m_corridorStamp = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavHierarchy::Invalidate( void )
+{
+	m_isValid = false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Group the mesh's areas into clusters, and connect the clusters
+ */
+void CNavHierarchy::Build( void )
+{
+	VPROF_BUDGET( "CNavHierarchy::Build", "NextBot" );
+
+	double startTime = Plat_FloatTime();
+
+	m_isValid = false;
+	m_clusterSize = MAX( nav_hpa_cluster_size.GetFloat(), 100.0f );
+	m_areaCluster.RemoveAll();
+	m_cluster.RemoveAll();
+	m_edge.RemoveAll();
+
+	unsigned int areaIDCount = 0;
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		areaIDCount = MAX( areaIDCount, TheNavAreas[ it ]->GetID() + 1 );
+	}
+
+	m_areaCluster.SetCount( areaIDCount );
+	for( int i=0; i<m_areaCluster.Count(); ++i )
+	{
+		m_areaCluster[i] = -1;
+	}
+
+	CUtlVector< CNavArea * > connected;
+	CUtlVector< CNavArea * > open;
+
+	//
+	// Flood fill each grid cell's areas into connected clusters
+	//
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *seed = TheNavAreas[ it ];
+
+		if ( m_areaCluster[ seed->GetID() ] >= 0 )
+			continue;
+
+		int cluster = m_cluster.AddToTail();
+		int cellX = (int)floor( seed->GetCenter().x / m_clusterSize );
+		int cellY = (int)floor( seed->GetCenter().y / m_clusterSize );
+
+		Vector centerSum = vec3_origin;
+		int areaCount = 0;
+
+		m_areaCluster[ seed->GetID() ] = cluster;
+		open.AddToTail( seed );
+
+		while( open.Count() )
+		{
+			CNavArea *area = open.Tail();
+			open.RemoveMultipleFromTail( 1 );
+
+			centerSum += area->GetCenter();
+			++areaCount;
+
+			CollectConnectedAreas( area, &connected );
+
+			for( int i=0; i<connected.Count(); ++i )
+			{
+				CNavArea *adjArea = connected[i];
+
+				if ( m_areaCluster[ adjArea->GetID() ] >= 0 )
+					continue;
+
+				if ( (int)floor( adjArea->GetCenter().x / m_clusterSize ) != cellX || (int)floor( adjArea->GetCenter().y / m_clusterSize ) != cellY )
+					continue;
+
+				m_areaCluster[ adjArea->GetID() ] = cluster;
+				open.AddToTail( adjArea );
+			}
+		}
+
+		m_cluster[ cluster ].center = centerSum / (float)areaCount;
+		m_cluster[ cluster ].firstEdge = 0;
+		m_cluster[ cluster ].edgeCount = 0;
+	}
+
+	//
+	// Connect clusters wherever their areas connect
+	//
+	CUtlVector< ClusterLink_t > links;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *area = TheNavAreas[ it ];
+		int from = m_areaCluster[ area->GetID() ];
+
+		CollectConnectedAreas( area, &connected );
+
+		for( int i=0; i<connected.Count(); ++i )
+		{
+			int to = m_areaCluster[ connected[i]->GetID() ];
+
+			if ( to != from )
+			{
+				ClusterLink_t link;
+				link.from = from;
+				link.to = to;
+				links.AddToTail( link );
+			}
+		}
+	}
+
+	links.Sort( &ClusterLink_t::Compare );
+
+	for( int i=0; i<links.Count(); ++i )
+	{
+		if ( i > 0 && links[i].from == links[i-1].from && links[i].to == links[i-1].to )
+			continue;
+
+		Cluster &from = m_cluster[ links[i].from ];
+		if ( from.edgeCount == 0 )
+		{
+			from.firstEdge = m_edge.Count();
+		}
+		++from.edgeCount;
+
+		int e = m_edge.AddToTail();
+		m_edge[e].to = links[i].to;
+		m_edge[e].cost = ( m_cluster[ links[i].to ].center - from.center ).Length();
+	}
+
+	m_isValid = true;
+
+	DevMsg( "Built hierarchical nav graph: %d areas in %d clusters with %d edges (%.2f ms)\n", TheNavAreas.Count(), m_cluster.Count(), m_edge.Count(), ( Plat_FloatTime() - startTime ) * 1000.0 );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Checksum of the parts of the mesh the hierarchy depends on
+ */
+unsigned int CNavHierarchy::ComputeMeshChecksum( void ) const
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	CUtlVector< CNavArea * > connected;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *area = TheNavAreas[ it ];
+
+		unsigned int id = area->GetID();
+		CRC32_ProcessBuffer( &crc, &id, sizeof( id ) );
+		CRC32_ProcessBuffer( &crc, &area->GetCenter(), sizeof( Vector ) );
+
+		CollectConnectedAreas( area, &connected );
+		for( int i=0; i<connected.Count(); ++i )
+		{
+			id = connected[i]->GetID();
+			CRC32_ProcessBuffer( &crc, &id, sizeof( id ) );
+		}
+	}
+
+	CRC32_Final( &crc );
+
+	return crc;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+const char *CNavHierarchy::GetFilename( void ) const
+{
+	// persistant return value
+	static char filename[256];
+	Q_snprintf( filename, sizeof( filename ), "maps\\%s.hpa", STRING( gpGlobals->mapname ) );
+
+	return filename;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavHierarchy::Save( void ) const
+{
+	if ( !m_isValid )
+		return false;
+
+	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
+
+	fileBuffer.PutUnsignedInt( NAV_HIERARCHY_MAGIC_NUMBER );
+	fileBuffer.PutUnsignedInt( NAV_HIERARCHY_VERSION );
+	fileBuffer.PutUnsignedInt( ComputeMeshChecksum() );
+	fileBuffer.PutFloat( m_clusterSize );
+
+	fileBuffer.PutInt( m_areaCluster.Count() );
+	for( int i=0; i<m_areaCluster.Count(); ++i )
+	{
+		fileBuffer.PutInt( m_areaCluster[i] );
+	}
+
+	fileBuffer.PutInt( m_cluster.Count() );
+	for( int i=0; i<m_cluster.Count(); ++i )
+	{
+		fileBuffer.PutFloat( m_cluster[i].center.x );
+		fileBuffer.PutFloat( m_cluster[i].center.y );
+		fileBuffer.PutFloat( m_cluster[i].center.z );
+		fileBuffer.PutInt( m_cluster[i].firstEdge );
+		fileBuffer.PutInt( m_cluster[i].edgeCount );
+	}
+
+	fileBuffer.PutInt( m_edge.Count() );
+	for( int i=0; i<m_edge.Count(); ++i )
+	{
+		fileBuffer.PutInt( m_edge[i].to );
+		fileBuffer.PutFloat( m_edge[i].cost );
+	}
+
+	const char *filename = GetFilename();
+	if ( !filesystem->WriteFile( filename, "MOD", fileBuffer ) )
+	{
+		Warning( "Unable to save hierarchical nav graph to %s\n", filename );
+		return false;
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the saved hierarchy, if it was built from the mesh that is currently loaded
+ */
+bool CNavHierarchy::Load( void )
+{
+	m_isValid = false;
+
+	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
+	if ( !filesystem->ReadFile( GetFilename(), "MOD", fileBuffer ) )
+		return false;
+
+	if ( fileBuffer.GetUnsignedInt() != NAV_HIERARCHY_MAGIC_NUMBER )
+		return false;
+
+	if ( fileBuffer.GetUnsignedInt() != NAV_HIERARCHY_VERSION )
+		return false;
+
+	if ( fileBuffer.GetUnsignedInt() != ComputeMeshChecksum() )
+	{
+		DevMsg( "Hierarchical nav graph %s is out of date\n", GetFilename() );
+		return false;
+	}
+
+	m_clusterSize = fileBuffer.GetFloat();
+	if ( m_clusterSize != MAX( nav_hpa_cluster_size.GetFloat(), 100.0f ) )
+		return false;
+
+	int areaIDCount = fileBuffer.GetInt();
+	if ( !fileBuffer.IsValid() || areaIDCount <= 0 || areaIDCount > fileBuffer.GetBytesRemaining() / (int)sizeof( int ) )
+		return false;
+
+	m_areaCluster.SetCount( areaIDCount );
+	for( int i=0; i<areaIDCount; ++i )
+	{
+		m_areaCluster[i] = fileBuffer.GetInt();
+	}
+
+	int clusterCount = fileBuffer.GetInt();
+	if ( !fileBuffer.IsValid() || clusterCount <= 0 || clusterCount > fileBuffer.GetBytesRemaining() / (int)sizeof( int ) )
+		return false;
+
+	m_cluster.SetCount( clusterCount );
+	for( int i=0; i<clusterCount; ++i )
+	{
+		m_cluster[i].center.x = fileBuffer.GetFloat();
+		m_cluster[i].center.y = fileBuffer.GetFloat();
+		m_cluster[i].center.z = fileBuffer.GetFloat();
+		m_cluster[i].firstEdge = fileBuffer.GetInt();
+		m_cluster[i].edgeCount = fileBuffer.GetInt();
+	}
+
+	int edgeCount = fileBuffer.GetInt();
+	if ( !fileBuffer.IsValid() || edgeCount < 0 || edgeCount > fileBuffer.GetBytesRemaining() / (int)sizeof( int ) )
+		return false;
+
+	m_edge.SetCount( edgeCount );
+	for( int i=0; i<edgeCount; ++i )
+	{
+		m_edge[i].to = fileBuffer.GetInt();
+		m_edge[i].cost = fileBuffer.GetFloat();
+	}
+
+	if ( !fileBuffer.IsValid() )
+		return false;
+
+	// make sure all indices are in range
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		unsigned int id = TheNavAreas[ it ]->GetID();
+		if ( id >= (unsigned int)areaIDCount || m_areaCluster[ id ] < 0 || m_areaCluster[ id ] >= clusterCount )
+			return false;
+	}
+
+	for( int i=0; i<clusterCount; ++i )
+	{
+		if ( m_cluster[i].edgeCount < 0 || m_cluster[i].firstEdge < 0 || m_cluster[i].firstEdge + m_cluster[i].edgeCount > edgeCount )
+			return false;
+	}
+
+	for( int i=0; i<edgeCount; ++i )
+	{
+		if ( m_edge[i].to < 0 || m_edge[i].to >= clusterCount )
+			return false;
+	}
+
+	m_isValid = true;
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int CNavHierarchy::GetCluster( const CNavArea *area ) const
+{
+	if ( !m_isValid || area == NULL || area->GetID() >= (unsigned int)m_areaCluster.Count() )
+		return -1;
+
+	return m_areaCluster[ area->GetID() ];
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find the cheapest route between the clusters of startArea and goalArea through the cluster graph,
+ * and mark the clusters along it, plus their neighbors, as the corridor to search.
+ */
+bool CNavHierarchy::BuildCorridor( CNavArea *startArea, CNavArea *goalArea )
+{
+	if ( !m_isValid || startArea == NULL || goalArea == NULL )
+		return false;
+
+	if ( ( startArea->GetCenter() - goalArea->GetCenter() ).IsLengthLessThan( nav_hpa_min_range.GetFloat() ) )
+		return false;
+
+	int startCluster = GetCluster( startArea );
+	int goalCluster = GetCluster( goalArea );
+
+	if ( startCluster < 0 || goalCluster < 0 || startCluster == goalCluster )
+		return false;
+
+	VPROF_BUDGET( "CNavHierarchy::BuildCorridor", "NextBotSpiky" );
+
+	if ( m_corridorMarker.Count() != m_cluster.Count() )
+	{
+		m_corridorMarker.SetCount( m_cluster.Count() );
+		m_clusterVisited.SetCount( m_cluster.Count() );
+		m_clusterCost.SetCount( m_cluster.Count() );
+		m_clusterParent.SetCount( m_cluster.Count() );
+		m_corridorStamp = 0;
+	}
+
+	++m_corridorStamp;
+	if ( m_corridorStamp == 1 )
+	{
+		// first use, or wrapped around
+		for( int i=0; i<m_cluster.Count(); ++i )
+		{
+			m_corridorMarker[i] = 0;
+			m_clusterVisited[i] = 0;
+		}
+	}
+
+	//
+	// A* over the cluster graph
+	//
+	const Vector &goalCenter = m_cluster[ goalCluster ].center;
+
+	m_openClusters.RemoveAll();
+
+	OpenCluster start;
+	start.cluster = startCluster;
+	start.costSoFar = 0.0f;
+	start.totalCost = ( m_cluster[ startCluster ].center - goalCenter ).Length();
+	m_openClusters.Insert( start );
+
+	m_clusterVisited[ startCluster ] = m_corridorStamp;
+	m_clusterCost[ startCluster ] = 0.0f;
+	m_clusterParent[ startCluster ] = -1;
+
+	bool isFound = false;
+
+	while( m_openClusters.Count() )
+	{
+		OpenCluster current = m_openClusters.ElementAtHead();
+		m_openClusters.RemoveAtHead();
+
+		// skip stale entries for clusters that were later reached more cheaply
+		if ( current.costSoFar > m_clusterCost[ current.cluster ] )
+			continue;
+
+		if ( current.cluster == goalCluster )
+		{
+			isFound = true;
+			break;
+		}
+
+		const Cluster &cluster = m_cluster[ current.cluster ];
+		for( int e=cluster.firstEdge; e<cluster.firstEdge + cluster.edgeCount; ++e )
+		{
+			int to = m_edge[e].to;
+			float costSoFar = current.costSoFar + m_edge[e].cost;
+
+			if ( m_clusterVisited[ to ] == m_corridorStamp && m_clusterCost[ to ] <= costSoFar )
+				continue;
+
+			m_clusterVisited[ to ] = m_corridorStamp;
+			m_clusterCost[ to ] = costSoFar;
+			m_clusterParent[ to ] = current.cluster;
+
+			OpenCluster next;
+			next.cluster = to;
+			next.costSoFar = costSoFar;
+			next.totalCost = costSoFar + ( m_cluster[ to ].center - goalCenter ).Length();
+			m_openClusters.Insert( next );
+		}
+	}
+
+	if ( !isFound )
+		return false;
+
+	//
+	// Mark the route, then widen it
+	//
+	m_corridor.RemoveAll();
+	for( int c = goalCluster; c >= 0; c = m_clusterParent[ c ] )
+	{
+		m_corridorMarker[ c ] = m_corridorStamp;
+		m_corridor.AddToTail( c );
+	}
+
+	for( int pass=0; pass<nav_hpa_corridor_width.GetInt(); ++pass )
+	{
+		int count = m_corridor.Count();
+		for( int i=0; i<count; ++i )
+		{
+			const Cluster &cluster = m_cluster[ m_corridor[i] ];
+			for( int e=cluster.firstEdge; e<cluster.firstEdge + cluster.edgeCount; ++e )
+			{
+				int to = m_edge[e].to;
+				if ( m_corridorMarker[ to ] != m_corridorStamp )
+				{
+					m_corridorMarker[ to ] = m_corridorStamp;
+					m_corridor.AddToTail( to );
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavHierarchy::IsInCorridor( const CNavArea *area ) const
+{
+	int cluster = GetCluster( area );
+
+	// areas the hierarchy doesn't know about are never excluded
+	return ( cluster < 0 ) ? true : ( m_corridorMarker[ cluster ] == m_corridorStamp );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CON_COMMAND_F( nav_hpa_build, "Rebuild and save the hierarchical nav graph for the current nav mesh", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	TheNavHierarchy.Build();
+	TheNavHierarchy.Save();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Compare path searches restricted to hierarchical corridors against searches of the whole mesh,
+ * for random long-range area pairs of the current nav mesh.
+ */
+CON_COMMAND_F( nav_bench_hpa, "Time hierarchical against full path searches on the current nav mesh, and compare path costs. Arguments: [query count] [random seed]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( TheNavAreas.Count() < 2 )
+	{
+		Msg( "No navigation mesh loaded.\n" );
+		return;
+	}
+
+	// the hierarchy is only kept up to date with nav_hpa on
+	if ( !TheNavHierarchy.IsValid() )
+	{
+		TheNavHierarchy.Build();
+	}
+
+	int queryCount = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 500;
+	int seed = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 1;
+
+	CUniformRandomStream random;
+	random.SetSeed( seed );
+
+	ShortestPathCost cost;
+	double fullTime = 0.0;
+	double hierarchicalTime = 0.0;
+	double costRatioSum = 0.0;
+	float worstCostRatio = 1.0f;
+	int comparedCount = 0;
+	int attemptCount = 0;
+
+	while( comparedCount < queryCount && attemptCount < queryCount * 20 )
+	{
+		++attemptCount;
+
+		CNavArea *startArea = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		CNavArea *goalArea = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+
+		if ( ( startArea->GetCenter() - goalArea->GetCenter() ).IsLengthLessThan( nav_hpa_min_range.GetFloat() ) )
+			continue;
+
+		double start = Plat_FloatTime();
+		bool isFullFound = NavAreaSearch( startArea, goalArea, NULL, cost, NULL, 0.0f, TEAM_ANY, false, false );
+		fullTime += Plat_FloatTime() - start;
+		float fullCost = goalArea->GetCostSoFar();
+
+		// what NavAreaBuildPath() does with nav_hpa on, whatever it is set to now
+		start = Plat_FloatTime();
+		bool isFound = TheNavHierarchy.BuildCorridor( startArea, goalArea ) && NavAreaSearch( startArea, goalArea, NULL, cost, NULL, 0.0f, TEAM_ANY, false, true );
+		if ( !isFound )
+		{
+			isFound = NavAreaSearch( startArea, goalArea, NULL, cost, NULL, 0.0f, TEAM_ANY, false, false );
+		}
+		hierarchicalTime += Plat_FloatTime() - start;
+		float hierarchicalCost = goalArea->GetCostSoFar();
+
+		if ( !isFullFound || !isFound )
+			continue;
+
+		float ratio = ( fullCost > 0.0f ) ? hierarchicalCost / fullCost : 1.0f;
+		costRatioSum += ratio;
+		worstCostRatio = MAX( worstCostRatio, ratio );
+		++comparedCount;
+	}
+
+	Msg( "%d long-range path queries over %d areas in %d clusters (seed %d):\n", comparedCount, TheNavAreas.Count(), TheNavHierarchy.GetClusterCount(), seed );
+	Msg( "  full search:         %8.2f ms\n", fullTime * 1000.0 );
+	Msg( "  hierarchical search: %8.2f ms (%.1fx)\n", hierarchicalTime * 1000.0, ( hierarchicalTime > 0.0 ) ? fullTime / hierarchicalTime : 0.0 );
+	Msg( "  path cost vs. full search: %.4f average, %.4f worst\n", comparedCount ? costRatioSum / comparedCount : 1.0, worstCostRatio );
+}
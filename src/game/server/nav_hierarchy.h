@@ -0,0 +1,97 @@
+// nav_hierarchy.h
+// Clustered abstraction of the Navigation Mesh for long-range path searches
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#ifndef _NAV_HIERARCHY_H_
+#define _NAV_HIERARCHY_H_
+
+#include "nav.h"
+#include "utlvector.h"
+#include "utlpriorityqueue.h"
+
+class CNavArea;
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A coarse graph over the nav mesh, HPA* style.
+ * Areas are grouped into clusters - connected sets of areas within one cell of a horizontal grid -
+ * and clusters are joined by edges wherever an area in one connects to an area in another.
+ * A long path search first finds a route through this small graph, then NavAreaBuildPath() only
+ * searches areas in the "corridor" of clusters along that route (widened by nav_hpa_corridor_width).
+ * The coarse route ignores the cost functor, so corridor paths may cost more than the best path -
+ * nav_bench_hpa measures how much. Corridor searches are only made with nav_hpa enabled.
+ * With nav_hpa on, the hierarchy is built when the mesh is loaded, and saved alongside the .nav file.
+ */
+class CNavHierarchy
+{
+public:
+	CNavHierarchy( void );
+
+	void Build( void );								// build from the current nav mesh
+	void Invalidate( void );						// the mesh has changed - stop using the hierarchy until it is rebuilt
+	bool IsValid( void ) const						{ return m_isValid; }
+
+	bool Load( void );								// load the hierarchy saved for the current map, if it matches the current mesh
+	bool Save( void ) const;
+
+	int GetClusterCount( void ) const				{ return m_cluster.Count(); }
+	int GetCluster( const CNavArea *area ) const;	// return the cluster containing the area, or -1
+
+	/**
+	 * Return true if a search from startArea to goalArea is long enough to benefit from a corridor.
+	 * Doesn't check nav_hpa - NavAreaBuildPath() does.
+	 * If so, and a coarse route exists, build the corridor and return true.
+	 * Main thread only - the corridor is stored in the hierarchy.
+	 */
+	bool BuildCorridor( CNavArea *startArea, CNavArea *goalArea );
+
+	bool IsInCorridor( const CNavArea *area ) const;	// true if area is in the most recently built corridor
+
+private:
+	struct Cluster
+	{
+		Vector center;								// average of the centers of the cluster's areas
+		int firstEdge;								// edges of this cluster are m_edge[ firstEdge ] .. m_edge[ firstEdge + edgeCount - 1 ]
+		int edgeCount;
+	};
+
+	struct Edge
+	{
+		int to;
+		float cost;
+	};
+
+	struct OpenCluster
+	{
+		int cluster;
+		float costSoFar;
+		float totalCost;
+
+		static bool IsLowerPriority( const OpenCluster &lhs, const OpenCluster &rhs )	{ return lhs.totalCost > rhs.totalCost; }
+	};
+
+	unsigned int ComputeMeshChecksum( void ) const;	// used to tell if a saved hierarchy matches the mesh
+	const char *GetFilename( void ) const;
+
+	bool m_isValid;
+	float m_clusterSize;
+	CUtlVector< int > m_areaCluster;				// cluster of each area, indexed by area ID
+	CUtlVector< Cluster > m_cluster;
+	CUtlVector< Edge > m_edge;
+
+	// corridor search state
+	CUtlVector< unsigned int > m_corridorMarker;	// per cluster, equals m_corridorStamp if the cluster is in the corridor
+	unsigned int m_corridorStamp;
+	CUtlVector< float > m_clusterCost;
+	CUtlVector< int > m_clusterParent;
+	CUtlVector< unsigned int > m_clusterVisited;
+	CUtlVector< int > m_corridor;
+	CUtlPriorityQueue< OpenCluster > m_openClusters;
+};
+
+extern CNavHierarchy TheNavHierarchy;
+extern ConVar nav_hpa;
+
+
+#endif // _NAV_HIERARCHY_H_
@@ -16,11 +16,14 @@
 #include "fmtstr.h"
 #include "utlbuffer.h"
 #include "tier0/vprof.h"
+#include "mathlib/ssemath.h"
+#include "vstdlib/random.h"
 #ifdef TERROR
 #include "func_simpleladder.h"
 #endif
 #include "functorutils.h"
 #include "nav_pathfind.h"
+#include "nav_vis_cache.h"
 
 #ifdef TF_DLL
 #include "tf/nav_mesh/tf_nav_area.h"
@@ -53,6 +56,7 @@ ConVar nav_show_func_nav_avoid( "nav_show_func_nav_avoid", "0", FCVAR_GAMEDLL |
 ConVar nav_show_func_nav_prefer( "nav_show_func_nav_prefer", "0", FCVAR_GAMEDLL | FCVAR_CHEAT, "Show areas of designer-placed bot preference due to func_nav_prefer entities" );
 ConVar nav_show_func_nav_prerequisite( "nav_show_func_nav_prerequisite", "0", FCVAR_GAMEDLL | FCVAR_CHEAT, "Show areas of designer-placed bot preference due to func_nav_prerequisite entities" );
 ConVar nav_max_vis_delta_list_length( "nav_max_vis_delta_list_length", "64", FCVAR_CHEAT );
+ConVar nav_packed_grid( "nav_packed_grid", "1", FCVAR_GAMEDLL | FCVAR_CHEAT, "If nonzero, area lookups by position use a packed copy of the area grid that tests four areas at once." );
 
 extern ConVar nav_show_potentially_visible;
 
@@ -71,6 +75,10 @@ CNavMesh::CNavMesh( void )
 	m_hostThreadModeRestoreValue = 0;
 	m_placeCount = 0;
 	m_placeName = NULL;
+	m_pathingGeneration = 0;
+	m_isPackedGridValid = false;
+	m_sampleStepCache.SetLessFunc( SampleStepLessFunc );
+	m_batchMapIndex = -1;
 
 	LoadPlaceDatabase();
 
@@ -107,6 +115,8 @@ void CNavMesh::Reset( void )
 
 	m_generationMode = GENERATE_NONE;
 	m_currentNode = NULL;
+	m_crouchCheckNodes.RemoveAll();
+	m_sampleStepCache.RemoveAll();
 	ClearWalkableSeeds();
 
 	m_isAnalyzed = false;
@@ -162,6 +172,9 @@ CNavArea *CNavMesh::GetMarkedArea( void ) const
  */
 void CNavMesh::DestroyNavigationMesh( bool incremental )
 {
+	++m_pathingGeneration;
+	TheNavHierarchy.Invalidate();
+
 	m_blockedAreas.RemoveAll();
 	m_avoidanceObstacleAreas.RemoveAll();
 	m_transientAreas.RemoveAll();
@@ -212,6 +225,9 @@ void CNavMesh::DestroyNavigationMesh( bool incremental )
 		m_grid.RemoveAll();
 		m_gridSizeX = 0;
 		m_gridSizeY = 0;
+
+		m_packedCellStart.Purge();
+		m_packedGroup.Purge();
 	}
 
 	// clear the hash table
@@ -219,6 +235,7 @@ void CNavMesh::DestroyNavigationMesh( bool incremental )
 	{
 		m_hashTable[i] = NULL;
 	}
+	m_areaByID.Purge();
 
 	if ( !incremental )
 	{
@@ -288,9 +305,17 @@ void CNavMesh::Update( void )
 		{
 			OnEditModeEnd();
 			m_isEditing = false;
+
+			// edits may have moved areas without re-adding them to the grid
+			InvalidatePackedGrid();
 		}
 	}
 
+	if ( !m_isPackedGridValid && !m_isEditing && nav_packed_grid.GetBool() )
+	{
+		BuildPackedGrid();
+	}
+
 	if (nav_show_danger.GetBool())
 	{
 		DrawDanger();
@@ -454,6 +479,7 @@ void CNavMesh::FireGameEvent( IGameEvent *gameEvent )
 void CNavMesh::AllocateGrid( float minX, float maxX, float minY, float maxY )
 {
 	m_grid.RemoveAll();
+	InvalidatePackedGrid();
 
 	m_minX = minX;
 	m_minY = minY;
@@ -490,6 +516,8 @@ void CNavMesh::AddNavArea( CNavArea *area )
 		}
 	}
 
+	InvalidatePackedGrid();
+
 	// add to hash table
 	int key = ComputeHashKey( area->GetID() );
 
@@ -537,6 +565,8 @@ void CNavMesh::RemoveNavArea( CNavArea *area )
 		}
 	}
 
+	InvalidatePackedGrid();
+
 	// remove from hash table
 	int key = ComputeHashKey( area->GetID() );
 
@@ -583,6 +613,20 @@ void CNavMesh::OnServerActivate( void )
 		CNavArea *area = TheNavAreas[ pit ];
 		area->OnServerActivate();
 	}
+
+	// if we are batch generating, this is the map we loaded
+	if ( IsBatchGenerating() )
+	{
+		if ( !Q_stricmp( STRING( gpGlobals->mapname ), m_batchMapList[ m_batchMapIndex ] ) )
+		{
+			BeginGeneration();
+		}
+		else
+		{
+			Warning( "Batch generation: expected map '%s' but '%s' was loaded, skipping\n", m_batchMapList[ m_batchMapIndex ], STRING( gpGlobals->mapname ) );
+			ContinueBatchGeneration();
+		}
+	}
 }
 
 #ifdef NEXT_BOT
@@ -687,6 +731,78 @@ inline void CNavMesh::GridToWorld( int gridX, int gridY, Vector *pos ) const
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Build the packed copy of the grid from m_grid.
+ * Each cell's areas are stored in groups of four, in the same order as in m_grid,
+ * so lookups through either return identical results.
+ */
+void CNavMesh::BuildPackedGrid( void )
+{
+	VPROF_BUDGET( "CNavMesh::BuildPackedGrid", "NextBot" );
+
+	m_packedCellStart.SetCount( m_grid.Count() + 1 );
+
+	int groupCount = 0;
+	FOR_EACH_VEC( m_grid, cell )
+	{
+		m_packedCellStart[ cell ] = groupCount;
+		groupCount += ( m_grid[ cell ].Count() + 3 ) / 4;
+	}
+	m_packedCellStart[ m_grid.Count() ] = groupCount;
+
+	m_packedGroup.SetCount( groupCount );
+
+	FOR_EACH_VEC( m_grid, cell )
+	{
+		const NavAreaVector &areaVector = m_grid[ cell ];
+
+		for( int i=0; i<areaVector.Count(); i += 4 )
+		{
+			PackedAreaGroup &group = m_packedGroup[ m_packedCellStart[ cell ] + i/4 ];
+
+			for( int lane=0; lane<4; ++lane )
+			{
+				if ( i + lane < areaVector.Count() )
+				{
+					CNavArea *area = areaVector[ i + lane ];
+					Vector nw = area->GetCorner( NORTH_WEST );
+					Vector se = area->GetCorner( SOUTH_EAST );
+
+					group.area[ lane ] = area;
+					SubFloat( group.loX, lane ) = nw.x;
+					SubFloat( group.loY, lane ) = nw.y;
+					SubFloat( group.hiX, lane ) = se.x;
+					SubFloat( group.hiY, lane ) = se.y;
+				}
+				else
+				{
+					// an empty extent that overlaps nothing
+					group.area[ lane ] = NULL;
+					SubFloat( group.loX, lane ) = FLT_MAX;
+					SubFloat( group.loY, lane ) = FLT_MAX;
+					SubFloat( group.hiX, lane ) = -FLT_MAX;
+					SubFloat( group.hiY, lane ) = -FLT_MAX;
+				}
+			}
+		}
+	}
+
+	m_isPackedGridValid = true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if lookups can use the packed grid instead of m_grid.
+ * Areas are moved in place while generating and editing, so the packed extents are only trusted outside of those.
+ */
+bool CNavMesh::IsPackedGridUsable( void ) const
+{
+	return m_isPackedGridValid && !m_isEditing && !IsGenerating() && nav_packed_grid.GetBool() && m_packedCellStart.Count() == m_grid.Count() + 1;
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Given a position, return the nav area that IsOverlapping and is *immediately* beneath it
@@ -701,37 +817,33 @@ CNavArea *CNavMesh::GetNavArea( const Vector &pos, float beneathLimit ) const
 	// get list in cell that contains position
 	int x = WorldToGridX( pos.x );
 	int y = WorldToGridY( pos.y );
-	NavAreaVector *areaVector = &m_grid[ x + y*m_gridSizeX ];
 
 	// search cell list to find correct area
 	CNavArea *use = NULL;
 	float useZ = -99999999.9f;
 	Vector testPos = pos + Vector( 0, 0, 5 );
 
-	FOR_EACH_VEC( (*areaVector), it )
-	{
-		CNavArea *area = (*areaVector)[ it ];
+	// only areas whose 2D boundaries contain the position
+	CellAreaIterator iter( this, x + y*m_gridSizeX, testPos );
 
-		// check if position is within 2D boundaries of this area
-		if (area->IsOverlapping( testPos ))
-		{
-			// project position onto area to get Z
-			float z = area->GetZ( testPos );
+	for( CNavArea *area = iter.Next(); area; area = iter.Next() )
+	{
+		// project position onto area to get Z
+		float z = area->GetZ( testPos );
 
-			// if area is above us, skip it
-			if (z > testPos.z)
-				continue;
+		// if area is above us, skip it
+		if (z > testPos.z)
+			continue;
 
-			// if area is too far below us, skip it
-			if (z < pos.z - beneathLimit)
-				continue;
+		// if area is too far below us, skip it
+		if (z < pos.z - beneathLimit)
+			continue;
 
-			// if area is higher than the one we have, use this instead
-			if (z > useZ)
-			{
-				use = area;
-				useZ = z;
-			}
+		// if area is higher than the one we have, use this instead
+		if (z > useZ)
+		{
+			use = area;
+			useZ = z;
 		}
 	}
 
@@ -769,21 +881,18 @@ CNavArea *CNavMesh::GetNavArea( CBaseEntity *pEntity, int nFlags, float flBeneat
 	// get list in cell that contains position
 	int x = WorldToGridX( testPos.x );
 	int y = WorldToGridY( testPos.y );
-	NavAreaVector *areaVector = &m_grid[ x + y*m_gridSizeX ];
 
 	// search cell list to find correct area
 	CNavArea *use = NULL;
 	float useZ = -99999999.9f;
 
 	bool bSkipBlockedAreas = ( ( nFlags & GETNAVAREA_ALLOW_BLOCKED_AREAS ) == 0 );
-	FOR_EACH_VEC( (*areaVector), it )
-	{
-		CNavArea *pArea = (*areaVector)[ it ];
 
-		// check if position is within 2D boundaries of this area
-		if ( !pArea->IsOverlapping( testPos ) )
-			continue;
+	// only areas whose 2D boundaries contain the position
+	CellAreaIterator iter( this, x + y*m_gridSizeX, testPos );
 
+	for( CNavArea *pArea = iter.Next(); pArea; pArea = iter.Next() )
+	{
 		// don't consider blocked areas
 		if ( bSkipBlockedAreas && pArea->IsBlocked( pEntity->GetTeamNumber() ) )
 			continue;
@@ -910,13 +1019,11 @@ CNavArea *CNavMesh::GetNearestNavArea( const Vector &pos, bool anyZ, float maxDi
 					 y < originY + shift )
 					continue;
 
-				NavAreaVector *areaVector = &m_grid[ x + y*m_gridSizeX ];
+				// find closest area in this cell, skipping areas whose 2D extent is already too far away
+				CellAreaIterator iter( this, x + y*m_gridSizeX, pos, &closeDistSq );
 
-				// find closest area in this cell
-				FOR_EACH_VEC( (*areaVector), it )
+				for( CNavArea *area = iter.Next(); area; area = iter.Next() )
 				{
-					CNavArea *area = (*areaVector)[ it ];
-
 					// skip if we've already visited this area
 					if ( area->m_nearNavSearchMarker == searchMarker )
 						continue;
@@ -997,6 +1104,117 @@ CNavArea *CNavMesh::GetNearestNavArea( const Vector &pos, bool anyZ, float maxDi
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Time GetNavArea() and GetNearestNavArea() at random positions, first walking m_grid and then
+ * using the packed grid, and check that both return the same areas.
+ */
+void CNavMesh::CommandNavBenchGrid( const CCommand &args )
+{
+	if ( TheNavAreas.Count() == 0 )
+	{
+		Msg( "No navigation mesh loaded.\n" );
+		return;
+	}
+
+	if ( m_isEditing || IsGenerating() )
+	{
+		Msg( "The packed grid is not used while editing or generating.\n" );
+		return;
+	}
+
+	if ( !m_isPackedGridValid )
+	{
+		BuildPackedGrid();
+	}
+
+	int queryCount = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 100000;
+	int seed = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 1;
+
+	CUniformRandomStream random;
+	random.SetSeed( seed );
+
+	// positions on and just above random areas, and positions near them for the nearest area queries
+	CUtlVector< Vector > onPos;
+	CUtlVector< Vector > nearPos;
+	onPos.SetCount( queryCount );
+	nearPos.SetCount( queryCount );
+	for( int i=0; i<queryCount; ++i )
+	{
+		const CNavArea *area = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		Vector nw = area->GetCorner( NORTH_WEST );
+		Vector se = area->GetCorner( SOUTH_EAST );
+
+		onPos[i].x = random.RandomFloat( nw.x, se.x );
+		onPos[i].y = random.RandomFloat( nw.y, se.y );
+		onPos[i].z = area->GetZ( onPos[i].x, onPos[i].y ) + random.RandomFloat( 0.0f, HalfHumanHeight );
+
+		nearPos[i] = onPos[i] + Vector( random.RandomFloat( -m_gridCellSize, m_gridCellSize ), random.RandomFloat( -m_gridCellSize, m_gridCellSize ), 0.0f );
+	}
+
+	// nearest area queries trace to the ground, so time fewer of them
+	int nearCount = MAX( 1, queryCount / 100 );
+
+	CUtlVector< CNavArea * > result[2];
+	double onTime[2];
+	double nearTime[2];
+
+	bool wasEnabled = nav_packed_grid.GetBool();
+
+	for( int pass=0; pass<2; ++pass )
+	{
+		nav_packed_grid.SetValue( pass );
+
+		result[ pass ].SetCount( queryCount + nearCount );
+
+		double start = Plat_FloatTime();
+		for( int i=0; i<queryCount; ++i )
+		{
+			result[ pass ][i] = GetNavArea( onPos[i] );
+		}
+		onTime[ pass ] = Plat_FloatTime() - start;
+
+		start = Plat_FloatTime();
+		for( int i=0; i<nearCount; ++i )
+		{
+			result[ pass ][ queryCount + i ] = GetNearestNavArea( nearPos[i] );
+		}
+		nearTime[ pass ] = Plat_FloatTime() - start;
+	}
+
+	nav_packed_grid.SetValue( wasEnabled );
+
+	int mismatchCount = 0;
+	for( int i=0; i<result[0].Count(); ++i )
+	{
+		if ( result[0][i] != result[1][i] )
+		{
+			++mismatchCount;
+		}
+	}
+
+	Msg( "%d position queries over %d areas in %d grid cells (seed %d):\n", queryCount, TheNavAreas.Count(), m_grid.Count(), seed );
+	Msg( "  GetNavArea:         grid %8.2f ms, packed %8.2f ms (%.2fx)\n", onTime[0] * 1000.0, onTime[1] * 1000.0, onTime[0] / MAX( onTime[1], 0.000001 ) );
+	Msg( "  GetNearestNavArea:  grid %8.2f ms, packed %8.2f ms (%.2fx) over %d queries\n", nearTime[0] * 1000.0, nearTime[1] * 1000.0, nearTime[0] / MAX( nearTime[1], 0.000001 ), nearCount );
+
+	if ( mismatchCount )
+	{
+		Warning( "  %d queries returned different areas!\n", mismatchCount );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CommandNavBenchGrid( const CCommand &args )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	TheNavMesh->CommandNavBenchGrid( args );
+}
+static ConCommand nav_bench_grid( "nav_bench_grid", CommandNavBenchGrid, "Time area lookups by position with and without the packed area grid. Arguments: [query count] [random seed]", FCVAR_GAMEDLL | FCVAR_CHEAT );
+
+
 //----------------------------------------------------------------------------
 // Given a position in the world, return the nav area that is closest
 // and at the same height, or beneath it.
@@ -1030,6 +1248,12 @@ CNavArea *CNavMesh::GetNavAreaByID( unsigned int id ) const
 	if (id == 0)
 		return NULL;
 
+	// while a freshly loaded mesh is being bound, look up directly instead of walking hash chains
+	if ( m_areaByID.Count() )
+	{
+		return ( id < (unsigned int)m_areaByID.Count() ) ? m_areaByID[ id ] : NULL;
+	}
+
 	int key = ComputeHashKey( id );
 
 	for( CNavArea *area = m_hashTable[key]; area; area = area->m_nextHash )
@@ -2620,6 +2844,59 @@ void CommandNavGenerateIncremental( void )
 static ConCommand nav_generate_incremental( "nav_generate_incremental", CommandNavGenerateIncremental, "Generate a Navigation Mesh for the current map and save it to disk.", FCVAR_GAMEDLL | FCVAR_CHEAT );
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Generate Navigation Meshes for a list of maps, one after another, then quit.
+ * The maps are given on the command line, or in a text file with one map name per line.
+ * Intended for headless use, ie: srcds ... +sv_cheats 1 +nav_generate_batch cfg/nav_maps.txt
+ */
+void CommandNavGenerateBatch( const CCommand &args )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: nav_generate_batch <map list file | map name> [map name...]\n" );
+		return;
+	}
+
+	CUtlStringList mapList;
+
+	CUtlBuffer fileBuffer( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( args.ArgC() == 2 && filesystem->ReadFile( args[1], "GAME", fileBuffer ) )
+	{
+		char line[ MAX_PATH ];
+		while( true )
+		{
+			fileBuffer.GetLine( line, sizeof( line ) );
+
+			if ( !fileBuffer.IsValid() )
+				break;
+
+			V_StripLeadingWhitespace( line );
+			V_StripTrailingWhitespace( line );
+
+			// skip blank lines and comments
+			if ( line[0] == '\0' || !Q_strncmp( line, "//", 2 ) )
+				continue;
+
+			mapList.CopyAndAddToTail( line );
+		}
+	}
+	else
+	{
+		for( int i=1; i<args.ArgC(); ++i )
+		{
+			mapList.CopyAndAddToTail( args[i] );
+		}
+	}
+
+	TheNavMesh->BeginBatchGeneration( mapList );
+}
+static ConCommand nav_generate_batch( "nav_generate_batch", CommandNavGenerateBatch, "Generate and save a Navigation Mesh for each map in a list, then quit. Takes map names, or a text file with one map name per line.", FCVAR_GAMEDLL | FCVAR_CHEAT );
+
+
 //--------------------------------------------------------------------------------------------------------------
 void CommandNavAnalyze( void )
 {
@@ -3357,6 +3634,8 @@ HidingSpot *GetHidingSpotByID( unsigned int id )
 // invoked when the area becomes blocked
 void CNavMesh::OnAreaBlocked( CNavArea *area )
 {
+	++m_pathingGeneration;
+
 	if ( !m_blockedAreas.HasElement( area ) )
 	{
 		m_blockedAreas.AddToTail( area );
@@ -3368,6 +3647,8 @@ void CNavMesh::OnAreaBlocked( CNavArea *area )
 // invoked when the area becomes un-blocked
 void CNavMesh::OnAreaUnblocked( CNavArea *area )
 {
+	++m_pathingGeneration;
+
 	m_blockedAreas.FindAndRemove( area );
 }
 
@@ -3450,6 +3731,9 @@ void CNavMesh::BeginVisibilityComputations( void )
 		CNavArea *area = TheNavAreas[ it ];
 		area->ResetPotentiallyVisibleAreas();
 	}
+
+	// areas that haven't changed since visibility was last computed get their lists back
+	TheNavVisibilityCache.Restore();
 }
 
 
@@ -3461,6 +3745,10 @@ void CNavMesh::EndVisibilityComputations( void )
 {
 	g_pNavVisPairHash->RemoveAll();
 
+	// save the full lists before they are compressed
+	TheNavVisibilityCache.Save();
+	TheNavVisibilityCache.Reset();
+
 	int avgVisLength = 0;
 	int maxVisLength = 0;
 	int minVisLength = 999999999;
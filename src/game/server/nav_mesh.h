@@ -20,8 +20,10 @@
 #define _NAV_MESH_H_
 
 #include "utlbuffer.h"
+#include "utlrbtree.h"
 #include "filesystem.h"
 #include "GameEventListener.h"
+#include "mathlib/ssemath.h"
 
 #include "nav.h"
 #include "nav_area.h"
@@ -279,6 +281,7 @@ public:
 	virtual void FireGameEvent( IGameEvent *event );					// incoming event processing
 
 	virtual NavErrorType Load( void );									// load navigation data from a file
+	NavErrorType LoadFromFile( const char *mapName, bool allowBinary, bool *loadedBinary = NULL );	// load the given map's navigation data, from its binary image if allowed and up to date
 	virtual NavErrorType PostLoad( unsigned int version );				// (EXTEND) invoked after all areas have been loaded - for pointer binding, etc
 	bool IsLoaded( void ) const		{ return m_isLoaded; }				// return true if a Navigation Mesh has been loaded
 	bool IsAnalyzed( void ) const	{ return m_isAnalyzed; }			// return true if a Navigation Mesh has been analyzed
@@ -292,6 +295,7 @@ public:
 	const CUtlVector< Place > *GetPlacesFromNavFile( bool *hasUnnamedPlaces );	// Reads the used place names from the nav file (can be used to selectively precache before the nav is loaded)
 
 	virtual bool Save( void ) const;									// store Navigation Mesh to a file
+	bool SaveBinary( const char *mapName ) const;						// store a binary image of the Navigation Mesh, made from the given map's current .nav file
 	bool IsOutOfDate( void ) const	{ return m_isOutOfDate; }			// return true if the Navigation Mesh is older than the current map version
 
 	virtual unsigned int GetSubVersionNumber( void ) const;										// returns sub-version number of data format used by derived classes
@@ -311,6 +315,9 @@ public:
 	virtual void OnAvoidanceObstacleEnteredArea( CNavArea *area );					// invoked when the area becomes obstructed
 	virtual void OnAvoidanceObstacleLeftArea( CNavArea *area );					// invoked when the area becomes un-obstructed
 
+	unsigned int GetPathingGeneration( void ) const	{ return m_pathingGeneration; }	// changes whenever areas are blocked, unblocked, created or destroyed - paths computed under an older generation may be stale
+	void OnPathCostsChanged( void )					{ ++m_pathingGeneration; }		// invoked when area costs or game-specific blocking change outside of OnAreaBlocked/OnAreaUnblocked (ie: func_nav_cost, TF_NAV_BLOCKED)
+
 	virtual void OnEditCreateNotify( CNavArea *newArea );				// invoked when given area has just been added to the mesh in edit mode
 	virtual void OnEditDestroyNotify( CNavArea *deadArea );				// invoked when given area has just been deleted from the mesh in edit mode
 	virtual void OnEditDestroyNotify( CNavLadder *deadLadder );			// invoked when given ladder has just been deleted from the mesh in edit mode
@@ -356,6 +363,8 @@ public:
 	#define INCREMENTAL_GENERATION true
 	void BeginGeneration( bool incremental = false );					// initiate the generation process
 	void BeginAnalysis( bool quitWhenFinished = false );						// re-analyze an existing Mesh.  Determine Hiding Spots, Encounter Spots, etc.
+	void BeginBatchGeneration( const CUtlStringList &mapList );			// load and generate each map in turn, then quit
+	bool IsBatchGenerating( void ) const	{ return m_batchMapIndex >= 0; }
 
 	bool IsGenerating( void ) const		{ return m_generationMode != GENERATE_NONE; }	// return true while a Navigation Mesh is being generated
 	const char *GetPlayerSpawnName( void ) const;						// return name of player spawn entity
@@ -446,6 +455,7 @@ public:
 	void CommandNavSaveSelected( const CCommand &args );				// Save selected set to disk
 	void CommandNavMergeMesh( const CCommand &args );					// Merge a saved selected set into the current mesh
 	void CommandNavMarkWalkable( void );
+	void CommandNavBenchGrid( const CCommand &args );					// time area lookups with and without the packed grid
 
 	void AddToDragSelectionSet( CNavArea *pArea );
 	void RemoveFromDragSelectionSet( CNavArea *pArea );
@@ -560,126 +570,14 @@ public:
 	 * If functor returns false, stop processing and return false.
 	 */
 	template < typename Functor >
-	bool ForAllAreasOverlappingExtent( Functor &func, const Extent &extent )
-	{
-		if ( !m_grid.Count() )
-		{
-#if _DEBUG
-			Warning("Query before nav mesh is loaded! %d\n", TheNavAreas.Count() );
-#endif
-			return true;
-		}
-		static unsigned int searchMarker = RandomInt(0, 1024*1024 );
-		if ( ++searchMarker == 0 )
-		{
-			++searchMarker;
-		}
-
-		Extent areaExtent;
-
-		// get list in cell that contains position
-		int startX = WorldToGridX( extent.lo.x );
-		int endX = WorldToGridX( extent.hi.x );
-		int startY = WorldToGridY( extent.lo.y );
-		int endY = WorldToGridY( extent.hi.y );
-
-		for( int x = startX; x <= endX; ++x )
-		{
-			for( int y = startY; y <= endY; ++y )
-			{
-				int iGrid = x + y*m_gridSizeX;
-				if ( iGrid >= m_grid.Count() )
-				{
-					ExecuteNTimes( 10, Warning( "** Walked off of the CNavMesh::m_grid in ForAllAreasOverlappingExtent()\n" ) );
-					return true;
-				}
-
-				NavAreaVector *areaVector = &m_grid[ iGrid ];
-
-				// find closest area in this cell
-				FOR_EACH_VEC( (*areaVector), it )
-				{
-					CNavArea *area = (*areaVector)[ it ];
-
-					// skip if we've already visited this area
-					if ( area->m_nearNavSearchMarker == searchMarker )
-						continue;
-
-					// mark as visited
-					area->m_nearNavSearchMarker = searchMarker;
-					area->GetExtent( &areaExtent );
-
-					if ( extent.IsOverlapping( areaExtent ) )
-					{
-						if ( func( area ) == false )
-							return false;
-					}
-				}
-			}
-		}
-		return true;
-	}
+	bool ForAllAreasOverlappingExtent( Functor &func, const Extent &extent );
 
 	//-------------------------------------------------------------------------------------
 	/**
 	 * Populate the given vector with all navigation areas that overlap the given extent.
 	 */
 	template< typename NavAreaType >
-	void CollectAreasOverlappingExtent( const Extent &extent, CUtlVector< NavAreaType * > *outVector )
-	{
-		if ( !m_grid.Count() )
-		{
-			return;
-		}
-
-		static unsigned int searchMarker = RandomInt( 0, 1024*1024 );
-		if ( ++searchMarker == 0 )
-		{
-			++searchMarker;
-		}
-
-		Extent areaExtent;
-
-		// get list in cell that contains position
-		int startX = WorldToGridX( extent.lo.x );
-		int endX = WorldToGridX( extent.hi.x );
-		int startY = WorldToGridY( extent.lo.y );
-		int endY = WorldToGridY( extent.hi.y );
-
-		for( int x = startX; x <= endX; ++x )
-		{
-			for( int y = startY; y <= endY; ++y )
-			{
-				int iGrid = x + y*m_gridSizeX;
-				if ( iGrid >= m_grid.Count() )
-				{
-					ExecuteNTimes( 10, Warning( "** Walked off of the CNavMesh::m_grid in CollectAreasOverlappingExtent()\n" ) );
-					return;
-				}
-
-				NavAreaVector *areaVector = &m_grid[ iGrid ];
-
-				// find closest area in this cell
-				for( int v=0; v<areaVector->Count(); ++v )
-				{
-					CNavArea *area = areaVector->Element( v );
-
-					// skip if we've already visited this area
-					if ( area->m_nearNavSearchMarker == searchMarker )
-						continue;
-
-					// mark as visited
-					area->m_nearNavSearchMarker = searchMarker;
-					area->GetExtent( &areaExtent );
-
-					if ( extent.IsOverlapping( areaExtent ) )
-					{
-						outVector->AddToTail( (NavAreaType *)area );
-					}
-				}
-			}
-		}
-	}
+	void CollectAreasOverlappingExtent( const Extent &extent, CUtlVector< NavAreaType * > *outVector );
 
 
 	template < typename Functor >
@@ -1076,7 +974,8 @@ public:
 	void ScriptGetNavAreasOverlappingEntityExtent( HSCRIPT hEntity, HSCRIPT hTable );
 
 protected:
-	NavErrorType GetNavDataFromFile( CUtlBuffer &outBuffer, bool *pNavDataFromBSP = NULL );
+	NavErrorType GetNavDataFromFile( CUtlBuffer &outBuffer, bool *pNavDataFromBSP = NULL, const char *mapName = NULL );
+	bool LoadBinary( const char *mapName );						// load the given map's binary nav image, if it is up to date
 
 	virtual void PostCustomAnalysis( void ) { }					// invoked when custom analysis step is complete
 	bool FindActiveNavArea( void );								// Finds the area or ladder the local player is currently pointing at.  Returns true if a surface was hit by the traceline.
@@ -1098,6 +997,26 @@ private:
 	float m_minY;
 	unsigned int m_areaCount;									// total number of nav areas
 
+	/**
+	 * Packed, read-only copy of m_grid used by the point queries (GetNavArea(), GetNearestNavArea()).
+	 * The areas of each cell are contiguous, in groups of four with their 2D extents laid out
+	 * so one SIMD compare tests all four. The copy is rebuilt in Update() after the grid changes;
+	 * until then, and while generating or editing, queries walk m_grid directly.
+	 */
+	struct PackedAreaGroup
+	{
+		fltx4 loX, loY, hiX, hiY;
+		CNavArea *area[4];										// NULL for padding past the end of a cell
+	};
+	CUtlVector< int > m_packedCellStart;						// groups of cell i are m_packedGroup[ m_packedCellStart[i] ] up to m_packedGroup[ m_packedCellStart[i+1] ]
+	CUtlVector< PackedAreaGroup, CUtlMemoryAligned< PackedAreaGroup, 16 > > m_packedGroup;
+	bool m_isPackedGridValid;
+	void BuildPackedGrid( void );
+	void InvalidatePackedGrid( void )	{ m_isPackedGridValid = false; }
+	bool IsPackedGridUsable( void ) const;
+	class CellAreaIterator;
+	friend class CellAreaIterator;
+
 	bool m_isLoaded;											// true if a Navigation Mesh has been loaded
 	bool m_isOutOfDate;											// true if the Navigation Mesh is older than the actual BSP
 	bool m_isAnalyzed;											// true if the Navigation Mesh needs analysis
@@ -1105,6 +1024,7 @@ private:
 	enum { HASH_TABLE_SIZE = 256 };
 	CNavArea *m_hashTable[ HASH_TABLE_SIZE ];					// hash table to optimize lookup by ID
 	int ComputeHashKey( unsigned int id ) const;				// returns a hash key for the given nav area ID
+	CUtlVector< CNavArea * > m_areaByID;						// areas indexed by ID, only while binding IDs to pointers after a load
 
 	int WorldToGridX( float wx ) const;							// given X component, return grid index
 	int WorldToGridY( float wy ) const;							// given Y component, return grid index
@@ -1189,12 +1109,66 @@ private:
 	void DestroyLadders( void );
 
 	bool SampleStep( void );									// sample the walkable areas of the map
+	void FinishSampling( void );								// complete work deferred during sampling
 	void CreateNavAreasFromNodes( void );						// cover all of the sampled nodes with nav areas
 
 	bool TestArea( CNavNode *node, int width, int height );		// check if an area of size (width, height) can fit, starting from node as upper left corner
 	int BuildArea( CNavNode *node, int width, int height );		// create a CNavArea of size (width, height) starting fom node at upper left corner
 	bool CheckObstacles( CNavNode *node, int width, int height, int x, int y );
 
+	//----------------------------------------------------------------------------------
+	// Parallel generation (nav_generate_parallel)
+	// Jobs only read the world and the mesh, and their results are applied in the same
+	// order the serial code would produce them, so the generated mesh is unchanged.
+	//
+	struct SampleStepResult										// the outcome of sampling one step from a node position in a direction
+	{
+		Vector from;											// exact position of the node the step is taken from
+		NavDirType dir;
+		bool isWalkable;										// false if no node should be added in this direction
+		Vector to;
+		Vector toNormal;
+		bool isOnDisplacement;
+		float obstacleHeight;
+		float obstacleStartDist;
+		float obstacleEndDist;
+	};
+	static bool SampleStepLessFunc( const SampleStepResult &lhs, const SampleStepResult &rhs );
+	CUtlRBTree< SampleStepResult, int > m_sampleStepCache;		// steps computed ahead of the sampling walk
+	void ComputeSampleStep( SampleStepResult &step );			// trace one step from step.from in step.dir
+	void GetSampleStep( CNavNode *node, NavDirType dir, SampleStepResult *step );	// return the step from the node in the given direction
+	void PrepareSampleSteps( CNavNode *node );					// compute the node's unvisited steps, and the steps likely to follow them, on the job pool
+
+	CUtlVector< CNavNode * > m_crouchCheckNodes;				// nodes whose CheckCrouch() has been deferred until sampling is complete
+	void CheckNodeCrouch( CNavNode *&node );
+
+	struct AreaTest												// TestArea() for one node, computed ahead of the greedy area creation pass
+	{
+		CNavNode *node;
+		int width;
+		int height;
+		bool canBuild;
+	};
+	void ComputeAreaTest( AreaTest &test );
+
+	struct GeneratedConnection
+	{
+		CNavArea *area;
+		NavDirType dir;
+	};
+	struct GeneratedAreaConnections								// connections found for one generated area, made in area order
+	{
+		CNavArea *area;
+		CUtlVector< GeneratedConnection > connect;
+
+		void Add( CNavArea *to, NavDirType dir )
+		{
+			GeneratedConnection connection = { to, dir };
+			connect.AddToTail( connection );
+		}
+	};
+	void FindGeneratedConnections( GeneratedAreaConnections &connections );
+
 	void MarkPlayerClipAreas( void );
 	void MarkJumpAreas( void );
 	void StichAndRemoveJumpAreas( void );
@@ -1260,6 +1234,10 @@ private:
 	int m_seedIdx;
 	int m_hostThreadModeRestoreValue;							// stores the value of host_threadmode before we changed it
 
+	CUtlStringList m_batchMapList;								// maps to generate in turn, see BeginBatchGeneration()
+	int m_batchMapIndex;										// index of the map being generated, or -1 if not batch generating
+	void ContinueBatchGeneration( void );
+
 	void BuildTransientAreaList( void );
 	CUtlVector< CNavArea * > m_transientAreas;
 
@@ -1269,6 +1247,7 @@ private:
 
 	void UpdateBlockedAreas( void );
 	CUtlVector< CNavArea * > m_blockedAreas;
+	unsigned int m_pathingGeneration;
 
 	CUtlVector< int > m_storedSelectedSet;						// "Stored" selected set, so we can do some editing and then restore the old selected set.  Done by ID, so we don't have to worry about split/delete/etc.
 
@@ -1358,6 +1337,275 @@ inline unsigned int CNavMesh::GetGenerationTraceMask( void ) const
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Iterates the areas of one grid cell that contain, or may be near, a position,
+ * or whose 2D extent overlaps an extent, in the order they are stored in the cell.
+ */
+class CNavMesh::CellAreaIterator
+{
+public:
+	// areas whose 2D extent contains 'pos', as CNavArea::IsOverlapping()
+	CellAreaIterator( const CNavMesh *mesh, int cell, const Vector &pos )
+	{
+		Init( mesh, cell, pos, NULL );
+	}
+
+	// areas that may be closer than sqrt( *maxDistSq ) to 'pos' in 2D. *maxDistSq may be lowered during the iteration.
+	CellAreaIterator( const CNavMesh *mesh, int cell, const Vector &pos, const float *maxDistSq )
+	{
+		Init( mesh, cell, pos, maxDistSq );
+	}
+
+	// areas that may overlap 'extent' - only their 2D extents are tested
+	CellAreaIterator( const CNavMesh *mesh, int cell, const Extent &extent )
+	{
+		Init( mesh, cell, vec3_origin, NULL );
+		m_extent = &extent;
+	}
+
+	CNavArea *Next( void );
+
+private:
+	void Init( const CNavMesh *mesh, int cell, const Vector &pos, const float *maxDistSq );
+	int ComputeGroupMask( const PackedAreaGroup &group ) const;
+
+	const CNavMesh *m_mesh;
+	const NavAreaVector *m_areaVector;		// non-NULL if iterating m_grid instead of the packed grid
+	int m_index;							// next area of m_areaVector, or next group of the packed grid
+	int m_end;
+	const PackedAreaGroup *m_group;
+	int m_mask;								// lanes of m_group left to return
+	int m_lane;
+	Vector m_pos;
+	const float *m_maxDistSq;
+	const Extent *m_extent;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline void CNavMesh::CellAreaIterator::Init( const CNavMesh *mesh, int cell, const Vector &pos, const float *maxDistSq )
+{
+	m_mesh = mesh;
+	m_pos = pos;
+	m_maxDistSq = maxDistSq;
+	m_extent = NULL;
+	m_group = NULL;
+	m_mask = 0;
+	m_lane = 0;
+
+	if ( mesh->IsPackedGridUsable() )
+	{
+		m_areaVector = NULL;
+		m_index = mesh->m_packedCellStart[ cell ];
+		m_end = mesh->m_packedCellStart[ cell+1 ];
+	}
+	else
+	{
+		m_areaVector = &mesh->m_grid[ cell ];
+		m_index = 0;
+		m_end = m_areaVector->Count();
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return a bit for each area in the group that passes the iterator's test
+ */
+inline int CNavMesh::CellAreaIterator::ComputeGroupMask( const PackedAreaGroup &group ) const
+{
+	if ( m_extent )
+	{
+		// as Extent::IsOverlapping(), in 2D
+		fltx4 fl4Overlap = AndSIMD( AndSIMD( CmpLeSIMD( group.loX, ReplicateX4( m_extent->hi.x ) ), CmpGeSIMD( group.hiX, ReplicateX4( m_extent->lo.x ) ) ),
+									AndSIMD( CmpLeSIMD( group.loY, ReplicateX4( m_extent->hi.y ) ), CmpGeSIMD( group.hiY, ReplicateX4( m_extent->lo.y ) ) ) );
+		return TestSignSIMD( fl4Overlap );
+	}
+
+	fltx4 fl4X = ReplicateX4( m_pos.x );
+	fltx4 fl4Y = ReplicateX4( m_pos.y );
+
+	if ( !m_maxDistSq )
+	{
+		fltx4 fl4Inside = AndSIMD( AndSIMD( CmpGeSIMD( fl4X, group.loX ), CmpLeSIMD( fl4X, group.hiX ) ),
+								   AndSIMD( CmpGeSIMD( fl4Y, group.loY ), CmpLeSIMD( fl4Y, group.hiY ) ) );
+		return TestSignSIMD( fl4Inside );
+	}
+
+	// 2D distance to the closest point on each extent. This never exceeds the
+	// distance to the point GetClosestPointOnArea() finds, so nothing closer is rejected.
+	fltx4 fl4DX = MaxSIMD( MaxSIMD( SubSIMD( group.loX, fl4X ), SubSIMD( fl4X, group.hiX ) ), Four_Zeros );
+	fltx4 fl4DY = MaxSIMD( MaxSIMD( SubSIMD( group.loY, fl4Y ), SubSIMD( fl4Y, group.hiY ) ), Four_Zeros );
+	fltx4 fl4DistSq = AddSIMD( MulSIMD( fl4DX, fl4DX ), MulSIMD( fl4DY, fl4DY ) );
+
+	return TestSignSIMD( CmpLtSIMD( fl4DistSq, ReplicateX4( *m_maxDistSq ) ) );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the next area, or NULL when the cell is exhausted
+ */
+inline CNavArea *CNavMesh::CellAreaIterator::Next( void )
+{
+	if ( m_areaVector )
+	{
+		while( m_index < m_end )
+		{
+			CNavArea *area = (*m_areaVector)[ m_index++ ];
+
+			if ( m_maxDistSq || m_extent || area->IsOverlapping( m_pos ) )
+				return area;
+		}
+
+		return NULL;
+	}
+
+	while( true )
+	{
+		while( m_mask )
+		{
+			int lane = m_lane++;
+
+			if ( m_mask & ( 1 << lane ) )
+			{
+				m_mask &= ~( 1 << lane );
+
+				// padding can only pass an unbounded extent test
+				if ( m_group->area[ lane ] )
+					return m_group->area[ lane ];
+			}
+		}
+
+		if ( m_index >= m_end )
+			return NULL;
+
+		m_group = &m_mesh->m_packedGroup[ m_index++ ];
+		m_mask = ComputeGroupMask( *m_group );
+		m_lane = 0;
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+template < typename Functor >
+bool CNavMesh::ForAllAreasOverlappingExtent( Functor &func, const Extent &extent )
+{
+	if ( !m_grid.Count() )
+	{
+#if _DEBUG
+		Warning("Query before nav mesh is loaded! %d\n", TheNavAreas.Count() );
+#endif
+		return true;
+	}
+	static unsigned int searchMarker = RandomInt(0, 1024*1024 );
+	if ( ++searchMarker == 0 )
+	{
+		++searchMarker;
+	}
+
+	Extent areaExtent;
+
+	// get list in cell that contains position
+	int startX = WorldToGridX( extent.lo.x );
+	int endX = WorldToGridX( extent.hi.x );
+	int startY = WorldToGridY( extent.lo.y );
+	int endY = WorldToGridY( extent.hi.y );
+
+	for( int x = startX; x <= endX; ++x )
+	{
+		for( int y = startY; y <= endY; ++y )
+		{
+			int iGrid = x + y*m_gridSizeX;
+			if ( iGrid >= m_grid.Count() )
+			{
+				ExecuteNTimes( 10, Warning( "** Walked off of the CNavMesh::m_grid in ForAllAreasOverlappingExtent()\n" ) );
+				return true;
+			}
+
+			// only areas whose 2D extent overlaps
+			CellAreaIterator iter( this, iGrid, extent );
+
+			for( CNavArea *area = iter.Next(); area; area = iter.Next() )
+			{
+				// skip if we've already visited this area
+				if ( area->m_nearNavSearchMarker == searchMarker )
+					continue;
+
+				// mark as visited
+				area->m_nearNavSearchMarker = searchMarker;
+				area->GetExtent( &areaExtent );
+
+				if ( extent.IsOverlapping( areaExtent ) )
+				{
+					if ( func( area ) == false )
+						return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+template< typename NavAreaType >
+void CNavMesh::CollectAreasOverlappingExtent( const Extent &extent, CUtlVector< NavAreaType * > *outVector )
+{
+	if ( !m_grid.Count() )
+	{
+		return;
+	}
+
+	static unsigned int searchMarker = RandomInt( 0, 1024*1024 );
+	if ( ++searchMarker == 0 )
+	{
+		++searchMarker;
+	}
+
+	Extent areaExtent;
+
+	// get list in cell that contains position
+	int startX = WorldToGridX( extent.lo.x );
+	int endX = WorldToGridX( extent.hi.x );
+	int startY = WorldToGridY( extent.lo.y );
+	int endY = WorldToGridY( extent.hi.y );
+
+	for( int x = startX; x <= endX; ++x )
+	{
+		for( int y = startY; y <= endY; ++y )
+		{
+			int iGrid = x + y*m_gridSizeX;
+			if ( iGrid >= m_grid.Count() )
+			{
+				ExecuteNTimes( 10, Warning( "** Walked off of the CNavMesh::m_grid in CollectAreasOverlappingExtent()\n" ) );
+				return;
+			}
+
+			// only areas whose 2D extent overlaps
+			CellAreaIterator iter( this, iGrid, extent );
+
+			for( CNavArea *area = iter.Next(); area; area = iter.Next() )
+			{
+				// skip if we've already visited this area
+				if ( area->m_nearNavSearchMarker == searchMarker )
+					continue;
+
+				// mark as visited
+				area->m_nearNavSearchMarker = searchMarker;
+				area->GetExtent( &areaExtent );
+
+				if ( extent.IsOverlapping( areaExtent ) )
+				{
+					outVector->AddToTail( (NavAreaType *)area );
+				}
+			}
+		}
+	}
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 //
 // Function prototypes
@@ -91,6 +91,7 @@ private:
 	unsigned char m_visited;										///< flags for automatic node generation. If direction bit is clear, that direction hasn't been explored yet.
 	CNavNode *m_parent;												///< the node prior to this in the search, which we pop back to when this node's search is done (a stack)
 	bool m_isCovered;												///< true when this node is "covered" by a CNavArea
+	bool m_isCrouchCheckPending;									///< true if CheckCrouch() has been deferred until sampling is complete
 	CNavArea *m_area;												///< the area this node is contained within
 
 	bool m_isBlocked[ NUM_CORNERS ];
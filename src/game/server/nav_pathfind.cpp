@@ -0,0 +1,452 @@
+// nav_pathfind.cpp
+// Reentrant path search state for the Navigation Mesh
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#include "cbase.h"
+#include "tier0/vprof.h"
+#include "vstdlib/random.h"
+
+#include "nav_mesh.h"
+#include "nav_pathfind.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+static CThreadFastMutex s_searchContextPoolMutex;
+static CUtlVector< CNavSearchContext * > s_searchContextPool;
+
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavArea::GetSearchContextCostSoFar( void ) const
+{
+	return m_activeSearchContext->GetCostSoFar( this );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavSearchContext::CActivateScope::CActivateScope( CNavSearchContext *context )
+{
+	m_prevContext = CNavArea::m_activeSearchContext;
+	CNavArea::m_activeSearchContext = context;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavSearchContext::CActivateScope::~CActivateScope()
+{
+	CNavArea::m_activeSearchContext = m_prevContext;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavSearchContext::CNavSearchContext( void )
+{
+	m_marker = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Get an unused context from the shared pool, creating one if needed. Safe to call from any thread.
+ */
+CNavSearchContext *CNavSearchContext::Acquire( void )
+{
+	AUTO_LOCK( s_searchContextPoolMutex );
+
+	if ( s_searchContextPool.Count() )
+	{
+		CNavSearchContext *context = s_searchContextPool.Tail();
+		s_searchContextPool.RemoveMultipleFromTail( 1 );
+		return context;
+	}
+
+	return new CNavSearchContext;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavSearchContext::Release( CNavSearchContext *context )
+{
+	AUTO_LOCK( s_searchContextPoolMutex );
+
+	s_searchContextPool.AddToTail( context );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Start a new search. Bumping the marker invalidates the state of every area at once.
+ */
+void CNavSearchContext::ClearSearchLists( void )
+{
+	// area IDs are always less than the next ID to be allocated
+	int areaIDCount = CNavArea::m_nextID;
+	if ( m_state.Count() < areaIDCount )
+	{
+		int oldCount = m_state.Count();
+		m_state.AddMultipleToTail( areaIDCount - oldCount );
+
+		for( int i=oldCount; i<areaIDCount; ++i )
+		{
+			m_state[i].marker = 0;
+		}
+	}
+
+	++m_marker;
+	if ( m_marker == 0 )
+	{
+		// wrapped around - stale markers could look current
+		for( int i=0; i<m_state.Count(); ++i )
+		{
+			m_state[i].marker = 0;
+		}
+		m_marker = 1;
+	}
+
+	m_openList.RemoveAll();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavSearchContext::AreaState &CNavSearchContext::GetState( const CNavArea *area )
+{
+	Assert( area->GetID() < (unsigned int)m_state.Count() );
+
+	AreaState &state = m_state[ area->GetID() ];
+
+	if ( state.marker != m_marker )
+	{
+		state.marker = m_marker;
+		state.openIndex = -1;
+		state.isClosed = false;
+		state.parentHow = NUM_TRAVERSE_TYPES;
+		state.parent = NULL;
+		state.costSoFar = 0.0f;
+		state.totalCost = 0.0f;
+		state.pathLengthSoFar = 0.0f;
+	}
+
+	return state;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+const CNavSearchContext::AreaState *CNavSearchContext::FindState( const CNavArea *area ) const
+{
+	if ( area == NULL || area->GetID() >= (unsigned int)m_state.Count() )
+		return NULL;
+
+	const AreaState &state = m_state[ area->GetID() ];
+
+	return ( state.marker == m_marker ) ? &state : NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavArea *CNavSearchContext::GetParent( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state ? state->parent : NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+NavTraverseType CNavSearchContext::GetParentHow( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state ? state->parentHow : NUM_TRAVERSE_TYPES;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavSearchContext::GetCostSoFar( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state ? state->costSoFar : 0.0f;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavSearchContext::BuildRoute( CNavArea *startArea, CNavArea *endArea, CUtlVector< NavRouteStep > *route ) const
+{
+	route->RemoveAll();
+
+	for( CNavArea *area = endArea; area; area = GetParent( area ) )
+	{
+		int i = route->AddToTail();
+		(*route)[i].area = area;
+		(*route)[i].how = GetParentHow( area );
+
+		// startArea can be re-evaluated during the pathfind and given a parent...
+		if ( area == startArea || route->Count() > m_state.Count() )
+			break;
+	}
+
+	route->Reverse();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavSearchContext::AddToOpenList( CNavArea *area, AreaState *state )
+{
+	int i = m_openList.AddToTail();
+	m_openList[i].totalCost = state->totalCost;
+	m_openList[i].area = area;
+	state->openIndex = i;
+
+	SiftUp( i );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavSearchContext::UpdateOnOpenList( AreaState *state )
+{
+	Assert( state->openIndex >= 0 );
+
+	m_openList[ state->openIndex ].totalCost = state->totalCost;
+	SiftUp( state->openIndex );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavArea *CNavSearchContext::PopOpenList( void )
+{
+	CNavArea *area = m_openList[0].area;
+	m_state[ area->GetID() ].openIndex = -1;
+
+	int last = m_openList.Count() - 1;
+	if ( last > 0 )
+	{
+		m_openList[0] = m_openList[ last ];
+		m_state[ m_openList[0].area->GetID() ].openIndex = 0;
+	}
+	m_openList.RemoveMultipleFromTail( 1 );
+
+	if ( m_openList.Count() > 1 )
+	{
+		SiftDown( 0 );
+	}
+
+	return area;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavSearchContext::SiftUp( int index )
+{
+	OpenEntry entry = m_openList[ index ];
+
+	while( index > 0 )
+	{
+		int parent = ( index - 1 ) / 2;
+		if ( m_openList[ parent ].totalCost <= entry.totalCost )
+			break;
+
+		m_openList[ index ] = m_openList[ parent ];
+		m_state[ m_openList[ index ].area->GetID() ].openIndex = index;
+		index = parent;
+	}
+
+	m_openList[ index ] = entry;
+	m_state[ entry.area->GetID() ].openIndex = index;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavSearchContext::SiftDown( int index )
+{
+	OpenEntry entry = m_openList[ index ];
+	int count = m_openList.Count();
+
+	while( true )
+	{
+		int child = 2 * index + 1;
+		if ( child >= count )
+			break;
+
+		if ( child + 1 < count && m_openList[ child + 1 ].totalCost < m_openList[ child ].totalCost )
+			++child;
+
+		if ( entry.totalCost <= m_openList[ child ].totalCost )
+			break;
+
+		m_openList[ index ] = m_openList[ child ];
+		m_state[ m_openList[ index ].area->GetID() ].openIndex = index;
+		index = child;
+	}
+
+	m_openList[ index ] = entry;
+	m_state[ entry.area->GetID() ].openIndex = index;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Collect the areas reachable from 'area' - floor connections in each direction,
+ * then the tops of up ladders (ahead, left, right), then the bottoms of down ladders, then elevator stops.
+ */
+void CNavSearchContext::CollectNeighbors( CNavArea *area )
+{
+	m_neighbors.RemoveAll();
+
+	for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+	{
+		const NavConnectVector *floorList = area->GetAdjacentAreas( (NavDirType)dir );
+
+		for( int i=0; i<floorList->Count(); ++i )
+		{
+			Neighbor &neighbor = m_neighbors[ m_neighbors.AddToTail() ];
+			neighbor.area = floorList->Element(i).area;
+			neighbor.how = (NavTraverseType)dir;
+			neighbor.ladder = NULL;
+			neighbor.elevator = NULL;
+			neighbor.length = floorList->Element(i).length;
+		}
+	}
+
+	const NavLadderConnectVector *ladderUpList = area->GetLadders( CNavLadder::LADDER_UP );
+	for( int i=0; i<ladderUpList->Count(); ++i )
+	{
+		const CNavLadder *ladder = ladderUpList->Element(i).ladder;
+
+		// do not use BEHIND connection, as its very hard to get to when going up a ladder
+		CNavArea *topArea[] = { ladder->m_topForwardArea, ladder->m_topLeftArea, ladder->m_topRightArea };
+
+		for( int t=0; t<ARRAYSIZE( topArea ); ++t )
+		{
+			if ( topArea[t] == NULL )
+				continue;
+
+			Neighbor &neighbor = m_neighbors[ m_neighbors.AddToTail() ];
+			neighbor.area = topArea[t];
+			neighbor.how = GO_LADDER_UP;
+			neighbor.ladder = ladder;
+			neighbor.elevator = NULL;
+			neighbor.length = -1.0f;
+		}
+	}
+
+	const NavLadderConnectVector *ladderDownList = area->GetLadders( CNavLadder::LADDER_DOWN );
+	for( int i=0; i<ladderDownList->Count(); ++i )
+	{
+		const CNavLadder *ladder = ladderDownList->Element(i).ladder;
+
+		if ( ladder->m_bottomArea == NULL )
+			continue;
+
+		Neighbor &neighbor = m_neighbors[ m_neighbors.AddToTail() ];
+		neighbor.area = ladder->m_bottomArea;
+		neighbor.how = GO_LADDER_DOWN;
+		neighbor.ladder = ladder;
+		neighbor.elevator = NULL;
+		neighbor.length = -1.0f;
+	}
+
+	const CFuncElevator *elevator = area->GetElevator();
+	if ( elevator )
+	{
+		const NavConnectVector &elevatorAreas = area->GetElevatorAreas();
+
+		for( int i=0; i<elevatorAreas.Count(); ++i )
+		{
+			Neighbor &neighbor = m_neighbors[ m_neighbors.AddToTail() ];
+			neighbor.area = elevatorAreas[i].area;
+			neighbor.how = ( neighbor.area->GetCenter().z > area->GetCenter().z ) ? GO_ELEVATOR_UP : GO_ELEVATOR_DOWN;
+			neighbor.ladder = NULL;
+			neighbor.elevator = elevator;
+			neighbor.length = -1.0f;
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Compare NavAreaBuildPath() against CNavSearchContext searches, serially and on the job pool,
+ * using random area pairs from the current nav mesh.
+ */
+CON_COMMAND_F( nav_bench_pathfind, "Time NavAreaBuildPath() against search context path queries on the current nav mesh. Arguments: [query count] [random seed]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( TheNavAreas.Count() < 2 )
+	{
+		Msg( "No navigation mesh loaded.\n" );
+		return;
+	}
+
+	int queryCount = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 1000;
+	int seed = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 1;
+
+	CUniformRandomStream random;
+	random.SetSeed( seed );
+
+	CUtlVector< NavPathQuery > queries;
+	queries.AddMultipleToTail( queryCount );
+	for( int i=0; i<queryCount; ++i )
+	{
+		NavPathQuery &query = queries[i];
+		query.startArea = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		query.goalArea = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		query.goalPos = query.goalArea->GetCenter();
+		query.hasGoalPos = true;
+		query.maxPathLength = 0.0f;
+		query.teamID = TEAM_ANY;
+		query.isPathFound = false;
+	}
+
+	ShortestPathCost cost;
+	CUtlVector< float > legacyCost;
+	CUtlVector< bool > legacyFound;
+	legacyCost.SetCount( queryCount );
+	legacyFound.SetCount( queryCount );
+
+	// the original search, with state in the areas - always over the whole mesh, since search contexts don't use the nav_hpa corridor
+	double start = Plat_FloatTime();
+	for( int i=0; i<queryCount; ++i )
+	{
+		legacyFound[i] = NavAreaSearch( queries[i].startArea, queries[i].goalArea, &queries[i].goalPos, cost, NULL, 0.0f, TEAM_ANY, false, false );
+		legacyCost[i] = legacyFound[i] ? queries[i].goalArea->GetCostSoFar() : 0.0f;
+	}
+	double legacyTime = Plat_FloatTime() - start;
+
+	// the same queries, with state in a search context
+	ShortestPathSearchCost searchCost;
+	int mismatchCount = 0;
+	CNavSearchContext *context = CNavSearchContext::Acquire();
+	start = Plat_FloatTime();
+	for( int i=0; i<queryCount; ++i )
+	{
+		bool isFound = context->BuildPath( queries[i].startArea, queries[i].goalArea, &queries[i].goalPos, searchCost );
+		float contextCost = isFound ? context->GetCostSoFar( queries[i].goalArea ) : 0.0f;
+
+		// ties may be broken differently, but the cost of the path found must agree
+		if ( isFound != legacyFound[i] || fabs( contextCost - legacyCost[i] ) > 0.001f * MAX( 1.0f, legacyCost[i] ) )
+		{
+			++mismatchCount;
+		}
+	}
+	double contextTime = Plat_FloatTime() - start;
+	CNavSearchContext::Release( context );
+
+	// all queries at once on the job pool
+	start = Plat_FloatTime();
+	NavAreaBuildPaths( queries.Base(), queryCount, searchCost );
+	double parallelTime = Plat_FloatTime() - start;
+
+	for( int i=0; i<queryCount; ++i )
+	{
+		if ( queries[i].isPathFound != legacyFound[i] )
+		{
+			++mismatchCount;
+		}
+	}
+
+	Msg( "%d path queries over %d areas (seed %d):\n", queryCount, TheNavAreas.Count(), seed );
+	Msg( "  NavAreaBuildPath:            %8.2f ms (%.1f queries/ms)\n", legacyTime * 1000.0, queryCount / MAX( legacyTime * 1000.0, 0.001 ) );
+	Msg( "  CNavSearchContext:           %8.2f ms (%.1f queries/ms)\n", contextTime * 1000.0, queryCount / MAX( contextTime * 1000.0, 0.001 ) );
+	Msg( "  NavAreaBuildPaths (parallel):%8.2f ms (%.1f queries/ms)\n", parallelTime * 1000.0, queryCount / MAX( parallelTime * 1000.0, 0.001 ) );
+	Msg( "  %d results disagree with NavAreaBuildPath\n", mismatchCount );
+}
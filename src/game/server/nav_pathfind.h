@@ -14,7 +14,9 @@
 
 #include "tier0/vprof.h"
 #include "mathlib/ssemath.h"
+#include "vstdlib/jobthread.h"
 #include "nav_area.h"
+#include "nav_hierarchy.h"
 
 
 
@@ -33,9 +35,10 @@ enum RouteType
 
 //--------------------------------------------------------------------------------------------------------------
 /**
- * Functor used with NavAreaBuildPath()
+ * Functor used with NavAreaBuildPath(), or with CNavSearchContext searches if IsSearchContext is true
  */
-class ShortestPathCost
+template < bool IsSearchContext >
+class ShortestPathCostT
 {
 public:
 	float operator() ( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, const CFuncElevator *elevator, float length )
@@ -63,7 +66,7 @@ public:
 				dist = ( area->GetCenter() - fromArea->GetCenter() ).Length();
 			}
 
-			float cost = dist + fromArea->GetCostSoFar();
+			float cost = dist + ( IsSearchContext ? fromArea->GetSearchCostSoFar() : fromArea->GetCostSoFar() );
 
 			// if this is a "crouch" area, add penalty
 			if ( area->GetAttributes() & NAV_MESH_CROUCH )
@@ -84,6 +87,9 @@ public:
 	}
 };
 
+typedef ShortestPathCostT< false > ShortestPathCost;
+typedef ShortestPathCostT< true > ShortestPathSearchCost;
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Find path from startArea to goalArea via an A* search, using supplied cost heuristic.
@@ -97,11 +103,38 @@ public:
  * Returns true if a path exists.
  */
 #define IGNORE_NAV_BLOCKERS true
+template< typename CostFunctor >
+bool NavAreaSearch( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea, float maxPathLength, int teamID, bool ignoreNavBlockers, bool isCorridorSearch );
+
 template< typename CostFunctor >
 bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false )
 {
 	VPROF_BUDGET( "NavAreaBuildPath", "NextBotSpiky" );
 
+	// with nav_hpa, long searches first find a coarse route through the hierarchical nav graph, and only search areas near it.
+	// The coarse route only knows about distance, not the cost functor (route preferences, func_nav_cost, jump limits),
+	// so the result can be worse than a full search - it is a trade of path quality for search time, off by default.
+	if ( nav_hpa.GetBool() && TheNavHierarchy.BuildCorridor( startArea, goalArea ) )
+	{
+		if ( NavAreaSearch( startArea, goalArea, goalPos, costFunc, closestArea, maxPathLength, teamID, ignoreNavBlockers, true ) )
+			return true;
+
+		// the cost functor ruled out the corridor - search the whole mesh
+	}
+
+	return NavAreaSearch( startArea, goalArea, goalPos, costFunc, closestArea, maxPathLength, teamID, ignoreNavBlockers, false );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * The A* search behind NavAreaBuildPath(). If 'isCorridorSearch' is true, only areas
+ * in the corridor most recently built by TheNavHierarchy are considered.
+ */
+template< typename CostFunctor >
+bool NavAreaSearch( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea, float maxPathLength, int teamID, bool ignoreNavBlockers, bool isCorridorSearch )
+{
+
 	if ( closestArea )
 	{
 		*closestArea = startArea;
@@ -332,6 +365,10 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 			if ( newArea->IsBlocked( teamID, ignoreNavBlockers ) )
 				continue;
 
+			// stay near the coarse route
+			if ( isCorridorSearch && !TheNavHierarchy.IsInCorridor( newArea ) )
+				continue;
+
 			float newCostSoFar = costFunc( newArea, area, ladder, elevator, length );
 
 			// NaNs really mess this function up causing tough to track down hangs. If
@@ -415,6 +452,330 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * One step of a route found by a path search: the area, and how it is entered from the previous step
+ */
+struct NavRouteStep
+{
+	CNavArea *area;
+	NavTraverseType how;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Per-query A* search state.
+ * NavAreaBuildPath() keeps its open and closed lists and costs in the CNavAreas themselves, so only
+ * one search can be in progress at a time. A CNavSearchContext keeps that state in its own table indexed
+ * by area ID, with a binary heap for the open list, so searches using different contexts can run concurrently.
+ * While a context is searching, CNavArea::GetSearchCostSoFar() on the searching thread returns that context's
+ * costs. Cost functors must read the cost so far of 'fromArea' with it instead of GetCostSoFar(), as
+ * ShortestPathSearchCost does, and must otherwise be thread safe.
+ */
+class CNavSearchContext
+{
+public:
+	CNavSearchContext( void );
+
+	/**
+	 * Identical to NavAreaBuildPath(), except the resulting parent links are read
+	 * from the context with GetParent()/BuildRoute() instead of from the areas.
+	 */
+	template< typename CostFunctor >
+	bool BuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false );
+
+	// results of the last search
+	CNavArea *GetParent( const CNavArea *area ) const;
+	NavTraverseType GetParentHow( const CNavArea *area ) const;
+	float GetCostSoFar( const CNavArea *area ) const;
+	void BuildRoute( CNavArea *startArea, CNavArea *endArea, CUtlVector< NavRouteStep > *route ) const;	// follow parent links back from endArea, and return the route in start to end order
+
+	static CNavSearchContext *Acquire( void );			// get an unused context from the shared pool
+	static void Release( CNavSearchContext *context );	// return a context to the shared pool
+
+private:
+	struct AreaState
+	{
+		unsigned int marker;			// the rest of this state is only valid if this equals m_marker
+		int openIndex;					// position in m_openList, or -1 if not on the open list
+		bool isClosed;
+		NavTraverseType parentHow;
+		CNavArea *parent;
+		float costSoFar;
+		float totalCost;
+		float pathLengthSoFar;
+	};
+
+	struct OpenEntry
+	{
+		float totalCost;
+		CNavArea *area;
+	};
+
+	struct Neighbor
+	{
+		CNavArea *area;
+		NavTraverseType how;
+		const CNavLadder *ladder;
+		const CFuncElevator *elevator;
+		float length;
+	};
+
+	// makes the calling thread's CNavArea::GetSearchCostSoFar() come from this context
+	class CActivateScope
+	{
+	public:
+		CActivateScope( CNavSearchContext *context );
+		~CActivateScope();
+
+	private:
+		CNavSearchContext *m_prevContext;
+	};
+
+	void ClearSearchLists( void );
+	AreaState &GetState( const CNavArea *area );				// return state of area for this search, resetting it if this search hasn't touched it yet
+	const AreaState *FindState( const CNavArea *area ) const;	// return state of area, or NULL if this search hasn't touched it
+
+	void AddToOpenList( CNavArea *area, AreaState *state );
+	void UpdateOnOpenList( AreaState *state );					// total cost of area has decreased
+	CNavArea *PopOpenList( void );
+	void SiftUp( int index );
+	void SiftDown( int index );
+
+	void CollectNeighbors( CNavArea *area );					// in the same order NavAreaBuildPath() visits them
+
+	CUtlVector< AreaState > m_state;			// indexed by area ID
+	CUtlVector< OpenEntry > m_openList;			// binary min-heap on total cost
+	CUtlVector< Neighbor > m_neighbors;
+	unsigned int m_marker;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+template< typename CostFunctor >
+bool CNavSearchContext::BuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea, float maxPathLength, int teamID, bool ignoreNavBlockers )
+{
+	VPROF_BUDGET( "CNavSearchContext::BuildPath", "NextBotSpiky" );
+
+	if ( closestArea )
+	{
+		*closestArea = startArea;
+	}
+
+	if (startArea == NULL)
+		return false;
+
+	ClearSearchLists();
+
+	CActivateScope activate( this );
+
+	AreaState &startState = GetState( startArea );
+	startState.parent = NULL;
+
+	if (goalArea != NULL && goalArea->IsBlocked( teamID, ignoreNavBlockers ))
+		goalArea = NULL;
+
+	if (goalArea == NULL && goalPos == NULL)
+		return false;
+
+	// if we are already in the goal area, build trivial path
+	if (startArea == goalArea)
+	{
+		return true;
+	}
+
+	// determine actual goal position
+	Vector actualGoalPos = (goalPos) ? *goalPos : goalArea->GetCenter();
+
+	// compute estimate of path length
+	startState.totalCost = (startArea->GetCenter() - actualGoalPos).Length();
+
+	float initCost = costFunc( startArea, NULL, NULL, NULL, -1.0f );	
+	if (initCost < 0.0f)
+		return false;
+	startState.costSoFar = initCost;
+	startState.pathLengthSoFar = 0.0f;
+
+	AddToOpenList( startArea, &startState );
+
+	// keep track of the area we visit that is closest to the goal
+	float closestAreaDist = startState.totalCost;
+
+	bool bHaveMaxPathLength = ( maxPathLength > 0.0f );
+
+	// do A* search
+	while( m_openList.Count() )
+	{
+		// get next area to check
+		CNavArea *area = PopOpenList();
+
+		// don't consider blocked areas
+		if ( area->IsBlocked( teamID, ignoreNavBlockers ) )
+			continue;
+
+		// check if we have found the goal area or position
+		if (area == goalArea || (goalArea == NULL && goalPos && area->Contains( *goalPos )))
+		{
+			if (closestArea)
+			{
+				*closestArea = area;
+			}
+
+			return true;
+		}
+
+		AreaState &areaState = GetState( area );
+
+		CollectNeighbors( area );
+
+		for( int i=0; i<m_neighbors.Count(); ++i )
+		{
+			const Neighbor &neighbor = m_neighbors[i];
+			CNavArea *newArea = neighbor.area;
+
+			// don't backtrack
+			if ( newArea == areaState.parent )
+				continue;
+			if ( newArea == area ) // self neighbor?
+				continue;
+
+			// don't consider blocked areas
+			if ( newArea->IsBlocked( teamID, ignoreNavBlockers ) )
+				continue;
+
+			float newCostSoFar = costFunc( newArea, area, neighbor.ladder, neighbor.elevator, neighbor.length );
+
+			// same NaN and bogus functor protection as NavAreaBuildPath()
+			if ( IS_NAN( newCostSoFar ) )
+				newCostSoFar = 1e30f;
+
+			// check if cost functor says this area is a dead-end
+			if ( newCostSoFar < 0.0f )
+				continue;
+
+			float minNewCostSoFar = areaState.costSoFar * 1.00001f + 0.00001f;
+			newCostSoFar = Max( newCostSoFar, minNewCostSoFar );
+
+			AreaState &newState = GetState( newArea );
+
+			// stop if path length limit reached
+			if ( bHaveMaxPathLength )
+			{
+				// keep track of path length so far
+				float deltaLength = ( newArea->GetCenter() - area->GetCenter() ).Length();
+				float newLengthSoFar = areaState.pathLengthSoFar + deltaLength;
+				if ( newLengthSoFar > maxPathLength )
+					continue;
+
+				newState.pathLengthSoFar = newLengthSoFar;
+			}
+
+			if ( ( newState.openIndex >= 0 || newState.isClosed ) && newState.costSoFar <= newCostSoFar )
+			{
+				// this is a worse path - skip it
+				continue;
+			}
+
+			// compute estimate of distance left to go
+			float distSq = ( newArea->GetCenter() - actualGoalPos ).LengthSqr();
+			float newCostRemaining = ( distSq > 0.0 ) ? FastSqrt( distSq ) : 0.0 ;
+
+			// track closest area to goal in case path fails
+			if ( closestArea && newCostRemaining < closestAreaDist )
+			{
+				*closestArea = newArea;
+				closestAreaDist = newCostRemaining;
+			}
+
+			newState.costSoFar = newCostSoFar;
+			newState.totalCost = newCostSoFar + newCostRemaining;
+			newState.isClosed = false;
+
+			if ( newState.openIndex >= 0 )
+			{
+				// area already on open list, update the heap to keep costs sorted
+				UpdateOnOpenList( &newState );
+			}
+			else
+			{
+				AddToOpenList( newArea, &newState );
+			}
+
+			newState.parent = area;
+			newState.parentHow = neighbor.how;
+		}
+
+		// we have searched this area
+		areaState.isClosed = true;
+	}
+
+	return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A path query for NavAreaBuildPaths(). Fill in the inputs, the outputs are set by the search.
+ */
+struct NavPathQuery
+{
+	CNavArea *startArea;
+	CNavArea *goalArea;
+	Vector goalPos;
+	bool hasGoalPos;					// if false, goalPos is ignored and the center of goalArea is used
+	float maxPathLength;
+	int teamID;
+
+	bool isPathFound;					// true if a path to the goal exists
+	CUtlVector< NavRouteStep > route;	// route to the goal, or to the area closest to it if no path was found
+};
+
+
+template< typename CostFunctor >
+class CNavPathQueryProcessor
+{
+public:
+	CNavPathQueryProcessor( CostFunctor &costFunc ) : m_costFunc( costFunc )
+	{
+	}
+
+	void Process( NavPathQuery &query )
+	{
+		CNavSearchContext *context = CNavSearchContext::Acquire();
+
+		CNavArea *closestArea = NULL;
+		query.isPathFound = context->BuildPath( query.startArea, query.goalArea, query.hasGoalPos ? &query.goalPos : NULL, m_costFunc, &closestArea, query.maxPathLength, query.teamID );
+		context->BuildRoute( query.startArea, closestArea, &query.route );
+
+		CNavSearchContext::Release( context );
+	}
+
+private:
+	CostFunctor &m_costFunc;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Run several path queries at once on the job pool, each with its own search context.
+ * The cost functor is shared by all queries, must be safe to call from any thread, and must read
+ * costs with CNavArea::GetSearchCostSoFar().
+ * The nav mesh must not change until this returns.
+ */
+template< typename CostFunctor >
+void NavAreaBuildPaths( NavPathQuery *queries, int count, CostFunctor &costFunc )
+{
+	VPROF_BUDGET( "NavAreaBuildPaths", "NextBotSpiky" );
+
+	if ( count <= 0 )
+		return;
+
+	CNavPathQueryProcessor< CostFunctor > processor( costFunc );
+	ParallelProcess( "NavAreaBuildPaths", queries, count, &processor, &CNavPathQueryProcessor< CostFunctor >::Process );
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Compute distance between two areas. Return -1 if can't reach 'endArea' from 'startArea'.
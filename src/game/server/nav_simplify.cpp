@@ -127,12 +127,16 @@ void CNavMesh::GenerateNodes( const Extent &bounds )
 {
 	m_simplifyGenerationExtent = bounds;
 	m_seedIdx = 0;
+	m_crouchCheckNodes.RemoveAll();
+	m_sampleStepCache.RemoveAll();
 
 	Assert( m_generationMode == GENERATE_SIMPLIFY );
 	while ( SampleStep() )
 	{
 		// do nothing
 	}
+
+	FinishSampling();
 }
 
 
@@ -0,0 +1,366 @@
+// nav_vis_cache.cpp
+// On-disk cache of area-to-area visibility, so nav_analyze only recomputes visibility for areas that changed
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#include "cbase.h"
+#include "filesystem.h"
+#include "checksum_crc.h"
+
+#include "nav_mesh.h"
+#include "nav_vis_cache.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+ConVar nav_vis_cache( "nav_vis_cache", "1", FCVAR_CHEAT, "If nonzero, nav mesh visibility is saved alongside the .nav file, and only recomputed for areas that have changed since" );
+
+extern ConVar nav_max_view_distance;
+extern ConVar nav_potentially_visible_dot_tolerance;
+
+CNavVisibilityCache TheNavVisibilityCache;
+
+#define NAV_VIS_CACHE_MAGIC_NUMBER	0x5349564E		// 'NVIS'
+#define NAV_VIS_CACHE_VERSION		1
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavVisibilityCache::CNavVisibilityCache( void ) : m_record( DefLessFunc( unsigned int ) )
+{
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavVisibilityCache::Reset( void )
+{
+	m_record.RemoveAll();
+	m_entry.Purge();
+	m_isRestored.Purge();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Visibility to and from an area depends only on its corners
+ */
+unsigned int CNavVisibilityCache::ComputeAreaHash( const CNavArea *area )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	for( int c=0; c<NUM_CORNERS; ++c )
+	{
+		Vector corner = area->GetCorner( (NavCornerType)c );
+		CRC32_ProcessBuffer( &crc, &corner, sizeof( Vector ) );
+	}
+
+	CRC32_Final( &crc );
+
+	return crc;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * The cache indexes the areas by ID. Returns false if the IDs are too sparse for that, like PostLoad does.
+ */
+bool CNavVisibilityCache::ComputeAreaIDCount( unsigned int *areaIDCount )
+{
+	const unsigned int maxTableSize = 4 * (unsigned int)TheNavAreas.Count() + 1024;
+	unsigned int maxAreaID = 0;
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		maxAreaID = MAX( maxAreaID, TheNavAreas[ it ]->GetID() );
+	}
+
+	// compare the largest ID itself, since ID+1 wraps to zero for an ID of 0xFFFFFFFF
+	if ( maxAreaID >= maxTableSize )
+	{
+		Warning( "Nav area IDs are too sparse for the nav visibility cache - use nav_compress_id\n" );
+		return false;
+	}
+
+	*areaIDCount = maxAreaID + 1;
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Checksum of the current map's BSP, so saved visibility is discarded when the world changes
+ */
+unsigned int CNavVisibilityCache::ComputeBspChecksum( void ) const
+{
+	char bspFilename[ 256 ];
+	Q_snprintf( bspFilename, sizeof( bspFilename ), "maps\\%s.bsp", STRING( gpGlobals->mapname ) );
+
+	FileHandle_t file = filesystem->Open( bspFilename, "rb", "GAME" );
+	if ( !file )
+		return 0;
+
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	CUtlVector< byte > buffer;
+	buffer.SetCount( 64 * 1024 );
+
+	int bytesRead;
+	while( ( bytesRead = filesystem->Read( buffer.Base(), buffer.Count(), file ) ) > 0 )
+	{
+		CRC32_ProcessBuffer( &crc, buffer.Base(), bytesRead );
+	}
+
+	filesystem->Close( file );
+
+	CRC32_Final( &crc );
+
+	return crc;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+const char *CNavVisibilityCache::GetFilename( void ) const
+{
+	// persistant return value
+	static char filename[256];
+	Q_snprintf( filename, sizeof( filename ), "maps\\%s.navvis", STRING( gpGlobals->mapname ) );
+
+	return filename;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the saved visibility lists, if they were computed against the current BSP with the current settings
+ */
+bool CNavVisibilityCache::Load( unsigned int bspChecksum )
+{
+	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
+	if ( !filesystem->ReadFile( GetFilename(), "MOD", fileBuffer ) )
+		return false;
+
+	if ( fileBuffer.GetUnsignedInt() != NAV_VIS_CACHE_MAGIC_NUMBER )
+		return false;
+
+	if ( fileBuffer.GetUnsignedInt() != NAV_VIS_CACHE_VERSION )
+		return false;
+
+	if ( fileBuffer.GetUnsignedInt() != bspChecksum )
+	{
+		DevMsg( "Nav visibility cache %s is out of date\n", GetFilename() );
+		return false;
+	}
+
+	if ( fileBuffer.GetFloat() != nav_max_view_distance.GetFloat() )
+		return false;
+
+	if ( fileBuffer.GetFloat() != nav_potentially_visible_dot_tolerance.GetFloat() )
+		return false;
+
+	int areaCount = fileBuffer.GetInt();
+	if ( !fileBuffer.IsValid() || areaCount < 0 || areaCount > fileBuffer.GetBytesRemaining() / (int)sizeof( int ) )
+		return false;
+
+	for( int i=0; i<areaCount; ++i )
+	{
+		unsigned int hash = fileBuffer.GetUnsignedInt();
+
+		AreaRecord record;
+		record.firstEntry = m_entry.Count();
+		record.entryCount = fileBuffer.GetInt();
+		if ( !fileBuffer.IsValid() || record.entryCount < 0 || record.entryCount > fileBuffer.GetBytesRemaining() / (int)sizeof( int ) )
+		{
+			Reset();
+			return false;
+		}
+
+		m_entry.AddMultipleToTail( record.entryCount );
+		for( int e=0; e<record.entryCount; ++e )
+		{
+			m_entry[ record.firstEntry + e ].areaHash = fileBuffer.GetUnsignedInt();
+			m_entry[ record.firstEntry + e ].attributes = fileBuffer.GetUnsignedChar();
+		}
+
+		int it = m_record.Find( hash );
+		if ( it == m_record.InvalidIndex() )
+		{
+			m_record.Insert( hash, record );
+		}
+		else
+		{
+			// two saved areas had the same corners - we can't tell which is which
+			m_record[ it ].entryCount = -1;
+		}
+	}
+
+	if ( !fileBuffer.IsValid() )
+	{
+		Reset();
+		return false;
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Give each area whose corners match a saved area that area's visibility list.
+ * Only entries for areas that are also restored are kept - entries between a restored area and a new
+ * or changed one are added when the new or changed area's visibility is computed.
+ */
+void CNavVisibilityCache::Restore( void )
+{
+	Reset();
+
+	if ( !nav_vis_cache.GetBool() )
+		return;
+
+	if ( !Load( ComputeBspChecksum() ) )
+		return;
+
+	unsigned int areaIDCount;
+	if ( !ComputeAreaIDCount( &areaIDCount ) )
+	{
+		m_record.RemoveAll();
+		m_entry.Purge();
+		return;
+	}
+
+	// find the area with each hash - areas with the same corners as another can't be restored
+	CUtlMap< unsigned int, CNavArea * > areaByHash( DefLessFunc( unsigned int ) );
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *area = TheNavAreas[ it ];
+
+		unsigned int hash = ComputeAreaHash( area );
+		int i = areaByHash.Find( hash );
+		if ( i == areaByHash.InvalidIndex() )
+		{
+			areaByHash.Insert( hash, area );
+		}
+		else
+		{
+			areaByHash[ i ] = NULL;
+		}
+	}
+
+	m_isRestored.SetCount( areaIDCount );
+	for( int i=0; i<m_isRestored.Count(); ++i )
+	{
+		m_isRestored[i] = false;
+	}
+
+	FOR_EACH_MAP_FAST( areaByHash, it )
+	{
+		CNavArea *area = areaByHash[ it ];
+		if ( area == NULL )
+			continue;
+
+		int r = m_record.Find( areaByHash.Key( it ) );
+		if ( r != m_record.InvalidIndex() && m_record[ r ].entryCount >= 0 )
+		{
+			m_isRestored[ area->GetID() ] = true;
+		}
+	}
+
+	int restoredCount = 0;
+
+	FOR_EACH_MAP_FAST( areaByHash, it )
+	{
+		CNavArea *area = areaByHash[ it ];
+		if ( area == NULL || !m_isRestored[ area->GetID() ] )
+			continue;
+
+		const AreaRecord &record = m_record[ m_record.Find( areaByHash.Key( it ) ) ];
+
+		area->m_inheritVisibilityFrom.area = NULL;
+		area->m_isInheritedFrom = false;
+		area->m_potentiallyVisibleAreas.EnsureCapacity( record.entryCount );
+
+		for( int e=0; e<record.entryCount; ++e )
+		{
+			const Entry &entry = m_entry[ record.firstEntry + e ];
+
+			int other = areaByHash.Find( entry.areaHash );
+			if ( other == areaByHash.InvalidIndex() || areaByHash[ other ] == NULL || !m_isRestored[ areaByHash[ other ]->GetID() ] )
+				continue;
+
+			CNavArea::AreaBindInfo info;
+			info.area = areaByHash[ other ];
+			info.attributes = entry.attributes;
+			area->m_potentiallyVisibleAreas.AddToTail( info );
+		}
+
+		++restoredCount;
+	}
+
+	// only the restored flags are needed from here on
+	m_record.RemoveAll();
+	m_entry.Purge();
+
+	Msg( "Restored visibility for %d of %d areas from %s\n", restoredCount, TheNavAreas.Count(), GetFilename() );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavVisibilityCache::IsRestored( const CNavArea *area ) const
+{
+	return area->GetID() < (unsigned int)m_isRestored.Count() && m_isRestored[ area->GetID() ];
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Save the full visibility list of every area
+ */
+bool CNavVisibilityCache::Save( void )
+{
+	if ( !nav_vis_cache.GetBool() )
+		return false;
+
+	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
+
+	fileBuffer.PutUnsignedInt( NAV_VIS_CACHE_MAGIC_NUMBER );
+	fileBuffer.PutUnsignedInt( NAV_VIS_CACHE_VERSION );
+	fileBuffer.PutUnsignedInt( ComputeBspChecksum() );
+	fileBuffer.PutFloat( nav_max_view_distance.GetFloat() );
+	fileBuffer.PutFloat( nav_potentially_visible_dot_tolerance.GetFloat() );
+
+	unsigned int areaIDCount;
+	if ( !ComputeAreaIDCount( &areaIDCount ) )
+		return false;
+
+	CUtlVector< unsigned int > areaHash;
+	areaHash.SetCount( areaIDCount );
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		areaHash[ TheNavAreas[ it ]->GetID() ] = ComputeAreaHash( TheNavAreas[ it ] );
+	}
+
+	fileBuffer.PutInt( TheNavAreas.Count() );
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const CNavArea *area = TheNavAreas[ it ];
+		const CNavArea::CAreaBindInfoArray &visible = area->m_potentiallyVisibleAreas;
+
+		fileBuffer.PutUnsignedInt( areaHash[ area->GetID() ] );
+		fileBuffer.PutInt( visible.Count() );
+
+		for( int i=0; i<visible.Count(); ++i )
+		{
+			fileBuffer.PutUnsignedInt( areaHash[ visible[i].area->GetID() ] );
+			fileBuffer.PutUnsignedChar( visible[i].attributes );
+		}
+	}
+
+	const char *filename = GetFilename();
+	if ( !filesystem->WriteFile( filename, "MOD", fileBuffer ) )
+	{
+		Warning( "Unable to save nav visibility cache to %s\n", filename );
+		return false;
+	}
+
+	return true;
+}
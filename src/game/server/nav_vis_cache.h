@@ -0,0 +1,61 @@
+// nav_vis_cache.h
+// On-disk cache of area-to-area visibility, so nav_analyze only recomputes visibility for areas that changed
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#ifndef _NAV_VIS_CACHE_H_
+#define _NAV_VIS_CACHE_H_
+
+#include "nav.h"
+#include "utlvector.h"
+#include "utlmap.h"
+
+class CNavArea;
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Visibility between two areas only depends on the world and the geometry of the two areas.
+ * When visibility computations end, each area's full visibility list is saved to a sidecar file,
+ * keyed by a hash of the area's corners, along with a checksum of the BSP.
+ * When they next begin, each area whose geometry hashes the same as a saved area gets that area's
+ * list back, less any entries for areas that no longer exist. Only areas that are new or changed
+ * are then computed, which also fills in the entries for them in the restored lists.
+ */
+class CNavVisibilityCache
+{
+public:
+	CNavVisibilityCache( void );
+
+	void Restore( void );							// restore the visibility lists of unchanged areas - call after the lists are reset
+	bool IsRestored( const CNavArea *area ) const;	// true if the area's visibility list was restored, and does not need to be computed
+	bool Save( void );								// save the visibility lists - call before they are compressed into deltas
+	void Reset( void );
+
+private:
+	struct Entry
+	{
+		unsigned int areaHash;
+		unsigned char attributes;
+	};
+
+	struct AreaRecord
+	{
+		int firstEntry;								// entries of this area are m_entry[ firstEntry ] .. m_entry[ firstEntry + entryCount - 1 ]
+		int entryCount;
+	};
+
+	static unsigned int ComputeAreaHash( const CNavArea *area );
+	static bool ComputeAreaIDCount( unsigned int *areaIDCount );
+	unsigned int ComputeBspChecksum( void ) const;
+	const char *GetFilename( void ) const;
+	bool Load( unsigned int bspChecksum );
+
+	CUtlMap< unsigned int, AreaRecord > m_record;	// saved areas, keyed by geometry hash
+	CUtlVector< Entry > m_entry;
+	CUtlVector< bool > m_isRestored;				// indexed by area ID
+};
+
+extern CNavVisibilityCache TheNavVisibilityCache;
+
+
+#endif // _NAV_VIS_CACHE_H_
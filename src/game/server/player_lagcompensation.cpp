@@ -10,8 +10,8 @@
 #include "igamesystem.h"
 #include "ilagcompensationmanager.h"
 #include "inetchannelinfo.h"
-#include "utllinkedlist.h"
 #include "BaseAnimatingOverlay.h"
+#include "mathlib/ssemath.h"
 #include "tier0/vprof.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -37,6 +37,10 @@ ConVar sv_showlagcompensation( "sv_showlagcompensation", "0", FCVAR_CHEAT, "Show
 
 ConVar sv_unlag_fixstuck( "sv_unlag_fixstuck", "0", FCVAR_DEVELOPMENTONLY, "Disallow backtracking a player for lag compensation if it will cause them to become stuck" );
 
+ConVar sv_unlag_batch( "sv_unlag_batch", "0", FCVAR_DEVELOPMENTONLY, "Only backtrack players whose recent bounds intersect the shooter's aim cone" );
+ConVar sv_unlag_batch_cone( "sv_unlag_batch_cone", "15", FCVAR_DEVELOPMENTONLY, "Half angle in degrees of the aim cone used by sv_unlag_batch", true, 0.0f, true, 89.0f );
+ConVar sv_unlag_batch_bloat( "sv_unlag_batch_bloat", "24", FCVAR_DEVELOPMENTONLY, "Extra radius added to each player's bounds by sv_unlag_batch, covers hitboxes outside the collision box and the shooter moving this command", true, 0.0f, false, 0.0f );
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
@@ -126,6 +130,173 @@ public:
 	float					m_flPoseParameters[MAXSTUDIOPOSEPARAM];
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: Fixed size history of lag records for one player.
+//
+// Records live in a ring buffer in structure-of-arrays form, so the per-tick
+// store doesn't allocate and backtracking can binary search the simulation
+// times instead of walking a list. Origins and bounds are kept 16 byte aligned
+// so they can be interpolated with SIMD ops.
+//-----------------------------------------------------------------------------
+#define LAG_RECORD_HISTORY_SIZE		128		// must be a power of two, covers sv_maxunlag at up to 128 tick
+#define LAG_RECORD_HISTORY_MASK		( LAG_RECORD_HISTORY_SIZE - 1 )
+
+struct LagRecordHistory_t
+{
+	VectorAligned			m_vecOrigin[LAG_RECORD_HISTORY_SIZE];
+	VectorAligned			m_vecMinsPreScaled[LAG_RECORD_HISTORY_SIZE];
+	VectorAligned			m_vecMaxsPreScaled[LAG_RECORD_HISTORY_SIZE];
+	QAngle					m_vecAngles[LAG_RECORD_HISTORY_SIZE];
+	float					m_flSimulationTime[LAG_RECORD_HISTORY_SIZE];
+	int						m_fFlags[LAG_RECORD_HISTORY_SIZE];
+
+	int						m_masterSequence[LAG_RECORD_HISTORY_SIZE];
+	float					m_masterCycle[LAG_RECORD_HISTORY_SIZE];
+	LayerRecord				m_layerRecords[LAG_RECORD_HISTORY_SIZE][MAX_LAYER_RECORDS];
+	float					m_flPoseParameters[LAG_RECORD_HISTORY_SIZE][MAXSTUDIOPOSEPARAM];
+};
+
+class CLagRecordTrack
+{
+public:
+	CLagRecordTrack() : m_pHistory( NULL )
+	{
+		RemoveAll();
+	}
+
+	~CLagRecordTrack()
+	{
+		Purge();
+	}
+
+	void Purge()
+	{
+		if ( m_pHistory )
+		{
+			MemAlloc_FreeAligned( m_pHistory );
+			m_pHistory = NULL;
+		}
+		RemoveAll();
+	}
+
+	void RemoveAll()
+	{
+		m_nHead = -1;
+		m_nCount = 0;
+		m_nFirstValid = 0;
+	}
+
+	int Count() const { return m_nCount; }
+
+	// Records are addressed by a running sequence number, newest at Head()
+	int Head() const { return m_nHead; }
+	int Tail() const { return m_nHead - m_nCount + 1; }
+	int Slot( int nRecord ) const { return nRecord & LAG_RECORD_HISTORY_MASK; }
+
+	LagRecordHistory_t *History() { return m_pHistory; }
+	const LagRecordHistory_t *History() const { return m_pHistory; }
+
+	float SimulationTime( int nRecord ) const { return m_pHistory->m_flSimulationTime[ Slot( nRecord ) ]; }
+
+	// Drops records from the tail that are older than flDeadTime
+	void RemoveOlderThan( float flDeadTime )
+	{
+		while ( m_nCount > 0 && SimulationTime( Tail() ) < flDeadTime )
+		{
+			--m_nCount;
+		}
+	}
+
+	// Adds a new record at the head, overwriting the oldest one if the ring is full.
+	// bBreaksHistory means backtracking must never reach past this record into older ones.
+	int AddToHead( bool bBreaksHistory )
+	{
+		if ( !m_pHistory )
+		{
+			m_pHistory = (LagRecordHistory_t *)MemAlloc_AllocAligned( sizeof( LagRecordHistory_t ), sizeof( fltx4 ) );
+			Q_memset( m_pHistory, 0, sizeof( LagRecordHistory_t ) );
+		}
+
+		++m_nHead;
+		if ( m_nCount < LAG_RECORD_HISTORY_SIZE )
+		{
+			++m_nCount;
+		}
+
+		if ( bBreaksHistory )
+		{
+			m_nFirstValid = m_nHead;
+		}
+
+		return Slot( m_nHead );
+	}
+
+	// Marks every record up to and including the head as unusable for backtracking
+	void InvalidateHistory()
+	{
+		m_nFirstValid = m_nHead + 1;
+	}
+
+	//-----------------------------------------------------------------------------
+	// Finds the newest record at or before flTargetTime, plus the next newer record
+	// to interpolate towards (-1 if none). Returns the ring slots of both, or false
+	// if a death or teleport lies between the head and the target time.
+	//-----------------------------------------------------------------------------
+	bool FindRecord( float flTargetTime, int &iRecord, int &iPrevRecord ) const
+	{
+		int nOldest = MAX( Tail(), m_nFirstValid );
+		if ( m_nCount <= 0 || nOldest > m_nHead )
+			return false;
+
+		int nFound = nOldest - 1;
+		int lo = nOldest;
+		int hi = m_nHead;
+		while ( lo <= hi )
+		{
+			int mid = lo + ( ( hi - lo ) >> 1 );
+			if ( SimulationTime( mid ) <= flTargetTime )
+			{
+				nFound = mid;
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid - 1;
+			}
+		}
+
+		if ( nFound < nOldest )
+		{
+			// Every usable record is newer than the target time. If we ran out of
+			// history we use the oldest record, but we can't step across a break.
+			if ( nOldest != Tail() )
+				return false;
+
+			nFound = nOldest;
+		}
+
+		iRecord = Slot( nFound );
+		iPrevRecord = ( nFound < m_nHead ) ? Slot( nFound + 1 ) : -1;
+		return true;
+	}
+
+private:
+	LagRecordHistory_t		*m_pHistory;	// allocated the first time a record is added
+	int						m_nHead;
+	int						m_nCount;
+	int						m_nFirstValid;	// oldest record backtracking may reach
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: a + ( b - a ) * frac on an aligned vector
+//-----------------------------------------------------------------------------
+static FORCEINLINE void LerpAlignedVector( const fltx4 &fl4Frac, const VectorAligned &a, const VectorAligned &b, Vector &out )
+{
+	fltx4 fl4A = LoadAlignedSIMD( a );
+	fltx4 fl4Result = MaddSIMD( SubSIMD( LoadAlignedSIMD( b ), fl4A ), fl4Frac, fl4A );
+	StoreUnaligned3SIMD( out.Base(), fl4Result );
+}
+
 
 //
 // Try to take the player from his current origin to vWantedPos.
@@ -212,14 +383,17 @@ public:
 private:
 	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
 
+	bool			GetSweptBounds( CBasePlayer *pPlayer, float flTargetTime, Vector &vecMins, Vector &vecMaxs );
+	int				CullBacktrackCandidates( CBasePlayer *player, const CUserCmd *cmd, CBasePlayer **ppCandidates, int nCandidates, float flTargetTime );
+
 	void ClearHistory()
 	{
 		for ( int i=0; i<MAX_PLAYERS; i++ )
 			m_PlayerTrack[i].Purge();
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	// keep a ring of lag records for each player
+	CLagRecordTrack			m_PlayerTrack[ MAX_PLAYERS ];
 
 	// Scratchpad for determining what needs to be restored
 	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
@@ -262,7 +436,7 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagRecordTrack *track = &m_PlayerTrack[i-1];
 
 		if ( !pPlayer )
 		{
@@ -274,66 +448,66 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
-
 		// remove tail records that are too old
-		intp tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
-		{
-			LagRecord &tail = track->Element( tailIndex );
-
-			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
-				break;
-			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
-		}
+		track->RemoveOlderThan( flDeadtime );
 
 		// check if head has same simulation time
 		if ( track->Count() > 0 )
 		{
-			LagRecord &head = track->Element( track->Head() );
-
 			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
+			if ( track->SimulationTime( track->Head() ) >= pPlayer->GetSimulationTime() )
 				continue; // don't add new entry for same or older time
 		}
 
+		// A teleport since the previous record means we can never backtrack past this one
+		bool bTeleported = false;
+		if ( track->Count() > 0 )
+		{
+			Vector delta = pPlayer->GetLocalOrigin() - track->History()->m_vecOrigin[ track->Slot( track->Head() ) ];
+			bTeleported = ( delta.Length2DSqr() > m_flTeleportDistanceSqr );
+		}
+
 		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		int slot = track->AddToHead( bTeleported );
+		LagRecordHistory_t *history = track->History();
 
-		record.m_fFlags = 0;
+		history->m_fFlags[slot] = 0;
 		if ( pPlayer->IsAlive() )
 		{
-			record.m_fFlags |= LC_ALIVE;
+			history->m_fFlags[slot] |= LC_ALIVE;
+		}
+		else
+		{
+			// player must be alive, nothing at or before this record can be used
+			track->InvalidateHistory();
 		}
 
-		record.m_flSimulationTime	= pPlayer->GetSimulationTime();
-		record.m_vecAngles			= pPlayer->GetLocalAngles();
-		record.m_vecOrigin			= pPlayer->GetLocalOrigin();
-		record.m_vecMinsPreScaled	= pPlayer->CollisionProp()->OBBMinsPreScaled();
-		record.m_vecMaxsPreScaled	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
+		history->m_flSimulationTime[slot]	= pPlayer->GetSimulationTime();
+		history->m_vecAngles[slot]			= pPlayer->GetLocalAngles();
+		history->m_vecOrigin[slot]			= pPlayer->GetLocalOrigin();
+		history->m_vecMinsPreScaled[slot]	= pPlayer->CollisionProp()->OBBMinsPreScaled();
+		history->m_vecMaxsPreScaled[slot]	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
 
+		LayerRecord *layerRecords = history->m_layerRecords[slot];
 		int layerCount = pPlayer->GetNumAnimOverlays();
 		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
 		{
 			CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
 			if( currentLayer )
 			{
-				record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-				record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-				record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-				record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
+				layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
+				layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
+				layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
+				layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
 			}
 		}
-		record.m_masterSequence = pPlayer->GetSequence();
-		record.m_masterCycle = pPlayer->GetCycle();
+		history->m_masterSequence[slot] = pPlayer->GetSequence();
+		history->m_masterCycle[slot] = pPlayer->GetCycle();
 
+		float *poseParameters = history->m_flPoseParameters[slot];
 		for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
 		{
-			record.m_flPoseParameters[i] = pPlayer->GetPoseParameter(i);
+			poseParameters[i] = pPlayer->GetPoseParameter(i);
 		}
 	}
 
@@ -411,7 +585,11 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		targettick = gpGlobals->tickcount - TIME_TO_TICKS( correct );
 	}
 	
+	float flTargetTime = TICKS_TO_TIME( targettick );
+
 	// Iterate all active players
+	CBasePlayer *pCandidates[ MAX_PLAYERS ];
+	int nCandidates = 0;
 	const CBitVec<MAX_EDICTS> *pEntityTransmitBits = engine->GetEntityTransmitBitsForClient( player->entindex() - 1 );
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 	{
@@ -432,9 +610,146 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		if ( !player->WantsLagCompensationOnEntity( pPlayer, cmd, pEntityTransmitBits ) )
 			continue;
 
+		pCandidates[ nCandidates++ ] = pPlayer;
+	}
+
+	if ( sv_unlag_batch.GetBool() )
+	{
+		nCandidates = CullBacktrackCandidates( player, cmd, pCandidates, nCandidates, flTargetTime );
+	}
+
+	for ( int i = 0; i < nCandidates; i++ )
+	{
 		// Move other player back in time
-		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
+		BacktrackPlayer( pCandidates[i], flTargetTime );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Gets the bounds covering a player now and at the history records
+//			BacktrackPlayer would move them to. Returns false if they can't be
+//			backtracked at all.
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::GetSweptBounds( CBasePlayer *pPlayer, float flTargetTime, Vector &vecMins, Vector &vecMaxs )
+{
+	CLagRecordTrack *track = &m_PlayerTrack[ pPlayer->entindex() - 1 ];
+	if ( track->Count() <= 0 )
+		return false;
+
+	const LagRecordHistory_t *history = track->History();
+	int head = track->Slot( track->Head() );
+	if ( !(history->m_fFlags[head] & LC_ALIVE) )
+		return false;
+
+	Vector delta = history->m_vecOrigin[head] - pPlayer->GetLocalOrigin();
+	if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
+		return false;
+
+	int record;
+	int prevRecord;
+	if ( !track->FindRecord( flTargetTime, record, prevRecord ) )
+		return false;
+
+	pPlayer->CollisionProp()->WorldSpaceAABB( &vecMins, &vecMaxs );
+
+	// History bounds are stored before model scale and relative to the local origin
+	float flScale = pPlayer->GetModelScale();
+	Vector vecParentOffset = pPlayer->GetAbsOrigin() - pPlayer->GetLocalOrigin();
+
+	int records[2] = { record, prevRecord };
+	for ( int i = 0; i < ARRAYSIZE( records ); i++ )
+	{
+		if ( records[i] < 0 )
+			continue;
+
+		Vector vecOrigin = history->m_vecOrigin[ records[i] ] + vecParentOffset;
+		VectorMin( vecMins, vecOrigin + history->m_vecMinsPreScaled[ records[i] ] * flScale, vecMins );
+		VectorMax( vecMaxs, vecOrigin + history->m_vecMaxsPreScaled[ records[i] ] * flScale, vecMaxs );
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Removes candidates whose swept bounds can't be touched by the shooter's
+//			aim cone. Bounds are reduced to spheres and tested four at a time.
+//			Returns the number of candidates left, kept in their original order.
+//-----------------------------------------------------------------------------
+int CLagCompensationManager::CullBacktrackCandidates( CBasePlayer *player, const CUserCmd *cmd, CBasePlayer **ppCandidates, int nCandidates, float flTargetTime )
+{
+	VPROF_BUDGET( "CullBacktrackCandidates", "CLagCompensationManager" );
+
+	FourVectors centers[ ( MAX_PLAYERS + 3 ) / 4 ];
+	fltx4 radii[ ( MAX_PLAYERS + 3 ) / 4 ];
+
+	float flBloat = sv_unlag_batch_bloat.GetFloat();
+	int nValid = 0;
+	for ( int i = 0; i < nCandidates; i++ )
+	{
+		Vector vecMins, vecMaxs;
+		if ( !GetSweptBounds( ppCandidates[i], flTargetTime, vecMins, vecMaxs ) )
+			continue;	// backtracking would leave them alone anyway
+
+		ppCandidates[nValid] = ppCandidates[i];
+
+		Vector vecCenter = ( vecMins + vecMaxs ) * 0.5f;
+		int nGroup = nValid >> 2;
+		int nLane = nValid & 3;
+		centers[nGroup].X( nLane ) = vecCenter.x;
+		centers[nGroup].Y( nLane ) = vecCenter.y;
+		centers[nGroup].Z( nLane ) = vecCenter.z;
+		SubFloat( radii[nGroup], nLane ) = ( vecMaxs - vecMins ).Length() * 0.5f + flBloat;
+		++nValid;
+	}
+
+	if ( !nValid )
+		return 0;
+
+	// Fill out the last group so the unused lanes hold sane values
+	for ( int i = nValid; i & 3; i++ )
+	{
+		centers[i >> 2].X( i & 3 ) = centers[i >> 2].Y( i & 3 ) = centers[i >> 2].Z( i & 3 ) = 0.0f;
+		SubFloat( radii[i >> 2], i & 3 ) = 0.0f;
+	}
+
+	Vector vecForward;
+	AngleVectors( cmd->viewangles, &vecForward );
+
+	FourVectors eye;
+	eye.DuplicateVector( player->Weapon_ShootPosition() );
+
+	float flSin, flCos;
+	SinCos( DEG2RAD( sv_unlag_batch_cone.GetFloat() ), &flSin, &flCos );
+	fltx4 fl4Sin = ReplicateX4( flSin );
+	fltx4 fl4Cos = ReplicateX4( flCos );
+
+	int nKept = 0;
+	for ( int nGroup = 0; nGroup * 4 < nValid; nGroup++ )
+	{
+		FourVectors delta = centers[nGroup];
+		delta -= eye;
+
+		fltx4 fl4Along = delta * vecForward;
+		fltx4 fl4Perp = SqrtSIMD( MaxSIMD( Four_Zeros, MsubSIMD( fl4Along, fl4Along, delta * delta ) ) );
+
+		// Distance from the sphere center to the cone surface, negative inside the cone.
+		// Spheres entirely behind the shooter are rejected separately.
+		fltx4 fl4ConeDist = SubSIMD( MulSIMD( fl4Perp, fl4Cos ), MulSIMD( fl4Along, fl4Sin ) );
+		fltx4 fl4Hit = AndSIMD( CmpLeSIMD( fl4ConeDist, radii[nGroup] ),
+								CmpLeSIMD( SubSIMD( Four_Zeros, radii[nGroup] ), fl4Along ) );
+
+		int nHitMask = TestSignSIMD( fl4Hit );
+		for ( int nLane = 0; nLane < 4; nLane++ )
+		{
+			int i = nGroup * 4 + nLane;
+			if ( i < nValid && ( nHitMask & ( 1 << nLane ) ) )
+			{
+				ppCandidates[nKept++] = ppCandidates[i];
+			}
+		}
 	}
+
+	return nKept;
 }
 
 void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
@@ -448,93 +763,73 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	int pl_index = pPlayer->entindex() - 1;
 
 	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+	CLagRecordTrack *track = &m_PlayerTrack[ pl_index ];
 
 	// check if we have at leat one entry
 	if ( track->Count() <= 0 )
 		return;
 
-	intp curr = track->Head();
+	const LagRecordHistory_t *history = track->History();
+	int head = track->Slot( track->Head() );
 
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
-
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	if ( !(history->m_fFlags[head] & LC_ALIVE) )
 	{
-		// remember last record
-		prevRecord = record;
-
-		// get next record
-		record = &track->Element( curr );
-
-		if ( !(record->m_fFlags & LC_ALIVE) )
-		{
-			// player most be alive, lost track
-			return;
-		}
-
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
-		{
-			// lost track, too much difference
-			return; 
-		}
-
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
-
-		prevOrg = record->m_vecOrigin;
-
-		// go one step back
-		curr = track->Next( curr );
+		// player most be alive, lost track
+		return;
 	}
 
-	Assert( record );
+	Vector delta = history->m_vecOrigin[head] - pPlayer->GetLocalOrigin();
+	if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
+	{
+		// lost track, too much difference
+		return; 
+	}
 
-	if ( !record )
+	// Deaths and teleports between older records were flagged when they were
+	// stored, so we can go straight to the record for the target time
+	int record;
+	int prevRecord;
+	if ( !track->FindRecord( flTargetTime, record, prevRecord ) )
 	{
 		if ( sv_unlag_debug.GetBool() )
 		{
 			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
 		}
 
-		return; // that should never happen
+		return;
 	}
 
 	float frac = 0.0f;
-	if ( prevRecord && 
-		 (record->m_flSimulationTime < flTargetTime) &&
-		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
+	if ( prevRecord >= 0 && 
+		 (history->m_flSimulationTime[record] < flTargetTime) &&
+		 (history->m_flSimulationTime[record] < history->m_flSimulationTime[prevRecord]) )
 	{
 		// we didn't find the exact time but have a valid previous record
 		// so interpolate between these two records;
 
-		Assert( prevRecord->m_flSimulationTime > record->m_flSimulationTime );
-		Assert( flTargetTime < prevRecord->m_flSimulationTime );
+		Assert( history->m_flSimulationTime[prevRecord] > history->m_flSimulationTime[record] );
+		Assert( flTargetTime < history->m_flSimulationTime[prevRecord] );
 
 		// calc fraction between both records
-		frac = ( flTargetTime - record->m_flSimulationTime ) / 
-			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
+		frac = ( flTargetTime - history->m_flSimulationTime[record] ) / 
+			( history->m_flSimulationTime[prevRecord] - history->m_flSimulationTime[record] );
 
 		Assert( frac > 0 && frac < 1 ); // should never extrapolate
 
-		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
-		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
-		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
-		maxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
+		fltx4 fl4Frac = ReplicateX4( frac );
+		LerpAlignedVector( fl4Frac, history->m_vecOrigin[record], history->m_vecOrigin[prevRecord], org );
+		LerpAlignedVector( fl4Frac, history->m_vecMinsPreScaled[record], history->m_vecMinsPreScaled[prevRecord], minsPreScaled );
+		LerpAlignedVector( fl4Frac, history->m_vecMaxsPreScaled[record], history->m_vecMaxsPreScaled[prevRecord], maxsPreScaled );
+		ang				= Lerp( frac, history->m_vecAngles[record], history->m_vecAngles[prevRecord] );
 	}
 	else
 	{
 		// we found the exact record or no other record to interpolate with
 		// just copy these values since they are the best we have
-		org				= record->m_vecOrigin;
-		ang				= record->m_vecAngles;
-		minsPreScaled	= record->m_vecMinsPreScaled;
-		maxsPreScaled	= record->m_vecMaxsPreScaled;
+		org				= history->m_vecOrigin[record];
+		ang				= history->m_vecAngles[record];
+		minsPreScaled	= history->m_vecMinsPreScaled[record];
+		maxsPreScaled	= history->m_vecMaxsPreScaled[record];
 	}
 
 	// See if this is still a valid position for us to teleport to
@@ -646,7 +941,7 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	restore->m_masterCycle = pPlayer->GetCycle();
 
 	bool interpolationAllowed = false;
-	if( prevRecord && (record->m_masterSequence == prevRecord->m_masterSequence) )
+	if( prevRecord >= 0 && (history->m_masterSequence[record] == history->m_masterSequence[prevRecord]) )
 	{
 		// If the master state changes, all layers will be invalid too, so don't interp (ya know, interp barely ever happens anyway)
 		interpolationAllowed = true;
@@ -658,36 +953,36 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	if( frac > 0.0f && interpolationAllowed )
 	{
 		interpolatedMasters = true;
-		pPlayer->SetSequence( Lerp( frac, record->m_masterSequence, prevRecord->m_masterSequence ) );
-		pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
+		pPlayer->SetSequence( Lerp( frac, history->m_masterSequence[record], history->m_masterSequence[prevRecord] ) );
+		pPlayer->SetCycle( Lerp( frac, history->m_masterCycle[record], history->m_masterCycle[prevRecord] ) );
 
-		if( record->m_masterCycle > prevRecord->m_masterCycle )
+		if( history->m_masterCycle[record] > history->m_masterCycle[prevRecord] )
 		{
 			// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
 			// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
-			float newCycle = Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle + 1 );
+			float newCycle = Lerp( frac, history->m_masterCycle[record], history->m_masterCycle[prevRecord] + 1 );
 			pPlayer->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
 		}
 		else
 		{
-			pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
+			pPlayer->SetCycle( Lerp( frac, history->m_masterCycle[record], history->m_masterCycle[prevRecord] ) );
 		}
 
 		for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
 		{
 			//don't lerp pose params, just pick the closest
-			pPlayer->SetPoseParameter( i, record->m_flPoseParameters[i] );
-			//pAnimating->SetPoseParameter( i, Lerp( frac, record->m_flPoseParameters[i], prevRecord->m_flPoseParameters[i] ) );
+			pPlayer->SetPoseParameter( i, history->m_flPoseParameters[record][i] );
+			//pAnimating->SetPoseParameter( i, Lerp( frac, history->m_flPoseParameters[record][i], history->m_flPoseParameters[prevRecord][i] ) );
 		}
 	}
 	if( !interpolatedMasters )
 	{
-		pPlayer->SetSequence(record->m_masterSequence);
-		pPlayer->SetCycle(record->m_masterCycle);
+		pPlayer->SetSequence(history->m_masterSequence[record]);
+		pPlayer->SetCycle(history->m_masterCycle[record]);
 
 		for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
 		{
-			pPlayer->SetPoseParameter( i, record->m_flPoseParameters[i] );
+			pPlayer->SetPoseParameter( i, history->m_flPoseParameters[record][i] );
 		}
 	}
 
@@ -707,8 +1002,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			bool interpolated = false;
 			if( (frac > 0.0f)  &&  interpolationAllowed )
 			{
-				LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
-				LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
+				const LayerRecord &recordsLayerRecord = history->m_layerRecords[record][layerIndex];
+				const LayerRecord &prevRecordsLayerRecord = history->m_layerRecords[prevRecord][layerIndex];
 				if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
 					&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
 					)
@@ -734,10 +1029,10 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			if( !interpolated )
 			{
 				//Either no interp, or interp failed.  Just use record.
-				currentLayer->m_flCycle = record->m_layerRecords[layerIndex].m_cycle;
-				currentLayer->m_nOrder = record->m_layerRecords[layerIndex].m_order;
-				currentLayer->m_nSequence = record->m_layerRecords[layerIndex].m_sequence;
-				currentLayer->m_flWeight = record->m_layerRecords[layerIndex].m_weight;
+				currentLayer->m_flCycle = history->m_layerRecords[record][layerIndex].m_cycle;
+				currentLayer->m_nOrder = history->m_layerRecords[record][layerIndex].m_order;
+				currentLayer->m_nSequence = history->m_layerRecords[record][layerIndex].m_sequence;
+				currentLayer->m_flWeight = history->m_layerRecords[record][layerIndex].m_weight;
 			}
 		}
 	}
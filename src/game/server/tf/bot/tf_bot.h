@@ -1062,6 +1062,45 @@ public:
 		}
 	}
 
+	virtual bool GetCacheKey( NextBotPathCostKey *key ) const
+	{
+		// these costs depend on combat, enemy buildings, and teammate positions
+		if ( m_routeType == SAFEST_ROUTE || m_me->IsPlayerClass( TF_CLASS_SPY ) || TFGameRules()->IsInTraining() )
+			return false;
+
+		// whether a func_nav_cost applies depends on the bot's tags, mission, and flag
+		if ( CFuncNavCost::IsAnyEnabled() )
+			return false;
+
+		struct
+		{
+			int entindex;			// only the DEFAULT_ROUTE preference is per-bot - other bots with the same state share routes
+			int team;
+			int routeType;
+			int timeMod;
+			int winningTeam;
+			float stepHeight;
+			float maxJumpHeight;
+			float maxDropHeight;
+		}
+		state;
+
+		bool isPreferenceUsed = ( m_routeType == DEFAULT_ROUTE && !m_me->IsMiniBoss() );
+
+		V_memset( &state, 0, sizeof( state ) );
+		state.entindex = isPreferenceUsed ? m_me->entindex() : 0;
+		state.team = m_me->GetTeamNumber();
+		state.routeType = m_routeType;
+		state.timeMod = isPreferenceUsed ? (int)( gpGlobals->curtime / 10.0f ) + 1 : 0;
+		state.winningTeam = TFGameRules()->RoundHasBeenWon() ? TFGameRules()->GetWinningTeam() : TEAM_INVALID;
+		state.stepHeight = m_stepHeight;
+		state.maxJumpHeight = m_maxJumpHeight;
+		state.maxDropHeight = m_maxDropHeight;
+
+		key->Set( state );
+		return true;
+	}
+
 	CTFBot *m_me;
 	RouteType m_routeType;
 	float m_stepHeight;
@@ -16,6 +16,19 @@ ConVar tf_bot_choose_target_interval( "tf_bot_choose_target_interval", "0.3f", F
 ConVar tf_bot_sniper_choose_target_interval( "tf_bot_sniper_choose_target_interval", "3.0f", FCVAR_CHEAT, "How often, in seconds, a zoomed-in Sniper can reselect his target" );
 
 
+//------------------------------------------------------------------------------------------
+// Don't collect and trace for a scan the MvM throttle in Update() is going to skip
+bool CTFBotVision::BeginPrepareUpdate( void )
+{
+	if ( TFGameRules()->IsMannVsMachineMode() && !m_scanTimer.IsElapsed() )
+	{
+		return false;
+	}
+
+	return IVision::BeginPrepareUpdate();
+}
+
+
 //------------------------------------------------------------------------------------------
 // Update internal state
 void CTFBotVision::Update( void )
@@ -19,6 +19,7 @@ public:
 	virtual ~CTFBotVision() { }
 
 	virtual void Update( void );								// update internal state
+	virtual bool BeginPrepareUpdate( void );
 
 	/**
 	 * Populate "potentiallyVisible" with the set of all entities we could potentially see. 
@@ -756,6 +756,31 @@ void CTFNavArea::ComputeInvasionAreaVectors( void )
 }
 
 
+//------------------------------------------------------------------------------------------------
+void CTFNavArea::SetAttributeTF( int flags )
+{
+	// TF_NAV_BLOCKED feeds IsBlocked(), so paths computed before it changed may be stale
+	if ( ( flags & TF_NAV_BLOCKED ) && !HasAttributeTF( TF_NAV_BLOCKED ) )
+	{
+		TheNavMesh->OnPathCostsChanged();
+	}
+
+	m_attributeFlags |= flags;
+}
+
+
+//------------------------------------------------------------------------------------------------
+void CTFNavArea::ClearAttributeTF( int flags )
+{
+	if ( ( flags & TF_NAV_BLOCKED ) && HasAttributeTF( TF_NAV_BLOCKED ) )
+	{
+		TheNavMesh->OnPathCostsChanged();
+	}
+
+	m_attributeFlags &= ~flags;
+}
+
+
 //------------------------------------------------------------------------------------------------
 bool CTFNavArea::IsBlocked( int teamID, bool ignoreNavBlockers ) const
 {
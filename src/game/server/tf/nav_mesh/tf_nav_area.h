@@ -344,16 +344,6 @@ inline bool CTFNavArea::IsInvasionSearchMarked( unsigned int marker ) const
 	return marker == m_invasionSearchMarker;
 }
 
-inline void CTFNavArea::SetAttributeTF( int flags )
-{
-	m_attributeFlags |= flags;
-}
-
-inline void CTFNavArea::ClearAttributeTF( int flags )
-{
-	m_attributeFlags &= ~flags;
-}
-
 inline bool CTFNavArea::HasAttributeTF( int flags ) const
 {
 	return ( m_attributeFlags & flags ) ? true : false;
@@ -0,0 +1,262 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs and shares the PVS tests for CheckTransmit
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "transmitsnapshot.h"
+#include "ServerNetworkProperty.h"
+#include "tier0/vprof.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// distinct client viewpoints kept per snapshot
+#define TRANSMIT_SNAPSHOT_MAX_CACHED	64
+
+ConVar sv_transmit_pvs_cache( "sv_transmit_pvs_cache", "0", 0, "Share the entity PVS tests between clients with the same PVS and areas." );
+ConVar sv_transmit_pvs_verify( "sv_transmit_pvs_verify", "0", 0, "Check every shared entity PVS test against the entity's own, and report any that differ (debug only, does the PVS tests twice)." );
+
+CTransmitSnapshot g_TransmitSnapshot( "CTransmitSnapshot" );
+
+
+CTransmitSnapshot::CTransmitSnapshot( char const *name ) : CAutoGameSystem( name )
+{
+	m_nTick = -1;
+	m_nPVSInformationUpdates = 0;
+	m_pInfo = NULL;
+	memset( m_pNetProps, 0, sizeof( m_pNetProps ) );
+}
+
+
+void CTransmitSnapshot::LevelShutdownPostEntity()
+{
+	m_nTick = -1;
+	m_Edicts.Purge();
+	m_Clusters.Purge();
+	m_Areas.Purge();
+	m_CachedPVS.Purge();
+	m_CachedPVSBytes.Purge();
+	m_InSnapshot.ClearAll();
+	memset( m_pNetProps, 0, sizeof( m_pNetProps ) );
+	m_pInfo = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// Copies the PVS information of the edicts that can be PVS checked, unless
+// the snapshot is already up to date
+//-----------------------------------------------------------------------------
+void CTransmitSnapshot::Update( const unsigned short *pEdictIndices, int nEdicts )
+{
+	if ( m_nTick == gpGlobals->tickcount && m_nPVSInformationUpdates == g_nPVSInformationUpdates )
+		return;
+
+	VPROF( "CTransmitSnapshot::Update" );
+
+	m_InSnapshot.ClearAll();
+	edict_t *pBaseEdict = engine->PEntityOfEntIndex( 0 );
+	for ( int i = 0; i < nEdicts; i++ )
+	{
+		int iEdict = pEdictIndices[i];
+		edict_t *pEdict = &pBaseEdict[iEdict];
+		if ( pEdict->IsFree() || !( pEdict->m_fStateFlags & (FL_EDICT_PVSCHECK|FL_EDICT_FULLCHECK) ) )
+			continue;
+
+		CServerNetworkProperty *pNetProp = static_cast<CServerNetworkProperty*>( pEdict->GetNetworkable() );
+		if ( !pNetProp )
+			continue;
+
+		pNetProp->RecomputePVSInformation();
+		m_pNetProps[iEdict] = pNetProp;
+		m_InSnapshot.Set( iEdict );
+	}
+
+	m_Edicts.RemoveAll();
+	m_Clusters.RemoveAll();
+	m_Areas.RemoveAll();
+	m_CachedPVS.RemoveAll();
+	m_CachedPVSBytes.RemoveAll();
+
+	CBitVec<MAX_MAP_AREAS> usedAreas;
+	usedAreas.ClearAll();
+	for ( int iEdict = m_InSnapshot.FindNextSetBit( 0 ); iEdict >= 0; iEdict = m_InSnapshot.FindNextSetBit( iEdict + 1 ) )
+	{
+		const PVSInfo_t *pPVSInfo = m_pNetProps[iEdict]->GetPVSInfo();
+
+		// headnode tests and unexpected areas are left to the live entity
+		if ( pPVSInfo->m_nClusterCount < 0 ||
+			pPVSInfo->m_nAreaNum < 0 || pPVSInfo->m_nAreaNum >= MAX_MAP_AREAS ||
+			pPVSInfo->m_nAreaNum2 < 0 || pPVSInfo->m_nAreaNum2 >= MAX_MAP_AREAS )
+		{
+			m_InSnapshot.Clear( iEdict );
+			continue;
+		}
+
+		SnapshotEdict_t &edict = m_Edicts[ m_Edicts.AddToTail() ];
+		edict.m_nEdict = iEdict;
+		edict.m_nArea = pPVSInfo->m_nAreaNum;
+		edict.m_nArea2 = pPVSInfo->m_nAreaNum2;
+		edict.m_nClusterCount = pPVSInfo->m_nClusterCount;
+		edict.m_nFirstCluster = m_Clusters.AddMultipleToTail( pPVSInfo->m_nClusterCount, pPVSInfo->m_pClusters );
+
+		usedAreas.Set( edict.m_nArea );
+		if ( edict.m_nArea2 )
+		{
+			usedAreas.Set( edict.m_nArea2 );
+		}
+	}
+
+	for ( int iArea = usedAreas.FindNextSetBit( 0 ); iArea >= 0; iArea = usedAreas.FindNextSetBit( iArea + 1 ) )
+	{
+		m_Areas.AddToTail( iArea );
+	}
+
+	m_nTick = gpGlobals->tickcount;
+	m_nPVSInformationUpdates = g_nPVSInformationUpdates;
+}
+
+
+//-----------------------------------------------------------------------------
+// The same tests CServerNetworkProperty::IsInPVS does, against the snapshot
+//-----------------------------------------------------------------------------
+void CTransmitSnapshot::TestEdicts()
+{
+	const unsigned char *pPVS = (const unsigned char *)m_pInfo->m_PVS;
+
+	for ( int i = 0; i < m_Edicts.Count(); i++ )
+	{
+		const SnapshotEdict_t &edict = m_Edicts[i];
+
+		if ( !m_ConnectedAreas.IsBitSet( edict.m_nArea ) && ( !edict.m_nArea2 || !m_ConnectedAreas.IsBitSet( edict.m_nArea2 ) ) )
+			continue;
+
+		const unsigned short *pClusters = m_Clusters.Base() + edict.m_nFirstCluster;
+		for ( int j = edict.m_nClusterCount; --j >= 0; )
+		{
+			int nCluster = pClusters[j];
+			if ( ((int)(pPVS[nCluster >> 3])) & BitVec_BitInByte( nCluster ) )
+			{
+				m_InPVS.Set( edict.m_nEdict );
+				break;
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The PVS tests only depend on the client's PVS and networked areas
+//-----------------------------------------------------------------------------
+CRC32_t CTransmitSnapshot::HashViewpoint( const CCheckTransmitInfo *pInfo )
+{
+	CRC32_t nHash;
+	CRC32_Init( &nHash );
+	CRC32_ProcessBuffer( &nHash, pInfo->m_PVS, pInfo->m_nPVSSize );
+	CRC32_ProcessBuffer( &nHash, pInfo->m_Areas, pInfo->m_AreasNetworked * sizeof( pInfo->m_Areas[0] ) );
+	CRC32_Final( &nHash );
+	return nHash;
+}
+
+int CTransmitSnapshot::FindCachedPVS( const CCheckTransmitInfo *pInfo, CRC32_t nHash ) const
+{
+	for ( int i = 0; i < m_CachedPVS.Count(); i++ )
+	{
+		const CachedPVS_t &cached = m_CachedPVS[i];
+		if ( cached.m_nHash == nHash &&
+			cached.m_nPVSSize == pInfo->m_nPVSSize &&
+			cached.m_nAreasNetworked == pInfo->m_AreasNetworked &&
+			!memcmp( cached.m_Areas, pInfo->m_Areas, pInfo->m_AreasNetworked * sizeof( pInfo->m_Areas[0] ) ) &&
+			!memcmp( m_CachedPVSBytes.Base() + cached.m_nFirstPVSByte, pInfo->m_PVS, pInfo->m_nPVSSize ) )
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+void CTransmitSnapshot::AddCachedPVS( const CCheckTransmitInfo *pInfo, CRC32_t nHash )
+{
+	if ( m_CachedPVS.Count() >= TRANSMIT_SNAPSHOT_MAX_CACHED ||
+		pInfo->m_nPVSSize < 0 || pInfo->m_nPVSSize > (int)sizeof( pInfo->m_PVS ) )
+		return;
+
+	CachedPVS_t &cached = m_CachedPVS[ m_CachedPVS.AddToTail() ];
+	cached.m_nHash = nHash;
+	cached.m_nPVSSize = pInfo->m_nPVSSize;
+	cached.m_nAreasNetworked = pInfo->m_AreasNetworked;
+	memcpy( cached.m_Areas, pInfo->m_Areas, pInfo->m_AreasNetworked * sizeof( pInfo->m_Areas[0] ) );
+	cached.m_nFirstPVSByte = m_CachedPVSBytes.AddMultipleToTail( pInfo->m_nPVSSize, pInfo->m_PVS );
+	cached.m_InPVS = m_InPVS;
+}
+
+
+bool CTransmitSnapshot::TestPVS( const CCheckTransmitInfo *pInfo, const unsigned short *pEdictIndices, int nEdicts )
+{
+	m_pInfo = NULL;
+
+	if ( !sv_transmit_pvs_cache.GetBool() )
+		return false;
+
+	VPROF( "CTransmitSnapshot::TestPVS" );
+
+	Update( pEdictIndices, nEdicts );
+	m_pInfo = pInfo;
+
+	CRC32_t nHash = HashViewpoint( pInfo );
+	int iCached = FindCachedPVS( pInfo, nHash );
+	if ( iCached >= 0 )
+	{
+		m_InPVS = m_CachedPVS[iCached].m_InPVS;
+		return true;
+	}
+
+	// An area is connected if the client can see into it from any of its
+	// networked areas. Each snapshot area is only looked up once.
+	m_ConnectedAreas.ClearAll();
+	for ( int i = 0; i < m_Areas.Count(); i++ )
+	{
+		int nArea = m_Areas[i];
+		for ( int j = 0; j < pInfo->m_AreasNetworked; j++ )
+		{
+			int clientArea = pInfo->m_Areas[j];
+			if ( clientArea == nArea || engine->CheckAreasConnected( clientArea, nArea ) )
+			{
+				m_ConnectedAreas.Set( nArea );
+				break;
+			}
+		}
+	}
+
+	m_InPVS.ClearAll();
+	TestEdicts();
+
+	AddCachedPVS( pInfo, nHash );
+	return true;
+}
+
+
+bool CTransmitSnapshot::IsInPVS( CServerNetworkProperty *pNetProp, const CCheckTransmitInfo *pInfo )
+{
+	Assert( pInfo == m_pInfo );
+
+	int iEdict = pNetProp->entindex();
+	if ( m_pInfo && m_nPVSInformationUpdates == g_nPVSInformationUpdates &&
+		m_InSnapshot.IsBitSet( iEdict ) && m_pNetProps[iEdict] == pNetProp )
+	{
+		Assert( ( pNetProp->edict()->m_fStateFlags & FL_EDICT_DIRTY_PVS_INFORMATION ) == 0 );
+		bool bInPVS = m_InPVS.IsBitSet( iEdict );
+
+		if ( sv_transmit_pvs_verify.GetBool() && bInPVS != pNetProp->IsInPVS( pInfo ) )
+		{
+			Warning( "CTransmitSnapshot: edict %d (%s) is %s the shared PVS but %s its own\n",
+				iEdict, pNetProp->GetClassName(), bInPVS ? "in" : "not in", bInPVS ? "not in" : "in" );
+		}
+
+		return bInPVS;
+	}
+
+	return pNetProp->IsInPVS( pInfo );
+}
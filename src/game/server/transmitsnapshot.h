@@ -0,0 +1,100 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs and shares the PVS tests for CheckTransmit
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef TRANSMITSNAPSHOT_H
+#define TRANSMITSNAPSHOT_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "igamesystem.h"
+#include "bitvec.h"
+#include "utlvector.h"
+#include "checksum_crc.h"
+#include "iservernetworkable.h"
+
+class CServerNetworkProperty;
+
+
+//-----------------------------------------------------------------------------
+// A read-only copy of the state CheckTransmit's PVS tests read: the transmit
+// flags, areas and cluster lists of the edicts. The copy is taken once a tick,
+// and is retaken whenever an entity's PVS information is recomputed.
+//
+// The PVS tests only depend on the client's PVS and networked areas, and
+// clients standing in the same clusters have the same ones. With
+// sv_transmit_pvs_cache, TestPVS tests every edict in the snapshot against
+// each distinct PVS and area list once, and keeps the results until the
+// snapshot is retaken; the other clients there copy them. The CheckTransmit
+// loop then gets its answers from IsInPVS. IsInPVS uses the live entity if
+// there's no result for it, or if any PVS information has been recomputed
+// since the snapshot, so the results are exactly what the serial loop gets -
+// sv_transmit_pvs_verify checks that. Everything client specific (FULLCHECK
+// entities, the skybox, HLTV) is still done by the CheckTransmit loop.
+//-----------------------------------------------------------------------------
+class CTransmitSnapshot : public CAutoGameSystem
+{
+public:
+	CTransmitSnapshot( char const *name );
+
+	virtual void LevelShutdownPostEntity();
+
+	// Tests the edicts against the client's PVS. Returns false if the cache is
+	// off, and IsInPVS shouldn't be used for this client.
+	bool TestPVS( const CCheckTransmitInfo *pInfo, const unsigned short *pEdictIndices, int nEdicts );
+
+	// Same as pNetProp->IsInPVS( pInfo ) for the client passed to TestPVS
+	bool IsInPVS( CServerNetworkProperty *pNetProp, const CCheckTransmitInfo *pInfo );
+
+private:
+	struct SnapshotEdict_t
+	{
+		unsigned short	m_nEdict;
+		short			m_nArea;
+		short			m_nArea2;
+		short			m_nClusterCount;
+		int				m_nFirstCluster;	// into m_Clusters
+	};
+
+	// a client viewpoint's results
+	struct CachedPVS_t
+	{
+		CRC32_t				m_nHash;
+		int					m_nPVSSize;
+		int					m_nAreasNetworked;
+		int					m_Areas[MAX_WORLD_AREAS];
+		int					m_nFirstPVSByte;	// into m_CachedPVSBytes
+		CBitVec<MAX_EDICTS>	m_InPVS;
+	};
+
+	void Update( const unsigned short *pEdictIndices, int nEdicts );
+	void TestEdicts();
+	static CRC32_t HashViewpoint( const CCheckTransmitInfo *pInfo );
+	int FindCachedPVS( const CCheckTransmitInfo *pInfo, CRC32_t nHash ) const;
+	void AddCachedPVS( const CCheckTransmitInfo *pInfo, CRC32_t nHash );
+
+	// the snapshot
+	int									m_nTick;
+	int									m_nPVSInformationUpdates;
+	CUtlVector< SnapshotEdict_t >		m_Edicts;			// in edict order
+	CUtlVector< unsigned short >		m_Clusters;
+	CUtlVector< short >					m_Areas;			// every area used by m_Edicts
+	CBitVec<MAX_EDICTS>					m_InSnapshot;
+	CServerNetworkProperty				*m_pNetProps[MAX_EDICTS];
+	CUtlVector< CachedPVS_t >			m_CachedPVS;		// cleared whenever the snapshot is retaken
+	CUtlVector< byte >					m_CachedPVSBytes;	// the m_nPVSSize bytes of each cached PVS
+
+	// results for the client passed to TestPVS
+	const CCheckTransmitInfo			*m_pInfo;
+	CBitVec<MAX_MAP_AREAS>				m_ConnectedAreas;
+	CBitVec<MAX_EDICTS>					m_InPVS;
+};
+
+extern CTransmitSnapshot g_TransmitSnapshot;
+
+
+#endif // TRANSMITSNAPSHOT_H
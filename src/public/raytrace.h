@@ -10,6 +10,7 @@
 #include <mathlib/lightdesc.h>
 #include <assert.h>
 #include <tier1/utlvector.h>
+#include <tier1/utlbuffer.h>
 #include <mathlib/mathlib.h>
 #include <bspfile.h>
 
@@ -208,6 +209,53 @@ struct RayTracingResult
 	fltx4 HitDistance;										// distance to intersection
 };
 
+/// rays for the 8 and 16 wide tracing routines. These are stored as plain arrays, [coord][ray],
+/// so that the layout doesn't depend on the instruction set used to trace them.
+template<int N> class WideRays
+{
+public:
+	float origin[3][N];
+	float direction[3][N];
+
+	// returns direction sign mask for all N rays. returns -1 if the rays can not be traced as a
+	// bundle.
+	int CalculateDirectionSignMask(void) const
+	{
+		int ret=0;
+		for(int c=0;c<3;c++)
+		{
+			int32 const *treat_as_int=((int32 const *) direction[c]);
+			int32 ormask=0;
+			int32 andmask=-1;
+			for(int i=0;i<N;i++)
+			{
+				ormask|=treat_as_int[i];
+				andmask&=treat_as_int[i];
+			}
+			if (ormask<0)
+			{
+				if (andmask>=0)
+					return -1;
+				ret|=(1<<c);
+			}
+		}
+		return ret;
+	}
+};
+
+typedef WideRays<8> EightRays;
+typedef WideRays<16> SixteenRays;
+
+template<int N> struct RayTracingWideResult
+{
+	float surface_normal[3][N];								// surface normal at intersection
+	int32 HitIds[N];										// -1=no hit. otherwise, triangle index
+	float HitDistance[N];									// distance to intersection
+};
+
+typedef RayTracingWideResult<8> RayTracingResult8;
+typedef RayTracingWideResult<16> RayTracingResult16;
+
 
 class RayTraceLight
 {
@@ -220,6 +268,8 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_SERIAL_TREE_GENERATION 8				// build the kd-tree with the original
+															// single threaded split search
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -297,6 +347,12 @@ public:
 	// SetupAccelerationStructure to prepare for tracing
 	void SetupAccelerationStructure(void);
 
+	// save the triangles and kd-tree after SetupAccelerationStructure, and restore them into an
+	// empty environment instead of adding the triangles and calling SetupAccelerationStructure.
+	// Restoring fails if the data was written by a build with a different tree layout.
+	void SaveAccelerationStructure(CUtlBuffer &buf) const;
+	bool LoadAccelerationStructure(CUtlBuffer &buf);
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -310,6 +366,18 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// trace 8 or 16 rays at once, using AVX2 or AVX-512 when the cpu supports them and
+	// Trace4Rays otherwise. The rays do not need to have matching direction signs. Each ray gets
+	// the same closest hit within its [TMin,TMax] as it would from Trace4Rays. There is no
+	// transparent triangle callback, since ITransparentTriangleCallback works on FourRays.
+	void Trace8Rays(const EightRays &rays, const float *TMin, const float *TMax,
+					RayTracingResult8 *rslt_out, int32 skip_id=-1);
+	void Trace16Rays(const SixteenRays &rays, const float *TMin, const float *TMax,
+					 RayTracingResult16 *rslt_out, int32 skip_id=-1);
+
+	// the widest ray bundle that this cpu can trace natively - 4, 8 or 16
+	static int GetNativeTraceWidth(void);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -2,8 +2,11 @@
 // $Id$
 
 #include "raytrace.h"
+#include "trace_wide.h"
+#include <tier1/processor_detect.h>
 #include <filesystem_tools.h>
 #include <cmdlib.h>
+#include <threads.h>
 #include <stdio.h>
 
 static bool SameSign(float a, float b)
@@ -253,10 +256,6 @@ int CacheOptimizedTriangle::ClassifyAgainstAxisSplit(int split_plane, float spli
 	return PLANECHECK_STRADDLING;
 }
 
-#define MAILBOX_HASH_SIZE 256
-#define MAX_TREE_DEPTH 21
-#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
-
 struct NodeToVisit {
 	CacheOptimizedKDNode const *node;
 	fltx4 TMin;
@@ -592,6 +591,113 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+// which of the wide tracing paths this cpu can run. checked on first use.
+static int s_nWideTraceSupport=-1;
+
+#define WIDE_TRACE_AVX2 1
+#define WIDE_TRACE_AVX512 2
+
+static int GetWideTraceSupport(void)
+{
+	if (s_nWideTraceSupport==-1)
+	{
+		int support=0;
+#ifdef RAYTRACE_AVX2
+		if (CheckAVX2Technology())
+			support|=WIDE_TRACE_AVX2;
+#endif
+#ifdef RAYTRACE_AVX512
+		if (CheckAVX512Technology())
+			support|=WIDE_TRACE_AVX512;
+#endif
+		s_nWideTraceSupport=support;
+	}
+	return s_nWideTraceSupport;
+}
+
+// trace N rays as N/4 groups of FourRays, for cpus or rays the wide paths can't handle
+template<int N> static void TraceWideRaysBy4(RayTracingEnvironment &env, const WideRays<N> &rays,
+											 const float *TMin, const float *TMax,
+											 RayTracingWideResult<N> *rslt_out, int32 skip_id)
+{
+	for(int i=0;i<N;i+=4)
+	{
+		FourRays myrays;
+		for(int c=0;c<3;c++)
+		{
+			myrays.origin[c]=LoadUnalignedSIMD(&rays.origin[c][i]);
+			myrays.direction[c]=LoadUnalignedSIMD(&rays.direction[c][i]);
+		}
+		RayTracingResult rslt;
+		env.Trace4Rays(myrays,LoadUnalignedSIMD(TMin+i),LoadUnalignedSIMD(TMax+i),&rslt,skip_id);
+		for(int j=0;j<4;j++)
+		{
+			rslt_out->HitIds[i+j]=rslt.HitIds[j];
+			rslt_out->HitDistance[i+j]=SubFloat(rslt.HitDistance,j);
+			rslt_out->surface_normal[0][i+j]=rslt.surface_normal.X(j);
+			rslt_out->surface_normal[1][i+j]=rslt.surface_normal.Y(j);
+			rslt_out->surface_normal[2][i+j]=rslt.surface_normal.Z(j);
+		}
+	}
+}
+
+void RayTracingEnvironment::Trace8Rays(const EightRays &rays, const float *TMin, const float *TMax,
+									   RayTracingResult8 *rslt_out, int32 skip_id)
+{
+	int msk=rays.CalculateDirectionSignMask();
+	if ((msk!=-1) && (GetWideTraceSupport() & WIDE_TRACE_AVX2))
+		TraceEightRaysAVX2(*this,rays,TMin,TMax,msk,rslt_out,skip_id);
+	else
+		TraceWideRaysBy4(*this,rays,TMin,TMax,rslt_out,skip_id);
+}
+
+void RayTracingEnvironment::Trace16Rays(const SixteenRays &rays, const float *TMin, const float *TMax,
+										RayTracingResult16 *rslt_out, int32 skip_id)
+{
+	int msk=rays.CalculateDirectionSignMask();
+	if ((msk!=-1) && (GetWideTraceSupport() & WIDE_TRACE_AVX512))
+	{
+		TraceSixteenRaysAVX512(*this,rays,TMin,TMax,msk,rslt_out,skip_id);
+		return;
+	}
+	if (! (GetWideTraceSupport() & WIDE_TRACE_AVX2))
+	{
+		TraceWideRaysBy4(*this,rays,TMin,TMax,rslt_out,skip_id);
+		return;
+	}
+	// trace each half 8 wide. the halves often have matching signs even when the whole bundle
+	// doesn't.
+	for(int h=0;h<16;h+=8)
+	{
+		EightRays myrays;
+		for(int c=0;c<3;c++)
+			for(int i=0;i<8;i++)
+			{
+				myrays.origin[c][i]=rays.origin[c][h+i];
+				myrays.direction[c][i]=rays.direction[c][h+i];
+			}
+		RayTracingResult8 rslt;
+		Trace8Rays(myrays,TMin+h,TMax+h,&rslt,skip_id);
+		for(int i=0;i<8;i++)
+		{
+			rslt_out->HitIds[h+i]=rslt.HitIds[i];
+			rslt_out->HitDistance[h+i]=rslt.HitDistance[i];
+			for(int c=0;c<3;c++)
+				rslt_out->surface_normal[c][h+i]=rslt.surface_normal[c][i];
+		}
+	}
+}
+
+int RayTracingEnvironment::GetNativeTraceWidth(void)
+{
+	if (GetWideTraceSupport() & WIDE_TRACE_AVX512)
+		return 16;
+	if (GetWideTraceSupport() & WIDE_TRACE_AVX2)
+		return 8;
+	return 4;
+}
+
+
 int RayTracingEnvironment::MakeLeafNode(int first_tri, int last_tri)
 {
 	CacheOptimizedKDNode ret;
@@ -869,6 +975,451 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 }
 
 
+// Binned SAH tree builder. This makes the same kind of tree as RefineNode, with the same cost
+// function and termination rules, but instead of classifying every triangle against each
+// candidate split in turn, it bins the triangles once per axis and reads the costs of
+// KDTREE_BIN_COUNT-1 evenly spaced splits, plus the splits which cut off the empty space on
+// either side, from the bins. The top of the tree is built serially until there are enough
+// subtrees to keep every thread busy, then the subtrees are built on the tool threads and
+// spliced into the tree in a fixed order, so the tree doesn't depend on thread timing.
+
+#define KDTREE_BIN_COUNT 32
+#define KDTREE_MIN_SUBTREE_TRIS 1024						// don't split the top of the tree
+															// any further than this
+#define KDTREE_SUBTREES_PER_THREAD 8
+
+struct KDTriangleBounds_t
+{
+	float m_Mins[3];
+	float m_Maxs[3];
+};
+
+struct KDSubtree_t
+{
+	int m_nNode;											// node this subtree is built into
+	CUtlVector<int32> m_Triangles;
+	Vector m_MinBound;
+	Vector m_MaxBound;
+	int m_nDepth;
+
+	// built by the tool threads. node 0 is the root of the subtree
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;
+	CUtlVector<int32> m_TriangleIndexList;
+};
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder(RayTracingEnvironment &env);
+
+	void Build(void);
+
+	void BuildSubtree(KDSubtree_t *pSubtree);
+
+private:
+	float CostOfSplit(int split_plane,float split_value,Vector const &MinBound,
+					  Vector const &MaxBound,int nleft,int nright,int nboth) const;
+	float FindBestSplit(int32 const *tri_list,int ntris,Vector const &MinBound,
+						Vector const &MaxBound,int &split_plane,float &split_value) const;
+	bool SplitNode(int32 const *tri_list,int ntris,Vector const &MinBound,Vector const &MaxBound,
+				   int depth,int &split_plane,float &split_value,int32 *new_triangle_list,
+				   int &nleft,int &nright,int &nboth) const;
+	void MakeLeaf(CUtlVector<CacheOptimizedKDNode> &nodes,CUtlVector<int32> &tri_index_list,
+				  int node_number,int32 const *tri_list,int ntris,
+				  Vector const &MinBound,Vector const &MaxBound) const;
+	void RefineNode(CUtlVector<CacheOptimizedKDNode> &nodes,CUtlVector<int32> &tri_index_list,
+					int node_number,int32 const *tri_list,int ntris,
+					Vector MinBound,Vector MaxBound,int depth) const;
+
+	RayTracingEnvironment &m_Env;
+	CUtlVector<KDTriangleBounds_t> m_TriangleBounds;
+};
+
+CKDTreeBuilder::CKDTreeBuilder(RayTracingEnvironment &env) : m_Env(env)
+{
+	m_TriangleBounds.SetCount(env.OptimizedTriangleList.Count());
+	for(int t=0;t<env.OptimizedTriangleList.Count();t++)
+	{
+		CacheOptimizedTriangle const &tri=env.OptimizedTriangleList[t];
+		for(int c=0;c<3;c++)
+		{
+			m_TriangleBounds[t].m_Mins[c]=min(tri.Vertex(0)[c],min(tri.Vertex(1)[c],tri.Vertex(2)[c]));
+			m_TriangleBounds[t].m_Maxs[c]=max(tri.Vertex(0)[c],max(tri.Vertex(1)[c],tri.Vertex(2)[c]));
+		}
+	}
+}
+
+// same as the cost computed by CalculateCostsOfSplit
+float CKDTreeBuilder::CostOfSplit(int split_plane,float split_value,Vector const &MinBound,
+								  Vector const &MaxBound,int nleft,int nright,int nboth) const
+{
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	LeftMaxes[split_plane]=split_value;
+	RightMins[split_plane]=split_value;
+	float SA_L=BoxSurfaceArea(MinBound,LeftMaxes);
+	float SA_R=BoxSurfaceArea(RightMins,MaxBound);
+	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
+	return COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
+		(SA_L*ISA*(nleft))+(SA_R*ISA*(nright)));
+}
+
+// returns the estimated cost of the cheapest split, or 1.0e23 if there is nothing to split
+float CKDTreeBuilder::FindBestSplit(int32 const *tri_list,int ntris,Vector const &MinBound,
+									Vector const &MaxBound,int &split_plane,
+									float &split_value) const
+{
+	float best_cost=1.0e23;
+	for(int axis=0;axis<3;axis++)
+	{
+		float lo=MinBound[axis];
+		float hi=MaxBound[axis];
+		if (hi<=lo)
+			continue;
+
+		// count the triangles starting and ending in each bin
+		int min_bins[KDTREE_BIN_COUNT];
+		int max_bins[KDTREE_BIN_COUNT];
+		memset(min_bins,0,sizeof(min_bins));
+		memset(max_bins,0,sizeof(max_bins));
+		float min_coord=1.0e23,max_coord=-1.0e23;
+		float bin_scale=KDTREE_BIN_COUNT/(hi-lo);
+		for(int t=0;t<ntris;t++)
+		{
+			KDTriangleBounds_t const &bounds=m_TriangleBounds[tri_list[t]];
+			min_coord=min(min_coord,bounds.m_Mins[axis]);
+			max_coord=max(max_coord,bounds.m_Maxs[axis]);
+			int min_bin=(int) ((bounds.m_Mins[axis]-lo)*bin_scale);
+			int max_bin=(int) ((bounds.m_Maxs[axis]-lo)*bin_scale);
+			min_bins[max(0,min(min_bin,KDTREE_BIN_COUNT-1))]++;
+			max_bins[max(0,min(max_bin,KDTREE_BIN_COUNT-1))]++;
+		}
+
+		// sweep the planes between the bins. triangles which end before a plane are on the left
+		// of it, ones which start after it are on the right, and the rest straddle it.
+		int nleft=0;
+		int nright=ntris;
+		for(int b=1;b<KDTREE_BIN_COUNT;b++)
+		{
+			nleft+=max_bins[b-1];
+			nright-=min_bins[b-1];
+			float trial_splitvalue=lo+(hi-lo)*b*(1.0/KDTREE_BIN_COUNT);
+			float trial_cost=CostOfSplit(axis,trial_splitvalue,MinBound,MaxBound,nleft,nright,
+										 ntris-nleft-nright);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=trial_splitvalue;
+			}
+		}
+
+		// and the planes which "grow" an empty node as much as possible on either side
+		if ((max_coord>lo) && (max_coord<hi))
+		{
+			float trial_cost=CostOfSplit(axis,max_coord,MinBound,MaxBound,ntris,0,0);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=max_coord;
+			}
+		}
+		if ((min_coord>lo) && (min_coord<hi))
+		{
+			float trial_cost=CostOfSplit(axis,min_coord,MinBound,MaxBound,0,ntris,0);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=min_coord;
+			}
+		}
+	}
+	return best_cost;
+}
+
+// decide whether and where to split a node. If it is worth splitting, the triangles are written
+// to new_triangle_list in the same layout RefineNode uses - left, then straddling, then right.
+bool CKDTreeBuilder::SplitNode(int32 const *tri_list,int ntris,Vector const &MinBound,
+							   Vector const &MaxBound,int depth,int &split_plane,
+							   float &split_value,int32 *new_triangle_list,
+							   int &nleft,int &nright,int &nboth) const
+{
+	if ((ntris<3) || NEVER_SPLIT || (depth>MAX_TREE_DEPTH))
+		return false;
+
+	if (FindBestSplit(tri_list,ntris,MinBound,MaxBound,split_plane,split_value)>=1.0e23)
+		return false;
+
+	// the bins only estimate how many triangles straddle the split, so classify them exactly,
+	// the same way ClassifyAgainstAxisSplit does
+	signed char *classification=new signed char[ntris];
+	nleft=nright=nboth=0;
+	for(int t=0;t<ntris;t++)
+	{
+		KDTriangleBounds_t const &bounds=m_TriangleBounds[tri_list[t]];
+		if (bounds.m_Mins[split_plane]>=split_value)
+		{
+			classification[t]=PLANECHECK_POSITIVE;
+			nright++;
+		}
+		else if (bounds.m_Maxs[split_plane]<=split_value)
+		{
+			classification[t]=PLANECHECK_NEGATIVE;
+			nleft++;
+		}
+		else
+		{
+			classification[t]=PLANECHECK_STRADDLING;
+			nboth++;
+		}
+	}
+
+	float cost_of_split=CostOfSplit(split_plane,split_value,MinBound,MaxBound,nleft,nright,nboth);
+	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
+	if (cost_of_no_split<=cost_of_split)
+	{
+		delete[] classification;
+		return false;
+	}
+
+	int n_left_output=0;
+	int n_both_output=0;
+	int n_right_output=0;
+	for(int t=0;t<ntris;t++)
+	{
+		switch(classification[t])
+		{
+			case PLANECHECK_NEGATIVE:
+				new_triangle_list[n_left_output++]=tri_list[t];
+				break;
+			case PLANECHECK_POSITIVE:
+				n_right_output++;
+				new_triangle_list[ntris-n_right_output]=tri_list[t];
+				break;
+			case PLANECHECK_STRADDLING:
+				new_triangle_list[nleft+n_both_output]=tri_list[t];
+				n_both_output++;
+				break;
+		}
+	}
+	delete[] classification;
+	return true;
+}
+
+void CKDTreeBuilder::MakeLeaf(CUtlVector<CacheOptimizedKDNode> &nodes,
+							  CUtlVector<int32> &tri_index_list,int node_number,
+							  int32 const *tri_list,int ntris,
+							  Vector const &MinBound,Vector const &MaxBound) const
+{
+	nodes[node_number].Children=KDNODE_STATE_LEAF+(tri_index_list.Count()<<2);
+	nodes[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	tri_index_list.AddMultipleToTail(ntris,tri_list);
+}
+
+void CKDTreeBuilder::RefineNode(CUtlVector<CacheOptimizedKDNode> &nodes,
+								CUtlVector<int32> &tri_index_list,int node_number,
+								int32 const *tri_list,int ntris,
+								Vector MinBound,Vector MaxBound,int depth) const
+{
+	int32 *new_triangle_list=new int32[max(ntris,1)];
+	int split_plane=0;
+	float split_value=0;
+	int nleft,nright,nboth;
+	if (! SplitNode(tri_list,ntris,MinBound,MaxBound,depth,split_plane,split_value,
+					new_triangle_list,nleft,nright,nboth))
+	{
+		MakeLeaf(nodes,tri_index_list,node_number,tri_list,ntris,MinBound,MaxBound);
+		delete[] new_triangle_list;
+		return;
+	}
+
+	int left_child=nodes.Count();
+	nodes[node_number].Children=split_plane+(left_child<<2);
+	nodes[node_number].SplittingPlaneValue=split_value;
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	CacheOptimizedKDNode newnode;
+	nodes.AddToTail(newnode);
+	nodes.AddToTail(newnode);
+
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	LeftMaxes[split_plane]=split_value;
+	RightMins[split_plane]=split_value;
+	if ( (ntris<20) && ((nleft==0) || (nright==0)) )
+		depth+=100;
+	RefineNode(nodes,tri_index_list,left_child,new_triangle_list,nleft+nboth,
+			   MinBound,LeftMaxes,depth+1);
+	RefineNode(nodes,tri_index_list,left_child+1,new_triangle_list+nleft,nright+nboth,
+			   RightMins,MaxBound,depth+1);
+	delete[] new_triangle_list;
+}
+
+void CKDTreeBuilder::BuildSubtree(KDSubtree_t *pSubtree)
+{
+	CacheOptimizedKDNode root;
+	pSubtree->m_Nodes.AddToTail(root);
+	RefineNode(pSubtree->m_Nodes,pSubtree->m_TriangleIndexList,0,pSubtree->m_Triangles.Base(),
+			   pSubtree->m_Triangles.Count(),pSubtree->m_MinBound,pSubtree->m_MaxBound,
+			   pSubtree->m_nDepth);
+	pSubtree->m_Triangles.Purge();
+}
+
+static CKDTreeBuilder *s_pKDTreeBuilder;
+static CUtlVector<KDSubtree_t *> *s_pKDSubtrees;
+
+static void BuildKDSubtreeThread(int iThread, int iWorkItem)
+{
+	s_pKDTreeBuilder->BuildSubtree((*s_pKDSubtrees)[iWorkItem]);
+}
+
+static int __cdecl CompareKDSubtreeSizes(KDSubtree_t * const *ppA, KDSubtree_t * const *ppB)
+{
+	// biggest first, so that the threads don't finish on a big one. ties in tree order.
+	int nA=(*ppA)->m_Triangles.Count();
+	int nB=(*ppB)->m_Triangles.Count();
+	if (nA!=nB)
+		return (nA>nB) ? -1 : 1;
+	return (*ppA)->m_nNode-(*ppB)->m_nNode;
+}
+
+void CKDTreeBuilder::Build(void)
+{
+	CUtlVector<CacheOptimizedKDNode> &nodes=m_Env.OptimizedKDTree;
+	CUtlVector<int32> &tri_index_list=m_Env.TriangleIndexList;
+
+	KDSubtree_t *pRoot=new KDSubtree_t;
+	pRoot->m_nNode=0;
+	pRoot->m_Triangles.SetCount(m_Env.OptimizedTriangleList.Count());
+	for(int t=0;t<pRoot->m_Triangles.Count();t++)
+		pRoot->m_Triangles[t]=t;
+	pRoot->m_MinBound=m_Env.m_MinBound;
+	pRoot->m_MaxBound=m_Env.m_MaxBound;
+	pRoot->m_nDepth=0;
+
+	CUtlVector<KDSubtree_t *> subtrees;
+	subtrees.AddToTail(pRoot);
+
+	// build the top of the tree here, always splitting the biggest subtree, until there are
+	// enough to go around the threads
+	int nMaxSubtrees=KDTREE_SUBTREES_PER_THREAD*max(numthreads,1);
+	while(subtrees.Count()<nMaxSubtrees)
+	{
+		int biggest=0;
+		for(int i=1;i<subtrees.Count();i++)
+			if (subtrees[i]->m_Triangles.Count()>subtrees[biggest]->m_Triangles.Count())
+				biggest=i;
+		KDSubtree_t *pSubtree=subtrees[biggest];
+		int ntris=pSubtree->m_Triangles.Count();
+		if (ntris<KDTREE_MIN_SUBTREE_TRIS)
+			break;
+
+		subtrees.Remove(biggest);
+
+		KDSubtree_t *pChildren[2];
+		for(int c=0;c<2;c++)
+		{
+			pChildren[c]=new KDSubtree_t;
+			pChildren[c]->m_Triangles.SetCount(ntris);
+		}
+
+		int split_plane=0;
+		float split_value=0;
+		int nleft,nright,nboth;
+		if (! SplitNode(pSubtree->m_Triangles.Base(),ntris,pSubtree->m_MinBound,
+						pSubtree->m_MaxBound,pSubtree->m_nDepth,split_plane,split_value,
+						pChildren[0]->m_Triangles.Base(),nleft,nright,nboth))
+		{
+			MakeLeaf(nodes,tri_index_list,pSubtree->m_nNode,pSubtree->m_Triangles.Base(),ntris,
+					 pSubtree->m_MinBound,pSubtree->m_MaxBound);
+			delete pChildren[0];
+			delete pChildren[1];
+			delete pSubtree;
+			continue;
+		}
+
+		int left_child=nodes.Count();
+		nodes[pSubtree->m_nNode].Children=split_plane+(left_child<<2);
+		nodes[pSubtree->m_nNode].SplittingPlaneValue=split_value;
+#ifdef DEBUG_RAYTRACE
+		nodes[pSubtree->m_nNode].vecMins = pSubtree->m_MinBound;
+		nodes[pSubtree->m_nNode].vecMaxs = pSubtree->m_MaxBound;
+#endif
+		CacheOptimizedKDNode newnode;
+		nodes.AddToTail(newnode);
+		nodes.AddToTail(newnode);
+
+		// the left child's list is the front of the split list, the right child's the back
+		memcpy(pChildren[1]->m_Triangles.Base(),pChildren[0]->m_Triangles.Base()+nleft,
+			   (nright+nboth)*sizeof(int32));
+		pChildren[0]->m_Triangles.SetCountNonDestructively(nleft+nboth);
+		pChildren[1]->m_Triangles.SetCountNonDestructively(nright+nboth);
+
+		int depth=pSubtree->m_nDepth;
+		if ( (ntris<20) && ((nleft==0) || (nright==0)) )
+			depth+=100;
+		for(int c=0;c<2;c++)
+		{
+			pChildren[c]->m_nNode=left_child+c;
+			pChildren[c]->m_MinBound=pSubtree->m_MinBound;
+			pChildren[c]->m_MaxBound=pSubtree->m_MaxBound;
+			pChildren[c]->m_nDepth=depth+1;
+			subtrees.AddToTail(pChildren[c]);
+		}
+		pChildren[0]->m_MaxBound[split_plane]=split_value;
+		pChildren[1]->m_MinBound[split_plane]=split_value;
+		delete pSubtree;
+	}
+
+	// build the rest of the subtrees on the threads
+	subtrees.Sort(CompareKDSubtreeSizes);
+	s_pKDTreeBuilder=this;
+	s_pKDSubtrees=&subtrees;
+	if ((numthreads>1) && (subtrees.Count()>1))
+	{
+		RunThreadsOnIndividual(subtrees.Count(),false,BuildKDSubtreeThread);
+	}
+	else
+	{
+		for(int i=0;i<subtrees.Count();i++)
+			BuildKDSubtreeThread(0,i);
+	}
+	s_pKDTreeBuilder=NULL;
+	s_pKDSubtrees=NULL;
+
+	// and splice them in. the root of each goes where its subtree was left, and the rest are
+	// appended, which keeps every pair of children next to each other
+	for(int i=0;i<subtrees.Count();i++)
+	{
+		KDSubtree_t *pSubtree=subtrees[i];
+		int node_base=nodes.Count()-1;
+		int tri_base=tri_index_list.Count();
+		for(int n=0;n<pSubtree->m_Nodes.Count();n++)
+		{
+			CacheOptimizedKDNode node=pSubtree->m_Nodes[n];
+			if (node.NodeType()==KDNODE_STATE_LEAF)
+				node.Children=KDNODE_STATE_LEAF+((node.TriangleIndexStart()+tri_base)<<2);
+			else
+				node.Children=node.NodeType()+((node.LeftChild()+node_base)<<2);
+			if (n==0)
+				nodes[pSubtree->m_nNode]=node;
+			else
+				nodes.AddToTail(node);
+		}
+		tri_index_list.AddVectorToTail(pSubtree->m_TriangleIndexList);
+		delete pSubtree;
+	}
+}
+
+
 void RayTracingEnvironment::SetupAccelerationStructure(void)
 {
 	CacheOptimizedKDNode root{};
@@ -878,7 +1429,15 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 		root_triangle_list[t]=t;
 	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
 								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+	if (Flags & RTE_FLAGS_SERIAL_TREE_GENERATION)
+	{
+		RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+	}
+	else
+	{
+		CKDTreeBuilder builder(*this);
+		builder.Build();
+	}
 	delete[] root_triangle_list;
 
 	// now, convert all triangles to "intersection format"
@@ -886,6 +1445,94 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
 }
 
+// saved acceleration structures start with this, so that ones written with a different layout of
+// the triangles or nodes are rejected instead of misread
+#define ACCELERATION_STRUCTURE_VERSION 1
+
+struct AccelerationStructureHeader_t
+{
+	int32 m_nVersion;
+	int32 m_nTriangleSize;
+	int32 m_nNodeSize;
+	uint32 m_nFlags;
+	float m_MinBound[3];
+	float m_MaxBound[3];
+	int32 m_nTriangles;
+	int32 m_nNodes;
+	int32 m_nTriangleIndices;
+	int32 m_nTriangleColors;
+	int32 m_nTriangleMaterials;
+};
+
+void RayTracingEnvironment::SaveAccelerationStructure(CUtlBuffer &buf) const
+{
+	AccelerationStructureHeader_t header;
+	header.m_nVersion=ACCELERATION_STRUCTURE_VERSION;
+	header.m_nTriangleSize=sizeof(CacheOptimizedTriangle);
+	header.m_nNodeSize=sizeof(CacheOptimizedKDNode);
+	header.m_nFlags=Flags;
+	for(int c=0;c<3;c++)
+	{
+		header.m_MinBound[c]=m_MinBound[c];
+		header.m_MaxBound[c]=m_MaxBound[c];
+	}
+	header.m_nTriangles=OptimizedTriangleList.Count();
+	header.m_nNodes=OptimizedKDTree.Count();
+	header.m_nTriangleIndices=TriangleIndexList.Count();
+	header.m_nTriangleColors=TriangleColors.Count();
+	header.m_nTriangleMaterials=TriangleMaterials.Count();
+	buf.Put(&header,sizeof(header));
+
+	// the triangles are in a block vector, so they aren't contiguous
+	for(int i=0;i<OptimizedTriangleList.Count();i++)
+		buf.Put(&OptimizedTriangleList[i],sizeof(CacheOptimizedTriangle));
+	buf.Put(OptimizedKDTree.Base(),OptimizedKDTree.Count()*sizeof(CacheOptimizedKDNode));
+	buf.Put(TriangleIndexList.Base(),TriangleIndexList.Count()*sizeof(int32));
+	buf.Put(TriangleColors.Base(),TriangleColors.Count()*sizeof(Vector));
+	buf.Put(TriangleMaterials.Base(),TriangleMaterials.Count()*sizeof(int32));
+}
+
+bool RayTracingEnvironment::LoadAccelerationStructure(CUtlBuffer &buf)
+{
+	Assert(OptimizedTriangleList.Count()==0);
+	AccelerationStructureHeader_t header;
+	if (buf.GetBytesRemaining()<(int) sizeof(header))
+		return false;
+	buf.Get(&header,sizeof(header));
+	if ((header.m_nVersion!=ACCELERATION_STRUCTURE_VERSION) ||
+		(header.m_nTriangleSize!=sizeof(CacheOptimizedTriangle)) ||
+		(header.m_nNodeSize!=sizeof(CacheOptimizedKDNode)) ||
+		(header.m_nTriangles<0) || (header.m_nNodes<1) || (header.m_nTriangleIndices<0) ||
+		(header.m_nTriangleColors<0) || (header.m_nTriangleMaterials<0))
+		return false;
+
+	int nBytes=header.m_nTriangles*sizeof(CacheOptimizedTriangle)+
+		header.m_nNodes*sizeof(CacheOptimizedKDNode)+header.m_nTriangleIndices*sizeof(int32)+
+		header.m_nTriangleColors*sizeof(Vector)+header.m_nTriangleMaterials*sizeof(int32);
+	if (buf.GetBytesRemaining()<nBytes)
+		return false;
+
+	Flags=header.m_nFlags;
+	m_MinBound.Init(header.m_MinBound[0],header.m_MinBound[1],header.m_MinBound[2]);
+	m_MaxBound.Init(header.m_MaxBound[0],header.m_MaxBound[1],header.m_MaxBound[2]);
+
+	OptimizedTriangleList.EnsureCapacity(header.m_nTriangles);
+	for(int i=0;i<header.m_nTriangles;i++)
+	{
+		int j=OptimizedTriangleList.AddToTail();
+		buf.Get(&OptimizedTriangleList[j],sizeof(CacheOptimizedTriangle));
+	}
+	OptimizedKDTree.SetCount(header.m_nNodes);
+	buf.Get(OptimizedKDTree.Base(),header.m_nNodes*sizeof(CacheOptimizedKDNode));
+	TriangleIndexList.SetCount(header.m_nTriangleIndices);
+	buf.Get(TriangleIndexList.Base(),header.m_nTriangleIndices*sizeof(int32));
+	TriangleColors.SetCount(header.m_nTriangleColors);
+	buf.Get(TriangleColors.Base(),header.m_nTriangleColors*sizeof(Vector));
+	TriangleMaterials.SetCount(header.m_nTriangleMaterials);
+	buf.Get(TriangleMaterials.Base(),header.m_nTriangleMaterials*sizeof(int32));
+	return true;
+}
+
 
 
 void RayTracingEnvironment::AddInfinitePointLight(Vector position, Vector intensity)
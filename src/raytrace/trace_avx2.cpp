@@ -0,0 +1,78 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// 8 wide ray tracing with AVX2. See trace_wide_impl.h.
+
+#include "trace_wide.h"
+
+#ifdef RAYTRACE_AVX2
+
+#include <immintrin.h>
+
+#if defined( __clang__ )
+#pragma clang attribute push( __attribute__(( target( "avx2" ) )), apply_to = function )
+#elif defined( __GNUC__ )
+#pragma GCC push_options
+#pragma GCC target( "avx2" )
+// no fused multiply-adds - they round differently from the SSE path
+#pragma GCC optimize( "fp-contract=off" )
+#endif
+
+#include "trace_wide_impl.h"
+
+struct EightLanesAVX2
+{
+	enum { N = 8 };
+	typedef __m256 Float;
+	typedef __m256i Int;
+	typedef __m256 Mask;
+
+	static FORCEINLINE Float Load( const float *p ) { return _mm256_loadu_ps( p ); }
+	static FORCEINLINE void Store( float *p, const Float &a ) { _mm256_storeu_ps( p, a ); }
+	static FORCEINLINE Float Replicate( float f ) { return _mm256_set1_ps( f ); }
+
+	static FORCEINLINE Float Add( const Float &a, const Float &b ) { return _mm256_add_ps( a, b ); }
+	static FORCEINLINE Float Sub( const Float &a, const Float &b ) { return _mm256_sub_ps( a, b ); }
+	static FORCEINLINE Float Mul( const Float &a, const Float &b ) { return _mm256_mul_ps( a, b ); }
+	static FORCEINLINE Float Div( const Float &a, const Float &b ) { return _mm256_div_ps( a, b ); }
+	static FORCEINLINE Float Min( const Float &a, const Float &b ) { return _mm256_min_ps( a, b ); }
+	static FORCEINLINE Float Max( const Float &a, const Float &b ) { return _mm256_max_ps( a, b ); }
+
+	// same predicates as the SSE compares - false if either side is a NaN
+	static FORCEINLINE Mask CmpLe( const Float &a, const Float &b ) { return _mm256_cmp_ps( a, b, _CMP_LE_OS ); }
+	static FORCEINLINE Mask CmpLt( const Float &a, const Float &b ) { return _mm256_cmp_ps( a, b, _CMP_LT_OS ); }
+	static FORCEINLINE Mask CmpGe( const Float &a, const Float &b ) { return _mm256_cmp_ps( a, b, _CMP_GE_OS ); }
+	static FORCEINLINE Mask CmpGt( const Float &a, const Float &b ) { return _mm256_cmp_ps( a, b, _CMP_GT_OS ); }
+
+	static FORCEINLINE Mask And( const Mask &a, const Mask &b ) { return _mm256_and_ps( a, b ); }
+	static FORCEINLINE Mask Or( const Mask &a, const Mask &b ) { return _mm256_or_ps( a, b ); }
+	static FORCEINLINE bool Any( const Mask &a ) { return _mm256_movemask_ps( a ) != 0; }
+
+	// a where the mask is set, b elsewhere
+	static FORCEINLINE Float Select( const Mask &m, const Float &a, const Float &b ) { return _mm256_blendv_ps( b, a, m ); }
+
+	static FORCEINLINE Int ReplicateInt( int32 n ) { return _mm256_set1_epi32( n ); }
+	static FORCEINLINE void StoreInt( int32 *p, const Int &a ) { _mm256_storeu_si256( (__m256i *) p, a ); }
+	static FORCEINLINE Int SelectInt( const Mask &m, const Int &a, const Int &b )
+	{
+		return _mm256_castps_si256( _mm256_blendv_ps( _mm256_castsi256_ps( b ), _mm256_castsi256_ps( a ), m ) );
+	}
+
+	// avoid the penalty for switching back to SSE code with the upper halves dirty
+	static FORCEINLINE void Finish( void ) { _mm256_zeroupper(); }
+};
+
+void TraceEightRaysAVX2( RayTracingEnvironment &env, const EightRays &rays,
+						 const float *TMin, const float *TMax, int DirectionSignMask,
+						 RayTracingResult8 *rslt_out, int32 skip_id )
+{
+	TraceWideRays<EightLanesAVX2>( env, rays, TMin, TMax, DirectionSignMask, rslt_out, skip_id );
+}
+
+#if defined( __clang__ )
+#pragma clang attribute pop
+#elif defined( __GNUC__ )
+#pragma GCC pop_options
+#endif
+
+#endif // RAYTRACE_AVX2
@@ -0,0 +1,75 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// 16 wide ray tracing with AVX-512. See trace_wide_impl.h.
+
+#include "trace_wide.h"
+
+#ifdef RAYTRACE_AVX512
+
+#include <immintrin.h>
+
+#if defined( __clang__ )
+#pragma clang attribute push( __attribute__(( target( "avx512f" ) )), apply_to = function )
+#elif defined( __GNUC__ )
+#pragma GCC push_options
+#pragma GCC target( "avx512f" )
+// no fused multiply-adds - they round differently from the SSE path
+#pragma GCC optimize( "fp-contract=off" )
+#endif
+
+#include "trace_wide_impl.h"
+
+struct SixteenLanesAVX512
+{
+	enum { N = 16 };
+	typedef __m512 Float;
+	typedef __m512i Int;
+	typedef __mmask16 Mask;
+
+	static FORCEINLINE Float Load( const float *p ) { return _mm512_loadu_ps( p ); }
+	static FORCEINLINE void Store( float *p, const Float &a ) { _mm512_storeu_ps( p, a ); }
+	static FORCEINLINE Float Replicate( float f ) { return _mm512_set1_ps( f ); }
+
+	static FORCEINLINE Float Add( const Float &a, const Float &b ) { return _mm512_add_ps( a, b ); }
+	static FORCEINLINE Float Sub( const Float &a, const Float &b ) { return _mm512_sub_ps( a, b ); }
+	static FORCEINLINE Float Mul( const Float &a, const Float &b ) { return _mm512_mul_ps( a, b ); }
+	static FORCEINLINE Float Div( const Float &a, const Float &b ) { return _mm512_div_ps( a, b ); }
+	static FORCEINLINE Float Min( const Float &a, const Float &b ) { return _mm512_min_ps( a, b ); }
+	static FORCEINLINE Float Max( const Float &a, const Float &b ) { return _mm512_max_ps( a, b ); }
+
+	// same predicates as the SSE compares - false if either side is a NaN
+	static FORCEINLINE Mask CmpLe( const Float &a, const Float &b ) { return _mm512_cmp_ps_mask( a, b, _CMP_LE_OS ); }
+	static FORCEINLINE Mask CmpLt( const Float &a, const Float &b ) { return _mm512_cmp_ps_mask( a, b, _CMP_LT_OS ); }
+	static FORCEINLINE Mask CmpGe( const Float &a, const Float &b ) { return _mm512_cmp_ps_mask( a, b, _CMP_GE_OS ); }
+	static FORCEINLINE Mask CmpGt( const Float &a, const Float &b ) { return _mm512_cmp_ps_mask( a, b, _CMP_GT_OS ); }
+
+	static FORCEINLINE Mask And( Mask a, Mask b ) { return (Mask) ( a & b ); }
+	static FORCEINLINE Mask Or( Mask a, Mask b ) { return (Mask) ( a | b ); }
+	static FORCEINLINE bool Any( Mask a ) { return a != 0; }
+
+	// a where the mask is set, b elsewhere
+	static FORCEINLINE Float Select( Mask m, const Float &a, const Float &b ) { return _mm512_mask_blend_ps( m, b, a ); }
+
+	static FORCEINLINE Int ReplicateInt( int32 n ) { return _mm512_set1_epi32( n ); }
+	static FORCEINLINE void StoreInt( int32 *p, const Int &a ) { _mm512_storeu_si512( p, a ); }
+	static FORCEINLINE Int SelectInt( Mask m, const Int &a, const Int &b ) { return _mm512_mask_blend_epi32( m, b, a ); }
+
+	// avoid the penalty for switching back to SSE code with the upper halves dirty
+	static FORCEINLINE void Finish( void ) { _mm256_zeroupper(); }
+};
+
+void TraceSixteenRaysAVX512( RayTracingEnvironment &env, const SixteenRays &rays,
+							 const float *TMin, const float *TMax, int DirectionSignMask,
+							 RayTracingResult16 *rslt_out, int32 skip_id )
+{
+	TraceWideRays<SixteenLanesAVX512>( env, rays, TMin, TMax, DirectionSignMask, rslt_out, skip_id );
+}
+
+#if defined( __clang__ )
+#pragma clang attribute pop
+#elif defined( __GNUC__ )
+#pragma GCC pop_options
+#endif
+
+#endif // RAYTRACE_AVX512
@@ -0,0 +1,44 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// declarations shared by the 8 and 16 wide ray tracing paths. The traversal code itself is in
+// trace_wide_impl.h.
+
+#ifndef TRACE_WIDE_H
+#define TRACE_WIDE_H
+
+#include "raytrace.h"
+
+#define MAILBOX_HASH_SIZE 256
+#define MAX_TREE_DEPTH 21
+#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
+
+// which compilers can build the wide paths
+#if defined( _M_IX86 ) || defined( _M_X64 ) || defined( __i386__ ) || defined( __x86_64__ )
+#if defined( _MSC_VER )
+#if _MSC_VER >= 1700
+#define RAYTRACE_AVX2
+#endif
+#if _MSC_VER >= 1910
+#define RAYTRACE_AVX512
+#endif
+#elif defined( __clang__ )
+#define RAYTRACE_AVX2
+#define RAYTRACE_AVX512
+#elif defined( __GNUC__ )
+#if ( __GNUC__ > 4 ) || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 )
+#define RAYTRACE_AVX2
+#define RAYTRACE_AVX512
+#endif
+#endif
+#endif
+
+// entry points of the instruction set specific files. rays must have a valid direction sign mask.
+void TraceEightRaysAVX2( RayTracingEnvironment &env, const EightRays &rays,
+						 const float *TMin, const float *TMax, int DirectionSignMask,
+						 RayTracingResult8 *rslt_out, int32 skip_id );
+void TraceSixteenRaysAVX512( RayTracingEnvironment &env, const SixteenRays &rays,
+							 const float *TMin, const float *TMax, int DirectionSignMask,
+							 RayTracingResult16 *rslt_out, int32 skip_id );
+
+#endif
@@ -0,0 +1,229 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// traversal code for the 8 and 16 wide ray tracing paths. Each instruction set gets its own .cpp
+// file, which includes this after switching the compiler over to that instruction set, defines
+// a lane type and instantiates TraceWideRays with it. Everything else, including raytrace.h,
+// must be included before the switch, so that none of the code shared with the rest of the
+// program is built for the wider instruction set.
+
+#ifndef TRACE_WIDE_IMPL_H
+#define TRACE_WIDE_IMPL_H
+
+#include "trace_wide.h"
+
+// This is Trace4Rays, N rays at a time, on a lane type L providing N wide float and int
+// vectors and comparison masks. Every ray goes through exactly the same arithmetic as it does
+// in Trace4Rays (including computing the reciprocal directions 4 at a time with the SSE code,
+// since the wider reciprocal estimates are not the same), so each ray finds the same closest
+// hit within its extents. As with Trace4Rays, a hit beyond a ray's extents may also be
+// reported, and which one depends on the other rays it was traced with.
+template<class L> void TraceWideRays( RayTracingEnvironment &env, const WideRays<L::N> &rays,
+									  const float *TMinIn, const float *TMaxIn,
+									  int DirectionSignMask,
+									  RayTracingWideResult<L::N> *rslt_out, int32 skip_id )
+{
+	typedef typename L::Float Float;
+	typedef typename L::Int Int;
+	typedef typename L::Mask Mask;
+
+	// these match FourEpsilons, FourZeros and FourNegativeEpsilons in raytrace.cpp
+	const Float Epsilons=L::Replicate(1.0e-10f);
+	const Float Zeros=L::Replicate(1.0e-10f);
+	const Float NegativeEpsilons=L::Replicate(-1.0e-10f);
+	const Float Ones=L::Replicate(1.0f);
+
+	float OneOverRayDirData[3][L::N];
+	Float Origin[3],Direction[3],OneOverRayDir[3];
+	for(int c=0;c<3;c++)
+	{
+		for(int i=0;i<L::N;i+=4)
+			StoreUnalignedSIMD(
+				&OneOverRayDirData[c][i],
+				ReciprocalSaturateSIMD(LoadUnalignedSIMD(&rays.direction[c][i])));
+		Origin[c]=L::Load(rays.origin[c]);
+		Direction[c]=L::Load(rays.direction[c]);
+		OneOverRayDir[c]=L::Load(OneOverRayDirData[c]);
+	}
+
+	Int HitIds=L::ReplicateInt(-1);
+	Float HitDistance=L::Replicate((float) 1.0e23);
+	Float NormalX=L::Replicate(0.0f);
+	Float NormalY=NormalX;
+	Float NormalZ=NormalX;
+
+	// now, clip rays against bounding box
+	Float TMin=L::Load(TMinIn);
+	Float TMax=L::Load(TMaxIn);
+	for(int c=0;c<3;c++)
+	{
+		Float isect_min_t=
+			L::Mul(L::Sub(L::Replicate(env.m_MinBound[c]),Origin[c]),OneOverRayDir[c]);
+		Float isect_max_t=
+			L::Mul(L::Sub(L::Replicate(env.m_MaxBound[c]),Origin[c]),OneOverRayDir[c]);
+		TMin=L::Max(TMin,L::Min(isect_min_t,isect_max_t));
+		TMax=L::Min(TMax,L::Max(isect_min_t,isect_max_t));
+	}
+
+	if (L::Any(L::CmpLe(TMin,TMax)))
+	{
+		int32 mailboxids[MAILBOX_HASH_SIZE];				// used to avoid redundant triangle tests
+		memset(mailboxids,0xff,sizeof(mailboxids));
+
+		int front_idx[3],back_idx[3];						// based on ray direction, whether to
+															// visit left or right node first
+		for(int c=0;c<3;c++)
+		{
+			front_idx[c]=(DirectionSignMask>>c)&1;
+			back_idx[c]=1-front_idx[c];
+		}
+
+		struct NodeToVisitWide
+		{
+			CacheOptimizedKDNode const *node;
+			float TMin[L::N];
+			float TMax[L::N];
+		};
+
+		NodeToVisitWide NodeQueue[MAX_NODE_STACK_LEN];
+		CacheOptimizedKDNode const *CurNode=&(env.OptimizedKDTree[0]);
+		NodeToVisitWide *stack_ptr=&NodeQueue[MAX_NODE_STACK_LEN];
+		while(1)
+		{
+			while (CurNode->NodeType() != KDNODE_STATE_LEAF)	// traverse until next leaf
+			{
+				int split_plane_number=CurNode->NodeType();
+				CacheOptimizedKDNode const *FrontChild=&(env.OptimizedKDTree[CurNode->LeftChild()]);
+
+				Float dist_to_sep_plane=					// dist=(split-org)/dir
+					L::Mul(
+						L::Sub(L::Replicate(CurNode->SplittingPlaneValue),
+							   Origin[split_plane_number]),OneOverRayDir[split_plane_number]);
+				Mask active=L::CmpLe(TMin,TMax);			// mask of which rays are active
+
+				// now, decide how to traverse children. can either do front,back, or do front
+				// and push back.
+				Mask hits_front=L::And(active,L::CmpGe(dist_to_sep_plane,TMin));
+				if (! L::Any(hits_front))
+				{
+					// missed the front. only traverse back
+					CurNode=FrontChild+back_idx[split_plane_number];
+					TMin=L::Max(TMin,dist_to_sep_plane);
+				}
+				else
+				{
+					Mask hits_back=L::And(active,L::CmpLe(dist_to_sep_plane,TMax));
+					if (! L::Any(hits_back))
+					{
+						// missed the back - only need to traverse front node
+						CurNode=FrontChild+front_idx[split_plane_number];
+						TMax=L::Min(TMax,dist_to_sep_plane);
+					}
+					else
+					{
+						// at least some rays hit both nodes.
+						// must push far, traverse near
+						assert(stack_ptr>NodeQueue);
+						--stack_ptr;
+						stack_ptr->node=FrontChild+back_idx[split_plane_number];
+						L::Store(stack_ptr->TMin,L::Max(TMin,dist_to_sep_plane));
+						L::Store(stack_ptr->TMax,TMax);
+						CurNode=FrontChild+front_idx[split_plane_number];
+						TMax=L::Min(TMax,dist_to_sep_plane);
+					}
+				}
+			}
+			// hit a leaf! must do intersection check
+			int ntris=CurNode->NumberOfTrianglesInLeaf();
+			if (ntris)
+			{
+				int32 const *tlist=&(env.TriangleIndexList[CurNode->TriangleIndexStart()]);
+				do
+				{
+					int tnum=*(tlist++);
+					// check mailbox
+					int mbox_slot=tnum & (MAILBOX_HASH_SIZE-1);
+					TriIntersectData_t const *tri = &( env.OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+					if ( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == skip_id ) )
+						continue;
+					mailboxids[mbox_slot] = tnum;
+
+					// compute plane intersection
+					Float Nx=L::Replicate( tri->m_flNx );
+					Float Ny=L::Replicate( tri->m_flNy );
+					Float Nz=L::Replicate( tri->m_flNz );
+
+					Float DDotN=L::Add(L::Add(L::Mul(Direction[0],Nx),L::Mul(Direction[1],Ny)),
+									   L::Mul(Direction[2],Nz));
+					// mask off zero or near zero (ray parallel to surface)
+					Mask did_hit=L::Or( L::CmpGt( DDotN,Epsilons ),
+										L::CmpLt( DDotN,NegativeEpsilons ) );
+
+					Float ODotN=L::Add(L::Add(L::Mul(Origin[0],Nx),L::Mul(Origin[1],Ny)),
+									   L::Mul(Origin[2],Nz));
+					Float numerator=L::Sub( L::Replicate( tri->m_flD ),ODotN );
+
+					Float isect_t=L::Div( numerator,DDotN );
+					// now, we have the distance to the plane. lets update our mask
+					did_hit=L::And( did_hit,L::CmpGt( isect_t,Zeros ) );
+					did_hit=L::And( did_hit,L::CmpLt( isect_t,HitDistance ) );
+
+					if ( ! L::Any( did_hit ) )
+						continue;
+
+					// now, check 3 edges
+					Float hitc1=L::Add( Origin[tri->m_nCoordSelect0],
+										L::Mul( isect_t,Direction[tri->m_nCoordSelect0] ) );
+					Float hitc2=L::Add( Origin[tri->m_nCoordSelect1],
+										L::Mul( isect_t,Direction[tri->m_nCoordSelect1] ) );
+
+					// do barycentric coordinate check
+					Float B0=L::Mul( L::Replicate( tri->m_ProjectedEdgeEquations[0] ),hitc1 );
+					B0=L::Add( B0,L::Mul( L::Replicate( tri->m_ProjectedEdgeEquations[1] ),hitc2 ) );
+					B0=L::Add( B0,L::Replicate( tri->m_ProjectedEdgeEquations[2] ) );
+
+					did_hit=L::And( did_hit,L::CmpGe( B0,Zeros ) );
+
+					Float B1=L::Mul( L::Replicate( tri->m_ProjectedEdgeEquations[3] ),hitc1 );
+					B1=L::Add( B1,L::Mul( L::Replicate( tri->m_ProjectedEdgeEquations[4] ),hitc2 ) );
+					B1=L::Add( B1,L::Replicate( tri->m_ProjectedEdgeEquations[5] ) );
+
+					did_hit=L::And( did_hit,L::CmpGe( B1,Zeros ) );
+
+					Float B2=L::Add( B1,B0 );
+					did_hit=L::And( did_hit,L::CmpLe( B2,Ones ) );
+
+					if ( ! L::Any( did_hit ) )
+						continue;
+
+					// now, set the hit_id and closest_hit fields for any enabled rays
+					HitIds=L::SelectInt( did_hit,L::ReplicateInt( tnum ),HitIds );
+					HitDistance=L::Select( did_hit,isect_t,HitDistance );
+					NormalX=L::Select( did_hit,Nx,NormalX );
+					NormalY=L::Select( did_hit,Ny,NormalY );
+					NormalZ=L::Select( did_hit,Nz,NormalZ );
+				} while (--ntris);
+				// now, check if all rays have terminated
+				if (! L::Any(L::CmpLe(TMax,HitDistance)))
+					break;
+			}
+
+			if (stack_ptr==&NodeQueue[MAX_NODE_STACK_LEN])
+				break;
+			// pop stack!
+			CurNode=stack_ptr->node;
+			TMin=L::Load(stack_ptr->TMin);
+			TMax=L::Load(stack_ptr->TMax);
+			stack_ptr++;
+		}
+	}
+
+	L::StoreInt(rslt_out->HitIds,HitIds);
+	L::Store(rslt_out->HitDistance,HitDistance);
+	L::Store(rslt_out->surface_normal[0],NormalX);
+	L::Store(rslt_out->surface_normal[1],NormalY);
+	L::Store(rslt_out->surface_normal[2],NormalZ);
+	L::Finish();
+}
+
+#endif
@@ -272,3 +272,54 @@ bool Check3DNowTechnology(void)
 #pragma optimize( "", on )
 
 #endif // _WIN32
+
+//-----------------------------------------------------------------------------
+// AVX2 and AVX-512 need the OS to save the wider registers on a context switch,
+// as well as CPU support, so check XCR0 along with the feature bits
+//-----------------------------------------------------------------------------
+#if defined( _WIN32 ) && !defined( _X360 )
+
+#include <intrin.h>
+
+static bool CheckOSXSaveState( unsigned int nStateMask )
+{
+	int regs[4];
+	__cpuid( regs, 1 );
+
+	// bit 27 of ecx is set if the OS uses XSAVE, bit 28 if the CPU has AVX
+	const int nNeeded = ( 1 << 27 ) | ( 1 << 28 );
+	if ( ( regs[2] & nNeeded ) != nNeeded )
+		return false;
+
+	return ( _xgetbv( 0 ) & nStateMask ) == nStateMask;
+}
+
+static unsigned int GetStructuredExtendedFeatures( void )
+{
+	int regs[4];
+	__cpuid( regs, 0 );
+	if ( regs[0] < 7 )
+		return 0;
+
+	__cpuidex( regs, 7, 0 );
+	return regs[1];
+}
+
+bool CheckAVX2Technology(void)
+{
+	// XMM and YMM state, and bit 5 of leaf 7 ebx
+	return CheckOSXSaveState( 0x06 ) && ( GetStructuredExtendedFeatures() & ( 1 << 5 ) ) != 0;
+}
+
+bool CheckAVX512Technology(void)
+{
+	// opmask and ZMM state as well, and bit 16 (AVX512F) of leaf 7 ebx
+	return CheckOSXSaveState( 0xE6 ) && ( GetStructuredExtendedFeatures() & ( 1 << 16 ) ) != 0;
+}
+
+#else
+
+bool CheckAVX2Technology(void) { return false; }
+bool CheckAVX512Technology(void) { return false; }
+
+#endif
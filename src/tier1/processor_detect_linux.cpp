@@ -71,3 +71,56 @@ bool Check3DNowTechnology(void)
 }
 
 #endif
+
+//-----------------------------------------------------------------------------
+// AVX2 and AVX-512 need the OS to save the wider registers on a context switch,
+// as well as CPU support, so check XCR0 along with the feature bits
+//-----------------------------------------------------------------------------
+#if defined( __i386__ ) || defined( __x86_64__ )
+
+#include <cpuid.h>
+
+static bool CheckOSXSaveState( unsigned int nStateMask )
+{
+	unsigned int eax, ebx, ecx, edx;
+	if ( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+		return false;
+
+	// bit 27 of ecx is set if the OS uses XSAVE, bit 28 if the CPU has AVX
+	const unsigned int nNeeded = ( 1 << 27 ) | ( 1 << 28 );
+	if ( ( ecx & nNeeded ) != nNeeded )
+		return false;
+
+	unsigned int xcr0Lo, xcr0Hi;
+	asm volatile( "xgetbv" : "=a" (xcr0Lo), "=d" (xcr0Hi) : "c" (0) );
+	return ( xcr0Lo & nStateMask ) == nStateMask;
+}
+
+static unsigned int GetStructuredExtendedFeatures( void )
+{
+	if ( __get_cpuid_max( 0, 0 ) < 7 )
+		return 0;
+
+	unsigned int eax, ebx, ecx, edx;
+	__cpuid_count( 7, 0, eax, ebx, ecx, edx );
+	return ebx;
+}
+
+bool CheckAVX2Technology(void)
+{
+	// XMM and YMM state, and bit 5 of leaf 7 ebx
+	return CheckOSXSaveState( 0x06 ) && ( GetStructuredExtendedFeatures() & ( 1 << 5 ) ) != 0;
+}
+
+bool CheckAVX512Technology(void)
+{
+	// opmask and ZMM state as well, and bit 16 (AVX512F) of leaf 7 ebx
+	return CheckOSXSaveState( 0xE6 ) && ( GetStructuredExtendedFeatures() & ( 1 << 16 ) ) != 0;
+}
+
+#else
+
+bool CheckAVX2Technology(void) { return false; }
+bool CheckAVX512Technology(void) { return false; }
+
+#endif
@@ -59,6 +59,7 @@ CUtlLinkedList<CleanupFn, unsigned short> g_CleanupFunctions;
 CUtlLinkedList<SpewHookFn, unsigned short> g_ExtraSpewHooks;
 
 bool g_bStopOnExit = false;
+bool g_bSuppressPrintfOutput = false;
 void (*g_ExtraSpewHook)(const char*) = NULL;
 
 #if defined( _WIN32 ) || defined( WIN32 )
@@ -218,7 +219,6 @@ void Error( char const *pMsg, ... )
 
 CRITICAL_SECTION g_SpewCS;
 bool g_bSpewCSInitted = false;
-bool g_bSuppressPrintfOutput = false;
 
 SpewRetval_t CmdLib_SpewOutputFunc( SpewType_t type, char const *pMsg )
 {
@@ -13,13 +13,19 @@
 
 #define	USED
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
-
-#define	MAX_THREADS	16
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
 
 
 class CRunThreadsData
@@ -30,18 +36,121 @@ public:
 	RunThreadsFn m_Fn;
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CUtlVector<CRunThreadsData> g_RunThreadsData;
 
 
-int		dispatch;
-int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
+bool g_bPinThreadsToNumaNodes = false;
+bool g_bReportThreadScaling = false;
+
+CUtlVector<ThreadHandle_t> g_ThreadHandles;
+
+
+/*
+===================================================================
+
+WORK QUEUES
+
+Work items are handed out in chunks of consecutive items. Chunks are
+dealt round-robin to per-thread queues, so the threads start out
+working on the front of the list together (vvis sorts its portals so
+the cheap ones come first). A thread takes chunks from the front of
+its own queue, and when its queue is empty, steals the back half of
+another thread's queue. The queues are only locked when a chunk is
+taken, so threads almost never contend.
+
+===================================================================
+*/
+
+// The chunks in a queue are m_iFirstChunk + k * m_nChunkStride, for m_iBegin <= k < m_iEnd.
+class CThreadWorkQueue
+{
+public:
+	CThreadFastMutex m_Lock;
+	int m_iFirstChunk;
+	int m_nChunkStride;
+	int m_iBegin;
+	int m_iEnd;
+
+	// Only touched by the owning thread.
+	int m_iNextItem;			// Items left in the chunk in progress.
+	int m_iEndItem;
+	int m_nSteals;
+	double m_flStartTime;		// When the thread started and ran out of work, for the scaling report.
+	double m_flEndTime;
+
+	byte m_Pad[64];				// Keep queues on separate cache lines.
+};
+
+CUtlVector<CThreadWorkQueue> g_WorkQueues;
+int		g_nChunkSize;
+int		workcount;
+int32 volatile g_nItemsDispatched;
+CThreadFastMutex g_PacifierLock;
+
+// 1 + index of the worker thread, or 0 on threads not started by RunThreadsOn.
+CTHREADLOCALINT g_iWorkerThread;
+
+
+static bool PopWorkChunk( CThreadWorkQueue &queue, int *pChunk )
+{
+	AUTO_LOCK( queue.m_Lock );
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+	if ( queue.m_iBegin >= queue.m_iEnd )
+		return false;
+
+	*pChunk = queue.m_iFirstChunk + queue.m_iBegin * queue.m_nChunkStride;
+	++queue.m_iBegin;
+	return true;
+}
+
+
+// Move the back half of another thread's queue into this (empty) one.
+static bool StealWorkChunks( int iThread )
+{
+	CThreadWorkQueue &queue = g_WorkQueues[iThread];
+
+	for ( int i=1; i < g_WorkQueues.Count(); i++ )
+	{
+		CThreadWorkQueue &victim = g_WorkQueues[(iThread + i) % g_WorkQueues.Count()];
 
+		// Check without the lock first so idle threads don't hammer the busy ones.
+		if ( victim.m_iBegin >= victim.m_iEnd )
+			continue;
+
+		// Never hold two queue locks at once, or two threads stealing from each other could deadlock.
+		victim.m_Lock.Lock();
+
+		int nLeft = victim.m_iEnd - victim.m_iBegin;
+		if ( nLeft <= 0 )
+		{
+			victim.m_Lock.Unlock();
+			continue;
+		}
+
+		int iFirstChunk = victim.m_iFirstChunk;
+		int nChunkStride = victim.m_nChunkStride;
+		int iEnd = victim.m_iEnd;
+		int iSplit = iEnd - ( nLeft + 1 ) / 2;
+		victim.m_iEnd = iSplit;
+
+		victim.m_Lock.Unlock();
+
+		AUTO_LOCK( queue.m_Lock );
+		queue.m_iFirstChunk = iFirstChunk;
+		queue.m_nChunkStride = nChunkStride;
+		queue.m_iBegin = iSplit;
+		queue.m_iEnd = iEnd;
+
+		++queue.m_nSteals;
+		return true;
+	}
+
+	return false;
+}
 
 
 /*
@@ -52,23 +161,35 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
-
-	ThreadLock ();
+	// Threads that aren't workers (there shouldn't be any) share the first queue.
+	int iThread = max( (int)g_iWorkerThread - 1, 0 );
+	CThreadWorkQueue &queue = g_WorkQueues[iThread];
 
-	if (dispatch == workcount)
+	if ( queue.m_iNextItem >= queue.m_iEndItem )
 	{
-		ThreadUnlock ();
-		return -1;
-	}
+		int iChunk;
+		while ( !PopWorkChunk( queue, &iChunk ) )
+		{
+			if ( !StealWorkChunks( iThread ) )
+			{
+				queue.m_flEndTime = Plat_FloatTime();
+				return -1;
+			}
+		}
 
-	UpdatePacifier( (float)dispatch / workcount );
+		queue.m_iNextItem = iChunk * g_nChunkSize;
+		queue.m_iEndItem = min( queue.m_iNextItem + g_nChunkSize, workcount );
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+		int nChunkItems = queue.m_iEndItem - queue.m_iNextItem;
+		int nDispatched = ThreadInterlockedExchangeAdd( &g_nItemsDispatched, nChunkItems ) + nChunkItems;
+		if ( pacifier && g_PacifierLock.TryLock() )
+		{
+			UpdatePacifier( (float)nDispatched / workcount );
+			g_PacifierLock.Unlock();
+		}
+	}
 
-	return r;
+	return queue.m_iNextItem++;
 }
 
 
@@ -101,45 +222,45 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 /*
 ===================================================================
 
-WIN32
+PLATFORM
 
 ===================================================================
 */
 
 int		numthreads = -1;
-CRITICAL_SECTION		crit;
+CThreadMutex		crit;
 static int enter;
 
 
-class CCritInit
-{
-public:
-	CCritInit()
-	{
-		InitializeCriticalSection (&crit);
-	}
-} g_CritInit;
-
-
-
 void SetLowPriority()
 {
+#ifdef _WIN32
 	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
+#else
+	setpriority( PRIO_PROCESS, 0, 19 );
+#endif
 }
 
 
 void ThreadSetDefault (void)
 {
-	SYSTEM_INFO info;
-
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+#ifdef _WIN32
+		numthreads = GetActiveProcessorCount( ALL_PROCESSOR_GROUPS );
+#else
+		numthreads = sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
+	if (numthreads > MAX_TOOL_THREADS)
+	{
+		Warning ("%i threads requested, using %i\n", numthreads, MAX_TOOL_THREADS);
+		numthreads = MAX_TOOL_THREADS;
+	}
+
 	Msg ("%i threads\n", numthreads);
 }
 
@@ -148,7 +269,7 @@ void ThreadLock (void)
 {
 	if (!threaded)
 		return;
-	EnterCriticalSection (&crit);
+	crit.Lock ();
 	if (enter)
 		Error ("Recursive ThreadLock\n");
 	enter = 1;
@@ -161,14 +282,85 @@ void ThreadUnlock (void)
 	if (!enter)
 		Error ("ThreadUnlock without lock\n");
 	enter = 0;
-	LeaveCriticalSection (&crit);
+	crit.Unlock ();
+}
+
+
+// Restrict the calling thread to the processors of one NUMA node, spreading threads over the nodes
+// round-robin, so each thread's memory (allocated on first touch) stays local to it.
+static void PinThreadToNumaNode( int iThread )
+{
+#ifdef _WIN32
+	ULONG nHighestNode;
+	if ( !GetNumaHighestNodeNumber( &nHighestNode ) || nHighestNode == 0 )
+		return;
+
+	ULONGLONG mask;
+	if ( GetNumaNodeProcessorMask( (UCHAR)( iThread % ( nHighestNode + 1 ) ), &mask ) && mask )
+	{
+		SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR)mask );
+	}
+#elif defined( LINUX )
+	int nNodes = 0;
+	while ( 1 )
+	{
+		char szPath[MAX_PATH];
+		Q_snprintf( szPath, sizeof( szPath ), "/sys/devices/system/node/node%d", nNodes );
+		if ( access( szPath, F_OK ) != 0 )
+			break;
+		++nNodes;
+	}
+
+	if ( nNodes <= 1 )
+		return;
+
+	char szPath[MAX_PATH];
+	Q_snprintf( szPath, sizeof( szPath ), "/sys/devices/system/node/node%d/cpulist", iThread % nNodes );
+	FILE *fp = fopen( szPath, "r" );
+	if ( !fp )
+		return;
+
+	// The list looks like "0-15,32-47".
+	cpu_set_t cpus;
+	CPU_ZERO( &cpus );
+
+	int iFirst, iLast;
+	while ( fscanf( fp, "%d", &iFirst ) == 1 )
+	{
+		iLast = iFirst;
+		int c = fgetc( fp );
+		if ( c == '-' )
+		{
+			if ( fscanf( fp, "%d", &iLast ) != 1 )
+				break;
+			c = fgetc( fp );
+		}
+
+		for ( int iCPU=iFirst; iCPU <= iLast && iCPU < CPU_SETSIZE; iCPU++ )
+			CPU_SET( iCPU, &cpus );
+
+		if ( c != ',' )
+			break;
+	}
+	fclose( fp );
+
+	if ( CPU_COUNT( &cpus ) )
+	{
+		sched_setaffinity( 0, sizeof( cpus ), &cpus );
+	}
+#endif
 }
 
 
 // This runs in the thread and dispatches a RunThreadsFn call.
-DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
+uintp InternalRunThreadsFn( void *pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+
+	g_iWorkerThread = pData->m_iThread + 1;
+	if ( g_bPinThreadsToNumaNodes )
+		PinThreadToNumaNode( pData->m_iThread );
+
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
 	return 0;
 }
@@ -182,29 +374,29 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 	if ( numthreads > MAX_TOOL_THREADS )
 		numthreads = MAX_TOOL_THREADS;
 
+	g_RunThreadsData.SetCount( numthreads );
+	g_ThreadHandles.SetCount( numthreads );
+
 	for ( int i=0; i < numthreads ;i++ )
 	{
 		g_RunThreadsData[i].m_iThread = i;
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
+		g_ThreadHandles[i] = CreateSimpleThread( InternalRunThreadsFn, &g_RunThreadsData[i] );
 
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
 		{
 			if( g_bLowPriorityThreads )
-				SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
+				ThreadSetPriority( g_ThreadHandles[i], TP_PRIORITY_LOWEST );
 		}
 		else if ( ePriority == k_eRunThreadsPriority_Idle )
 		{
-			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
+#ifdef _WIN32
+			ThreadSetPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
+#else
+			ThreadSetPriority( g_ThreadHandles[i], TP_PRIORITY_LOWEST );
+#endif
 		}
 	}
 }
@@ -212,13 +404,41 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
-	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	for ( int i=0; i < g_ThreadHandles.Count(); i++ )
+	{
+		ThreadJoin( g_ThreadHandles[i] );
+		ReleaseThreadHandle( g_ThreadHandles[i] );
+	}
+	g_ThreadHandles.RemoveAll();
 
 	threaded = false;
 }
-	
+
+
+// Print how well the last RunThreadsOn pass used its threads. The speedup is the thread time spent
+// working divided by the elapsed time, so it is what the pass gained over running on one thread.
+static void ReportThreadScaling( double flElapsed )
+{
+	double flBusy = 0, flMin = 1e30, flMax = 0;
+	int nSteals = 0;
+
+	for ( int i=0; i < g_WorkQueues.Count(); i++ )
+	{
+		double flThread = g_WorkQueues[i].m_flEndTime - g_WorkQueues[i].m_flStartTime;
+		flBusy += flThread;
+		flMin = min( flMin, flThread );
+		flMax = max( flMax, flThread );
+		nSteals += g_WorkQueues[i].m_nSteals;
+	}
+
+	if ( flElapsed <= 0 )
+		return;
+
+	double flSpeedup = flBusy / flElapsed;
+	Msg( "    %i items in chunks of %i, %i threads: %.2fs, %.1fx speedup, %.0f%% efficiency, thread time %.2fs - %.2fs, %i steals\n",
+		workcount, g_nChunkSize, g_WorkQueues.Count(), flElapsed, flSpeedup, 100.0 * flSpeedup / g_WorkQueues.Count(), flMin, flMax, nSteals );
+}
+
 
 /*
 =============
@@ -227,10 +447,12 @@ RunThreadsOn
 */
 void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData )
 {
-	int		start, end;
+	double	start, end;
+
+	if (numthreads == -1)
+		ThreadSetDefault ();
 
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
 	StartPacifier("");
 	pacifier = showpacifier;
@@ -241,7 +463,25 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	return;
 #endif
 
-	
+	// Small chunks keep the tail of the pass short, since a chunk can't be split once it is taken.
+	g_nChunkSize = clamp( workcnt / ( numthreads * 64 ), 1, 16 );
+	int nChunks = ( workcnt + g_nChunkSize - 1 ) / g_nChunkSize;
+
+	g_WorkQueues.SetCount( min( numthreads, MAX_TOOL_THREADS ) );
+	for ( int i=0; i < g_WorkQueues.Count(); i++ )
+	{
+		CThreadWorkQueue &queue = g_WorkQueues[i];
+		queue.m_iFirstChunk = i;
+		queue.m_nChunkStride = g_WorkQueues.Count();
+		queue.m_iBegin = 0;
+		queue.m_iEnd = ( nChunks - i + g_WorkQueues.Count() - 1 ) / g_WorkQueues.Count();
+		queue.m_iNextItem = queue.m_iEndItem = 0;
+		queue.m_nSteals = 0;
+		queue.m_flStartTime = start;
+		queue.m_flEndTime = start;
+	}
+	g_nItemsDispatched = 0;
+
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
 
@@ -250,8 +490,11 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	if (pacifier)
 	{
 		EndPacifier(false);
-		printf (" (%i)\n", end-start);
+		printf (" (%i)\n", (int)(end-start));
 	}
+
+	if ( g_bReportThreadScaling )
+		ReportThreadScaling( end - start );
 }
 
 
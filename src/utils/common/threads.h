@@ -18,7 +18,7 @@
 
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
 // large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
+#define MAX_TOOL_THREADS	256
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
@@ -27,6 +27,12 @@ extern	int		numthreads;
 // If set to true, then all the threads that are created are low priority.
 extern bool	g_bLowPriorityThreads;
 
+// If set to true, each thread is restricted to the processors of one NUMA node (-numa).
+extern bool	g_bPinThreadsToNumaNodes;
+
+// If set to true, RunThreadsOn prints the speedup each pass got from its threads (-threadstats).
+extern bool	g_bReportThreadScaling;
+
 typedef void (*ThreadWorkerFn)( int iThread, int iWorkItem );
 typedef void (*RunThreadsFn)( int iThread, void *pUserData );
 
@@ -1114,6 +1114,14 @@ int RunVBSP( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-numa" ) )
+		{
+			g_bPinThreadsToNumaNodes = true;
+		}
+		else if( !Q_stricmp( argv[i], "-threadstats" ) )
+		{
+			g_bReportThreadScaling = true;
+		}
 		else if( !Q_stricmp( argv[i], "-lightifmissing" ) )
 		{
 			g_bLightIfMissing = true;
@@ -1220,6 +1228,8 @@ int RunVBSP( int argc, char **argv )
 				"  -novconfig   : Don't bring up graphical UI on vproject errors.\n"
 				"  -threads     : Control the number of threads vbsp uses (defaults to the # of\n"
 				"                 processors on your machine).\n"
+				"  -numa        : Keep each thread on the processors of one NUMA node.\n"
+				"  -threadstats : Print the speedup each threaded pass gets from its threads.\n"
 				"  -verboseentities: If -v is on, this disables verbose output for submodels.\n"
 				"  -noweld      : Don't join face vertices together.\n"
 				"  -nocsg       : Don't chop out intersecting brush areas.\n"
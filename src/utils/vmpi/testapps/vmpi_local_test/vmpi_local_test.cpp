@@ -0,0 +1,136 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Smoke test for the POSIX local-worker VMPI backend. The master forks
+//          its workers, hands them a batch of work units with DistributeWork,
+//          and checks that every work unit comes back once with the right
+//          result. Exits with 0 if everything checks out.
+//
+//=============================================================================//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "vmpi.h"
+#include "vmpi_distribute_work.h"
+#include "threads.h"
+#include "tier0/dbg.h"
+#include "tier0/icommandline.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+
+
+#define DEFAULT_WORK_UNITS	2000
+
+static CUtlVector<uint32> g_Results;
+static CUtlVector<int> g_ResultCounts;		// How many results the master accepted for each work unit
+static int g_nResultsFromWorkers = 0;
+static int g_nBadResults = 0;
+
+
+// Enough work that a work unit isn't free, and a result the master can check.
+static uint32 ComputeWorkUnit( uint64 iWorkUnit )
+{
+	uint32 x = (uint32)iWorkUnit + 1;
+	for ( int i=0; i < 20000; i++ )
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	}
+	return x;
+}
+
+
+static void ProcessWorkUnit( int iThread, uint64 iWorkUnit, MessageBuffer *pBuf )
+{
+	// The master runs with mpi_NoMasterWorkerThreads, so this is always a worker.
+	uint32 result = ComputeWorkUnit( iWorkUnit );
+	pBuf->write( &result, sizeof( result ) );
+}
+
+
+static void ReceiveWorkUnit( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
+{
+	uint32 result;
+	if ( iWorkUnit >= (uint64)g_Results.Count() || pBuf->read( &result, sizeof( result ) ) == -1 )
+	{
+		++g_nBadResults;
+		return;
+	}
+
+	g_Results[iWorkUnit] = result;
+	++g_ResultCounts[iWorkUnit];
+	++g_nResultsFromWorkers;
+}
+
+
+static void HandleDisconnect( int procID, const char *pReason )
+{
+	if ( VMPI_IsWorker() )
+	{
+		// The master is done with us.
+		exit( 0 );
+	}
+}
+
+
+int main( int argc, char **argv )
+{
+	CommandLine()->CreateCmdLine( argc, argv );
+
+	int nWorkUnits = DEFAULT_WORK_UNITS;
+	const char *pWorkUnits = VMPI_FindArg( argc, argv, "-workunits", NULL );
+	if ( pWorkUnits )
+		nWorkUnits = MAX( 1, atoi( pWorkUnits ) );
+
+	// Leave all the work to the workers so that every result has to make the trip back to the master.
+	CommandLine()->AppendParm( VMPI_GetParamString( mpi_NoMasterWorkerThreads ), NULL );
+
+	ThreadSetDefault();
+
+	if ( !VMPI_Init( argc, argv, NULL, HandleDisconnect, VMPI_RUN_LOCAL ) )
+	{
+		Warning( "VMPI_Init failed.\n" );
+		return 1;
+	}
+
+	g_Results.SetCount( nWorkUnits );
+	g_ResultCounts.SetCount( nWorkUnits );
+	for ( int i=0; i < nWorkUnits; i++ )
+	{
+		g_Results[i] = 0;
+		g_ResultCounts[i] = 0;
+	}
+
+	DistributeWork( nWorkUnits, ProcessWorkUnit, ReceiveWorkUnit );
+
+	if ( VMPI_IsWorker() )
+	{
+		// Wait for the master to hang up.
+		while ( 1 )
+			VMPI_DispatchNextMessage();
+	}
+
+	int nMissing = 0, nWrong = 0;
+	for ( int i=0; i < nWorkUnits; i++ )
+	{
+		if ( g_ResultCounts[i] != 1 )
+			++nMissing;
+		else if ( g_Results[i] != ComputeWorkUnit( i ) )
+			++nWrong;
+	}
+
+	int nWorkers = VMPI_GetCurrentNumberOfConnections() - 1;
+	VMPI_Finalize();
+
+	Msg( "\n%d work units: %d from %d workers, %d missing or duplicated, %d wrong, %d malformed.\n",
+		nWorkUnits, g_nResultsFromWorkers, nWorkers, nMissing, nWrong, g_nBadResults );
+
+	if ( nMissing || nWrong || g_nBadResults )
+	{
+		Warning( "vmpi_local_test FAILED\n" );
+		return 1;
+	}
+
+	Msg( "vmpi_local_test passed\n" );
+	return 0;
+}
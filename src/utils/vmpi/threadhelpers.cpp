@@ -5,9 +5,12 @@
 // $NoKeywords: $
 //=============================================================================//
 
+#if defined( _WIN32 )
 #include <windows.h>
+#endif
 #include "threadhelpers.h"
 #include "tier0/dbg.h"
+#include "tier0/threadtools.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -16,6 +19,8 @@
 // CVMPICriticalSection implementation.
 // -------------------------------------------------------------------------------- //
 
+#if defined( _WIN32 )
+
 CVMPICriticalSection::CVMPICriticalSection()
 {
 	Assert( sizeof( CRITICAL_SECTION ) == SIZEOF_CS );
@@ -69,6 +74,61 @@ void CVMPICriticalSection::Unlock()
 	LeaveCriticalSection( (CRITICAL_SECTION*)&m_CS );
 }
 
+#else
+
+CVMPICriticalSection::CVMPICriticalSection()
+{
+#if defined( _DEBUG )
+	pthread_mutex_init( (pthread_mutex_t*)&m_DeadlockProtect, NULL );
+#endif
+
+	pthread_mutex_init( (pthread_mutex_t*)&m_CS, NULL );
+}
+
+
+CVMPICriticalSection::~CVMPICriticalSection()
+{
+	pthread_mutex_destroy( (pthread_mutex_t*)&m_CS );
+
+#if defined( _DEBUG )
+	pthread_mutex_destroy( (pthread_mutex_t*)&m_DeadlockProtect );
+#endif
+}
+
+
+
+void CVMPICriticalSection::Lock()
+{
+#if defined( _DEBUG )
+	// Check if this one is already locked.
+	unsigned long id = (unsigned long)ThreadGetCurrentId();
+	pthread_mutex_lock( (pthread_mutex_t*)&m_DeadlockProtect );
+		Assert( m_Locks.Find( id ) == m_Locks.InvalidIndex() );
+		m_Locks.AddToTail( id );
+	pthread_mutex_unlock( (pthread_mutex_t*)&m_DeadlockProtect );
+#endif
+
+	pthread_mutex_lock( (pthread_mutex_t*)&m_CS );
+}
+
+
+void CVMPICriticalSection::Unlock()
+{
+#if defined( _DEBUG )
+	// Check if this one is already locked.
+	unsigned long id = (unsigned long)ThreadGetCurrentId();
+	pthread_mutex_lock( (pthread_mutex_t*)&m_DeadlockProtect );
+		int index = m_Locks.Find( id );
+		Assert( index != m_Locks.InvalidIndex() );
+		m_Locks.Remove( index );
+	pthread_mutex_unlock( (pthread_mutex_t*)&m_DeadlockProtect );
+#endif
+	
+	pthread_mutex_unlock( (pthread_mutex_t*)&m_CS );
+}
+
+#endif
+
 
 
 // -------------------------------------------------------------------------------- //
@@ -119,6 +179,8 @@ CEvent::~CEvent()
 	Term();
 }
 
+#if defined( _WIN32 )
+
 bool CEvent::Init( bool bManualReset, bool bInitialState )
 {
 	Term();
@@ -154,4 +216,45 @@ bool CEvent::ResetEvent()
 	return ::ResetEvent( (HANDLE)m_hEvent ) != 0;
 }
 
+#else
+
+bool CEvent::Init( bool bManualReset, bool bInitialState )
+{
+	Term();
+
+	CThreadEvent *pEvent = new CThreadEvent( bManualReset );
+	if ( bInitialState )
+		pEvent->Set();
+
+	m_hEvent = pEvent;
+	return true;
+}
+
+void CEvent::Term()
+{
+	if ( m_hEvent )
+	{
+		delete (CThreadEvent*)m_hEvent;
+		m_hEvent = NULL;
+	}
+}
+
+void* CEvent::GetEventHandle() const
+{
+	Assert( m_hEvent );
+	return m_hEvent;
+}
 
+bool CEvent::SetEvent()
+{
+	Assert( m_hEvent );
+	return ((CThreadEvent*)m_hEvent)->Set();
+}
+
+bool CEvent::ResetEvent()
+{
+	Assert( m_hEvent );
+	return ((CThreadEvent*)m_hEvent)->Reset();
+}
+
+#endif
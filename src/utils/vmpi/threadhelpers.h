@@ -14,10 +14,15 @@
 
 #include "tier1/utllinkedlist.h"
 
-#if PLATFORM_WINDOWS_PC64
-	#define SIZEOF_CS	40	// sizeof( CRITICAL_SECTION )
+#if defined( _WIN32 )
+	#if PLATFORM_WINDOWS_PC64
+		#define SIZEOF_CS	40	// sizeof( CRITICAL_SECTION )
+	#else
+		#define SIZEOF_CS	24	// sizeof( CRITICAL_SECTION )
+	#endif
 #else
-	#define SIZEOF_CS	24	// sizeof( CRITICAL_SECTION )
+	#include <pthread.h>
+	#define SIZEOF_CS	sizeof( pthread_mutex_t )
 #endif
 
 class CVMPICriticalSection
@@ -4,7 +4,9 @@
 //
 //=============================================================================//
 
+#if defined( _WIN32 )
 #include <windows.h>
+#endif
 #include "vmpi.h"
 #include "vmpi_distribute_work.h"
 #include "tier0/platform.h"
@@ -138,7 +140,7 @@ void ShowMPIStats(
 		Msg( "Total Bytes Recv : %dk (%.2fk/sec, %d messages)\n", (int)flKRecv, flKRecv / flTimeSpent, nMessagesReceived );
 		if ( g_bMPIMaster )
 		{
-			Msg( "Duplicated WUs   : %I64u (%.1f%%)\n", g_nDuplicatedWUs, (float)g_nDuplicatedWUs * 100.0f / g_nWUs );
+			Msg( "Duplicated WUs   : %llu (%.1f%%)\n", (unsigned long long)g_nDuplicatedWUs, (float)g_nDuplicatedWUs * 100.0f / g_nWUs );
 
 			Msg( "\nWU count by proc:\n" );
 
@@ -164,7 +166,7 @@ void ShowMPIStats(
 				Msg( "%s", pMachineName );
 				
 				char formatStr[512];
-				Q_snprintf( formatStr, sizeof( formatStr ), "%%%ds %I64u\n", 30 - strlen( pMachineName ), g_wuCountByProcess[ sortedProcs[i] ] );
+				Q_snprintf( formatStr, sizeof( formatStr ), "%%%ds %llu\n", 30 - strlen( pMachineName ), (unsigned long long)g_wuCountByProcess[ sortedProcs[i] ] );
 				Msg( formatStr, ":" );
 			}
 		}
@@ -290,7 +292,7 @@ bool DistributeWorkDispatch( MessageBuffer *pBuf, int iSource, int iPacketID )
 			pBuf->read( &iWorkUnit, sizeof( iWorkUnit ) );
 			if ( iWorkUnit >= pInfo->m_nWorkUnits )
 			{
-				Error( "DistributeWork: got an invalid work unit index (%I64u for WU count of %I64u).", iWorkUnit, pInfo->m_nWorkUnits );
+				Error( "DistributeWork: got an invalid work unit index (%llu for WU count of %llu).", (unsigned long long)iWorkUnit, (unsigned long long)pInfo->m_nWorkUnits );
 			}
 
 			HandleWorkUnitCompleted( pInfo, iSource, iWorkUnit, pBuf );
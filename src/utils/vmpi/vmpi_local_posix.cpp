@@ -0,0 +1,961 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: VMPI backend for POSIX. Instead of finding workers on the network,
+//          the master forks its workers on the local machine and talks to each
+//          of them over a Unix socket pair. Packets are the same MessageBuffer
+//          bytes vmpi.cpp sends, prefixed with their length.
+//
+//=============================================================================//
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include "vmpi.h"
+#include "vmpi_distribute_work.h"
+#include "vmpi_distribute_tracker.h"
+#include "threadhelpers.h"
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+#include "tier0/threadtools.h"
+#include "tier0/icommandline.h"
+#include "tier1/strtools.h"
+#include "tier1/utllinkedlist.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+#define DEFAULT_LOCAL_WORKERS	2	// Unless they specify -mpi_LocalWorkers, the master forks this many workers.
+#define MAX_LOCAL_WORKERS		64
+
+#define VMPI_INTERNAL_PACKET_ID	27
+	#define VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER				7
+
+VMPI_REGISTER_PACKET_ID( VMPI_INTERNAL_PACKET_ID );
+VMPI_REGISTER_SUBPACKET_ID( VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER );
+
+
+// Command-line parameters list.
+#define VMPI_PARAM( paramName, paramFlags, helpText ) {paramName, paramFlags, "-"#paramName, helpText},
+class CVMPIParam
+{
+public:
+	EVMPICmdLineParam m_eParam;
+	int m_ParamFlags;
+	const char *m_pName;
+	const char *m_pHelpText;
+};
+static CVMPIParam g_VMPIParams[] =
+{
+	{k_eVMPICmdLineParam_FirstParam, 0, "k_eVMPICmdLineParam_FirstParam", "unused"},
+	{k_eVMPICmdLineParam_VMPIParam, 0, "mpi", "Enable VMPI."},
+#include "vmpi_parameters.h"
+};
+#undef VMPI_PARAM
+
+
+// ---------------------------------------------------------------------------------------- //
+// Globals.
+// ---------------------------------------------------------------------------------------- //
+
+// One of these for each process we can talk to. On the master, connection 0 is the
+// master itself and has no socket. On a worker, connection 0 is the master.
+class CLocalConnection
+{
+public:
+	CLocalConnection()
+	{
+		m_Socket = -1;
+		m_Pid = 0;
+		m_hReadThread = NULL;
+		m_MachineName[0] = 0;
+		m_bConnected = false;
+		m_JobWorkerID = 0;
+	}
+
+	int m_Socket;
+	pid_t m_Pid;					// Only set on the master.
+	ThreadHandle_t m_hReadThread;
+	CThreadFastMutex m_SendMutex;	// Keeps the chunks of a packet together when several threads send.
+	char m_MachineName[128];
+	bool m_bConnected;
+	unsigned long m_JobWorkerID;
+};
+
+// A packet read by one of the socket threads, waiting for the main thread to dispatch it.
+struct LocalPacket_t
+{
+	int m_iSource;
+	int m_Len;
+	char m_Data[1];
+};
+
+static CLocalConnection g_Connections[MAX_LOCAL_WORKERS+1];
+static int g_nConnections = 0;
+
+// This queues up all the incoming VMPI messages, and the connections that closed.
+static CThreadFastMutex g_MessagesMutex;
+static CUtlLinkedList< LocalPacket_t*, int > g_Messages;
+static CUtlVector< int > g_Disconnects;
+static CThreadEvent g_MessagesEvent;	// This is set when there are messages or disconnects in the queue.
+
+static CUtlLinkedList<VMPI_Disconnect_Handler,int> g_DisconnectHandlers;
+
+static VMPIDispatchFn g_VMPIDispatch[MAX_VMPI_PACKET_IDS];
+static CVMPIPacketIDReg *g_pVMPIPacketIDRegHead = NULL;
+
+static VMPIRunMode g_VMPIRunMode = VMPI_RUN_LOCAL;
+
+static char g_CurrentStageString[128] = "";
+static CVMPICriticalSection g_CurrentStageCS;
+
+// If true, then it will set certain thread priorities low.
+bool g_bSetThreadPriorities = true;
+
+int g_nMaxWorkerCount = DEFAULT_LOCAL_WORKERS;
+
+int g_nBytesSent = 0;
+int g_nMessagesSent = 0;
+int g_nBytesReceived = 0;
+int g_nMessagesReceived = 0;
+
+int g_nMulticastBytesSent = 0;
+int g_nMulticastBytesReceived = 0;
+
+bool g_bUseMPI = false;
+int g_iVMPIVerboseLevel = 0;
+bool g_bMPIMaster = false;
+
+bool g_bMPI_Stats = false;
+bool g_bMPI_StatsTextOutput = false;
+
+
+// ---------------------------------------------------------------------------------------- //
+// CVMPIPacketIDReg and CDispatchReg.
+// ---------------------------------------------------------------------------------------- //
+
+CVMPIPacketIDReg::CVMPIPacketIDReg( int nPacketID, int nSubPacketID, const char *pName )
+{
+	m_nPacketID = nPacketID;
+	m_nSubPacketID = nSubPacketID;
+	m_pName = pName;
+	m_pNext = g_pVMPIPacketIDRegHead;
+	g_pVMPIPacketIDRegHead = this;
+}
+
+void CVMPIPacketIDReg::Lookup( int nPacketID, int nSubPacketID, char *pPacketIDString, int nPacketIDStringSize, char *pSubPacketIDString, int nSubPacketIDStringSize )
+{
+	// First find the packet ID.
+	CVMPIPacketIDReg *pCur;
+	for ( pCur = g_pVMPIPacketIDRegHead; pCur; pCur = pCur->m_pNext )
+	{
+		if ( pCur->m_nPacketID == nPacketID && pCur->m_nSubPacketID == -1 )
+		{
+			V_strncpy( pPacketIDString, pCur->m_pName, nPacketIDStringSize );
+			break;
+		}
+	}
+
+	// Didn't find it? Just print the number.
+	if ( !pCur )
+	{
+		V_snprintf( pPacketIDString, nPacketIDStringSize, "(%d)", nPacketID );
+	}
+
+	// Now find the subpacket ID.
+	for ( pCur = g_pVMPIPacketIDRegHead; pCur; pCur = pCur->m_pNext )
+	{
+		if ( pCur->m_nPacketID == nPacketID && pCur->m_nSubPacketID == nSubPacketID )
+		{
+			V_strncpy( pSubPacketIDString, pCur->m_pName, nSubPacketIDStringSize );
+			break;
+		}
+	}
+
+	// Didn't find it? Just print the number.
+	if ( !pCur )
+	{
+		V_snprintf( pSubPacketIDString, nSubPacketIDStringSize, "(%d)", nSubPacketID );
+	}
+}
+
+
+CDispatchReg::CDispatchReg( int iPacketID, VMPIDispatchFn fn )
+{
+	Assert( iPacketID >= 0 && iPacketID < MAX_VMPI_PACKET_IDS );
+	Assert( !g_VMPIDispatch[iPacketID] );
+	g_VMPIDispatch[iPacketID] = fn;
+}
+
+
+bool VMPI_InternalDispatchFn( MessageBuffer *pBuf, int iSource, int iPacketID )
+{
+	if ( pBuf->getLen() >= 2 && pBuf->data[1] == VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER )
+	{
+		pBuf->setOffset( 2 );
+
+		char str[2048];
+		if ( pBuf->ReadString( str, sizeof( str ) ) == -1 )
+			Plat_FatalError( "Error in ReadString() while reading VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER." );
+
+		Msg( "\nWorker %d (%s) message: %s\n", iSource, VMPI_GetMachineName( iSource ), str );
+		return true;
+	}
+
+	return false;
+}
+CDispatchReg g_VMPIInternalDispatchReg( VMPI_INTERNAL_PACKET_ID, VMPI_InternalDispatchFn ); // register to handle the messages we want
+
+
+// ---------------------------------------------------------------------------------------- //
+// Socket helpers.
+// ---------------------------------------------------------------------------------------- //
+
+static bool WriteAll( int sock, const void *pData, int nBytes )
+{
+	const char *pCur = (const char*)pData;
+	while ( nBytes > 0 )
+	{
+		ssize_t ret = send( sock, pCur, nBytes, MSG_NOSIGNAL );
+		if ( ret < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			return false;
+		}
+
+		pCur += ret;
+		nBytes -= ret;
+	}
+	return true;
+}
+
+
+static bool ReadAll( int sock, void *pData, int nBytes )
+{
+	char *pCur = (char*)pData;
+	while ( nBytes > 0 )
+	{
+		ssize_t ret = recv( sock, pCur, nBytes, 0 );
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return false;
+
+		pCur += ret;
+		nBytes -= ret;
+	}
+	return true;
+}
+
+
+// Each connection has one of these reading its packets into the message queue.
+static uintp ReadThreadFn( void *pParam )
+{
+	int iConnection = (int)(intp)pParam;
+	int sock = g_Connections[iConnection].m_Socket;
+
+	while ( 1 )
+	{
+		int len;
+		if ( !ReadAll( sock, &len, sizeof( len ) ) || len < 0 )
+			break;
+
+		LocalPacket_t *pPacket = (LocalPacket_t*)malloc( sizeof( LocalPacket_t ) + len );
+		pPacket->m_iSource = iConnection;
+		pPacket->m_Len = len;
+		if ( !ReadAll( sock, pPacket->m_Data, len ) )
+		{
+			free( pPacket );
+			break;
+		}
+
+		g_MessagesMutex.Lock();
+			g_Messages.AddToTail( pPacket );
+		g_MessagesMutex.Unlock();
+		g_MessagesEvent.Set();
+	}
+
+	// The other side went away (or we're shutting down). Let the main thread handle it.
+	g_MessagesMutex.Lock();
+		g_Disconnects.AddToTail( iConnection );
+	g_MessagesMutex.Unlock();
+	g_MessagesEvent.Set();
+	return 0;
+}
+
+
+static void StartReadThread( int iConnection )
+{
+	g_Connections[iConnection].m_bConnected = true;
+	g_Connections[iConnection].m_hReadThread = CreateSimpleThread( ReadThreadFn, (void*)(intp)iConnection );
+}
+
+
+static void HandleDisconnect( int iConnection )
+{
+	CLocalConnection *pConnection = &g_Connections[iConnection];
+	if ( !pConnection->m_bConnected )
+		return;
+
+	pConnection->m_bConnected = false;
+
+	const char *pReason = "connection closed";
+	FOR_EACH_LL( g_DisconnectHandlers, i )
+	{
+		g_DisconnectHandlers[i]( iConnection, pReason );
+	}
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// Init and shutdown.
+// ---------------------------------------------------------------------------------------- //
+
+const char* VMPI_FindArg( int argc, char **argv, const char *pName, const char *pDefault )
+{
+	for ( int i=0; i < argc; i++ )
+	{
+		if ( stricmp( argv[i], pName ) == 0 )
+		{
+			if ( (i+1) < argc )
+				return argv[i+1];
+			else
+				return pDefault;
+		}
+	}
+	return NULL;
+}
+
+
+static void ParseOptions( int argc, char **argv )
+{
+	if ( VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_DontSetThreadPriorities ) ) )
+	{
+		Msg( "%s found.\n", VMPI_GetParamString( mpi_DontSetThreadPriorities ) );
+		g_bSetThreadPriorities = false;
+	}
+
+	const char *pVerbose = VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_Verbose ), "1" );
+	if ( pVerbose )
+	{
+		if ( pVerbose[0] == '1' )
+			g_iVMPIVerboseLevel = 1;
+		else if ( pVerbose[0] == '2' )
+			g_iVMPIVerboseLevel = 2;
+	}
+}
+
+
+bool VMPI_Init(
+	int &argc,
+	char **&argv,
+	const char *pDependencyFilename,
+	VMPI_Disconnect_Handler handler,
+	VMPIRunMode runMode,
+	bool bConnectingAsService
+	)
+{
+	if ( handler )
+		VMPI_AddDisconnectHandler( handler );
+
+	if ( VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_Worker ), NULL ) )
+		Error( "%s is not supported on this platform. The master forks its own workers (see %s).\n",
+			VMPI_GetParamString( mpi_Worker ), VMPI_GetParamString( mpi_LocalWorkers ) );
+
+	g_bUseMPI = true;
+	g_bMPIMaster = true;
+	g_VMPIRunMode = runMode;
+	ParseOptions( argc, argv );
+
+	int nWorkers = DEFAULT_LOCAL_WORKERS;
+	const char *pWorkerCount = VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_LocalWorkers ) );
+	if ( pWorkerCount )
+		nWorkers = atoi( pWorkerCount );
+	nWorkers = clamp( nWorkers, 1, MAX_LOCAL_WORKERS );
+	g_nMaxWorkerCount = nWorkers + 1;
+
+	// Add ourselves as the first process (rank 0).
+	V_strncpy( g_Connections[0].m_MachineName, VMPI_GetLocalMachineName(), sizeof( g_Connections[0].m_MachineName ) );
+	g_nConnections = 1;
+
+	// Make sure everything we've printed so far doesn't get printed again by the workers.
+	fflush( stdout );
+	fflush( stderr );
+
+	for ( int iWorker=1; iWorker <= nWorkers; iWorker++ )
+	{
+		int fds[2];
+		if ( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) != 0 )
+			Error( "VMPI_Init: socketpair failed (%s).\n", strerror( errno ) );
+
+		pid_t pid = fork();
+		if ( pid < 0 )
+			Error( "VMPI_Init: fork failed (%s).\n", strerror( errno ) );
+
+		if ( pid == 0 )
+		{
+			// We're a worker. Forget the master's other workers, and make the master connection 0.
+			close( fds[0] );
+			for ( int i=1; i < iWorker; i++ )
+				close( g_Connections[i].m_Socket );
+
+			g_bMPIMaster = false;
+			g_Connections[0].m_Socket = fds[1];
+			g_nConnections = 1;
+			StartReadThread( 0 );
+			return true;
+		}
+
+		close( fds[1] );
+		CLocalConnection *pConnection = &g_Connections[iWorker];
+		pConnection->m_Socket = fds[0];
+		pConnection->m_Pid = pid;
+		V_snprintf( pConnection->m_MachineName, sizeof( pConnection->m_MachineName ), "%s:%d", VMPI_GetLocalMachineName(), (int)pid );
+		g_nConnections = iWorker + 1;
+	}
+
+	// Only start the socket threads once all the workers are forked, so none of them inherits a thread's locks.
+	for ( int i=1; i < g_nConnections; i++ )
+		StartReadThread( i );
+
+	Msg( "VMPI: forked %d local workers.\n", nWorkers );
+	return true;
+}
+
+
+void VMPI_Init_PatchMaster( int argc, char **argv )
+{
+	Error( "VMPI patch mode is not supported on this platform.\n" );
+}
+
+
+void VMPI_Finalize()
+{
+	DistributeWork_Cancel();
+
+	// Closing the sockets makes the workers' reads fail, so they shut down too.
+	for ( int i=0; i < g_nConnections; i++ )
+	{
+		CLocalConnection *pConnection = &g_Connections[i];
+		if ( pConnection->m_Socket != -1 )
+			shutdown( pConnection->m_Socket, SHUT_RDWR );
+	}
+
+	for ( int i=0; i < g_nConnections; i++ )
+	{
+		CLocalConnection *pConnection = &g_Connections[i];
+		if ( pConnection->m_hReadThread )
+		{
+			ThreadJoin( pConnection->m_hReadThread );
+			ReleaseThreadHandle( pConnection->m_hReadThread );
+			pConnection->m_hReadThread = NULL;
+		}
+
+		if ( pConnection->m_Socket != -1 )
+		{
+			close( pConnection->m_Socket );
+			pConnection->m_Socket = -1;
+		}
+
+		if ( pConnection->m_Pid > 0 )
+		{
+			int status;
+			waitpid( pConnection->m_Pid, &status, 0 );
+			pConnection->m_Pid = 0;
+		}
+
+		pConnection->m_bConnected = false;
+	}
+
+	g_nConnections = 0;
+
+	// Get rid of all the packets.
+	FOR_EACH_LL( g_Messages, i )
+	{
+		free( g_Messages[i] );
+	}
+	g_Messages.Purge();
+	g_Disconnects.Purge();
+}
+
+
+bool VMPI_HandleAutoRestart()
+{
+	return true;
+}
+
+
+VMPIRunMode VMPI_GetRunMode()
+{
+	return g_VMPIRunMode;
+}
+
+
+VMPIFileSystemMode VMPI_GetFileSystemMode()
+{
+	return VMPI_FILESYSTEM_TCP;
+}
+
+
+int VMPI_GetCurrentNumberOfConnections()
+{
+	return g_nConnections;
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// Receiving and dispatching.
+// ---------------------------------------------------------------------------------------- //
+
+static void InternalHandleSocketErrors()
+{
+	// Copy the list out so the disconnect handlers run outside the mutex (they usually call Error()).
+	CUtlVector<int> disconnects;
+	g_MessagesMutex.Lock();
+		disconnects.CopyArray( g_Disconnects.Base(), g_Disconnects.Count() );
+		g_Disconnects.Purge();
+	g_MessagesMutex.Unlock();
+
+	for ( int i=0; i < disconnects.Count(); i++ )
+		HandleDisconnect( disconnects[i] );
+}
+
+
+void VMPI_HandleSocketErrors( unsigned long timeout )
+{
+	if ( timeout )
+		ThreadSleep( timeout );
+
+	InternalHandleSocketErrors();
+}
+
+
+static bool VMPI_GetNextMessage( MessageBuffer *pBuf, int *pSource, unsigned long startTimeout )
+{
+	uint32 startTime = Plat_MSTime();
+	uint32 timeout = startTimeout;
+
+	while ( 1 )
+	{
+		InternalHandleSocketErrors();
+
+		g_MessagesMutex.Lock();
+			LocalPacket_t *pPacket = NULL;
+			int iHead = g_Messages.Head();
+			if ( iHead != g_Messages.InvalidIndex() )
+			{
+				pPacket = g_Messages[iHead];
+				g_Messages.Remove( iHead );
+			}
+
+			// Set the event again if there is more waiting.
+			if ( g_Messages.Count() > 0 || g_Disconnects.Count() > 0 )
+				g_MessagesEvent.Set();
+		g_MessagesMutex.Unlock();
+
+		if ( pPacket )
+		{
+			// Copy it into their message buffer.
+			pBuf->setLen( pPacket->m_Len );
+			memcpy( pBuf->data, pPacket->m_Data, pPacket->m_Len );
+			*pSource = pPacket->m_iSource;
+
+			// Update global stats about how much data we've received.
+			++g_nMessagesReceived;
+			g_nBytesReceived += pPacket->m_Len + 4;	// (4 bytes extra for the packet length)
+
+			free( pPacket );
+			return true;
+		}
+
+		if ( !g_MessagesEvent.Wait( timeout ) )
+			return false;
+
+		// Update the timeout.
+		if ( startTimeout != VMPI_TIMEOUT_INFINITE )
+		{
+			uint32 delta = Plat_MSTime() - startTime;
+			timeout = ( delta >= startTimeout ) ? 0 : startTimeout - delta;
+		}
+	}
+}
+
+
+static bool VMPI_InternalDispatch( MessageBuffer *pBuf, int iSource )
+{
+	if ( pBuf->getLen() < 1 )
+		return false;
+
+	// data is plain char, which is signed on some platforms
+	unsigned char iPacketID = (unsigned char)pBuf->data[0];
+	if ( iPacketID < MAX_VMPI_PACKET_IDS && g_VMPIDispatch[iPacketID] )
+	{
+		return g_VMPIDispatch[iPacketID]( pBuf, iSource, iPacketID );
+	}
+	else
+	{
+		return false;
+	}
+}
+
+
+bool VMPI_DispatchNextMessage( unsigned long timeout )
+{
+	MessageBuffer buf;
+	while ( 1 )
+	{
+		int iSource;
+		if ( !VMPI_GetNextMessage( &buf, &iSource, timeout ) )
+			return false;
+
+		if ( VMPI_InternalDispatch( &buf, iSource ) )
+			return true;
+
+		// Oops! What is this packet?
+		Assert( false );
+	}
+}
+
+
+bool VMPI_DispatchUntil( MessageBuffer *pBuf, int *pSource, int packetID, int subPacketID, bool bWait )
+{
+	while ( 1 )
+	{
+		if ( !VMPI_GetNextMessage( pBuf, pSource, bWait ? VMPI_TIMEOUT_INFINITE : 0 ) )
+			return false;
+
+		if ( !VMPI_InternalDispatch( pBuf, *pSource ) )
+		{
+			if ( pBuf->getLen() >= 1 && (unsigned char)pBuf->data[0] == packetID )
+			{
+				if ( subPacketID == -1 )
+					return true;
+
+				if ( pBuf->getLen() >= 2 && (unsigned char)pBuf->data[1] == subPacketID )
+					return true;
+			}
+		}
+	}
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// Sending.
+// ---------------------------------------------------------------------------------------- //
+
+bool VMPI_SendData( void *pData, int nBytes, int iDest, int fVMPISendFlags )
+{
+	return VMPI_SendChunks( &pData, &nBytes, 1, iDest, fVMPISendFlags );
+}
+
+
+bool VMPI_SendChunks( void const * const *pChunks, const int *pChunkLengths, int nChunks, int iDest, int fVMPISendFlags )
+{
+	if ( iDest == VMPI_SEND_TO_ALL || iDest == VMPI_PERSISTENT )
+	{
+		// All the workers are forked in VMPI_Init, so there are never any new workers
+		// to send persistent packets to later.
+		for ( int i=0; i < g_nConnections; i++ )
+		{
+			if ( g_Connections[i].m_Socket != -1 )
+				VMPI_SendChunks( pChunks, pChunkLengths, nChunks, i );
+		}
+
+		return true;
+	}
+
+	if ( !VMPI_IsProcConnected( iDest ) )
+		return false;
+
+	int len = 0;
+	for ( int i=0; i < nChunks; i++ )
+		len += pChunkLengths[i];
+
+	g_nMessagesSent++;
+	g_nBytesSent += len + 4; // for message tag.
+
+	CLocalConnection *pConnection = &g_Connections[iDest];
+	AUTO_LOCK( pConnection->m_SendMutex );
+
+	if ( !WriteAll( pConnection->m_Socket, &len, sizeof( len ) ) )
+		return false;
+
+	for ( int i=0; i < nChunks; i++ )
+	{
+		if ( !WriteAll( pConnection->m_Socket, pChunks[i], pChunkLengths[i] ) )
+			return false;
+	}
+
+	return true;
+}
+
+
+bool VMPI_Send2Chunks( const void *pChunk1, int chunk1Len, const void *pChunk2, int chunk2Len, int iDest, int fVMPISendFlags )
+{
+	const void *pChunks[2] = { pChunk1, pChunk2 };
+	int len[2] = { chunk1Len, chunk2Len };
+	return VMPI_SendChunks( pChunks, len, ARRAYSIZE( pChunks ), iDest, fVMPISendFlags );
+}
+
+
+bool VMPI_Send3Chunks( const void *pChunk1, int chunk1Len, const void *pChunk2, int chunk2Len, const void *pChunk3, int chunk3Len, int iDest, int fVMPISendFlags )
+{
+	const void *pChunks[3] = { pChunk1, pChunk2, pChunk3 };
+	int len[3] = { chunk1Len, chunk2Len, chunk3Len };
+	return VMPI_SendChunks( pChunks, len, ARRAYSIZE( pChunks ), iDest, fVMPISendFlags );
+}
+
+
+void VMPI_FlushGroupedPackets( unsigned long msInterval )
+{
+	// Packets are never grouped; the Unix sockets are cheap enough to send each one right away.
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// Connection queries.
+// ---------------------------------------------------------------------------------------- //
+
+void VMPI_AddDisconnectHandler( VMPI_Disconnect_Handler handler )
+{
+	g_DisconnectHandlers.AddToTail( handler );
+}
+
+
+bool VMPI_IsProcValid( int procID )
+{
+	return procID >= 0 && procID < g_nConnections;
+}
+
+
+bool VMPI_IsProcConnected( int procID )
+{
+	if ( procID < 0 || procID >= g_nConnections )
+	{
+		Assert( false );
+		return false;
+	}
+
+	return g_Connections[procID].m_bConnected;
+}
+
+
+bool VMPI_IsProcAService( int procID )
+{
+	return false;
+}
+
+
+void VMPI_Sleep( unsigned long ms )
+{
+	ThreadSleep( ms );
+}
+
+
+const char* VMPI_GetLocalMachineName()
+{
+	static char cName[256];
+	if ( gethostname( cName, sizeof( cName ) ) == 0 )
+	{
+		cName[sizeof( cName ) - 1] = 0;
+		return cName;
+	}
+	else
+	{
+		return "(error in gethostname)";
+	}
+}
+
+
+const char* VMPI_GetMachineName( int iProc )
+{
+	if ( iProc < 0 || iProc >= g_nConnections )
+	{
+		Assert( false );
+		return "invalid index";
+	}
+
+	return g_Connections[iProc].m_MachineName;
+}
+
+
+bool VMPI_HasMachineNameBeenSet( int iProc )
+{
+	return VMPI_IsProcValid( iProc );
+}
+
+
+unsigned long VMPI_GetJobWorkerID( int iProc )
+{
+	Assert( VMPI_IsProcValid( iProc ) );
+	return g_Connections[iProc].m_JobWorkerID;
+}
+
+
+void VMPI_SetJobWorkerID( int iProc, unsigned long jobWorkerID )
+{
+	Assert( VMPI_IsProcValid( iProc ) );
+	g_Connections[iProc].m_JobWorkerID = jobWorkerID;
+}
+
+
+bool VMPI_IsThisWorkerRunningOnMasterMachine()
+{
+	return true;
+}
+
+
+bool VMPI_IsThisMyIP( CIPAddr testIP )
+{
+	return testIP.ip[0] == 127;
+}
+
+
+void VMPI_QueryRegistryForWorkers( CUtlVector<VMPIWorkerInfo_t> &registeredWorkers )
+{
+	// There is no registry of network workers here.
+	registeredWorkers.Purge();
+}
+
+
+void VMPI_InviteDebugWorkers()
+{
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// Stage, SDK mode, and parameters.
+// ---------------------------------------------------------------------------------------- //
+
+void VMPI_GetCurrentStage( char *pOut, int strLen )
+{
+	CVMPICriticalSectionLock csLock( &g_CurrentStageCS );
+	csLock.Lock();
+	V_strncpy( pOut, g_CurrentStageString, strLen );
+}
+
+
+void VMPI_SetCurrentStage( const char *pCurStage )
+{
+	CVMPICriticalSectionLock csLock( &g_CurrentStageCS );
+	csLock.Lock();
+	V_strncpy( g_CurrentStageString, pCurStage, sizeof( g_CurrentStageString ) );
+}
+
+
+bool VMPI_IsSDKMode()
+{
+	// The workers are forks of the master, so they never need the command line sent to them.
+	return true;
+}
+
+
+const char* VMPI_GetParamString( EVMPICmdLineParam eParam )
+{
+	if ( eParam <= k_eVMPICmdLineParam_FirstParam || eParam >= k_eVMPICmdLineParam_LastParam )
+	{
+		Assert( false );
+		Warning( "Invalid call: VMPI_GetParamString( %d )\n", eParam );
+		return "unknown";
+	}
+	else
+	{
+		return g_VMPIParams[eParam].m_pName;
+	}
+}
+
+int VMPI_GetParamFlags( EVMPICmdLineParam eParam )
+{
+	if ( eParam <= k_eVMPICmdLineParam_FirstParam || eParam >= k_eVMPICmdLineParam_LastParam )
+	{
+		Assert( false );
+		Warning( "Invalid call: VMPI_GetParamString( %d )\n", eParam );
+		return 0;
+	}
+	else
+	{
+		return g_VMPIParams[eParam].m_ParamFlags;
+	}
+}
+
+bool VMPI_IsParamUsed( EVMPICmdLineParam eParam )
+{
+	int iParam = CommandLine()->FindParm( VMPI_GetParamString( eParam ) );
+	return iParam != 0;
+}
+
+const char* VMPI_GetParamHelpString( EVMPICmdLineParam eParam )
+{
+	if ( eParam <= k_eVMPICmdLineParam_FirstParam || eParam >= k_eVMPICmdLineParam_LastParam )
+	{
+		Assert( false );
+		Warning( "Invalid call: VMPI_GetParamHelpString( %d )\n", eParam );
+		return "unknown vmpi param";
+	}
+	else
+	{
+		return g_VMPIParams[eParam].m_pHelpText;
+	}
+}
+
+void VMPI_PrintMsgOnMaster( const char *pMessage, ... )
+{
+	char formatted[2048];
+	va_list marker;
+	va_start( marker, pMessage );
+	V_vsnprintf( formatted, sizeof( formatted ), pMessage, marker );
+	va_end( marker );
+
+	if ( VMPI_IsMaster() )
+	{
+		Msg( "%s\n", formatted );
+	}
+	else
+	{
+		MessageBuffer mb;
+
+		char cPacketHeader[2] = {VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER};
+		mb.write( cPacketHeader, sizeof( cPacketHeader ) );
+		mb.WriteString( formatted );
+
+		VMPI_SendData( mb.data, mb.getLen(), VMPI_MASTER_ID );
+	}
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// The work unit tracker is a Windows debug UI; nothing to track here.
+// ---------------------------------------------------------------------------------------- //
+
+void VMPITracker_Start( int nWorkUnits )
+{
+}
+
+void VMPITracker_WorkUnitSentToWorker( int iWorkUnit, int iWorker )
+{
+}
+
+void VMPITracker_WorkUnitStarted( int iWorkUnit, int iWorker )
+{
+}
+
+void VMPITracker_WorkUnitCompleted( int iWorkUnit, int iWorker )
+{
+}
+
+void VMPITracker_End()
+{
+}
+
+void VMPITracker_HandleDebugKeypresses()
+{
+}
+
+bool VMPITracker_WriteDebugFile( const char *pFilename )
+{
+	return false;
+}
@@ -9,6 +9,7 @@
 #include "vrad.h"
 #include "lightmap.h"
 #include "radial.h"
+#include "raybatch.h"
 #include "mathlib/bumpvects.h"
 #include "tier1/utlvector.h"
 #include "vmpi.h"
@@ -1669,6 +1670,34 @@ void ExportDirectLightsToWorldLights()
 #define NSAMPLES_SUN_AREA_LIGHT 30							// number of samples to take for an
                                                             // non-point sun light
 
+// Visibility tests for the gather functions below. When BuildFacelights is
+// batching rays these go to the thread's ray batch instead of being traced
+static void GatherTestLine( int iThread, FourVectors const& start, FourVectors const& stop,
+							fltx4 *pFractionVisible, int static_prop_index_to_ignore )
+{
+	CShadowRayBatch &batch = g_ShadowRayBatch[iThread];
+	if ( !batch.IsReplaying() )
+		g_nDirectLightingRays[iThread] += 4;
+
+	if ( batch.IsActive() )
+		batch.TestLine( start, stop, pFractionVisible, static_prop_index_to_ignore );
+	else
+		TestLine( start, stop, pFractionVisible, static_prop_index_to_ignore );
+}
+
+static void GatherTestLine_DoesHitSky( int iThread, FourVectors const& start, FourVectors const& stop,
+									   fltx4 *pFractionVisible, int static_prop_index_to_ignore )
+{
+	CShadowRayBatch &batch = g_ShadowRayBatch[iThread];
+	if ( !batch.IsReplaying() )
+		g_nDirectLightingRays[iThread] += 4;
+
+	if ( batch.IsActive() )
+		batch.TestLine_DoesHitSky( start, stop, pFractionVisible, true, static_prop_index_to_ignore );
+	else
+		TestLine_DoesHitSky( start, stop, pFractionVisible, true, static_prop_index_to_ignore );
+}
+
 // Helper function - gathers light from sun (emit_skylight)
 void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
 							 FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
@@ -1720,7 +1749,7 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 		delta4.DuplicateVector ( delta );
 		delta4 += pos;
 
-		TestLine_DoesHitSky ( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
+		GatherTestLine_DoesHitSky( iThread, pos, delta4, &fractionVisible, static_prop_index_to_ignore );
 
 		totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
 	}
@@ -1810,7 +1839,7 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		surfacePos -= offset;
 
 		fltx4 fractionVisible = Four_Ones;
-		TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
+		GatherTestLine_DoesHitSky( iThread, surfacePos, delta, &fractionVisible, static_prop_index_to_ignore );
 		for ( int i = 0; i < normalCount; i++ )
 		{
 			fltx4 addedAmount = MulSIMD( fractionVisible, dots[i] );
@@ -1978,7 +2007,7 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 
 	// Raytrace for visibility function
 	fltx4 fractionVisible = Four_Ones;
-	TestLine( pos, src, &fractionVisible, static_prop_index_to_ignore);
+	GatherTestLine( iThread, pos, src, &fractionVisible, static_prop_index_to_ignore );
 	dot = MulSIMD( fractionVisible, dot );
 	out.m_flDot[0] = dot;
 
@@ -3056,6 +3085,125 @@ static void InitSampleInfo( lightinfo_t const& l, int iThread, SSE_SampleInfo_t&
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Computes the illumination points and normals of a group of 4 samples
+//-----------------------------------------------------------------------------
+static int ComputeSampleGroupPointsAndNormals( lightinfo_t const& l, SSE_SampleInfo_t& info, int grp )
+{
+	int nSample = 4 * grp;
+
+	sample_t *sample = info.m_pFaceLight->sample + nSample;
+	int numSamples = min ( 4, info.m_pFaceLight->numsamples - nSample );
+
+	Vector v[4], n[4];
+	FourVectors positions;
+	FourVectors normals;
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
+		n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
+	}
+	positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
+	normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
+
+	ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &info, numSamples );
+
+	// Fixup sample normals in case of smooth faces
+	if ( !l.isflat )
+	{
+		for ( int i = 0; i < numSamples; i++ )
+			sample[i].normal = info.m_PointNormals[0].Vec( i );
+	}
+
+	return numSamples;
+}
+
+//-----------------------------------------------------------------------------
+// Makes the same visibility tests GatherSampleLightAt4Points would, without
+// adding any light. Used to fill a ray batch
+//-----------------------------------------------------------------------------
+static void QueueSampleLightAt4Points( SSE_SampleInfo_t& info, int numSamples )
+{
+	SSE_sampleLightOutput_t out;
+
+	for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
+	{
+		bool skipLight = true;
+		for( int s = 0; s < numSamples; s++ )
+		{
+			if( PVSCheck( dl->pvs, info.m_Clusters[s] ) )
+			{
+				skipLight = false;
+				break;
+			}
+		}
+		if ( skipLight )
+			continue;
+
+		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Same as GatherSampleLightAt4Points on each sample group of a face, except
+// the visibility tests of a run of groups are queued up and traced together
+// (-batchrays)
+//-----------------------------------------------------------------------------
+#define MAX_BATCHED_SAMPLE_GROUPS		64
+#define MAX_BATCHED_VISIBILITY_TESTS	4096
+
+struct BatchedSampleGroup_t
+{
+	FourVectors	m_Points;
+	FourVectors	m_PointNormals[ NUM_BUMP_VECTS + 1 ];
+	int			m_Clusters[4];
+	int			m_NumSamples;
+};
+
+static void GatherBatchedSampleLight( lightinfo_t const& l, SSE_SampleInfo_t& info, int numGroups )
+{
+	CShadowRayBatch &batch = g_ShadowRayBatch[info.m_iThread];
+	BatchedSampleGroup_t groups[MAX_BATCHED_SAMPLE_GROUPS];
+
+	int grp = 0;
+	while ( grp < numGroups )
+	{
+		// queue up the visibility tests of as many groups as fit in the batch
+		int firstGroup = grp;
+		batch.BeginRecording();
+		while ( ( grp < numGroups ) && ( grp - firstGroup < MAX_BATCHED_SAMPLE_GROUPS ) &&
+				( batch.QueuedTestCount() < MAX_BATCHED_VISIBILITY_TESTS ) )
+		{
+			BatchedSampleGroup_t &group = groups[grp - firstGroup];
+			group.m_NumSamples = ComputeSampleGroupPointsAndNormals( l, info, grp );
+			group.m_Points = info.m_Points;
+			for ( int b = 0; b < info.m_NormalCount; b++ )
+				group.m_PointNormals[b] = info.m_PointNormals[b];
+			for ( int i = 0; i < 4; i++ )
+				group.m_Clusters[i] = info.m_Clusters[i];
+
+			QueueSampleLightAt4Points( info, group.m_NumSamples );
+			++grp;
+		}
+
+		// trace them all, then gather the light again using the results
+		batch.Trace();
+		for ( int i = firstGroup; i < grp; ++i )
+		{
+			BatchedSampleGroup_t &group = groups[i - firstGroup];
+			info.m_Points = group.m_Points;
+			for ( int b = 0; b < info.m_NormalCount; b++ )
+				info.m_PointNormals[b] = group.m_PointNormals[b];
+			for ( int j = 0; j < 4; j++ )
+				info.m_Clusters[j] = group.m_Clusters[j];
+
+			GatherSampleLightAt4Points( info, 4 * i, group.m_NumSamples );
+		}
+		batch.EndReplay();
+	}
+}
+
 void BuildFacelights (int iThread, int facenum)
 {
 	int	i, j;
@@ -3066,7 +3214,6 @@ void BuildFacelights (int iThread, int facenum)
 	SSE_SampleInfo_t sampleInfo;
 	directlight_t *dl;
 	Vector spot;
-	Vector v[4], n[4];
 
 	if( g_bInterrupt )
 		return;
@@ -3109,40 +3256,37 @@ void BuildFacelights (int iThread, int facenum)
 	// Allocate sample positions/normals to SSE
 	int numGroups = ( fl->numsamples & 0x3) ? ( fl->numsamples / 4 ) + 1 : ( fl->numsamples / 4 );
 
-	// always allocate style 0 lightmap
-	f->styles[0] = 0;
-	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
-
-	// sample the lights at each sample location
-	for ( int grp = 0; grp < numGroups; ++grp )
+	// with -relight, faces that no changed light reaches keep the direct lighting of the last compile
+	bool bRestored = g_bRelight && RestoreRelightFaceLight( iThread, facenum, fl, l.facenormal, sampleInfo.m_NormalCount );
+	if ( bRestored )
 	{
-		int nSample = 4 * grp;
-
-		sample_t *sample = sampleInfo.m_pFaceLight->sample + nSample;
-		int numSamples = min ( 4, sampleInfo.m_pFaceLight->numsamples - nSample );
-
-		FourVectors positions;
-		FourVectors normals;
-
-		for ( int i = 0; i < 4; i++ )
+		// the sample normals still have to be fixed up on smooth faces
+		for ( int grp = 0; grp < numGroups; ++grp )
 		{
-			v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
-			n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
+			ComputeSampleGroupPointsAndNormals( l, sampleInfo, grp );
 		}
-		positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
-		normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
-
-		ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &sampleInfo, numSamples );
+	}
+	else
+	{
+		// always allocate style 0 lightmap
+		f->styles[0] = 0;
+		AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
 
-		// Fixup sample normals in case of smooth faces
-		if ( !l.isflat )
+		// sample the lights at each sample location
+		if ( g_bBatchShadowRays && !g_bTextureShadows )
 		{
-			for ( int i = 0; i < numSamples; i++ )
-				sample[i].normal = sampleInfo.m_PointNormals[0].Vec( i );
+			GatherBatchedSampleLight( l, sampleInfo, numGroups );
 		}
+		else
+		{
+			for ( int grp = 0; grp < numGroups; ++grp )
+			{
+				int numSamples = ComputeSampleGroupPointsAndNormals( l, sampleInfo, grp );
 
-		// Iterate over all the lights and add their contribution to this group of spots
-		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+				// Iterate over all the lights and add their contribution to this group of spots
+				GatherSampleLightAt4Points( sampleInfo, 4 * grp, numSamples );
+			}
+		}
 	}
 	
 	// Tell the incremental light manager that we're done with this face.
@@ -3161,7 +3305,7 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
-	if (do_extra && !sampleInfo.m_IsDispFace)
+	if (do_extra && !sampleInfo.m_IsDispFace && !bRestored)
 	{
 		// For each lightstyle, perform a supersampling pass
 		for ( i = 0; i < MAXLIGHTMAPS; ++i )
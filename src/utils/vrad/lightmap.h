@@ -137,5 +137,12 @@ void FreeDLights();
 
 void ExportDirectLightsToWorldLights();
 
+// -relight
+void LoadRelightCache( const char *pFilename );
+bool RestoreRelightFaceLight( int iThread, int facenum, facelight_t *fl, const Vector &vecFaceNormal, int nNormalCount );
+void SaveRelightFaceLights( void );
+bool LoadRelightTransfers( void );
+void SaveRelightCache( const char *pFilename );
+
 
 #endif // LIGHTMAP_H
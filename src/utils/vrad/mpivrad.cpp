@@ -297,8 +297,10 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		patch->numtransfers = numtransfers;
 		if (numtransfers) 
 		{
-			patch->transfers = new transfer_t[numtransfers];
-			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
+			pBuf->read( &patch->transferscale, sizeof(patch->transferscale) );
+			pBuf->read( &patch->transferbytes, sizeof(patch->transferbytes) );
+			patch->transfers = AllocTransferList( patch->transferbytes );
+			pBuf->read( patch->transfers, patch->transferbytes );
 		}
 		
 		total_transfer += numtransfers;
@@ -333,7 +335,12 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		if ( patch->numtransfers )
+		{
+			pData->m_pVisLeafsMB->write( &patch->transferscale, sizeof(patch->transferscale) );
+			pData->m_pVisLeafsMB->write( &patch->transferbytes, sizeof(patch->transferbytes) );
+			pData->m_pVisLeafsMB->write( patch->transfers, patch->transferbytes );
+		}
 	}
 }
 
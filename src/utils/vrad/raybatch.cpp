@@ -0,0 +1,339 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Batched shadow ray tracing for the direct lighting gather
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "raybatch.h"
+
+
+// tests are sorted by the direction of their rays, on a grid of this many cells
+// across each face of a cube, then by origin, on a grid of cells this size in
+// morton order. Tests that land in the same cells are traced together.
+#define RAYBATCH_DIRECTION_BITS	5
+#define RAYBATCH_CELL_SIZE		256
+#define RAYBATCH_CELL_BITS		7
+
+// at most this many tests, of 4 rays each, are traced at once
+#define RAYBATCH_PACKET_TESTS	4
+
+CShadowRayBatch g_ShadowRayBatch[MAX_TOOL_THREADS+1];
+int64 g_nDirectLightingRays[MAX_TOOL_THREADS+1];
+
+
+//-----------------------------------------------------------------------------
+// Sort key for a test: the cube face and cell the direction of its first ray
+// points through, then the morton code of the cell its first ray starts in.
+// Tests from nearby points towards the same light get the same key.
+//-----------------------------------------------------------------------------
+static uint32 SpreadCellBits( uint32 n )
+{
+	uint32 nResult = 0;
+	for ( int i = 0; i < RAYBATCH_CELL_BITS; i++ )
+	{
+		nResult |= ( ( n >> i ) & 1 ) << ( i * 3 );
+	}
+	return nResult;
+}
+
+static uint64 TestSortKey( const Vector &origin, const Vector &direction )
+{
+	// the octant comes first, so that tests traced together can share a
+	// direction sign mask
+	uint32 nOctant = ( direction.x < 0.0f ? 1 : 0 ) | ( direction.y < 0.0f ? 2 : 0 ) | ( direction.z < 0.0f ? 4 : 0 );
+	Vector absDir( fabs( direction.x ), fabs( direction.y ), fabs( direction.z ) );
+	int nMajor = ( absDir.x >= absDir.y ) ? ( ( absDir.x >= absDir.z ) ? 0 : 2 ) : ( ( absDir.y >= absDir.z ) ? 1 : 2 );
+	float flScale = ( absDir[nMajor] > 0.0f ) ? ( 1 << RAYBATCH_DIRECTION_BITS ) / absDir[nMajor] : 0.0f;
+	uint32 nU = min( (uint32)( absDir[( nMajor + 1 ) % 3] * flScale ), ( 1u << RAYBATCH_DIRECTION_BITS ) - 1 );
+	uint32 nV = min( (uint32)( absDir[( nMajor + 2 ) % 3] * flScale ), ( 1u << RAYBATCH_DIRECTION_BITS ) - 1 );
+	uint32 nDirection = ( ( ( ( nOctant << 2 ) | nMajor ) << RAYBATCH_DIRECTION_BITS | nU ) << RAYBATCH_DIRECTION_BITS ) | nV;
+
+	uint32 nMorton = 0;
+	for ( int i = 0; i < 3; i++ )
+	{
+		int nCell = (int)( ( origin[i] + MAX_COORD_INTEGER ) * ( 1.0f / RAYBATCH_CELL_SIZE ) );
+		nCell = max( 0, min( nCell, ( 1 << RAYBATCH_CELL_BITS ) - 1 ) );
+		nMorton |= SpreadCellBits( nCell ) << i;
+	}
+
+	return ( (uint64)nDirection << ( 3 * RAYBATCH_CELL_BITS ) ) | nMorton;
+}
+
+
+//-----------------------------------------------------------------------------
+// CShadowRayBatch
+//-----------------------------------------------------------------------------
+CShadowRayBatch::CShadowRayBatch()
+{
+	m_Mode = MODE_INACTIVE;
+	m_nReplayTest = 0;
+}
+
+void CShadowRayBatch::BeginRecording()
+{
+	m_Tests.RemoveAll();
+	m_SkyboxTests.RemoveAll();
+	m_Mode = MODE_RECORDING;
+}
+
+void CShadowRayBatch::EndReplay()
+{
+	Assert( m_nReplayTest == m_Tests.Count() );
+	m_Mode = MODE_INACTIVE;
+}
+
+void CShadowRayBatch::QueueTest( VisibilityTestList_t &tests, FourVectors const& start, FourVectors const& stop,
+	int32 nSkipID, bool bSky, bool bCanRecurse, int nParent )
+{
+	VisibilityTest_t &test = tests[ tests.AddToTail() ];
+	test.m_Start = start;
+	test.m_Stop = stop;
+
+	// same math as TestLine, so that the rays are bit for bit the ones it would trace
+	test.m_Rays.origin = start;
+	test.m_Rays.direction = stop;
+	test.m_Rays.direction -= test.m_Rays.origin;
+	test.m_Length = test.m_Rays.direction.length();
+	test.m_Rays.direction *= ReciprocalSIMD( test.m_Length );
+
+	test.m_Occlusion = Four_Zeros;
+	test.m_nSkipID = nSkipID;
+	test.m_bSky = bSky;
+	test.m_bCanRecurse = bCanRecurse;
+	test.m_nParent = nParent;
+}
+
+int __cdecl CShadowRayBatch::CompareQueuedTests( const QueuedTest_t *a, const QueuedTest_t *b )
+{
+	if ( a->m_nSkipID != b->m_nSkipID )
+		return ( a->m_nSkipID < b->m_nSkipID ) ? -1 : 1;
+	if ( a->m_nSortKey != b->m_nSortKey )
+		return ( a->m_nSortKey < b->m_nSortKey ) ? -1 : 1;
+
+	// then in queued order, so that the order doesn't depend on the sort
+	return a->m_nTest - b->m_nTest;
+}
+
+//-----------------------------------------------------------------------------
+// Records whether each ray of a test is blocked
+//-----------------------------------------------------------------------------
+static void SetOcclusion( fltx4 &occlusion, bool bSky, int nLane, int32 nHitID, float flHitDistance, float flLength )
+{
+	if ( ( nHitID == -1 ) || ( flHitDistance >= flLength ) )
+		return;
+
+	// sky tests can see through the sky
+	if ( bSky && ( g_RtEnv.OptimizedTriangleList[nHitID].m_Data.m_IntersectData.m_nTriangleID & TRACE_ID_SKY ) )
+		return;
+
+	SubFloat( occlusion, nLane ) = 1.0f;
+}
+
+static const float s_flTMin[16] = { 0 };
+
+static void TraceWideRays( const EightRays &rays, const float *TMax, RayTracingResult8 *pResult, int32 nSkipID )
+{
+	g_RtEnv.Trace8Rays( rays, s_flTMin, TMax, pResult, nSkipID );
+}
+
+static void TraceWideRays( const SixteenRays &rays, const float *TMax, RayTracingResult16 *pResult, int32 nSkipID )
+{
+	g_RtEnv.Trace16Rays( rays, s_flTMin, TMax, pResult, nSkipID );
+}
+
+//-----------------------------------------------------------------------------
+// Traces the rays of nCount sorted tests N at a time
+//-----------------------------------------------------------------------------
+template <int N> void CShadowRayBatch::TracePacket( VisibilityTestList_t &tests, int nFirst, int nCount )
+{
+	WideRays<N> rays;
+	ALIGN16 float flTMax[N] ALIGN16_POST;
+	for ( int i = 0; i < N; i++ )
+	{
+		// pad out a partial packet by repeating its last test
+		const VisibilityTest_t &test = tests[ m_QueuedTests[ nFirst + min( i / 4, nCount - 1 ) ].m_nTest ];
+		int nLane = i & 3;
+		for ( int c = 0; c < 3; c++ )
+		{
+			rays.origin[c][i] = SubFloat( test.m_Rays.origin[c], nLane );
+			rays.direction[c][i] = SubFloat( test.m_Rays.direction[c], nLane );
+		}
+		flTMax[i] = SubFloat( test.m_Length, nLane );
+	}
+
+	RayTracingWideResult<N> result;
+	TraceWideRays( rays, flTMax, &result, m_QueuedTests[nFirst].m_nSkipID );
+
+	for ( int i = 0; i < nCount * 4; i++ )
+	{
+		VisibilityTest_t &test = tests[ m_QueuedTests[ nFirst + i / 4 ].m_nTest ];
+		SetOcclusion( test.m_Occlusion, test.m_bSky, i & 3, result.HitIds[i], result.HitDistance[i], flTMax[i] );
+	}
+}
+
+void CShadowRayBatch::TraceTests( VisibilityTestList_t &tests )
+{
+	// sort the tests so that ones which start near each other and point the
+	// same way are next to each other
+	m_QueuedTests.SetCount( tests.Count() );
+	for ( int i = 0; i < tests.Count(); i++ )
+	{
+		VisibilityTest_t &test = tests[i];
+		QueuedTest_t &queued = m_QueuedTests[i];
+		queued.m_nSortKey = TestSortKey( test.m_Rays.origin.Vec( 0 ), test.m_Rays.direction.Vec( 0 ) );
+		queued.m_nSkipID = test.m_nSkipID;
+		queued.m_nTest = i;
+	}
+	m_QueuedTests.Sort( CompareQueuedTests );
+
+	int nQueued = 0;
+	while ( nQueued < m_QueuedTests.Count() )
+	{
+		// tests with the same key are traced together, 4 at a time
+		const QueuedTest_t &first = m_QueuedTests[nQueued];
+		int nCount = 1;
+		while ( ( nCount < RAYBATCH_PACKET_TESTS ) && ( nQueued + nCount < m_QueuedTests.Count() ) &&
+				( m_QueuedTests[nQueued + nCount].m_nSkipID == first.m_nSkipID ) &&
+				( m_QueuedTests[nQueued + nCount].m_nSortKey == first.m_nSortKey ) )
+		{
+			nCount++;
+		}
+
+		if ( nCount == 1 )
+		{
+			// nothing to trace it with, so trace it the way TestLine would
+			VisibilityTest_t &test = tests[first.m_nTest];
+			RayTracingResult result;
+			g_RtEnv.Trace4Rays( test.m_Rays, Four_Zeros, test.m_Length, &result, first.m_nSkipID );
+			for ( int i = 0; i < 4; i++ )
+			{
+				SetOcclusion( test.m_Occlusion, test.m_bSky, i, result.HitIds[i], SubFloat( result.HitDistance, i ), SubFloat( test.m_Length, i ) );
+			}
+		}
+		else if ( nCount == 2 )
+		{
+			TracePacket<8>( tests, nQueued, nCount );
+		}
+		else
+		{
+			TracePacket<16>( tests, nQueued, nCount );
+		}
+
+		nQueued += nCount;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Sky tests that weren't fully blocked continue into the 3D skyboxes, the
+// same way TestLine_DoesHitSky recurses
+//-----------------------------------------------------------------------------
+void CShadowRayBatch::QueueSkyboxTests()
+{
+	m_SkyboxTests.RemoveAll();
+	if ( g_bNoSkyRecurse )
+		return;
+
+	for ( int i = 0; i < m_Tests.Count(); i++ )
+	{
+		const VisibilityTest_t &test = m_Tests[i];
+		if ( !test.m_bSky || !test.m_bCanRecurse )
+			continue;
+		if ( TestSignSIMD( CmpGeSIMD( test.m_Occlusion, Four_Ones ) ) == 0xF )
+			continue;
+
+		int leafIndex = PointLeafnum( test.m_Start.Vec( 0 ) );
+		if ( leafIndex < 0 )
+			continue;
+
+		int area = dleafs[leafIndex].area;
+		if ( area < 0 || area >= numareas || area_sky_cameras[area] >= 0 )
+			continue;
+
+		FourVectors dir = test.m_Stop;
+		dir -= test.m_Start;
+		dir.VectorNormalize();
+
+		for ( int cam = 0; cam < num_sky_cameras; ++cam )
+		{
+			FourVectors skystart, skystop;
+			skystart.DuplicateVector( sky_cameras[cam].origin );
+			skystop = test.m_Start;
+			skystop *= sky_cameras[cam].world_to_sky;
+			skystart += skystop;
+
+			skystop = dir;
+			skystop *= MAX_TRACE_LENGTH;
+			skystop += skystart;
+			QueueTest( m_SkyboxTests, skystart, skystop, test.m_nSkipID, true, false, i );
+		}
+	}
+}
+
+void CShadowRayBatch::Trace()
+{
+	Assert( m_Mode == MODE_RECORDING );
+
+	TraceTests( m_Tests );
+
+	QueueSkyboxTests();
+	if ( m_SkyboxTests.Count() )
+	{
+		TraceTests( m_SkyboxTests );
+		for ( int i = 0; i < m_SkyboxTests.Count(); i++ )
+		{
+			VisibilityTest_t &parent = m_Tests[ m_SkyboxTests[i].m_nParent ];
+			parent.m_Occlusion = AddSIMD( parent.m_Occlusion, m_SkyboxTests[i].m_Occlusion );
+		}
+	}
+
+	m_Mode = MODE_REPLAYING;
+	m_nReplayTest = 0;
+}
+
+void CShadowRayBatch::TestLine( FourVectors const& start, FourVectors const& stop,
+	fltx4 *pFractionVisible, int static_prop_index_to_ignore )
+{
+	if ( m_Mode == MODE_RECORDING )
+	{
+		QueueTest( m_Tests, start, stop, TRACE_ID_STATICPROP | static_prop_index_to_ignore, false, false, -1 );
+		*pFractionVisible = Four_Ones;
+		return;
+	}
+
+	if ( m_Mode == MODE_REPLAYING && m_nReplayTest < m_Tests.Count() )
+	{
+		const VisibilityTest_t &test = m_Tests[ m_nReplayTest++ ];
+		Assert( !test.m_bSky );
+		*pFractionVisible = SubSIMD( Four_Ones, test.m_Occlusion );
+		return;
+	}
+
+	Assert( 0 );
+	::TestLine( start, stop, pFractionVisible, static_prop_index_to_ignore );
+}
+
+void CShadowRayBatch::TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip )
+{
+	if ( m_Mode == MODE_RECORDING )
+	{
+		QueueTest( m_Tests, start, stop, TRACE_ID_STATICPROP | static_prop_to_skip, true, canRecurse, -1 );
+		*pFractionVisible = Four_Ones;
+		return;
+	}
+
+	if ( m_Mode == MODE_REPLAYING && m_nReplayTest < m_Tests.Count() )
+	{
+		const VisibilityTest_t &test = m_Tests[ m_nReplayTest++ ];
+		Assert( test.m_bSky );
+		fltx4 occlusion = MaxSIMD( test.m_Occlusion, Four_Zeros );
+		occlusion = MinSIMD( occlusion, Four_Ones );
+		*pFractionVisible = SubSIMD( Four_Ones, occlusion );
+		return;
+	}
+
+	Assert( 0 );
+	::TestLine_DoesHitSky( start, stop, pFractionVisible, canRecurse, static_prop_to_skip );
+}
@@ -0,0 +1,106 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Batched shadow ray tracing for the direct lighting gather
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef RAYBATCH_H
+#define RAYBATCH_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/ssemath.h"
+#include "utlvector.h"
+#include "threads.h"
+
+
+//-----------------------------------------------------------------------------
+// Queues the visibility tests the light gather functions make, and traces them
+// all at once.
+//
+// The gather functions are run over a set of samples twice. While recording,
+// TestLine and TestLine_DoesHitSky queue their rays and report everything as
+// visible, and the results are thrown away. Trace then sorts the queued tests
+// by direction and origin, and traces tests that start near each other and
+// point the same way together, up to 16 rays at a time. While
+// replaying, the gather functions are run again over the same samples and
+// lights, and each visibility test gets the visibility its rays were found to
+// have. The gather functions make the same tests in the same order both
+// times, so the lighting comes out as if each test had been traced on its own.
+//
+// Rays can't be batched with -textureshadows, since the texture coverage
+// callback works on FourRays.
+//-----------------------------------------------------------------------------
+class CShadowRayBatch
+{
+public:
+	CShadowRayBatch();
+
+	bool IsRecording() const	{ return m_Mode == MODE_RECORDING; }
+	bool IsReplaying() const	{ return m_Mode == MODE_REPLAYING; }
+	bool IsActive() const		{ return m_Mode != MODE_INACTIVE; }
+
+	// number of visibility tests queued since BeginRecording
+	int QueuedTestCount() const	{ return m_Tests.Count(); }
+
+	void BeginRecording();
+	void Trace();				// trace the queued tests, and start replaying
+	void EndReplay();
+
+	// same as the global TestLine and TestLine_DoesHitSky
+	void TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFractionVisible, int static_prop_index_to_ignore );
+	void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop, fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip );
+
+private:
+	enum Mode_t
+	{
+		MODE_INACTIVE,
+		MODE_RECORDING,
+		MODE_REPLAYING,
+	};
+
+	struct VisibilityTest_t
+	{
+		FourVectors	m_Start;
+		FourVectors	m_Stop;
+		FourRays	m_Rays;			// normalized the same way TestLine does
+		fltx4		m_Length;
+		fltx4		m_Occlusion;	// 1 for each ray that was blocked, summed with its skybox tests
+		int32		m_nSkipID;
+		bool		m_bSky;
+		bool		m_bCanRecurse;
+		int			m_nParent;		// 3D skybox tests: the test this continues
+	};
+
+	struct QueuedTest_t
+	{
+		uint64		m_nSortKey;
+		int32		m_nSkipID;
+		int			m_nTest;
+	};
+
+	typedef CUtlVector< VisibilityTest_t, CUtlMemoryAligned< VisibilityTest_t, 16 > > VisibilityTestList_t;
+
+	static int __cdecl CompareQueuedTests( const QueuedTest_t *a, const QueuedTest_t *b );
+	void QueueTest( VisibilityTestList_t &tests, FourVectors const& start, FourVectors const& stop, int32 nSkipID, bool bSky, bool bCanRecurse, int nParent );
+	void TraceTests( VisibilityTestList_t &tests );
+	template <int N> void TracePacket( VisibilityTestList_t &tests, int nFirst, int nCount );
+	void QueueSkyboxTests();
+
+	Mode_t m_Mode;
+	VisibilityTestList_t m_Tests;
+	VisibilityTestList_t m_SkyboxTests;
+	CUtlVector< QueuedTest_t > m_QueuedTests;
+	int m_nReplayTest;
+};
+
+// each thread's batch. Only BuildFacelights uses them, and only with -batchrays
+extern CShadowRayBatch g_ShadowRayBatch[MAX_TOOL_THREADS+1];
+
+// number of shadow rays the direct lighting gather has traced on each thread
+extern int64 g_nDirectLightingRays[MAX_TOOL_THREADS+1];
+
+
+#endif // RAYBATCH_H
@@ -0,0 +1,664 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Relighting only the faces that changed lights reach (-relight)
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "tier1/utlbuffer.h"
+
+
+extern int total_transfer;
+extern int max_transfer;
+
+//-----------------------------------------------------------------------------
+// Relight cache
+//
+// A full compile with -relight saves the lights it was run with, the direct
+// lighting of every face and the patch transfers to <mapname>.rlc
+// (<mapname>_hdr.rlc for HDR). The next -relight compile of the same geometry
+// compares its lights against the saved ones. Faces that none of the new,
+// removed or changed lights can reach get their direct lighting from the
+// cache instead of gathering it again, and the bounces are run again with the
+// saved transfers instead of rebuilding the visibility matrix.
+//
+// A light reaches a sample if the sample is in the light's PVS and the light
+// is brighter than RELIGHT_INFLUENCE_CUTOFF there, ignoring shadows. Light
+// intensities are divided by 255 when the lights are loaded, so the cutoff is
+// a light value of about 2.5 on the 0-255 scale. A face a changed light was
+// judged not to reach keeps its cached lighting, so it can be off by up to
+// the cutoff for each such light. Compile without -relight for exact results.
+//-----------------------------------------------------------------------------
+
+#define RELIGHT_CACHE_ID			( ( 'C' << 24 ) | ( 'L' << 16 ) | ( 'R' << 8 ) | 'V' )
+#define RELIGHT_CACHE_VERSION		1
+
+#define RELIGHT_INFLUENCE_CUTOFF	0.01f
+
+struct RelightCacheHeader_t
+{
+	int m_nId;
+	int m_nVersion;
+	CRC32_t m_SettingsCRC;
+};
+
+// everything about a direct light that its lighting depends on. Lights are
+// zeroed before they're filled in so the padding compares equal.
+struct RelightLight_t
+{
+	dworldlight_t	m_Light;
+	int				m_nFaceNum;
+	int				m_nTexData;
+	float			m_flStartFadeDistance;
+	float			m_flEndFadeDistance;
+	float			m_flCapDist;
+};
+
+struct RelightFaceHeader_t
+{
+	int		m_nNumSamples;		// -1 if the face has no lightmap
+	int		m_nNormalCount;
+	CRC32_t	m_SampleCRC;
+	byte	m_Styles[MAXLIGHTMAPS];
+};
+
+// the part of the map a new, removed or changed light reaches
+struct RelightInfluence_t
+{
+	Vector	m_vecOrigin;
+	float	m_flRadius;
+	int		m_nPVS;				// offset into s_InfluencePVS
+};
+
+static bool s_bRelighting = false;		// true when the cache matches and faces can be restored from it
+static CUtlBuffer s_Cache;
+static CUtlVector<int> s_FaceOffsets;	// of each face's RelightFaceHeader_t in s_Cache, -1 if missing
+static int s_nTransferOffset = -1;
+
+static CUtlVector<RelightLight_t> s_Lights;	// the lights this compile is run with
+static CUtlVector<byte> s_LightPVS;
+static CUtlVector<RelightInfluence_t> s_Influences;
+static CUtlVector<byte> s_InfluencePVS;
+static int s_nPVSBytes;
+
+static CUtlBuffer s_FaceLights;			// the direct lighting of this compile
+static int s_nRestoredFaces[MAX_TOOL_THREADS+1];
+
+
+//-----------------------------------------------------------------------------
+// Everything besides the lights which the cached lighting depends on
+//-----------------------------------------------------------------------------
+static CRC32_t ComputeRelightSettingsCRC( void )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	int nVersion = RELIGHT_CACHE_VERSION;
+	CRC32_ProcessBuffer( &crc, &nVersion, sizeof( nVersion ) );
+
+	// shadow casters
+	CRC32_t geometryCRC = ComputeRayTraceGeometryCRC();
+	CRC32_ProcessBuffer( &crc, &geometryCRC, sizeof( geometryCRC ) );
+
+	// lightmaps and patches
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *f = &g_pFaces[i];
+		CRC32_ProcessBuffer( &crc, f->m_LightmapTextureMinsInLuxels, sizeof( f->m_LightmapTextureMinsInLuxels ) );
+		CRC32_ProcessBuffer( &crc, f->m_LightmapTextureSizeInLuxels, sizeof( f->m_LightmapTextureSizeInLuxels ) );
+		CRC32_ProcessBuffer( &crc, &f->smoothingGroups, sizeof( f->smoothingGroups ) );
+	}
+	for ( int i = 0; i < texinfo.Count(); i++ )
+	{
+		CRC32_ProcessBuffer( &crc, texinfo[i].textureVecsTexelsPerWorldUnits, sizeof( texinfo[i].textureVecsTexelsPerWorldUnits ) );
+		CRC32_ProcessBuffer( &crc, texinfo[i].lightmapVecsLuxelsPerWorldUnits, sizeof( texinfo[i].lightmapVecsLuxelsPerWorldUnits ) );
+		CRC32_ProcessBuffer( &crc, &texinfo[i].texdata, sizeof( texinfo[i].texdata ) );
+	}
+	CRC32_ProcessBuffer( &crc, dtexdata, numtexdata * sizeof( dtexdata[0] ) );
+	CRC32_ProcessBuffer( &crc, dvisdata, visdatasize );
+
+	// options
+	CRC32_ProcessBuffer( &crc, &g_bHDR, sizeof( g_bHDR ) );
+	CRC32_ProcessBuffer( &crc, &do_extra, sizeof( do_extra ) );
+	CRC32_ProcessBuffer( &crc, &do_fast, sizeof( do_fast ) );
+	CRC32_ProcessBuffer( &crc, &do_centersamples, sizeof( do_centersamples ) );
+	CRC32_ProcessBuffer( &crc, &extrapasses, sizeof( extrapasses ) );
+	CRC32_ProcessBuffer( &crc, &smoothing_threshold, sizeof( smoothing_threshold ) );
+	CRC32_ProcessBuffer( &crc, &indirect_sun, sizeof( indirect_sun ) );
+	CRC32_ProcessBuffer( &crc, &dlight_map, sizeof( dlight_map ) );
+	CRC32_ProcessBuffer( &crc, &g_SunAngularExtent, sizeof( g_SunAngularExtent ) );
+	CRC32_ProcessBuffer( &crc, &g_flSkySampleScale, sizeof( g_flSkySampleScale ) );
+	CRC32_ProcessBuffer( &crc, &g_bLargeDispSampleRadius, sizeof( g_bLargeDispSampleRadius ) );
+	CRC32_ProcessBuffer( &crc, &g_bNoSkyRecurse, sizeof( g_bNoSkyRecurse ) );
+	CRC32_ProcessBuffer( &crc, &g_bDisablePropSelfShadowing, sizeof( g_bDisablePropSelfShadowing ) );
+	CRC32_ProcessBuffer( &crc, &maxchop, sizeof( maxchop ) );
+	CRC32_ProcessBuffer( &crc, &minchop, sizeof( minchop ) );
+	CRC32_ProcessBuffer( &crc, &dispchop, sizeof( dispchop ) );
+	CRC32_ProcessBuffer( &crc, &g_MaxDispPatchRadius, sizeof( g_MaxDispPatchRadius ) );
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
+// the patches the transfers were made between
+static CRC32_t ComputePatchCRC( void )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	for ( int i = 0; i < g_Patches.Count(); i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		CRC32_ProcessBuffer( &crc, &patch->origin, sizeof( patch->origin ) );
+		CRC32_ProcessBuffer( &crc, &patch->normal, sizeof( patch->normal ) );
+		CRC32_ProcessBuffer( &crc, &patch->area, sizeof( patch->area ) );
+		CRC32_ProcessBuffer( &crc, &patch->faceNumber, sizeof( patch->faceNumber ) );
+		CRC32_ProcessBuffer( &crc, &patch->child1, sizeof( patch->child1 ) );
+		CRC32_ProcessBuffer( &crc, &patch->child2, sizeof( patch->child2 ) );
+	}
+	CRC32_Final( &crc );
+	return crc;
+}
+
+static CRC32_t ComputeSampleCRC( const facelight_t *fl )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	for ( int i = 0; i < fl->numsamples; i++ )
+	{
+		CRC32_ProcessBuffer( &crc, &fl->sample[i].pos, sizeof( fl->sample[i].pos ) );
+	}
+	CRC32_Final( &crc );
+	return crc;
+}
+
+
+//-----------------------------------------------------------------------------
+// How far from a light it can be brighter than RELIGHT_INFLUENCE_CUTOFF.
+// FLT_MAX for lights without falloff.
+//-----------------------------------------------------------------------------
+static float LightInfluenceRadius( const RelightLight_t &light )
+{
+	const dworldlight_t &wl = light.m_Light;
+	float flMaxIntensity = max( wl.intensity.x, max( wl.intensity.y, wl.intensity.z ) );
+	if ( flMaxIntensity <= 0.0f )
+		return 0.0f;
+
+	// the distance at which the falloff reaches flMaxIntensity / cutoff
+	float flRadius = FLT_MAX;
+	float flAttn = flMaxIntensity / RELIGHT_INFLUENCE_CUTOFF;
+	switch ( wl.type )
+	{
+	case emit_surface:
+		flRadius = sqrt( flAttn );
+		break;
+
+	case emit_point:
+	case emit_spotlight:
+		if ( wl.quadratic_attn > 0.0f )
+		{
+			float flDiscriminant = wl.linear_attn * wl.linear_attn - 4.0f * wl.quadratic_attn * ( wl.constant_attn - flAttn );
+			flRadius = ( -wl.linear_attn + sqrt( max( flDiscriminant, 0.0f ) ) ) / ( 2.0f * wl.quadratic_attn );
+		}
+		else if ( wl.linear_attn > 0.0f )
+		{
+			flRadius = ( flAttn - wl.constant_attn ) / wl.linear_attn;
+		}
+
+		// the falloff stops at the cap distance
+		if ( flRadius > light.m_flCapDist )
+		{
+			flRadius = FLT_MAX;
+		}
+		break;
+
+	default:
+		// sky lights reach everything that can see the sky
+		return FLT_MAX;
+	}
+
+	// lights with a hard falloff reach zero at the end of the fade
+	if ( light.m_flEndFadeDistance > light.m_flStartFadeDistance )
+	{
+		flRadius = min( flRadius, light.m_flEndFadeDistance );
+	}
+
+	return max( flRadius, 1.0f );
+}
+
+static void AddInfluence( const RelightLight_t &light, const byte *pPVS )
+{
+	int i = s_Influences.AddToTail();
+	s_Influences[i].m_vecOrigin = light.m_Light.origin;
+	s_Influences[i].m_flRadius = LightInfluenceRadius( light );
+	s_Influences[i].m_nPVS = s_InfluencePVS.AddMultipleToTail( s_nPVSBytes, pPVS );
+}
+
+static int __cdecl CompareLightKeys( const void *pA, const void *pB )
+{
+	uint64 a = *( const uint64 * )pA;
+	uint64 b = *( const uint64 * )pB;
+	return ( a < b ) ? -1 : ( a > b ) ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Finds the lights that aren't in both lists, and adds the parts of the map
+// they reach to s_Influences
+//-----------------------------------------------------------------------------
+static int FindChangedLights( const RelightLight_t *pOldLights, const byte *pOldPVS, int nOldLights )
+{
+	// pair lights up by their CRC, high 32 bits CRC and low 32 bits index
+	CUtlVector<uint64> oldKeys, newKeys;
+	for ( int i = 0; i < nOldLights; i++ )
+	{
+		uint64 nCRC = CRC32_ProcessSingleBuffer( &pOldLights[i], sizeof( RelightLight_t ) );
+		oldKeys.AddToTail( ( nCRC << 32 ) | i );
+	}
+	for ( int i = 0; i < s_Lights.Count(); i++ )
+	{
+		uint64 nCRC = CRC32_ProcessSingleBuffer( &s_Lights[i], sizeof( RelightLight_t ) );
+		newKeys.AddToTail( ( nCRC << 32 ) | i );
+	}
+	qsort( oldKeys.Base(), oldKeys.Count(), sizeof( uint64 ), CompareLightKeys );
+	qsort( newKeys.Base(), newKeys.Count(), sizeof( uint64 ), CompareLightKeys );
+
+	CUtlVector<bool> oldMatched, newMatched;
+	oldMatched.SetCount( nOldLights );
+	newMatched.SetCount( s_Lights.Count() );
+	memset( oldMatched.Base(), 0, oldMatched.Count() * sizeof( bool ) );
+	memset( newMatched.Base(), 0, newMatched.Count() * sizeof( bool ) );
+
+	int iOld = 0, iNew = 0;
+	while ( iOld < oldKeys.Count() && iNew < newKeys.Count() )
+	{
+		uint32 nOldCRC = (uint32)( oldKeys[iOld] >> 32 );
+		uint32 nNewCRC = (uint32)( newKeys[iNew] >> 32 );
+		if ( nOldCRC < nNewCRC )
+		{
+			++iOld;
+		}
+		else if ( nNewCRC < nOldCRC )
+		{
+			++iNew;
+		}
+		else
+		{
+			int nOld = (int)( oldKeys[iOld] & 0xffffffff );
+			int nNew = (int)( newKeys[iNew] & 0xffffffff );
+			if ( !memcmp( &pOldLights[nOld], &s_Lights[nNew], sizeof( RelightLight_t ) ) )
+			{
+				oldMatched[nOld] = true;
+				newMatched[nNew] = true;
+			}
+			++iOld;
+			++iNew;
+		}
+	}
+
+	int nChanged = 0;
+	for ( int i = 0; i < nOldLights; i++ )
+	{
+		if ( !oldMatched[i] )
+		{
+			AddInfluence( pOldLights[i], pOldPVS + i * s_nPVSBytes );
+			++nChanged;
+		}
+	}
+	for ( int i = 0; i < s_Lights.Count(); i++ )
+	{
+		if ( !newMatched[i] )
+		{
+			AddInfluence( s_Lights[i], s_LightPVS.Base() + i * s_nPVSBytes );
+			++nChanged;
+		}
+	}
+	return nChanged;
+}
+
+
+//-----------------------------------------------------------------------------
+// Reads the cache and finds which lights have changed since it was written.
+// Called before the direct lighting, after the lights are created.
+//-----------------------------------------------------------------------------
+void LoadRelightCache( const char *pFilename )
+{
+	s_bRelighting = false;
+	s_Cache.Purge();
+	s_FaceOffsets.Purge();
+	s_nTransferOffset = -1;
+	s_Influences.Purge();
+	s_InfluencePVS.Purge();
+	memset( s_nRestoredFaces, 0, sizeof( s_nRestoredFaces ) );
+
+	// remember the lights this compile is run with, for the next one
+	s_nPVSBytes = ( dvis->numclusters / 8 ) + 1;
+	s_Lights.Purge();
+	s_LightPVS.Purge();
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		RelightLight_t &light = s_Lights[s_Lights.AddToTail()];
+		memset( &light, 0, sizeof( light ) );
+		light.m_Light = dl->light;
+		light.m_nFaceNum = dl->facenum;
+		light.m_nTexData = dl->texdata;
+		light.m_flStartFadeDistance = dl->m_flStartFadeDistance;
+		light.m_flEndFadeDistance = dl->m_flEndFadeDistance;
+		light.m_flCapDist = dl->m_flCapDist;
+		s_LightPVS.AddMultipleToTail( s_nPVSBytes, dl->pvs );
+	}
+
+	if ( !g_pFileSystem->ReadFile( pFilename, NULL, s_Cache ) )
+	{
+		Msg( "No relight cache, lighting every face\n" );
+		return;
+	}
+
+	RelightCacheHeader_t header;
+	if ( s_Cache.GetBytesRemaining() < (int)sizeof( header ) )
+		return;
+	s_Cache.Get( &header, sizeof( header ) );
+	if ( header.m_nId != RELIGHT_CACHE_ID || header.m_nVersion != RELIGHT_CACHE_VERSION )
+		return;
+
+	if ( header.m_SettingsCRC != ComputeRelightSettingsCRC() )
+	{
+		Msg( "Geometry or options have changed since %s was written, lighting every face\n", pFilename );
+		s_Cache.Purge();
+		return;
+	}
+
+	// lights
+	int nOldLights = s_Cache.GetInt();
+	int nLightSize = sizeof( RelightLight_t ) + s_nPVSBytes;
+	if ( !s_Cache.IsValid() || nOldLights < 0 || nOldLights > s_Cache.GetBytesRemaining() / nLightSize )
+	{
+		Warning( "%s is damaged, lighting every face\n", pFilename );
+		s_Cache.Purge();
+		return;
+	}
+	const RelightLight_t *pOldLights = (const RelightLight_t *)s_Cache.PeekGet();
+	const byte *pOldPVS = (const byte *)s_Cache.PeekGet( nOldLights * sizeof( RelightLight_t ) );
+	s_Cache.SeekGet( CUtlBuffer::SEEK_CURRENT, nOldLights * nLightSize );
+
+	// faces
+	int nFaces = s_Cache.GetInt();
+	if ( !s_Cache.IsValid() || nFaces != numfaces )
+	{
+		Warning( "%s is damaged, lighting every face\n", pFilename );
+		s_Cache.Purge();
+		return;
+	}
+	bool bDamaged = false;
+	s_FaceOffsets.SetCount( numfaces );
+	for ( int i = 0; i < numfaces && !bDamaged; i++ )
+	{
+		RelightFaceHeader_t faceHeader;
+		s_FaceOffsets[i] = s_Cache.TellGet();
+		s_Cache.Get( &faceHeader, sizeof( faceHeader ) );
+		if ( !s_Cache.IsValid() )
+		{
+			bDamaged = true;
+		}
+		else if ( faceHeader.m_nNumSamples < 0 )
+		{
+			s_FaceOffsets[i] = -1;
+		}
+		else if ( faceHeader.m_nNormalCount < 1 || faceHeader.m_nNormalCount > NUM_BUMP_VECTS + 1 )
+		{
+			bDamaged = true;
+		}
+		else
+		{
+			int nStyles = 0;
+			while ( nStyles < MAXLIGHTMAPS && faceHeader.m_Styles[nStyles] != 255 )
+				++nStyles;
+			int nBytes = nStyles * faceHeader.m_nNormalCount * faceHeader.m_nNumSamples * sizeof( LightingValue_t );
+			bDamaged = s_Cache.GetBytesRemaining() < nBytes;
+			s_Cache.SeekGet( CUtlBuffer::SEEK_CURRENT, nBytes );
+		}
+	}
+	if ( bDamaged )
+	{
+		Warning( "%s is damaged, lighting every face\n", pFilename );
+		s_Cache.Purge();
+		s_FaceOffsets.Purge();
+		return;
+	}
+
+	s_nTransferOffset = s_Cache.TellGet();
+
+	int nChanged = FindChangedLights( pOldLights, pOldPVS, nOldLights );
+	Msg( "Relighting: %d lights, %d of them new, removed or changed\n", s_Lights.Count(), nChanged );
+
+	s_bRelighting = true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns true if a new, removed or changed light can reach the face
+//-----------------------------------------------------------------------------
+static bool IsFaceReachedByChangedLight( const facelight_t *fl, const Vector &vecFaceNormal )
+{
+	if ( !s_Influences.Count() )
+		return false;
+
+	// the supersamples of -extra are within a luxel of their sample
+	float flPad = 2.0f * sqrt( max( fl->worldAreaPerLuxel, 0.0f ) );
+
+	for ( int i = 0; i < fl->numsamples; i++ )
+	{
+		// the light is gathered slightly off the surface, but with the PVS
+		// cluster of the sample itself
+		Vector vecPos = fl->sample[i].pos + vecFaceNormal;
+		int nCluster = -2;
+
+		for ( int j = 0; j < s_Influences.Count(); j++ )
+		{
+			const RelightInfluence_t &influence = s_Influences[j];
+			if ( influence.m_flRadius != FLT_MAX && vecPos.DistTo( influence.m_vecOrigin ) - flPad > influence.m_flRadius )
+				continue;
+
+			if ( nCluster == -2 )
+			{
+				nCluster = ClusterFromPoint( fl->sample[i].pos );
+			}
+			if ( PVSCheck( s_InfluencePVS.Base() + influence.m_nPVS, nCluster ) )
+				return true;
+		}
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Fills in the face's direct lighting from the cache, if no changed light can
+// reach it. The samples must have been built already.
+//-----------------------------------------------------------------------------
+bool RestoreRelightFaceLight( int iThread, int facenum, facelight_t *fl, const Vector &vecFaceNormal, int nNormalCount )
+{
+	if ( !s_bRelighting || s_FaceOffsets[facenum] < 0 )
+		return false;
+
+	const byte *pData = (const byte *)s_Cache.Base() + s_FaceOffsets[facenum];
+	RelightFaceHeader_t header;
+	memcpy( &header, pData, sizeof( header ) );
+	pData += sizeof( header );
+
+	if ( header.m_nNumSamples != fl->numsamples || header.m_nNormalCount != nNormalCount )
+		return false;
+
+	if ( header.m_SampleCRC != ComputeSampleCRC( fl ) )
+		return false;
+
+	if ( IsFaceReachedByChangedLight( fl, vecFaceNormal ) )
+		return false;
+
+	dface_t *f = &g_pFaces[facenum];
+	int nBytes = fl->numsamples * sizeof( LightingValue_t );
+	for ( int k = 0; k < MAXLIGHTMAPS; k++ )
+	{
+		f->styles[k] = header.m_Styles[k];
+		if ( f->styles[k] == 255 )
+			continue;
+
+		for ( int n = 0; n < nNormalCount; n++ )
+		{
+			fl->light[k][n] = ( LightingValue_t* )malloc( nBytes );
+			memcpy( fl->light[k][n], pData, nBytes );
+			pData += nBytes;
+		}
+	}
+
+	++s_nRestoredFaces[iThread];
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Saves the direct lighting of every face, before the bounced light is
+// added to it
+//-----------------------------------------------------------------------------
+void SaveRelightFaceLights( void )
+{
+	if ( s_bRelighting )
+	{
+		int nRestored = 0;
+		for ( int i = 0; i < ARRAYSIZE( s_nRestoredFaces ); i++ )
+		{
+			nRestored += s_nRestoredFaces[i];
+		}
+		Msg( "Relighting: reused the direct lighting of %d of %d faces\n", nRestored, numfaces );
+	}
+
+	s_FaceLights.Purge();
+	s_FaceLights.PutInt( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *f = &g_pFaces[i];
+		facelight_t *fl = &facelight[i];
+
+		RelightFaceHeader_t header;
+		memset( &header, 0, sizeof( header ) );
+		header.m_nNumSamples = -1;
+		if ( f->styles[0] == 255 || !fl->numsamples || !fl->light[0][0] )
+		{
+			s_FaceLights.Put( &header, sizeof( header ) );
+			continue;
+		}
+
+		header.m_nNumSamples = fl->numsamples;
+		header.m_nNormalCount = 0;
+		while ( header.m_nNormalCount < NUM_BUMP_VECTS + 1 && fl->light[0][header.m_nNormalCount] )
+			++header.m_nNormalCount;
+		header.m_SampleCRC = ComputeSampleCRC( fl );
+		memcpy( header.m_Styles, f->styles, sizeof( header.m_Styles ) );
+		s_FaceLights.Put( &header, sizeof( header ) );
+
+		for ( int k = 0; k < MAXLIGHTMAPS && f->styles[k] != 255; k++ )
+		{
+			for ( int n = 0; n < header.m_nNormalCount; n++ )
+			{
+				s_FaceLights.Put( fl->light[k][n], fl->numsamples * sizeof( LightingValue_t ) );
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Fills in the patch transfers from the cache instead of building them.
+// Returns false if they have to be built.
+//-----------------------------------------------------------------------------
+bool LoadRelightTransfers( void )
+{
+	if ( !s_bRelighting || s_nTransferOffset < 0 )
+		return false;
+
+	s_Cache.SeekGet( CUtlBuffer::SEEK_HEAD, s_nTransferOffset );
+	int nPatches = s_Cache.GetInt();
+	CRC32_t patchCRC;
+	s_Cache.Get( &patchCRC, sizeof( patchCRC ) );
+	if ( !s_Cache.IsValid() || nPatches != g_Patches.Count() || patchCRC != ComputePatchCRC() )
+		return false;
+
+	// read them all before keeping any, in case the file was cut short
+	int nStart = s_Cache.TellGet();
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		int nTransfers = s_Cache.GetInt();
+		int nBytes = s_Cache.GetInt();
+		s_Cache.GetFloat();
+		if ( !s_Cache.IsValid() || nTransfers < 0 || nBytes < 0 || s_Cache.GetBytesRemaining() < nBytes )
+			return false;
+		s_Cache.SeekGet( CUtlBuffer::SEEK_CURRENT, nBytes );
+	}
+
+	s_Cache.SeekGet( CUtlBuffer::SEEK_HEAD, nStart );
+	total_transfer = 0;
+	max_transfer = 0;
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		patch->numtransfers = s_Cache.GetInt();
+		patch->transferbytes = s_Cache.GetInt();
+		patch->transferscale = s_Cache.GetFloat();
+		patch->transfers = NULL;
+		if ( patch->transferbytes )
+		{
+			patch->transfers = AllocTransferList( patch->transferbytes );
+			s_Cache.Get( patch->transfers, patch->transferbytes );
+		}
+
+		total_transfer += patch->numtransfers;
+		max_transfer = max( max_transfer, patch->numtransfers );
+	}
+
+	Msg( "Relighting: reused %d transfers, max %d\n", total_transfer, max_transfer );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the lights, the direct lighting saved by SaveRelightFaceLights and
+// the transfers, if the bounces were run
+//-----------------------------------------------------------------------------
+void SaveRelightCache( const char *pFilename )
+{
+	s_Cache.Purge();
+	s_FaceOffsets.Purge();
+	s_bRelighting = false;
+
+	RelightCacheHeader_t header;
+	header.m_nId = RELIGHT_CACHE_ID;
+	header.m_nVersion = RELIGHT_CACHE_VERSION;
+	header.m_SettingsCRC = ComputeRelightSettingsCRC();
+
+	CUtlBuffer buf;
+	buf.Put( &header, sizeof( header ) );
+
+	buf.PutInt( s_Lights.Count() );
+	buf.Put( s_Lights.Base(), s_Lights.Count() * sizeof( RelightLight_t ) );
+	buf.Put( s_LightPVS.Base(), s_LightPVS.Count() );
+
+	buf.Put( s_FaceLights.Base(), s_FaceLights.TellPut() );
+	s_FaceLights.Purge();
+
+	// a compile without bounces has no transfers
+	int nPatches = ( numbounce > 0 ) ? g_Patches.Count() : 0;
+	CRC32_t patchCRC = ComputePatchCRC();
+	buf.PutInt( nPatches );
+	buf.Put( &patchCRC, sizeof( patchCRC ) );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		buf.PutInt( patch->numtransfers );
+		buf.PutInt( patch->transfers ? patch->transferbytes : 0 );
+		buf.PutFloat( patch->transferscale );
+		if ( patch->transfers )
+		{
+			buf.Put( patch->transfers, patch->transferbytes );
+		}
+	}
+
+	if ( !g_pFileSystem->WriteFile( pFilename, NULL, buf ) )
+	{
+		Warning( "Couldn't write relight cache %s\n", pFilename );
+	}
+}
@@ -13,6 +13,7 @@
 #include "trace.h"
 #include "Cmodel.h"
 #include "mathlib/vmatrix.h"
+#include "vstdlib/random.h"
 
 
 //=============================================================================
@@ -180,6 +181,260 @@ void TestLine( const FourVectors& start, const FourVectors& stop,
 }
 
 
+//-----------------------------------------------------------------------------
+// Ray tracing benchmark
+//-----------------------------------------------------------------------------
+
+#define BENCHMARK_RAY_BUNDLES	( 1 << 15 )		// of 16 rays each, 512K rays in all
+#define BENCHMARK_RAY_JITTER	8.0f
+
+struct BenchmarkRayBundle_t
+{
+	SixteenRays m_Rays;
+	float m_TMin[16];
+	float m_TMax[16];
+};
+
+// a random point just in front of a face of the world
+static Vector RandomPointOnFace( CUniformRandomStream &random, int facenum )
+{
+	dface_t *f = &g_pFaces[facenum];
+	Vector origin( 0, 0, 0 );
+	winding_t *w = WindingFromFace( f, origin );
+
+	Vector point = w->p[0];
+	if ( w->numpoints >= 3 )
+	{
+		int tri = random.RandomInt( 2, w->numpoints - 1 );
+		float b1 = random.RandomFloat();
+		float b2 = random.RandomFloat();
+		if ( b1 + b2 > 1.0f )
+		{
+			b1 = 1.0f - b1;
+			b2 = 1.0f - b2;
+		}
+		point += b1 * ( w->p[tri - 1] - w->p[0] ) + b2 * ( w->p[tri] - w->p[0] );
+	}
+	FreeWinding( w );
+
+	return point + dplanes[f->planenum].normal;
+}
+
+static Vector RandomJitter( CUniformRandomStream &random )
+{
+	return Vector( random.RandomFloat( -BENCHMARK_RAY_JITTER, BENCHMARK_RAY_JITTER ),
+				   random.RandomFloat( -BENCHMARK_RAY_JITTER, BENCHMARK_RAY_JITTER ),
+				   random.RandomFloat( -BENCHMARK_RAY_JITTER, BENCHMARK_RAY_JITTER ) );
+}
+
+static int CountBenchmarkMismatches( const CUtlVector<BenchmarkRayBundle_t> &bundles,
+	const CUtlVector<RayTracingResult16> &expected, const CUtlVector<RayTracingResult16> &results, int *pHits )
+{
+	int nMismatches = 0;
+	*pHits = 0;
+	for ( int b = 0; b < bundles.Count(); b++ )
+	{
+		for ( int i = 0; i < 16; i++ )
+		{
+			bool bExpectedHit = expected[b].HitIds[i] != -1 && expected[b].HitDistance[i] < bundles[b].m_TMax[i];
+			bool bHit = results[b].HitIds[i] != -1 && results[b].HitDistance[i] < bundles[b].m_TMax[i];
+			if ( bExpectedHit )
+				++(*pHits);
+
+			if ( bHit != bExpectedHit ||
+				 ( bHit && ( results[b].HitIds[i] != expected[b].HitIds[i] || results[b].HitDistance[i] != expected[b].HitDistance[i] ) ) )
+			{
+				++nMismatches;
+			}
+		}
+	}
+	return nMismatches;
+}
+
+// Bundles of rays from a small patch of one world face to a small patch of
+// another, which is roughly what lighting a luxel looks like.
+static bool GenerateBenchmarkRays( CUtlVector<BenchmarkRayBundle_t> &bundles )
+{
+	dmodel_t *pWorld = &dmodels[0];
+	if ( pWorld->numfaces < 2 )
+	{
+		Warning( "Not enough faces to benchmark ray tracing\n" );
+		return false;
+	}
+
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	bundles.SetCount( BENCHMARK_RAY_BUNDLES );
+	for ( int b = 0; b < bundles.Count(); b++ )
+	{
+		int nFrom = pWorld->firstface + random.RandomInt( 0, pWorld->numfaces - 1 );
+		int nTo = pWorld->firstface + random.RandomInt( 0, pWorld->numfaces - 1 );
+		Vector from = RandomPointOnFace( random, nFrom );
+		Vector to = RandomPointOnFace( random, nTo );
+
+		BenchmarkRayBundle_t &bundle = bundles[b];
+		for ( int i = 0; i < 16; i++ )
+		{
+			Vector start = from + RandomJitter( random );
+			Vector dir = to + RandomJitter( random ) - start;
+			float len = VectorNormalize( dir );
+			if ( len == 0.0f )
+			{
+				dir.Init( 0, 0, 1 );
+			}
+			for ( int c = 0; c < 3; c++ )
+			{
+				bundle.m_Rays.origin[c][i] = start[c];
+				bundle.m_Rays.direction[c][i] = dir[c];
+			}
+			bundle.m_TMin[i] = 0.0f;
+			bundle.m_TMax[i] = len;
+		}
+	}
+	return true;
+}
+
+static void TraceBenchmarkBundle4( RayTracingEnvironment &env, const BenchmarkRayBundle_t &bundle, RayTracingResult16 &result )
+{
+	for ( int i = 0; i < 16; i += 4 )
+	{
+		FourRays rays;
+		for ( int c = 0; c < 3; c++ )
+		{
+			rays.origin[c] = LoadUnalignedSIMD( &bundle.m_Rays.origin[c][i] );
+			rays.direction[c] = LoadUnalignedSIMD( &bundle.m_Rays.direction[c][i] );
+		}
+		RayTracingResult rt_result;
+		env.Trace4Rays( rays, LoadUnalignedSIMD( &bundle.m_TMin[i] ), LoadUnalignedSIMD( &bundle.m_TMax[i] ), &rt_result );
+		for ( int j = 0; j < 4; j++ )
+		{
+			result.HitIds[i + j] = rt_result.HitIds[j];
+			result.HitDistance[i + j] = SubFloat( rt_result.HitDistance, j );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Traces the same set of rays against the map 4, 8 and 16 at a time, and prints
+// the rays per second of each along with any hits that differ from the 4 wide
+// results.
+//-----------------------------------------------------------------------------
+void BenchmarkRayTracing( void )
+{
+	CUtlVector<BenchmarkRayBundle_t> bundles;
+	if ( !GenerateBenchmarkRays( bundles ) )
+		return;
+
+	int nRays = bundles.Count() * 16;
+	Msg( "Benchmarking %d rays against %d triangles (widest native trace: %d rays)\n",
+		nRays, g_RtEnv.OptimizedTriangleList.Count(), RayTracingEnvironment::GetNativeTraceWidth() );
+
+	CUtlVector<RayTracingResult16> results[3];
+	for ( int w = 0; w < 3; w++ )
+	{
+		results[w].SetCount( bundles.Count() );
+
+		double flStart = Plat_FloatTime();
+		for ( int b = 0; b < bundles.Count(); b++ )
+		{
+			const BenchmarkRayBundle_t &bundle = bundles[b];
+			RayTracingResult16 &result = results[w][b];
+			if ( w == 0 )
+			{
+				TraceBenchmarkBundle4( g_RtEnv, bundle, result );
+			}
+			else if ( w == 1 )
+			{
+				for ( int i = 0; i < 16; i += 8 )
+				{
+					EightRays rays;
+					for ( int c = 0; c < 3; c++ )
+					{
+						memcpy( rays.origin[c], &bundle.m_Rays.origin[c][i], sizeof( rays.origin[c] ) );
+						memcpy( rays.direction[c], &bundle.m_Rays.direction[c][i], sizeof( rays.direction[c] ) );
+					}
+					RayTracingResult8 rt_result;
+					g_RtEnv.Trace8Rays( rays, &bundle.m_TMin[i], &bundle.m_TMax[i], &rt_result );
+					memcpy( &result.HitIds[i], rt_result.HitIds, sizeof( rt_result.HitIds ) );
+					memcpy( &result.HitDistance[i], rt_result.HitDistance, sizeof( rt_result.HitDistance ) );
+				}
+			}
+			else
+			{
+				g_RtEnv.Trace16Rays( bundle.m_Rays, bundle.m_TMin, bundle.m_TMax, &result );
+			}
+		}
+		double flSeconds = MAX( Plat_FloatTime() - flStart, 1.0e-6 );
+
+		int nHits;
+		int nMismatches = CountBenchmarkMismatches( bundles, results[0], results[w], &nHits );
+		Msg( "  %2d wide: %.2f seconds, %.2f million rays/second, %d of %d rays blocked, %d differ from 4 wide\n",
+			4 << w, flSeconds, nRays / flSeconds / 1.0e6, nHits, nRays, nMismatches );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Builds the kd-tree for the triangles added to g_RtEnv so far with both the
+// original serial builder and the parallel binned one, and prints how long each
+// took, the size of each tree, and how fast rays trace through each. Has to be
+// called before g_RtEnv's own tree is built, while its triangles can still be
+// copied.
+//-----------------------------------------------------------------------------
+void BenchmarkKDTreeBuild( void )
+{
+	CUtlVector<BenchmarkRayBundle_t> bundles;
+	if ( !GenerateBenchmarkRays( bundles ) )
+		return;
+
+	int nRays = bundles.Count() * 16;
+	Msg( "Benchmarking kd-tree construction for %d triangles on %d threads\n",
+		g_RtEnv.OptimizedTriangleList.Count(), numthreads );
+
+	static const char *s_pBuilderNames[2] = { "serial", "parallel" };
+	CUtlVector<RayTracingResult16> results[2];
+	for ( int e = 0; e < 2; e++ )
+	{
+		RayTracingEnvironment *pEnv = new RayTracingEnvironment;
+		pEnv->Flags = g_RtEnv.Flags;
+		if ( e == 0 )
+		{
+			pEnv->Flags |= RTE_FLAGS_SERIAL_TREE_GENERATION;
+		}
+		pEnv->OptimizedTriangleList = g_RtEnv.OptimizedTriangleList;
+
+		double flStart = Plat_FloatTime();
+		pEnv->SetupAccelerationStructure();
+		double flBuildSeconds = Plat_FloatTime() - flStart;
+
+		int nLeaves = 0;
+		for ( int n = 0; n < pEnv->OptimizedKDTree.Count(); n++ )
+		{
+			if ( pEnv->OptimizedKDTree[n].NodeType() == KDNODE_STATE_LEAF )
+				++nLeaves;
+		}
+
+		results[e].SetCount( bundles.Count() );
+		flStart = Plat_FloatTime();
+		for ( int b = 0; b < bundles.Count(); b++ )
+		{
+			TraceBenchmarkBundle4( *pEnv, bundles[b], results[e][b] );
+		}
+		double flTraceSeconds = MAX( Plat_FloatTime() - flStart, 1.0e-6 );
+
+		int nHits;
+		int nMismatches = CountBenchmarkMismatches( bundles, results[0], results[e], &nHits );
+		Msg( "  %8s: built in %.2f seconds, %d nodes, %d leaves, %d triangle references\n",
+			s_pBuilderNames[e], flBuildSeconds, pEnv->OptimizedKDTree.Count(), nLeaves, pEnv->TriangleIndexList.Count() );
+		Msg( "            %.2f million rays/second, %d of %d rays blocked, %d differ from serial\n",
+			nRays / flTraceSeconds / 1.0e6, nHits, nRays, nMismatches );
+
+		delete pEnv;
+	}
+}
+
+
+
 
 /*
 ================
@@ -651,3 +906,171 @@ void AddBrushesForRayTrace( void )
 		}
 	}
 }
+
+
+//-----------------------------------------------------------------------------
+// Ray trace cache
+//
+// The ray trace environment only depends on the world brushes, displacements
+// and static props, and not on the lights, so when only the lights of a map
+// change, the triangles and kd-tree from the last run can be loaded instead of
+// being rebuilt. The cache is keyed by a CRC of everything the triangles are
+// made from.
+//-----------------------------------------------------------------------------
+
+#define RAYTRACE_CACHE_ID		( ( 'C' << 24 ) | ( 'T' << 16 ) | ( 'R' << 8 ) | 'V' )
+#define RAYTRACE_CACHE_VERSION	1
+
+struct RayTraceCacheHeader_t
+{
+	int m_nId;
+	int m_nVersion;
+	CRC32_t m_GeometryCRC;
+};
+
+static void HashString( CRC32_t *pCRC, const char *pString )
+{
+	// include the terminator, so that consecutive strings can't run together
+	CRC32_ProcessBuffer( pCRC, pString, Q_strlen( pString ) + 1 );
+}
+
+// Only the parts of the bsp that the ray trace triangles come from are hashed.
+// vrad writes the lighting into the faces, leaves and displacements, so
+// those are hashed field by field rather than as whole lumps.
+CRC32_t ComputeRayTraceGeometryCRC( void )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	int nVersion = RAYTRACE_CACHE_VERSION;
+	CRC32_ProcessBuffer( &crc, &nVersion, sizeof( nVersion ) );
+	CRC32_ProcessBuffer( &crc, &g_RtEnv.Flags, sizeof( g_RtEnv.Flags ) );
+	CRC32_ProcessBuffer( &crc, &g_bStaticPropPolys, sizeof( g_bStaticPropPolys ) );
+	CRC32_ProcessBuffer( &crc, &g_bTextureShadows, sizeof( g_bTextureShadows ) );
+	for ( int i = 0; i < g_NonShadowCastingMaterialStrings.Count(); i++ )
+	{
+		HashString( &crc, g_NonShadowCastingMaterialStrings[i] );
+	}
+
+	// brushes
+	CRC32_ProcessBuffer( &crc, dmodels, nummodels * sizeof( dmodels[0] ) );
+	CRC32_ProcessBuffer( &crc, dnodes, numnodes * sizeof( dnodes[0] ) );
+	for ( int i = 0; i < numleafs; i++ )
+	{
+		CRC32_ProcessBuffer( &crc, &dleafs[i].firstleafbrush, sizeof( dleafs[i].firstleafbrush ) );
+		CRC32_ProcessBuffer( &crc, &dleafs[i].numleafbrushes, sizeof( dleafs[i].numleafbrushes ) );
+	}
+	CRC32_ProcessBuffer( &crc, dleafbrushes, numleafbrushes * sizeof( dleafbrushes[0] ) );
+	CRC32_ProcessBuffer( &crc, dbrushes, numbrushes * sizeof( dbrushes[0] ) );
+	CRC32_ProcessBuffer( &crc, dbrushsides, numbrushsides * sizeof( dbrushsides[0] ) );
+	CRC32_ProcessBuffer( &crc, dplanes, numplanes * sizeof( dplanes[0] ) );
+	for ( int i = 0; i < texinfo.Count(); i++ )
+	{
+		CRC32_ProcessBuffer( &crc, &texinfo[i].flags, sizeof( texinfo[i].flags ) );
+	}
+
+	// faces, for the sky and the displacements
+	CRC32_ProcessBuffer( &crc, dvertexes, numvertexes * sizeof( dvertexes[0] ) );
+	CRC32_ProcessBuffer( &crc, dedges, numedges * sizeof( dedges[0] ) );
+	CRC32_ProcessBuffer( &crc, dsurfedges, numsurfedges * sizeof( dsurfedges[0] ) );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *f = &g_pFaces[i];
+		CRC32_ProcessBuffer( &crc, &f->planenum, sizeof( f->planenum ) );
+		CRC32_ProcessBuffer( &crc, &f->firstedge, sizeof( f->firstedge ) );
+		CRC32_ProcessBuffer( &crc, &f->numedges, sizeof( f->numedges ) );
+		CRC32_ProcessBuffer( &crc, &f->texinfo, sizeof( f->texinfo ) );
+		CRC32_ProcessBuffer( &crc, &f->dispinfo, sizeof( f->dispinfo ) );
+	}
+
+	// displacements
+	for ( int i = 0; i < g_dispinfo.Count(); i++ )
+	{
+		ddispinfo_t *pDisp = &g_dispinfo[i];
+		CRC32_ProcessBuffer( &crc, &pDisp->startPosition, sizeof( pDisp->startPosition ) );
+		CRC32_ProcessBuffer( &crc, &pDisp->m_iDispVertStart, sizeof( pDisp->m_iDispVertStart ) );
+		CRC32_ProcessBuffer( &crc, &pDisp->m_iDispTriStart, sizeof( pDisp->m_iDispTriStart ) );
+		CRC32_ProcessBuffer( &crc, &pDisp->power, sizeof( pDisp->power ) );
+		CRC32_ProcessBuffer( &crc, &pDisp->contents, sizeof( pDisp->contents ) );
+		CRC32_ProcessBuffer( &crc, &pDisp->m_iMapFace, sizeof( pDisp->m_iMapFace ) );
+		CRC32_ProcessBuffer( &crc, pDisp->m_EdgeNeighbors, sizeof( pDisp->m_EdgeNeighbors ) );
+		CRC32_ProcessBuffer( &crc, pDisp->m_CornerNeighbors, sizeof( pDisp->m_CornerNeighbors ) );
+		CRC32_ProcessBuffer( &crc, pDisp->m_AllowedVerts, sizeof( pDisp->m_AllowedVerts ) );
+	}
+	CRC32_ProcessBuffer( &crc, g_DispVerts.Base(), g_DispVerts.Count() * sizeof( CDispVert ) );
+	CRC32_ProcessBuffer( &crc, g_DispTris.Base(), g_DispTris.Count() * sizeof( CDispTri ) );
+
+	// brush entities which cast shadows
+	for ( int i = 0; i < num_entities; i++ )
+	{
+		if ( IntForKey( &entities[i], "vrad_brush_cast_shadows" ) != 0 )
+		{
+			HashString( &crc, ValueForKey( &entities[i], "model" ) );
+			HashString( &crc, ValueForKey( &entities[i], "origin" ) );
+			HashString( &crc, ValueForKey( &entities[i], "angles" ) );
+		}
+	}
+
+	// static props
+	StaticPropMgr()->HashRayTraceGeometry( &crc );
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+// Loads g_RtEnv from the cache, if the cache was made from the same geometry.
+// g_RtEnv must be empty.
+//-----------------------------------------------------------------------------
+bool LoadRayTraceCache( const char *pFilename )
+{
+	CUtlBuffer buf;
+	if ( !g_pFileSystem->ReadFile( pFilename, NULL, buf ) )
+		return false;
+
+	RayTraceCacheHeader_t header;
+	if ( buf.GetBytesRemaining() < (int)sizeof( header ) )
+		return false;
+	buf.Get( &header, sizeof( header ) );
+	if ( header.m_nId != RAYTRACE_CACHE_ID || header.m_nVersion != RAYTRACE_CACHE_VERSION )
+		return false;
+
+	if ( header.m_GeometryCRC != ComputeRayTraceGeometryCRC() )
+	{
+		Msg( "Geometry has changed since %s was written\n", pFilename );
+		return false;
+	}
+
+	if ( !g_RtEnv.LoadAccelerationStructure( buf ) || !StaticPropMgr()->LoadRayTraceMaterials( buf ) )
+	{
+		Warning( "%s is damaged, rebuilding the ray-trace acceleration structure\n", pFilename );
+		g_RtEnv.OptimizedTriangleList.Purge();
+		g_RtEnv.OptimizedKDTree.Purge();
+		g_RtEnv.TriangleIndexList.Purge();
+		g_RtEnv.TriangleColors.Purge();
+		g_RtEnv.TriangleMaterials.Purge();
+		return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Writes g_RtEnv to the cache, after its acceleration structure has been set up.
+//-----------------------------------------------------------------------------
+void SaveRayTraceCache( const char *pFilename )
+{
+	RayTraceCacheHeader_t header;
+	header.m_nId = RAYTRACE_CACHE_ID;
+	header.m_nVersion = RAYTRACE_CACHE_VERSION;
+	header.m_GeometryCRC = ComputeRayTraceGeometryCRC();
+
+	CUtlBuffer buf;
+	buf.Put( &header, sizeof( header ) );
+	g_RtEnv.SaveAccelerationStructure( buf );
+	StaticPropMgr()->SaveRayTraceMaterials( buf );
+
+	if ( !g_pFileSystem->WriteFile( pFilename, NULL, buf ) )
+	{
+		Warning( "Couldn't write ray-trace cache %s\n", pFilename );
+	}
+}
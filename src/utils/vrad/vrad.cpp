@@ -11,6 +11,7 @@
 #include "vrad.h"
 #include "physdll.h"
 #include "lightmap.h"
+#include "raybatch.h"
 #include "tier1/strtools.h"
 #include "vmpi.h"
 #include "macro_texture.h"
@@ -19,6 +20,13 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "mathlib/compressed_vector.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -57,6 +65,8 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bBenchmarkRays = false;
+bool		g_bRayTraceCache = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -80,6 +90,8 @@ char		level_lights[MAX_PATH] = "";
 
 char		vismatfile[_MAX_PATH] = "";
 char		incrementfile[_MAX_PATH] = "";
+char		rtcachefile[_MAX_PATH] = "";
+char		relightfile[_MAX_PATH] = "";
 
 IIncremental *g_pIncremental = 0;
 bool		g_bInterrupt = false;	// Wsed with background lighting in WC. Tells VRAD
@@ -118,6 +130,8 @@ double		g_flStartTime;
 bool		g_bStaticPropLighting = false;
 bool        g_bStaticPropPolys = false;
 bool        g_bTextureShadows = false;
+bool        g_bBatchShadowRays = false;
+bool        g_bRelight = false;
 bool        g_bDisablePropSelfShadowing = false;
 
 
@@ -1199,11 +1213,172 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 }
 
 
+//-----------------------------------------------------------------------------
+// Transfer lists
+//
+// The transfers of every patch live in one arena. A patch's transfers are
+// sorted by shooter patch, and each is stored as the distance to its patch
+// from the previous transfer's patch, 7 bits per byte with the high bit set
+// on all but the last byte, followed by its weight as a float16. Weights are
+// relative to patch->transferscale, so they keep their precision however
+// small the patch's transfers are.
+//-----------------------------------------------------------------------------
+#define TRANSFER_ARENA_BLOCK_SIZE	( 16 * 1024 * 1024 )
+
+class CTransferArena
+{
+public:
+	CTransferArena() : m_nBlockUsed( 0 ), m_nBlockSize( 0 ), m_nAllocated( 0 ), m_nReserved( 0 ) {}
+
+	byte *Alloc( int nBytes )
+	{
+		if ( m_nBlockUsed + nBytes > m_nBlockSize )
+		{
+			m_nBlockSize = max( TRANSFER_ARENA_BLOCK_SIZE, nBytes );
+			m_nBlockUsed = 0;
+			byte *pBlock = ( byte * )malloc( m_nBlockSize );
+			if ( !pBlock )
+				Error( "Memory allocation failure" );
+			m_Blocks.AddToTail( pBlock );
+			m_nReserved += m_nBlockSize;
+		}
+
+		byte *pResult = m_Blocks.Tail() + m_nBlockUsed;
+		m_nBlockUsed += nBytes;
+		m_nAllocated += nBytes;
+		return pResult;
+	}
+
+	int64 AllocatedBytes() const	{ return m_nAllocated; }
+	int64 ReservedBytes() const		{ return m_nReserved; }
+
+private:
+	CUtlVector<byte *> m_Blocks;
+	int m_nBlockUsed;
+	int m_nBlockSize;
+	int64 m_nAllocated;
+	int64 m_nReserved;
+};
+
+static CTransferArena s_TransferArena;
+
+byte *AllocTransferList( int nBytes )
+{
+	ThreadLock();
+	byte *pResult = s_TransferArena.Alloc( nBytes );
+	ThreadUnlock();
+	return pResult;
+}
+
+static int __cdecl CompareTransfers( const void *pA, const void *pB )
+{
+	return ( ( const transfer_t * )pA )->patch - ( ( const transfer_t * )pB )->patch;
+}
+
+static inline int TransferDeltaBytes( int nDelta )
+{
+	return ( nDelta < ( 1 << 7 ) ) ? 1 : ( nDelta < ( 1 << 14 ) ) ? 2 : ( nDelta < ( 1 << 21 ) ) ? 3 : 4;
+}
+
+// Reads back the transfer list of a patch
+class CTransferReader
+{
+public:
+	CTransferReader( const CPatch *pPatch ) : m_pData( pPatch->transfers ), m_nPatch( 0 ) {}
+
+	// returns the shooter patch of the next transfer, and its weight relative to
+	// the patch's transferscale
+	FORCEINLINE int Next( float &flWeight )
+	{
+		int nDelta = 0;
+		int nShift = 0;
+		byte b;
+		do
+		{
+			b = *m_pData++;
+			nDelta |= ( b & 0x7f ) << nShift;
+			nShift += 7;
+		} while ( b & 0x80 );
+		m_nPatch += nDelta;
+
+		unsigned int nHalf = m_pData[0] | ( m_pData[1] << 8 );
+		m_pData += 2;
+		if ( nHalf >= 0x400 )
+		{
+			// the weights are positive, so a normal float16 only needs its exponent rebiased
+			union { unsigned int i; float f; } bits;
+			bits.i = ( nHalf << 13 ) + ( ( 127 - 15 ) << 23 );
+			flWeight = bits.f;
+		}
+		else
+		{
+			// denorm
+			flWeight = nHalf * ( 1.0f / ( 1 << 24 ) );
+		}
+
+		return m_nPatch;
+	}
+
+private:
+	const byte *m_pData;
+	int m_nPatch;
+};
+
+//-----------------------------------------------------------------------------
+// Normalizes the transfers of a patch and stores them in its transfer list
+//-----------------------------------------------------------------------------
+static void EncodeTransfers( CPatch *patch, transfer_t *all_transfers, float flTotal )
+{
+	int nTransfers = patch->numtransfers;
+
+	// sorted, the deltas between patches are small and the shooters are read in order
+	qsort( all_transfers, nTransfers, sizeof( transfer_t ), CompareTransfers );
+
+	int nBytes = 0;
+	float flMaxTransfer = 0.0f;
+	int nPrevPatch = 0;
+	for ( int j = 0; j < nTransfers; j++ )
+	{
+		nBytes += TransferDeltaBytes( all_transfers[j].patch - nPrevPatch ) + 2;
+		nPrevPatch = all_transfers[j].patch;
+		flMaxTransfer = max( flMaxTransfer, all_transfers[j].transfer );
+	}
+
+	byte *pData = AllocTransferList( nBytes );
+	patch->transfers = pData;
+	patch->transferbytes = nBytes;
+
+	float flSum = 0.0f;
+	float flQuantizedSum = 0.0f;
+	nPrevPatch = 0;
+	for ( int j = 0; j < nTransfers; j++ )
+	{
+		int nDelta = all_transfers[j].patch - nPrevPatch;
+		nPrevPatch = all_transfers[j].patch;
+		while ( nDelta >= 0x80 )
+		{
+			*pData++ = ( byte )( nDelta | 0x80 );
+			nDelta >>= 7;
+		}
+		*pData++ = ( byte )nDelta;
+
+		float16_with_assign weight = all_transfers[j].transfer / flMaxTransfer;
+		*pData++ = ( byte )( weight.GetBits() & 0xff );
+		*pData++ = ( byte )( weight.GetBits() >> 8 );
+
+		flSum += all_transfers[j].transfer;
+		flQuantizedSum += weight;
+	}
+
+	// scale so that the quantized weights still add up to the same energy
+	patch->transferscale = ( flQuantizedSum > 0.0f ) ? flTotal * flSum / flQuantizedSum : 0.0f;
+}
+
 void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 {
 	int		j;
 	float	total;
-	transfer_t	*t, *t2;
+	transfer_t	*t2;
 	total = 0;
 
 	if( ndxPatch == g_Patches.InvalidIndex() )
@@ -1218,11 +1393,6 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 			max_transfer = patch->numtransfers;
 		}
 
-
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
 		t2 = all_transfers;
 
@@ -1238,17 +1408,7 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
-		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
-		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
-		}
-		if (patch->numtransfers > max_transfer)
-		{
-			max_transfer = patch->numtransfers;
-		}
+		EncodeTransfers( patch, all_transfers, total );
 	}
 	else
 	{
@@ -1532,110 +1692,120 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+// GatherLight works on runs of this many receiving patches at a time
+#define GATHER_LIGHT_BLOCK_SIZE	256
+
+// light each patch shoots this bounce (emitlight * reflectivity), and where the
+// patches are. Kept apart from g_Patches so that gathering only touches the
+// few bytes of each shooter it needs.
+static CUtlVector<Vector> s_ShooterLight;
+static CUtlVector<Vector> s_PatchOrigins;
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
-	transfer_t	*trans;
 	int			num;
 	CPatch		*patch;
 	Vector		sum, v;
 
+	unsigned int uiPatchCount = g_Patches.Size();
+	const Vector *pShooterLight = s_ShooterLight.Base();
+	const Vector *pPatchOrigins = s_PatchOrigins.Base();
+
 	while (1)
 	{
-		j = GetThreadWork ();
-		if (j == -1)
+		int nBlock = GetThreadWork ();
+		if (nBlock == -1)
 			break;
 
-		patch = &g_Patches[j];
-
-		trans = patch->transfers;
-		num = patch->numtransfers;
-		if ( patch->needsBumpmap )
+		unsigned int uiBlockEnd = min( uiPatchCount, ( unsigned int )( nBlock + 1 ) * GATHER_LIGHT_BLOCK_SIZE );
+		for ( j = nBlock * GATHER_LIGHT_BLOCK_SIZE; j < ( int )uiBlockEnd; j++ )
 		{
-			Vector delta;
-			Vector bumpSum[NUM_BUMP_VECTS+1];
-			Vector normals[NUM_BUMP_VECTS+1];
+			patch = &g_Patches[j];
 
-			// Disps
-			bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
-			if ( bDisp )
-			{
-				normals[0] = patch->normal;
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				Vector vecTexU, vecTexV;
-				PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
-
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
-			}
-			else
+			CTransferReader reader( patch );
+			num = patch->numtransfers;
+			if ( patch->needsBumpmap )
 			{
-				GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
+				Vector delta;
+				Vector bumpSum[NUM_BUMP_VECTS+1];
+				Vector normals[NUM_BUMP_VECTS+1];
 
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
-					pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
-					normals[0], &normals[1] );
-			}
+				// Disps
+				bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
+				if ( bDisp )
+				{
+					normals[0] = patch->normal;
+					texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+					Vector vecTexU, vecTexV;
+					PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
 
-			// force the base lightmap to use the flat normal instead of the phong normal
-			// FIXME: why does the patch not use the phong normal?
-			normals[0] = patch->normal;
+					// use facenormal along with the smooth normal to build the three bump map vectors
+					GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
+				}
+				else
+				{
+					GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
 
-			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-			{
-				VectorFill( bumpSum[i], 0 );
-			}
+					texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+					// use facenormal along with the smooth normal to build the three bump map vectors
+					GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
+						pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
+						normals[0], &normals[1] );
+				}
 
-			float dot;
-			for (k=0 ; k<num ; k++, trans++)
-			{
-				CPatch *patch2 = &g_Patches[trans->patch];
+				// force the base lightmap to use the flat normal instead of the phong normal
+				// FIXME: why does the patch not use the phong normal?
+				normals[0] = patch->normal;
 
-				// get vector to other patch
-				VectorSubtract (patch2->origin, patch->origin, delta);
-				VectorNormalize (delta);
-				// find light emitted from other patch
-				for(i=0; i<3; i++)
+				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
+					VectorFill( bumpSum[i], 0 );
 				}
-				// remove normal already factored into transfer steradian
-				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
-				
-				Vector bumpTransfer;
-				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+
+				float dot;
+				for (k=0 ; k<num ; k++)
 				{
-					dot = DotProduct( delta, normals[i] );
-					if ( dot <= 0 )
+					float transfer;
+					int ndxShooter = reader.Next( transfer );
+
+					// get vector to other patch
+					VectorSubtract (pPatchOrigins[ndxShooter], patch->origin, delta);
+					VectorNormalize (delta);
+					// remove normal already factored into transfer steradian
+					float scale = 1.0f / DotProduct (delta, patch->normal);
+					// find light emitted from other patch
+					VectorScale( pShooterLight[ndxShooter], transfer * scale, v );
+					
+					Vector bumpTransfer;
+					for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 					{
+						dot = DotProduct( delta, normals[i] );
+						if ( dot <= 0 )
+						{
 //						Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
-						continue;
+							continue;
+						}
+						bumpTransfer = v * dot;
+						VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
 					}
-					bumpTransfer = v * dot;
-					VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
+				}
+				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+				{
+					VectorScale( bumpSum[i], patch->transferscale, addlight[j].light[i] );
 				}
 			}
-			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-			{
-				VectorCopy( bumpSum[i], addlight[j].light[i] );
-			}
-		}
-		else
-		{
-			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			else
 			{
-				for(i=0; i<3; i++)
+				VectorFill( sum, 0 );
+				for (k=0 ; k<num ; k++)
 				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					float transfer;
+					int ndxShooter = reader.Next( transfer );
+					VectorMA( sum, transfer, pShooterLight[ndxShooter], sum );
 				}
-				VectorScale( v, trans->transfer, v );
-				VectorAdd( sum, v, sum );
+				VectorScale( sum, patch->transferscale, addlight[j].light[0] );
 			}
-			VectorCopy( sum, addlight[j].light[0] );
 		}
 	}
 }
@@ -1645,6 +1815,25 @@ void GatherLight (int threadnum, void *pUserData)
 #endif
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns the most memory the process has had resident, in bytes
+//-----------------------------------------------------------------------------
+static double GetPeakMemoryUsage()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if ( GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+		return (double)counters.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	if ( getrusage( RUSAGE_SELF, &usage ) == 0 )
+		return (double)usage.ru_maxrss * 1024;	// ru_maxrss is in kilobytes
+	return 0;
+#endif
+}
+
+
 /*
 =============
 BounceLight
@@ -1700,19 +1889,35 @@ void BounceLight (void)
 	}
 #endif
 
+	s_ShooterLight.SetSize( uiPatchCount );
+	s_PatchOrigins.SetSize( uiPatchCount );
+	for ( i = 0; i < uiPatchCount; i++ )
+	{
+		s_PatchOrigins[i] = g_Patches[i].origin;
+	}
+
+	double flBounceStart = Plat_FloatTime();
+
 	i = 0;
 	while ( bouncing )
 	{
+		double flStart = Plat_FloatTime();
+
+		for ( unsigned j = 0; j < uiPatchCount; j++ )
+		{
+			VectorMultiply( emitlight[j], g_Patches[j].reflectivity, s_ShooterLight[j] );
+		}
+
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
-		unsigned int uiPatchCount = g_Patches.Size();
-		RunThreadsOn (uiPatchCount, true, GatherLight);
+		int nBlocks = ( uiPatchCount + GATHER_LIGHT_BLOCK_SIZE - 1 ) / GATHER_LIGHT_BLOCK_SIZE;
+		RunThreadsOn (nBlocks, true, GatherLight);
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
 		CollectLight( added );
 
-		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
+		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f) in %.2f seconds\n", i+1, added[0], added[1], added[2], Plat_FloatTime() - flStart );
 
 		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
 			bouncing = false;
@@ -1724,6 +1929,12 @@ void BounceLight (void)
 			WriteWorld (name, 0);
 		}
 	}
+
+	Msg( "%d bounces in %.2f seconds, peak memory %.1f megs\n", i, Plat_FloatTime() - flBounceStart,
+		GetPeakMemoryUsage() / ( 1024.0 * 1024.0 ) );
+
+	s_ShooterLight.Purge();
+	s_PatchOrigins.Purge();
 }
 
 
@@ -1932,8 +2143,9 @@ void MakeAllScales (void)
 
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	Msg("transfer lists: %5.1f megs (%5.1f megs uncompressed)\n"
+		, s_TransferArena.ReservedBytes() / (1024.0*1024.0)
+		, (double)total_transfer * sizeof(transfer_t) / (1024*1024));
 }
 
 
@@ -2019,6 +2231,18 @@ bool RadWorld_Go()
 		BuildFacesVisibleToLights( true );
 	}
 
+#ifdef MPI
+	if ( g_bRelight && g_bUseMPI )
+	{
+		Warning( "-relight doesn't work with -mpi, lighting every face.\n" );
+		g_bRelight = false;
+	}
+#endif
+	if ( g_bRelight )
+	{
+		LoadRelightCache( relightfile );
+	}
+
 	// build initial facelights
 #ifdef MPI
 	if (g_bUseMPI) 
@@ -2029,13 +2253,39 @@ bool RadWorld_Go()
 	else 
 #endif
 	{
+		if ( g_bBatchShadowRays && g_bTextureShadows )
+		{
+			Warning( "-batchrays doesn't work with -textureshadows, tracing shadow rays one bundle at a time.\n" );
+		}
+
+		memset( g_nDirectLightingRays, 0, sizeof( g_nDirectLightingRays ) );
+		double start = Plat_FloatTime();
+
 		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
+
+		double elapsed = Plat_FloatTime() - start;
+		int64 nRays = 0;
+		for ( int i = 0; i < ARRAYSIZE( g_nDirectLightingRays ); i++ )
+		{
+			nRays += g_nDirectLightingRays[i];
+		}
+		if ( elapsed > 0 )
+		{
+			Msg( "Direct lighting: %.1f million shadow rays, %.2f Mrays/s%s\n", nRays / 1.0e6, nRays / ( elapsed * 1.0e6 ),
+				( g_bBatchShadowRays && !g_bTextureShadows ) ? " (batched)" : "" );
+		}
 	}
 
 	// Was the process interrupted?
 	if( g_pIncremental && (g_iCurFace != numfaces) )
 		return false;
 
+	// keep the direct lighting before FinalLightFace adds the bounced light to it
+	if ( g_bRelight )
+	{
+		SaveRelightFaceLights();
+	}
+
 	// Figure out the offset into lightmap data for each face.
 	PrecompLightmapOffsets();
 	
@@ -2067,7 +2317,10 @@ bool RadWorld_Go()
 			addlight.SetSize( g_Patches.Size() );
 			memset( addlight.Base(), 0, g_Patches.Size() * sizeof( bumplights_t ) );
 
-			MakeAllScales ();
+			if ( !g_bRelight || !LoadRelightTransfers() )
+			{
+				MakeAllScales ();
+			}
 
 			// spread light around
 			BounceLight ();
@@ -2096,6 +2349,11 @@ bool RadWorld_Go()
 #endif
 			
 		Msg("FinalLightFace Done\n"); fflush(stdout);
+
+		if ( g_bRelight )
+		{
+			SaveRelightCache( relightfile );
+		}
 	}
 
 	return true;
@@ -2188,6 +2446,9 @@ void VRAD_LoadBSP( char const *pFilename )
 
 	strcpy(incrementfile, source);
 	Q_DefaultExtension(incrementfile, ".r0", sizeof(incrementfile));
+	strcpy(rtcachefile, source);
+	Q_DefaultExtension(rtcachefile, ".rtc", sizeof(rtcachefile));
+	Q_snprintf( relightfile, sizeof( relightfile ), "%s%s", source, g_bHDR ? "_hdr.rlc" : ".rlc" );
 	Q_DefaultExtension(source, ".bsp", sizeof( source ));
 
 	Msg( "Loading %s\n", source );
@@ -2237,7 +2498,6 @@ void VRAD_LoadBSP( char const *pFilename )
 
 
 	ParseEntities ();
-	ExtractBrushEntityShadowCasters();
 
 	StaticPropMgr()->Init();
 	StaticDispMgr()->Init();
@@ -2273,21 +2533,46 @@ void VRAD_LoadBSP( char const *pFilename )
 		clusterChildren[ndx] = clusterChildren.InvalidIndex();
 	}
 
-	// Setup ray tracer
-	AddBrushesForRayTrace();
-	StaticDispMgr()->AddPolysForRayTrace();
-	StaticPropMgr()->AddPolysForRayTrace();
-
-	// Dump raytracer for glview
-	if ( g_bDumpRtEnv )
-		WriteRTEnv("trace.txt");
+	// The dump and the benchmark need the triangles before the acceleration
+	// structure is set up, which the cache doesn't have.
+	bool bUseRayTraceCache = g_bRayTraceCache && !g_bDumpRtEnv && !g_bBenchmarkRays;
 
-	// Build acceleration structure
-	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
-	float end = Plat_FloatTime();
-	printf ( "Done (%.2f seconds)\n", end-start );
+	if ( bUseRayTraceCache && LoadRayTraceCache( rtcachefile ) )
+	{
+		float end = Plat_FloatTime();
+		Msg( "Loaded ray-trace acceleration structure from %s (%.2f seconds)\n", rtcachefile, end-start );
+	}
+	else
+	{
+		// Setup ray tracer
+		ExtractBrushEntityShadowCasters();
+		AddBrushesForRayTrace();
+		StaticDispMgr()->AddPolysForRayTrace();
+		StaticPropMgr()->AddPolysForRayTrace();
+
+		// Dump raytracer for glview
+		if ( g_bDumpRtEnv )
+			WriteRTEnv("trace.txt");
+
+		if ( g_bBenchmarkRays )
+			BenchmarkKDTreeBuild();
+
+		// Build acceleration structure
+		printf ( "Setting up ray-trace acceleration structure... ");
+		start = Plat_FloatTime();
+		g_RtEnv.SetupAccelerationStructure();
+		float end = Plat_FloatTime();
+		printf ( "Done (%.2f seconds)\n", end-start );
+
+#ifdef MPI
+		if ( !g_bUseMPI || g_bMPIMaster )
+#endif
+		{
+			if ( bUseRayTraceCache )
+				SaveRayTraceCache( rtcachefile );
+		}
+	}
 
 #if 0  // To test only k-d build
 	exit(0);
@@ -2412,6 +2697,10 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bTextureShadows = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-batchrays" ) )
+		{
+			g_bBatchShadowRays = true;
+		}
 		else if ( !strcmp(argv[i], "-dump") )
 		{
 			g_bDumpPatches = true;
@@ -2432,6 +2721,20 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-benchrays" ) )
+		{
+			g_bBenchmarkRays = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtcache" ) )
+		{
+			g_bRayTraceCache = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-relight" ) )
+		{
+			// relighting is only worth it if the geometry is the same, so the tree can be reused too
+			g_bRelight = true;
+			g_bRayTraceCache = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2565,6 +2868,14 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-numa" ) )
+		{
+			g_bPinThreadsToNumaNodes = true;
+		}
+		else if( !Q_stricmp( argv[i], "-threadstats" ) )
+		{
+			g_bReportThreadScaling = true;
+		}
 		else if( !Q_stricmp( argv[i], "-loghash" ) )
 		{
 			g_bLogHashData = true;
@@ -2836,8 +3147,20 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -benchrays      : Time building the ray-trace kd-tree serially and in\n"
+		"                    parallel, and tracing rays against the map 4, 8 and 16\n"
+		"                    at a time, then exit.\n"
+		"  -rtcache        : Save the ray-trace acceleration structure to <mapname>.rtc,\n"
+		"                    and load it instead of rebuilding it when the map's\n"
+		"                    geometry and static props haven't changed.\n"
+		"  -relight        : Save the lights, direct lighting and transfers to\n"
+		"                    <mapname>.rlc. When only lights have changed since, only\n"
+		"                    relight the faces they reach, and rerun the bounces with\n"
+		"                    the saved transfers. Implies -rtcache.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
+		"  -numa           : Keep each thread on the processors of one NUMA node.\n"
+		"  -threadstats    : Print the speedup each threaded pass gets from its threads.\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
 		"                    level lights file.\n"
 		"  -noextra        : Disable supersampling.\n"
@@ -2874,6 +3197,8 @@ void PrintUsage( int argc, char **argv )
         "  -OnlyStaticProps   : Only perform direct static prop lighting (vrad debug option)\n"
 		"  -StaticPropNormals : when lighting static props, just show their normal vector\n"
 		"  -textureshadows : Allows texture alpha channels to block light - rays intersecting alpha surfaces will sample the texture\n"
+		"  -batchrays      : Queue up the shadow rays of the direct lighting pass and trace them\n"
+		"                    in coherent batches. Not used with -textureshadows.\n"
 		"  -noskyboxrecurse : Turn off recursion into 3d skybox (skybox shadows on world)\n"
 		"  -nossprops      : Globally disable self-shadowing on static props\n"
 		"\n"
@@ -2935,6 +3260,14 @@ int RunVRAD( int argc, char **argv )
 
 	VRAD_LoadBSP( argv[i] );
 
+	if ( g_bBenchmarkRays )
+	{
+		BenchmarkRayTracing();
+		DeleteCmdLine( argc, argv );
+		CmdLib_Cleanup();
+		return 0;
+	}
+
 	if ( (! onlydetail) && (! g_bOnlyStaticProps ) )
 	{
 		RadWorld_Go();
@@ -30,6 +30,7 @@
 #include "utlvector.h"
 #include "iincremental.h"
 #include "raytrace.h"
+#include "tier1/checksum_crc.h"
 
 
 #ifdef _WIN32
@@ -106,6 +107,8 @@ struct bumplights_t
 };
 
 
+// a transfer while it's being built. Once MakeScales is done with them they're
+// kept in the encoded form described above EncodeTransfers in vrad.cpp
 struct transfer_t
 {
 	int	patch;
@@ -237,7 +240,9 @@ struct CPatch
 //	struct		patch_s		*nextclusterchild;		// next terminal child in cluster
 
 	int			numtransfers;
-	transfer_t	*transfers;
+	int			transferbytes;			// size of the encoded transfer list
+	float		transferscale;			// transfer of an encoded weight of 1
+	byte		*transfers;				// encoded transfer list, see EncodeTransfers
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -276,6 +281,7 @@ extern bool         g_bNoSkyRecurse;
 extern bool			bDumpNormals;
 extern bool			g_bFastAmbient;
 extern float		maxchop;
+extern float		minchop;
 extern FileHandle_t	pFileSamples[4][4];
 extern qboolean		g_bLowPriority;
 extern qboolean		do_fast;
@@ -288,6 +294,8 @@ extern float g_flSkySampleScale;								// extra sampling factor for indirect li
 extern bool g_bLargeDispSampleRadius;
 extern bool g_bStaticPropPolys;
 extern bool g_bTextureShadows;
+extern bool g_bBatchShadowRays;
+extern bool g_bRelight;
 extern bool g_bShowStaticPropNormals;
 extern bool g_bDisablePropSelfShadowing;
 
@@ -390,9 +398,16 @@ void TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFracti
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1, bool bDoDebug = false );
 
+// times tracing rays against the map 4, 8 and 16 at a time
+void BenchmarkRayTracing( void );
+void BenchmarkKDTreeBuild( void );
+
 // converts any marked brush entities to triangles for shadow casting
 void ExtractBrushEntityShadowCasters ( void );
 void AddBrushesForRayTrace ( void );
+CRC32_t ComputeRayTraceGeometryCRC( void );
+bool LoadRayTraceCache( const char *pFilename );
+void SaveRayTraceCache( const char *pFilename );
 
 void BaseLightForFace( dface_t *f, Vector& light, float *parea, Vector& reflectivity );
 void CreateDirectLights (void);
@@ -400,6 +415,7 @@ void GetPhongNormal( int facenum, Vector const& spot, Vector& phongnormal );
 int LightForString( char *pLight, Vector& intensity );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers );
 void MakeScales( int ndxPatch, transfer_t *all_transfers );
+byte *AllocTransferList( int nBytes );
 
 // Run startup code like initialize mathlib.
 void VRAD_Init();
@@ -602,6 +618,11 @@ public:
 	virtual void Shutdown() = 0;
 	virtual void ComputeLighting( int iThread ) = 0;
 	virtual void AddPolysForRayTrace() = 0;
+
+	// the ray trace cache
+	virtual void HashRayTraceGeometry( CRC32_t *pCRC ) = 0;
+	virtual void SaveRayTraceMaterials( CUtlBuffer &buf ) = 0;
+	virtual bool LoadRayTraceMaterials( CUtlBuffer &buf ) = 0;
 };
 
 //extern PropTested_t s_PropTested[MAX_TOOL_THREADS+1];
@@ -258,6 +258,11 @@ public:
 	// iterate all the instanced static props and compute their vertex lighting
 	void ComputeLighting( int iThread );
 
+	// the ray trace cache
+	void HashRayTraceGeometry( CRC32_t *pCRC );
+	void SaveRayTraceMaterials( CUtlBuffer &buf );
+	bool LoadRayTraceMaterials( CUtlBuffer &buf );
+
 private:
 	// VMPI stuff.
 #ifdef MPI
@@ -768,6 +773,38 @@ public:
 		}
 	}
 	
+	// hashes the alpha of every loaded texture, since the coverage of the triangles that use them depends on it
+	void HashTextures( CRC32_t *pCRC )
+	{
+		for ( int i = m_Textures.First(); i != m_Textures.InvalidIndex(); i = m_Textures.Next( i ) )
+		{
+			const alphatexture_t &tex = m_Textures[i];
+			const char *pName = m_Textures.GetElementName( i );
+			CRC32_ProcessBuffer( pCRC, &i, sizeof( i ) );
+			CRC32_ProcessBuffer( pCRC, pName, Q_strlen( pName ) );
+			CRC32_ProcessBuffer( pCRC, &tex.width, sizeof( tex.width ) );
+			CRC32_ProcessBuffer( pCRC, &tex.height, sizeof( tex.height ) );
+			CRC32_ProcessBuffer( pCRC, &tex.allowBackface, sizeof( tex.allowBackface ) );
+			CRC32_ProcessBuffer( pCRC, tex.pAlphaTexels, tex.width * tex.height );
+		}
+	}
+
+	void SaveMaterialEntries( CUtlBuffer &buf )
+	{
+		buf.PutInt( m_MaterialEntries.Count() );
+		buf.Put( m_MaterialEntries.Base(), m_MaterialEntries.Count() * sizeof( materialentry_t ) );
+	}
+
+	bool LoadMaterialEntries( CUtlBuffer &buf )
+	{
+		int count = buf.GetInt();
+		if ( count < 0 || buf.GetBytesRemaining() < count * (int)sizeof( materialentry_t ) )
+			return false;
+		m_MaterialEntries.SetCount( count );
+		buf.Get( m_MaterialEntries.Base(), count * sizeof( materialentry_t ) );
+		return true;
+	}
+
 	int AddMaterialEntry( int shadowTextureIndex, const Vector2D &t0, const Vector2D &t1, const Vector2D &t2 )
 	{
 		int index = m_MaterialEntries.AddToTail();
@@ -2016,6 +2053,49 @@ void CVradStaticPropMgr::AddPolysForRayTrace( void )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Hashes everything AddPolysForRayTrace depends on: the static prop lump, the
+// models and their texture shadow setup, and the shadow textures themselves.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::HashRayTraceGeometry( CRC32_t *pCRC )
+{
+	GameLumpHandle_t handle = g_GameLumps.GetGameLumpHandle( GAMELUMP_STATIC_PROPS );
+	int size = g_GameLumps.GameLumpSize( handle );
+	if ( size && g_GameLumps.GetGameLump( handle ) )
+	{
+		CRC32_ProcessBuffer( pCRC, g_GameLumps.GetGameLump( handle ), size );
+	}
+
+	for ( int i = 0; i < m_StaticPropDict.Count(); ++i )
+	{
+		StaticPropDict_t &dict = m_StaticPropDict[i];
+		bool bHasCollision = dict.m_pModel != NULL;
+		CRC32_ProcessBuffer( pCRC, &bHasCollision, sizeof( bHasCollision ) );
+		if ( dict.m_pStudioHdr )
+		{
+			CRC32_ProcessBuffer( pCRC, dict.m_pStudioHdr, dict.m_pStudioHdr->length );
+		}
+		CRC32_ProcessBuffer( pCRC, dict.m_VtxBuf.Base(), dict.m_VtxBuf.TellPut() );
+		CRC32_ProcessBuffer( pCRC, dict.m_textureShadowIndex.Base(), dict.m_textureShadowIndex.Count() * sizeof( int ) );
+	}
+
+	g_ShadowTextureList.HashTextures( pCRC );
+}
+
+//-----------------------------------------------------------------------------
+// The texture shadow material entries AddPolysForRayTrace makes, which the
+// cached triangles refer to.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::SaveRayTraceMaterials( CUtlBuffer &buf )
+{
+	g_ShadowTextureList.SaveMaterialEntries( buf );
+}
+
+bool CVradStaticPropMgr::LoadRayTraceMaterials( CUtlBuffer &buf )
+{
+	return g_ShadowTextureList.LoadMaterialEntries( buf );
+}
+
 struct tl_tri_t
 {
 	Vector	p0;
@@ -7,6 +7,9 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "threads.h"
+#include "mathlib/ssemath.h"
+#include "tier1/processor_detect.h"
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -33,15 +36,83 @@ int CountBits (byte *bits, int numbits)
 {
 	int		i;
 	int		c;
+	uint32	v;
 
+	// whole 32 bit words first
 	c = 0;
-	for (i=0 ; i<numbits ; i++)
+	for (i=0 ; i<(numbits>>5) ; i++)
+	{
+		v = ((uint32 *)bits)[i];
+		v = v - ((v >> 1) & 0x55555555);
+		v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+		c += (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+	}
+
+	for (i<<=5 ; i<numbits ; i++)
 		if ( CheckBit( bits, i ) )
 			c++;
 
 	return c;
 }
 
+
+// whether this cpu can run MightSeeMoreAVX2. checked on first use.
+static int s_nAVX2Support = -1;
+
+bool MightSeeMore (byte *might, const byte *prev, const byte *test, const byte *vis)
+{
+	int		j;
+	long	more;
+
+#ifdef VVIS_AVX2
+	if (s_nAVX2Support == -1)
+		s_nAVX2Support = CheckAVX2Technology() ? 1 : 0;
+	if (s_nAVX2Support)
+		return MightSeeMoreAVX2 (might, prev, test, vis, portalbytes);
+#endif
+
+	more = 0;
+	for (j=0 ; j<portallongs ; j++)
+	{
+		((long *)might)[j] = ((long *)prev)[j] & ((long *)test)[j];
+		more |= ((long *)might)[j] & ~((long *)vis)[j];
+	}
+
+	return more != 0;
+}
+
+
+/*
+==============
+WindingPlaneDists
+
+Distances of all the points of a winding from a plane, four points at a time.
+Each one comes out the same as DotProduct (point, normal) - dist.
+dists needs room for numpoints rounded up to a multiple of 4.
+==============
+*/
+static void WindingPlaneDists (const winding_t *w, const plane_t *plane, vec_t *dists)
+{
+	int		i;
+	fltx4	nx, ny, nz, dist, d;
+
+	// stack windings have no padding beyond their fixed size
+	COMPILE_TIME_ASSERT ((MAX_POINTS_ON_FIXED_WINDING % 4) == 0);
+
+	nx = ReplicateX4 (plane->normal[0]);
+	ny = ReplicateX4 (plane->normal[1]);
+	nz = ReplicateX4 (plane->normal[2]);
+	dist = ReplicateX4 (plane->dist);
+
+	for (i=0 ; i<w->numpoints ; i+=4)
+	{
+		d = MulSIMD (LoadUnalignedSIMD (w->x + i), nx);
+		d = AddSIMD (d, MulSIMD (LoadUnalignedSIMD (w->y + i), ny));
+		d = AddSIMD (d, MulSIMD (LoadUnalignedSIMD (w->z + i), nz));
+		StoreUnalignedSIMD (dists + i, SubSIMD (d, dist));
+	}
+}
+
 int		c_fullskip;
 int		c_portalskip, c_leafskip;
 int		c_vistest, c_mighttest;
@@ -81,6 +152,7 @@ winding_t *AllocStackWinding (pstack_t *stack)
 		if (stack->freewindings[i])
 		{
 			stack->freewindings[i] = 0;
+			stack->windings[i].Init ();
 			return &stack->windings[i];
 		}
 	}
@@ -94,9 +166,13 @@ void FreeStackWinding (winding_t *w, pstack_t *stack)
 {
 	int		i;
 
-	i = w - stack->windings;
+	for (i=0 ; i<3 ; i++)
+	{
+		if (w == &stack->windings[i])
+			break;
+	}
 
-	if (i<0 || i>2)
+	if (i>2)
 		return;		// not from local
 
 	if (stack->freewindings[i])
@@ -128,11 +204,10 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 	counts[0] = counts[1] = counts[2] = 0;
 
 // determine sides for each point
+	WindingPlaneDists (in, split, dists);
 	for (i=0 ; i<in->numpoints ; i++)
 	{
-		dot = DotProduct (in->points[i], split->normal);
-		dot -= split->dist;
-		dists[i] = dot;
+		dot = dists[i];
 		if (dot > ON_VIS_EPSILON)
 			sides[i] = SIDE_FRONT;
 		else if (dot < -ON_VIS_EPSILON)
@@ -162,8 +237,6 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 
 	for (i=0 ; i<in->numpoints ; i++)
 	{
-		Vector& p1 = in->points[i];
-
 		if (neww->numpoints == MAX_POINTS_ON_FIXED_WINDING)
 		{
 			FreeStackWinding (neww, stack);
@@ -172,14 +245,14 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 
 		if (sides[i] == SIDE_ON)
 		{
-			VectorCopy (p1, neww->points[neww->numpoints]);
+			neww->CopyPoint (neww->numpoints, in, i);
 			neww->numpoints++;
 			continue;
 		}
 	
 		if (sides[i] == SIDE_FRONT)
 		{
-			VectorCopy (p1, neww->points[neww->numpoints]);
+			neww->CopyPoint (neww->numpoints, in, i);
 			neww->numpoints++;
 		}
 		
@@ -193,7 +266,8 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 		}
 
 	// generate a split point
-		Vector& p2 = in->points[(i+1)%in->numpoints];
+		Vector p1 = in->Point (i);
+		Vector p2 = in->Point ((i+1)%in->numpoints);
 		
 		dot = dists[i] / (dists[i]-dists[i+1]);
 		for (j=0 ; j<3 ; j++)
@@ -206,7 +280,7 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 				mid[j] = p1[j] + dot*(p2[j]-p1[j]);
 		}
 			
-		VectorCopy (mid, neww->points[neww->numpoints]);
+		neww->SetPoint (neww->numpoints, mid);
 		neww->numpoints++;
 	}
 	
@@ -245,19 +319,20 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 	vec_t		length;
 	int			counts[3];
 	bool		fliptest;
+	vec_t		dists[MAX_POINTS_ON_WINDING];
 
 // check all combinations	
 	for (i=0 ; i<source->numpoints ; i++)
 	{
 		l = (i+1)%source->numpoints;
-		VectorSubtract (source->points[l] , source->points[i], v1);
+		VectorSubtract (source->Point(l) , source->Point(i), v1);
 
 	// fing a vertex of pass that makes a plane that puts all of the
 	// vertexes of pass on the front side and all of the vertexes of
 	// source on the back side
 		for (j=0 ; j<pass->numpoints ; j++)
 		{
-			VectorSubtract (pass->points[j], source->points[i], v2);
+			VectorSubtract (pass->Point(j), source->Point(i), v2);
 
 			plane.normal[0] = v1[1]*v2[2] - v1[2]*v2[1];
 			plane.normal[1] = v1[2]*v2[0] - v1[0]*v2[2];
@@ -278,7 +353,7 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 			plane.normal[1] *= length;
 			plane.normal[2] *= length;
 
-			plane.dist = DotProduct (pass->points[j], plane.normal);
+			plane.dist = DotProduct (pass->Point(j), plane.normal);
 
 		//
 		// find out which side of the generated seperating plane has the
@@ -286,11 +361,12 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 		//
 #if 1
 			fliptest = false;
+			WindingPlaneDists (source, &plane, dists);
 			for (k=0 ; k<source->numpoints ; k++)
 			{
 				if (k == i || k == l)
 					continue;
-				d = DotProduct (source->points[k], plane.normal) - plane.dist;
+				d = dists[k];
 				if (d < -ON_VIS_EPSILON)
 				{	// source is on the negative side, so we want all
 					// pass and target on the positive side
@@ -323,11 +399,12 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 		// this is the seperating plane
 		//
 			counts[0] = counts[1] = counts[2] = 0;
+			WindingPlaneDists (pass, &plane, dists);
 			for (k=0 ; k<pass->numpoints ; k++)
 			{
 				if (k==j)
 					continue;
-				d = DotProduct (pass->points[k], plane.normal) - plane.dist;
+				d = dists[k];
 				if (d < -ON_VIS_EPSILON)
 					break;
 				else if (d > ON_VIS_EPSILON)
@@ -342,11 +419,11 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 				continue;	// planar with seperating plane
 #else
 			k = (j+1)%pass->numpoints;
-			d = DotProduct (pass->points[k], plane.normal) - plane.dist;
+			d = DotProduct (pass->Point(k), plane.normal) - plane.dist;
 			if (d < -ON_VIS_EPSILON)
 				continue;
 			k = (j+pass->numpoints-1)%pass->numpoints;
-			d = DotProduct (pass->points[k], plane.normal) - plane.dist;
+			d = DotProduct (pass->Point(k), plane.normal) - plane.dist;
 			if (d < -ON_VIS_EPSILON)
 				continue;			
 #endif
@@ -389,7 +466,7 @@ void WindingCenter (winding_t *w, Vector &center)
 
 	VectorCopy (vec3_origin, center);
 	for (i=0 ; i<w->numpoints ; i++)
-		VectorAdd (w->points[i], center, center);
+		VectorAdd (w->Point(i), center, center);
 
 	scale = 1.0/w->numpoints;
 	VectorScale (center, scale, center);
@@ -405,7 +482,7 @@ Vector ClusterCenter( int cluster )
 		winding_t *w = leafs[cluster].portals[i]->winding;
 		for ( int j = 0; j < w->numpoints; j++ )
 		{
-			AddPointToBounds( w->points[j], mins, maxs );
+			AddPointToBounds( w->Point( j ), mins, maxs );
 		}
 	}
 	return (mins + maxs) * 0.5f;
@@ -429,14 +506,14 @@ void DumpPortalTrace( pstack_t *pStack )
 		g_PortalTrace.m_list.AddToTail(mid);
 		for ( int i = 0; i < w->numpoints; i++ )
 		{
-			g_PortalTrace.m_list.AddToTail(w->points[i]);
+			g_PortalTrace.m_list.AddToTail(w->Point(i));
 			g_PortalTrace.m_list.AddToTail(mid);
 		}
 		for ( int i = 0; i < w->numpoints; i++ )
 		{
-			g_PortalTrace.m_list.AddToTail(w->points[i]);
+			g_PortalTrace.m_list.AddToTail(w->Point(i));
 		}
-		g_PortalTrace.m_list.AddToTail(w->points[0]);
+		g_PortalTrace.m_list.AddToTail(w->Point(0));
 		g_PortalTrace.m_list.AddToTail(mid);
 	}
 	mid = ClusterCenter( g_TraceClusterStop );
@@ -483,8 +560,8 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	portal_t	*p;
 	plane_t		backplane;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		*test, *might, *vis, more;
+	int			i;
+	byte		*test;
 	int			pnum;
 
 #ifdef MPI
@@ -509,9 +586,6 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	stack.next = NULL;
 	stack.leaf = leaf;
 	stack.portal = NULL;
-
-	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
 	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
@@ -528,21 +602,15 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		// if the portal can't see anything we haven't allready seen, skip it
 		if (p->status == stat_done)
 		{
-			test = (long *)p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = (long *)p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			might[j] = ((long *)prevstack->mightsee)[j] & test[j];
-			more |= (might[j] & ~vis[j]);
-		}
-		
-		if ( !more && CheckBit( thread->base->portalvis, pnum ) )
+		if ( !MightSeeMore( stack.mightsee, prevstack->mightsee, test, thread->base->portalvis )
+			&& CheckBit( thread->base->portalvis, pnum ) )
 		{	// can't see anything new
 			continue;
 		}
@@ -623,19 +691,16 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 
 /*
 ===============
-PortalFlow
+FlowPortal
 
 generates the portalvis bit vector
 ===============
 */
-void PortalFlow (int iThread, int portalnum)
+static void FlowPortal (portal_t *p)
 {
 	threaddata_t	data;
-	int				i;
-	portal_t		*p;
 	int				c_might, c_can;
 
-	p = sorted_portals[portalnum];
 	p->status = stat_working;
 				
 	c_might = CountBits (p->portalflood, g_numportals*2);
@@ -646,8 +711,7 @@ void PortalFlow (int iThread, int portalnum)
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
-	for (i=0 ; i<portallongs ; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+	memcpy (data.pstack_head.mightsee, p->portalflood, portalbytes);
 
 	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
 
@@ -660,6 +724,73 @@ void PortalFlow (int iThread, int portalnum)
 		(int)(p - portals),	c_might, c_can, data.c_chains);
 }
 
+void PortalFlow (int iThread, int portalnum)
+{
+	FlowPortal (sorted_portals[portalnum]);
+}
+
+
+/*
+===============
+PortalFlowScheduled
+
+Runs the portals in sorted_portals in a dynamic order. The portals are
+sorted by nummightsee, which is used as the estimate of how long each one
+will take. They're taken cheapest first, so the expensive ones can stop
+at the portals that are already done. Once the most expensive portal left
+would take as long as the remaining work split across the threads, the
+portals are taken from the expensive end instead, so the longest ones
+don't all end up running by themselves at the end of the pass.
+===============
+*/
+static int		s_nFlowFront, s_nFlowBack;
+static int64	s_nFlowCostLeft;
+
+static int64 PortalFlowCost (portal_t *p)
+{
+	// portals from the vis cache are already done
+	if (p->status == stat_done)
+		return 0;
+	return p->nummightsee + 1;
+}
+
+void InitPortalFlowSchedule (void)
+{
+	int		i;
+
+	s_nFlowFront = 0;
+	s_nFlowBack = g_numportals*2;
+	s_nFlowCostLeft = 0;
+	for (i=0 ; i<g_numportals*2 ; i++)
+		s_nFlowCostLeft += PortalFlowCost (sorted_portals[i]);
+}
+
+void PortalFlowScheduled (int iThread, int iWorkItem)
+{
+	portal_t	*p;
+
+	ThreadLock ();
+	if (s_nFlowFront >= s_nFlowBack)
+	{
+		ThreadUnlock ();
+		Error ("PortalFlowScheduled: ran out of portals");
+	}
+	p = sorted_portals[s_nFlowBack-1];
+	if (!nosort && PortalFlowCost (p) * numthreads >= s_nFlowCostLeft)
+	{
+		s_nFlowBack--;
+	}
+	else
+	{
+		p = sorted_portals[s_nFlowFront++];
+	}
+	s_nFlowCostLeft -= PortalFlowCost (p);
+	ThreadUnlock ();
+
+	if (p->status != stat_done)
+		FlowPortal (p);
+}
+
 
 /*
 ===============================================================================
@@ -719,10 +850,18 @@ void BasePortalVis (int iThread, int portalnum)
 	winding_t	*w;
 	Vector		segment;
 	double		dist2, minDist2;
+	vec_t		dists[MAX_POINTS_ON_WINDING];
 
 	// get the portal
 	p = portals+portalnum;
 
+	// the vis cache already filled it in
+	if (p->status == stat_done)
+	{
+		c_flood += p->nummightsee;
+		return;
+	}
+
 	//
 	// allocate memory for bitwise vis solutions for this portal
 	//
@@ -748,9 +887,10 @@ void BasePortalVis (int iThread, int portalnum)
 		//
 		//
 		w = tp->winding;
+		WindingPlaneDists (w, &p->plane, dists);
 		for (k=0 ; k<w->numpoints ; k++)
 		{
-			d = DotProduct (w->points[k], p->plane.normal) - p->plane.dist;
+			d = dists[k];
 			if (d > ON_VIS_EPSILON)
 				break;
 		}
@@ -761,9 +901,10 @@ void BasePortalVis (int iThread, int portalnum)
 		//
 		//
 		w = p->winding;
+		WindingPlaneDists (w, &tp->plane, dists);
 		for (k=0 ; k<w->numpoints ; k++)
 		{
-			d = DotProduct (w->points[k], tp->plane.normal) - tp->plane.dist;
+			d = dists[k];
 			if (d < -ON_VIS_EPSILON)
 				break;
 		}
@@ -780,7 +921,7 @@ void BasePortalVis (int iThread, int portalnum)
 			minDist2 = 1024000000.0;			// 32000^2
 			for( k = 0; k < w->numpoints; k++ )
 			{
-				VectorSubtract( w->points[k], p->origin, segment );
+				VectorSubtract( w->Point( k ), p->origin, segment );
 				dist2 = ( segment[0] * segment[0] ) + ( segment[1] * segment[1] ) + ( segment[2] * segment[2] );
 				if( dist2 < minDist2 )
 				{
@@ -829,8 +970,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 {
 	portal_t	*p;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		more;
+	int			i;
 	int			pnum;
 	byte		newmight[MAX_PORTALS/8];
 
@@ -847,15 +987,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 			continue;
 
 		// if this portal can see some portals we mightsee, recurse
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			((long *)newmight)[j] = ((long *)mightsee)[j] 
-				& ((long *)p->portalflood)[j];
-			more |= ((long *)newmight)[j] & ~((long *)cansee)[j];
-		}
-
-		if (!more)
+		if (!MightSeeMore (newmight, mightsee, p->portalflood, cansee))
 			continue;	// can't see anything new
 
 		SetBit( cansee, pnum );
@@ -0,0 +1,40 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: AVX2 versions of the portal flow bit vector loops
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+#include "vis.h"
+
+#ifdef VVIS_AVX2
+
+#include <immintrin.h>
+
+#if defined( __clang__ )
+#pragma clang attribute push( __attribute__(( target( "avx2" ) )), apply_to = function )
+#elif defined( __GNUC__ )
+#pragma GCC push_options
+#pragma GCC target( "avx2" )
+#endif
+
+bool MightSeeMoreAVX2( byte *might, const byte *prev, const byte *test, const byte *vis, int numbytes )
+{
+	__m256i more = _mm256_setzero_si256();
+	for ( int i = 0; i < numbytes; i += 32 )
+	{
+		__m256i m = _mm256_and_si256( _mm256_loadu_si256( (const __m256i *)( prev + i ) ),
+									  _mm256_loadu_si256( (const __m256i *)( test + i ) ) );
+		_mm256_storeu_si256( (__m256i *)( might + i ), m );
+		more = _mm256_or_si256( more, _mm256_andnot_si256( _mm256_loadu_si256( (const __m256i *)( vis + i ) ), m ) );
+	}
+	return !_mm256_testz_si256( more, more );
+}
+
+#if defined( __clang__ )
+#pragma clang attribute pop
+#elif defined( __GNUC__ )
+#pragma GCC pop_options
+#endif
+
+#endif // VVIS_AVX2
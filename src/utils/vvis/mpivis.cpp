@@ -456,7 +456,10 @@ public:
 						for ( int i=0; i < g_numportals*2; i++ )
 						{
 							portal_t *p = sorted_portals[i];
-							ScratchPad_DrawWinding( pPad, p->winding->numpoints, p->winding->points, Vector( 1, 0, 0 ), Vector( .3, .3, .3 ) );
+							Vector points[MAX_POINTS_ON_WINDING];
+							for ( int j=0; j < p->winding->numpoints; j++ )
+								points[j] = p->winding->Point( j );
+							ScratchPad_DrawWinding( pPad, p->winding->numpoints, points, Vector( 1, 0, 0 ), Vector( .3, .3, .3 ) );
 						}
 						
 						pPad->Release();
@@ -28,11 +28,29 @@ struct plane_t
 #define MAX_POINTS_ON_WINDING	64
 #define	MAX_POINTS_ON_FIXED_WINDING	12
 
+// The points are kept in separate x, y and z arrays so the flow code can test
+// four of them against a plane at once. Each array has room for the winding's
+// points rounded up to a multiple of 4.
 struct winding_t
 {
 	qboolean	original;			// don't free, it's part of the portal
 	int		numpoints;
-	Vector	points[MAX_POINTS_ON_FIXED_WINDING];			// variable sized
+	float	*x;						// variable sized
+	float	*y;
+	float	*z;
+
+	Vector	Point( int i ) const					{ return Vector( x[i], y[i], z[i] ); }
+	void	SetPoint( int i, const Vector &v )		{ x[i] = v.x; y[i] = v.y; z[i] = v.z; }
+	void	CopyPoint( int i, const winding_t *w, int j )	{ x[i] = w->x[j]; y[i] = w->y[j]; z[i] = w->z[j]; }
+};
+
+// The windings chopped on the flow stack. These only have room for
+// MAX_POINTS_ON_FIXED_WINDING points, so RecursiveLeafFlow's frames stay small.
+struct stackwinding_t : public winding_t
+{
+	float	points[3][MAX_POINTS_ON_FIXED_WINDING];
+
+	void	Init()		{ x = points[0]; y = points[1]; z = points[2]; }
 };
 
 winding_t	*NewWinding (int points);
@@ -73,7 +91,7 @@ struct pstack_t
 	winding_t	*source;
 	winding_t	*pass;
 
-	winding_t	windings[3];	// source, pass, temp in any order
+	stackwinding_t	windings[3];	// source, pass, temp in any order
 	int			freewindings[3];
 
 	plane_t		portalplane;
@@ -106,6 +124,8 @@ extern	byte		*uncompressed;
 extern	int		leafbytes, leaflongs;
 extern	int		portalbytes, portallongs;
 
+extern	bool	nosort;
+
 
 void LeafFlow (int leafnum);
 
@@ -113,13 +133,32 @@ void LeafFlow (int leafnum);
 void BasePortalVis (int iThread, int portalnum);
 void BetterPortalVis (int portalnum);
 void PortalFlow (int iThread, int portalnum);
+void InitPortalFlowSchedule (void);
+void PortalFlowScheduled (int iThread, int iWorkItem);
 void WritePortalTrace( const char *source );
 
+// -viscache
+void LoadVisCache( const char *pFilename );
+void SaveVisCache( const char *pFilename );
+
 extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
 extern int g_TraceClusterStart, g_TraceClusterStop;
 
 int CountBits (byte *bits, int numbits);
 
+// which compilers can build flow_avx2.cpp
+#if defined( _M_IX86 ) || defined( _M_X64 ) || defined( __i386__ ) || defined( __x86_64__ )
+#if ( defined( _MSC_VER ) && _MSC_VER >= 1700 ) || defined( __clang__ ) || \
+	( defined( __GNUC__ ) && ( ( __GNUC__ > 4 ) || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) ) )
+#define VVIS_AVX2
+#endif
+#endif
+
+// Sets might = prev & test over portalbytes bytes, and returns true if might has any
+// bit that vis doesn't. portalbytes is a multiple of 32.
+bool MightSeeMore (byte *might, const byte *prev, const byte *test, const byte *vis);
+bool MightSeeMoreAVX2 (byte *might, const byte *prev, const byte *test, const byte *vis, int numbytes);
+
 #define CheckBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] & ( 1 << ( (bitNumber) & 7 ) ) )
 #define SetBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] |= ( 1 << ( (bitNumber) & 7 ) ) )
 #define ClearBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] &= ~( 1 << ( (bitNumber) & 7 ) ) )
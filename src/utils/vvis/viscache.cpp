@@ -0,0 +1,402 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Reusing the portal vis of portals that haven't changed (-viscache)
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vis.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/checksum_md5.h"
+#include "filesystem.h"
+
+
+//-----------------------------------------------------------------------------
+// Vis cache
+//
+// A compile with -viscache saves the portalflood and portalvis of every
+// portal to <mapname>.vvc. The next -viscache compile matches its portals
+// against the saved ones by a key made from the portal's winding and the
+// windings of all the portals of the two leafs it connects.
+//
+// A portal's vis only depends on its own winding, the leafs its flood passes
+// through, and the portals it might see. So a saved portal is reused if its
+// key matches, and every portal in its saved portalflood matches a portal of
+// this compile too. A changed room changes the keys of the portals into it,
+// so every portal that might see into it is run again.
+//-----------------------------------------------------------------------------
+
+#define VIS_CACHE_ID			( ( 'C' << 24 ) | ( 'S' << 16 ) | ( 'I' << 8 ) | 'V' )
+#define VIS_CACHE_VERSION		1
+
+struct VisCacheHeader_t
+{
+	int m_nId;
+	int m_nVersion;
+	CRC32_t m_SettingsCRC;
+};
+
+static CUtlVector<MD5Value_t> s_PortalKeys;		// of each portal of this compile
+
+
+//-----------------------------------------------------------------------------
+// Everything besides the portals which the cached vis depends on
+//-----------------------------------------------------------------------------
+static CRC32_t ComputeVisCacheSettingsCRC( void )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	int nVersion = VIS_CACHE_VERSION;
+	CRC32_ProcessBuffer( &crc, &nVersion, sizeof( nVersion ) );
+	CRC32_ProcessBuffer( &crc, &g_bUseRadius, sizeof( g_bUseRadius ) );
+	if ( g_bUseRadius )
+	{
+		CRC32_ProcessBuffer( &crc, &g_VisRadius, sizeof( g_VisRadius ) );
+	}
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
+
+static int __cdecl CompareMD5( const MD5Value_t *a, const MD5Value_t *b )
+{
+	return memcmp( a->bits, b->bits, sizeof( a->bits ) );
+}
+
+static const MD5Value_t *s_pSortKeys;
+
+static int __cdecl ComparePortalKeys( const int *a, const int *b )
+{
+	return CompareMD5( &s_pSortKeys[*a], &s_pSortKeys[*b] );
+}
+
+
+//-----------------------------------------------------------------------------
+// The key of each portal: its winding and plane, and the windings of the
+// portals of the leafs on both sides of it.
+//-----------------------------------------------------------------------------
+static void ComputePortalKeys( void )
+{
+	if ( s_PortalKeys.Count() == g_numportals*2 )
+		return;
+
+	CUtlVector<MD5Value_t> windingHashes;
+	windingHashes.SetCount( g_numportals*2 );
+	for ( int i = 0; i < g_numportals*2; i++ )
+	{
+		portal_t *p = &portals[i];
+		winding_t *w = p->winding;
+
+		MD5Context_t ctx;
+		MD5Init( &ctx );
+		MD5Update( &ctx, (const unsigned char *)&w->numpoints, sizeof( w->numpoints ) );
+		MD5Update( &ctx, (const unsigned char *)w->x, w->numpoints * sizeof( w->x[0] ) );
+		MD5Update( &ctx, (const unsigned char *)w->y, w->numpoints * sizeof( w->y[0] ) );
+		MD5Update( &ctx, (const unsigned char *)w->z, w->numpoints * sizeof( w->z[0] ) );
+		MD5Update( &ctx, (const unsigned char *)&p->plane, sizeof( p->plane ) );
+		MD5Final( windingHashes[i].bits, &ctx );
+	}
+
+	// the portals of a leaf are hashed in sorted order, so the order they
+	// were written to the .prt in doesn't matter
+	CUtlVector<MD5Value_t> leafHashes;
+	CUtlVector<MD5Value_t> leafWindings;
+	leafHashes.SetCount( portalclusters );
+	for ( int i = 0; i < portalclusters; i++ )
+	{
+		leaf_t *leaf = &leafs[i];
+		leafWindings.RemoveAll();
+		for ( int j = 0; j < leaf->portals.Count(); j++ )
+		{
+			leafWindings.AddToTail( windingHashes[ leaf->portals[j] - portals ] );
+		}
+		leafWindings.Sort( CompareMD5 );
+		MD5_ProcessSingleBuffer( leafWindings.Base(), leafWindings.Count() * sizeof( MD5Value_t ), leafHashes[i] );
+	}
+
+	// each file portal is two memory portals, so the other one of the pair is
+	// in the leaf on this portal's side
+	s_PortalKeys.SetCount( g_numportals*2 );
+	for ( int i = 0; i < g_numportals*2; i++ )
+	{
+		MD5Context_t ctx;
+		MD5Init( &ctx );
+		MD5Update( &ctx, windingHashes[i].bits, sizeof( windingHashes[i].bits ) );
+		MD5Update( &ctx, leafHashes[ portals[i].leaf ].bits, sizeof( leafHashes[0].bits ) );
+		MD5Update( &ctx, leafHashes[ portals[i^1].leaf ].bits, sizeof( leafHashes[0].bits ) );
+		MD5Final( s_PortalKeys[i].bits, &ctx );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Zero runs are written as a zero and the run length, the same as CompressVis
+//-----------------------------------------------------------------------------
+static void PutPortalBits( CUtlBuffer &buf, const byte *bits )
+{
+	CUtlVector<byte> compressed;
+	compressed.EnsureCapacity( portalbytes );
+	for ( int j = 0; j < portalbytes; j++ )
+	{
+		compressed.AddToTail( bits[j] );
+		if ( bits[j] )
+			continue;
+
+		int rep = 1;
+		for ( j++; j < portalbytes; j++ )
+		{
+			if ( bits[j] || rep == 255 )
+				break;
+			rep++;
+		}
+		compressed.AddToTail( rep );
+		j--;
+	}
+
+	buf.PutInt( compressed.Count() );
+	buf.Put( compressed.Base(), compressed.Count() );
+}
+
+static bool GetPortalBits( CUtlBuffer &buf, byte *bits, int nBytes )
+{
+	int nCompressed = buf.GetInt();
+	if ( !buf.IsValid() || nCompressed < 0 || buf.GetBytesRemaining() < nCompressed )
+		return false;
+
+	const byte *in = (const byte *)buf.PeekGet();
+	const byte *end = in + nCompressed;
+	buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nCompressed );
+
+	int out = 0;
+	while ( in < end )
+	{
+		if ( *in )
+		{
+			if ( out >= nBytes )
+				return false;
+			bits[out++] = *in++;
+			continue;
+		}
+
+		if ( in + 1 >= end || out + in[1] > nBytes )
+			return false;
+		memset( bits + out, 0, in[1] );
+		out += in[1];
+		in += 2;
+	}
+
+	return out == nBytes;
+}
+
+
+//-----------------------------------------------------------------------------
+// Fills in the portals the cache has vis for, and marks them done so
+// BasePortalVis and PortalFlow skip them
+//-----------------------------------------------------------------------------
+void LoadVisCache( const char *pFilename )
+{
+	CUtlBuffer buf;
+	if ( !g_pFileSystem->ReadFile( pFilename, NULL, buf ) )
+	{
+		Msg( "No vis cache, running vis on every portal\n" );
+		return;
+	}
+
+	VisCacheHeader_t header;
+	if ( buf.GetBytesRemaining() < (int)sizeof( header ) )
+		return;
+	buf.Get( &header, sizeof( header ) );
+	if ( header.m_nId != VIS_CACHE_ID || header.m_nVersion != VIS_CACHE_VERSION )
+		return;
+
+	if ( header.m_SettingsCRC != ComputeVisCacheSettingsCRC() )
+	{
+		Msg( "Options have changed since %s was written, running vis on every portal\n", pFilename );
+		return;
+	}
+
+	int nOldPortals = buf.GetInt();
+	int nOldPortalBytes = buf.GetInt();
+	if ( !buf.IsValid() || nOldPortals < 0 || nOldPortalBytes < ( nOldPortals + 7 ) / 8 || nOldPortalBytes > MAX_PORTALS/8 ||
+		 buf.GetBytesRemaining() < nOldPortals * (int)sizeof( MD5Value_t ) )
+	{
+		Warning( "%s is damaged, running vis on every portal\n", pFilename );
+		return;
+	}
+	const MD5Value_t *pOldKeys = (const MD5Value_t *)buf.PeekGet();
+	buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nOldPortals * sizeof( MD5Value_t ) );
+
+	// match the saved portals to this compile's. Keys that more than one
+	// portal has can't be matched.
+	ComputePortalKeys();
+
+	CUtlVector<int> sorted;
+	sorted.SetCount( g_numportals*2 );
+	for ( int i = 0; i < g_numportals*2; i++ )
+	{
+		sorted[i] = i;
+	}
+	s_pSortKeys = s_PortalKeys.Base();
+	sorted.Sort( ComparePortalKeys );
+
+	CUtlVector<int> oldToNew;
+	CUtlVector<int> newToOld;
+	oldToNew.SetCount( nOldPortals );
+	newToOld.SetCount( g_numportals*2 );
+	for ( int i = 0; i < g_numportals*2; i++ )
+	{
+		newToOld[i] = -1;
+	}
+
+	for ( int i = 0; i < nOldPortals; i++ )
+	{
+		oldToNew[i] = -1;
+
+		int lo = 0;
+		int hi = sorted.Count() - 1;
+		while ( lo <= hi )
+		{
+			int mid = ( lo + hi ) / 2;
+			int cmp = CompareMD5( &pOldKeys[i], &s_PortalKeys[ sorted[mid] ] );
+			if ( cmp == 0 )
+			{
+				if ( ( mid > 0 && s_PortalKeys[ sorted[mid-1] ] == pOldKeys[i] ) ||
+					 ( mid < sorted.Count() - 1 && s_PortalKeys[ sorted[mid+1] ] == pOldKeys[i] ) )
+					break;
+
+				int j = sorted[mid];
+				if ( newToOld[j] == -1 )
+				{
+					newToOld[j] = i;
+					oldToNew[i] = j;
+				}
+				else
+				{
+					// the cache had two portals with the same key
+					if ( newToOld[j] >= 0 )
+					{
+						oldToNew[ newToOld[j] ] = -1;
+					}
+					newToOld[j] = -2;
+				}
+				break;
+			}
+			if ( cmp < 0 )
+				hi = mid - 1;
+			else
+				lo = mid + 1;
+		}
+	}
+
+	byte *pOldFlood = (byte *)malloc( nOldPortalBytes );
+	byte *pOldVis = (byte *)malloc( nOldPortalBytes );
+
+	int nReused = 0;
+	bool bDamaged = false;
+	for ( int i = 0; i < nOldPortals; i++ )
+	{
+		if ( !GetPortalBits( buf, pOldFlood, nOldPortalBytes ) || !GetPortalBits( buf, pOldVis, nOldPortalBytes ) )
+		{
+			bDamaged = true;
+			break;
+		}
+
+		int j = oldToNew[i];
+		if ( j < 0 )
+			continue;
+
+		// everything the portal might see has to be unchanged too
+		bool bReuse = true;
+		for ( int b = 0; b < nOldPortalBytes && bReuse; b++ )
+		{
+			if ( !( pOldFlood[b] | pOldVis[b] ) )
+				continue;
+			for ( int k = b * 8; k < b * 8 + 8; k++ )
+			{
+				if ( !CheckBit( pOldFlood, k ) && !CheckBit( pOldVis, k ) )
+					continue;
+				if ( k >= nOldPortals || oldToNew[k] < 0 )
+				{
+					bReuse = false;
+				}
+			}
+		}
+		if ( !bReuse )
+			continue;
+
+		portal_t *p = &portals[j];
+		p->portalfront = (byte *)malloc( portalbytes );
+		memset( p->portalfront, 0, portalbytes );
+		p->portalflood = (byte *)malloc( portalbytes );
+		memset( p->portalflood, 0, portalbytes );
+		p->portalvis = (byte *)malloc( portalbytes );
+		memset( p->portalvis, 0, portalbytes );
+
+		for ( int k = 0; k < nOldPortals; k++ )
+		{
+			if ( !pOldFlood[k >> 3] && !pOldVis[k >> 3] )
+			{
+				k |= 7;
+				continue;
+			}
+			if ( CheckBit( pOldFlood, k ) )
+			{
+				SetBit( p->portalflood, oldToNew[k] );
+			}
+			if ( CheckBit( pOldVis, k ) )
+			{
+				SetBit( p->portalvis, oldToNew[k] );
+			}
+		}
+
+		p->nummightsee = CountBits( p->portalflood, g_numportals*2 );
+		p->status = stat_done;
+		nReused++;
+	}
+
+	free( pOldFlood );
+	free( pOldVis );
+
+	if ( bDamaged )
+	{
+		// the portals matched before the damage are still good
+		Warning( "%s is damaged, only some of it was used\n", pFilename );
+	}
+
+	Msg( "Vis cache: reused the vis of %d of %d portals\n", nReused, g_numportals*2 );
+}
+
+
+//-----------------------------------------------------------------------------
+// Saves the vis of every portal for the next -viscache compile
+//-----------------------------------------------------------------------------
+void SaveVisCache( const char *pFilename )
+{
+	ComputePortalKeys();
+
+	VisCacheHeader_t header;
+	header.m_nId = VIS_CACHE_ID;
+	header.m_nVersion = VIS_CACHE_VERSION;
+	header.m_SettingsCRC = ComputeVisCacheSettingsCRC();
+
+	CUtlBuffer buf;
+	buf.Put( &header, sizeof( header ) );
+
+	buf.PutInt( g_numportals*2 );
+	buf.PutInt( portalbytes );
+	buf.Put( s_PortalKeys.Base(), s_PortalKeys.Count() * sizeof( MD5Value_t ) );
+
+	for ( int i = 0; i < g_numportals*2; i++ )
+	{
+		PutPortalBits( buf, portals[i].portalflood );
+		PutPortalBits( buf, portals[i].portalvis );
+	}
+
+	if ( !g_pFileSystem->WriteFile( pFilename, NULL, buf ) )
+	{
+		Warning( "Couldn't write vis cache %s\n", pFilename );
+	}
+}
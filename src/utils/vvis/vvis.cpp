@@ -46,6 +46,7 @@ int			portalbytes, portallongs;
 
 bool		fastvis;
 bool		nosort;
+bool		g_bVisCache = false;
 
 int			totalvis;
 
@@ -63,11 +64,11 @@ void PlaneFromWinding (winding_t *w, plane_t *plane)
 	Vector		v1, v2;
 
 // calc plane
-	VectorSubtract (w->points[2], w->points[1], v1);
-	VectorSubtract (w->points[0], w->points[1], v2);
+	VectorSubtract (w->Point(2), w->Point(1), v1);
+	VectorSubtract (w->Point(0), w->Point(1), v2);
 	CrossProduct (v2, v1, plane->normal);
 	VectorNormalize (plane->normal);
-	plane->dist = DotProduct (w->points[0], plane->normal);
+	plane->dist = DotProduct (w->Point(0), plane->normal);
 }
 
 
@@ -79,14 +80,20 @@ NewWinding
 winding_t *NewWinding (int points)
 {
 	winding_t	*w;
-	int			size;
+	int			capacity, size;
 	
 	if (points > MAX_POINTS_ON_WINDING)
 		Error ("NewWinding: %i points, max %d", points, MAX_POINTS_ON_WINDING);
 	
-	size = (int)(&((winding_t *)0)->points[points]);
+	// room to test the points four at a time
+	capacity = (points + 3) & ~3;
+	size = sizeof(winding_t) + 3 * capacity * sizeof(float);
 	w = (winding_t*)malloc (size);
 	memset (w, 0, size);
+
+	w->x = (float *)(w + 1);
+	w->y = w->x + capacity;
+	w->z = w->y + capacity;
 	
 	return w;
 }
@@ -95,7 +102,7 @@ void pw(winding_t *w)
 {
 	int		i;
 	for (i=0 ; i<w->numpoints ; i++)
-		Msg ("(%5.1f, %5.1f, %5.1f)\n",w->points[i][0], w->points[i][1],w->points[i][2]);
+		Msg ("(%5.1f, %5.1f, %5.1f)\n",w->x[i], w->y[i], w->z[i]);
 }
 
 void prl(leaf_t *l)
@@ -310,7 +317,8 @@ void CalcPortalVis (void)
 	else 
 #endif
 	{
-		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
+		InitPortalFlowSchedule ();
+		RunThreadsOnIndividual (g_numportals*2, true, PortalFlowScheduled);
 	}
 }
 
@@ -381,7 +389,7 @@ void SetPortalSphere (portal_t *p)
 	VectorCopy (vec3_origin, total);
 	for (i=0 ; i<w->numpoints ; i++)
 	{
-		VectorAdd (total, w->points[i], total);
+		VectorAdd (total, w->Point(i), total);
 	}
 	
 	for (i=0 ; i<3 ; i++)
@@ -390,7 +398,7 @@ void SetPortalSphere (portal_t *p)
 	bestr = 0;		
 	for (i=0 ; i<w->numpoints ; i++)
 	{
-		VectorSubtract (w->points[i], total, dist);
+		VectorSubtract (w->Point(i), total, dist);
 		r = VectorLength (dist);
 		if (r > bestr)
 			bestr = r;
@@ -478,7 +486,8 @@ void LoadPortals (char *name)
 	leafbytes = ((portalclusters+63)&~63)>>3;
 	leaflongs = leafbytes/sizeof(long);
 	
-	portalbytes = ((g_numportals*2+63)&~63)>>3;
+	// portal bit vectors are padded to 256 bits for the AVX2 flow loops
+	portalbytes = ((g_numportals*2+255)&~255)>>3;
 	portallongs = portalbytes/sizeof(long);
 
 // each file portal is split into two memory portals
@@ -515,15 +524,13 @@ void LoadPortals (char *name)
 		for (j=0 ; j<numpoints ; j++)
 		{
 			double	v[3];
-			int		k;
 
 			// scanf into double, then assign to vec_t
 			// so we don't care what size vec_t is
 			if (fscanf (f, "(%lf %lf %lf ) "
 			, &v[0], &v[1], &v[2]) != 3)
 				Error ("LoadPortals: reading portal %i", i);
-			for (k=0 ; k<3 ; k++)
-				w->points[j][k] = v[k];
+			w->SetPoint (j, Vector (v[0], v[1], v[2]));
 		}
 		fscanf (f, "\n");
 		
@@ -549,7 +556,7 @@ void LoadPortals (char *name)
 		p->winding->numpoints = w->numpoints;
 		for (j=0 ; j<w->numpoints ; j++)
 		{
-			VectorCopy (w->points[w->numpoints-1-j], p->winding->points[j]);
+			p->winding->CopyPoint (j, w, w->numpoints-1-j);
 		}
 
 		p->plane = plane;
@@ -948,6 +955,10 @@ int ParseCommandLine( int argc, char **argv )
 			i++;
 			Msg( "Tracing vis from cluster %d to %d\n", g_TraceClusterStart, g_TraceClusterStop );
 		}
+		else if (!Q_stricmp (argv[i],"-viscache"))
+		{
+			g_bVisCache = true;
+		}
 		else if (!Q_stricmp (argv[i],"-nosort"))
 		{
 			Msg ("nosort = true\n");
@@ -959,6 +970,14 @@ int ParseCommandLine( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-numa" ) )
+		{
+			g_bPinThreadsToNumaNodes = true;
+		}
+		else if( !Q_stricmp( argv[i], "-threadstats" ) )
+		{
+			g_bReportThreadScaling = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-FullMinidumps" ) )
 		{
 			EnableFullMinidumps( true );
@@ -1041,7 +1060,11 @@ void PrintUsage( int argc, char **argv )
 #endif
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
+		"  -numa           : Keep each thread on the processors of one NUMA node.\n"
+		"  -threadstats    : Print the speedup each threaded pass gets from its threads.\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
+		"  -viscache       : Save the vis of each portal to <mapname>.vvc, and reuse it\n"
+		"                    for the portals that haven't changed on the next -viscache run.\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
@@ -1175,10 +1198,33 @@ int RunVVis( int argc, char **argv )
 	Msg ("reading %s\n", portalfile);
 	LoadPortals (portalfile);
 
+	char visCacheFile[1024];
+	V_snprintf( visCacheFile, sizeof( visCacheFile ), "%s.vvc", source );
+	if ( g_bVisCache && fastvis )
+	{
+		Warning( "-viscache doesn't work with -fast, ignoring it\n" );
+		g_bVisCache = false;
+	}
+#ifdef MPI
+	if ( g_bVisCache && g_bUseMPI )
+	{
+		Warning( "-viscache doesn't work with -mpi, ignoring it\n" );
+		g_bVisCache = false;
+	}
+#endif
+	if ( g_bVisCache && g_TraceClusterStart < 0 )
+	{
+		LoadVisCache( visCacheFile );
+	}
+
 	// don't write out results when simply doing a trace
 	if ( g_TraceClusterStart < 0 )
 	{
 		CalcVis ();
+		if ( g_bVisCache )
+		{
+			SaveVisCache( visCacheFile );
+		}
 		CalcPAS ();
 
 		// We need a mapping from cluster to leaves, since the PVS